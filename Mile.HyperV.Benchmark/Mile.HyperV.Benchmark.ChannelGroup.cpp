@@ -0,0 +1,592 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.ChannelGroup.cpp
+ * PURPOSE:    Implementation for Mile.HyperV channel group benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.ChannelGroup.h>
+#include <Mile.HyperV.VMBus.HostEmulator.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    enum class QueueMode
+    {
+        // Every processor submits to the primary channel.
+        Shared,
+        // Every processor submits to its own subchannel.
+        PerProcessor,
+    };
+
+    struct ChannelGroupResult
+    {
+        double Seconds;
+        // The packets of the busiest queue over those of the idlest one.
+        double Imbalance;
+        std::uint64_t Busy;
+        std::uint64_t Errors;
+    };
+
+    ChannelGroupResult MeasureChannelGroup(
+        QueueMode Mode,
+        std::uint32_t ProcessorCount,
+        HV_UINT32 PayloadSize,
+        std::uint64_t PacketsPerProcessor)
+    {
+        const HV_UINT32 RingSize = 256 * 1024;
+        const std::uint32_t QueueCount =
+            (Mode == QueueMode::Shared) ? 1 : ProcessorCount;
+        const std::uint32_t HardwareCount =
+            std::max(1u, std::thread::hardware_concurrency());
+
+        std::vector<std::unique_ptr<SharedMemory>> Memories;
+        std::vector<VmbusRing> Rings;
+        for (std::uint32_t i = 0; i < QueueCount; ++i)
+        {
+            Memories.push_back(std::make_unique<SharedMemory>(
+                VmbusRingControlPageSize + RingSize));
+            Rings.push_back(
+                ::Mile::HyperV::Benchmark::CreateRing(*Memories.back()));
+        }
+
+        std::vector<VmbusChannelQueue> Queues(QueueCount);
+        std::vector<HV_UINT16> ProcessorMap(ProcessorCount);
+        std::vector<HV_VP_INDEX> Processors(ProcessorCount);
+        VmbusChannelGroup Group;
+        ChannelGroupResult Result = {};
+        if (!NT_SUCCESS(Group.Initialize(
+            Queues.data(),
+            QueueCount,
+            ProcessorMap.data(),
+            ProcessorCount)))
+        {
+            ++Result.Errors;
+            return Result;
+        }
+        for (std::uint32_t i = 0; i < QueueCount; ++i)
+        {
+            if (!NT_SUCCESS(Group.Add(
+                static_cast<HV_UINT16>(i),
+                i + 1,
+                0,
+                Rings[i])))
+            {
+                ++Result.Errors;
+            }
+        }
+        for (std::uint32_t i = 0; i < ProcessorCount; ++i)
+        {
+            Processors[i] = i;
+        }
+        // Nothing retargets interrupts in this measurement.
+        if (!NT_SUCCESS(Group.Rebalance(
+            Processors.data(),
+            ProcessorCount,
+            [](const void*, HV_UINT32) { return STATUS_SUCCESS; })))
+        {
+            ++Result.Errors;
+        }
+
+        std::atomic<std::uint64_t> Errors = 0;
+        Stopwatch Watch;
+
+        // Every ring has a consumer of its own, as every channel has its
+        // own interrupt on the host.
+        std::vector<std::thread> Consumers;
+        for (std::uint32_t i = 0; i < QueueCount; ++i)
+        {
+            Consumers.emplace_back([&, i]()
+            {
+                ::Mile::HyperV::Benchmark::PinCurrentThread(
+                    (ProcessorCount + i) % HardwareCount);
+                VmbusRingReader Reader(Rings[i]);
+                std::uint64_t Total = 0;
+                for (std::uint32_t j = 0; j < ProcessorCount; ++j)
+                {
+                    if (Group.QueueOf(j) == &Queues[i])
+                    {
+                        Total += PacketsPerProcessor;
+                    }
+                }
+                std::vector<std::uint64_t> Expected(ProcessorCount, 0);
+                std::uint64_t Consumed = 0;
+                Backoff Waiter;
+                while (Consumed < Total)
+                {
+                    HV_UINT32 Count = 0;
+                    Reader.ReadBatch([&](VmbusRingPacket const& Packet)
+                    {
+                        std::uint64_t Header[2] = {};
+                        Packet.CopyPayload(Header, sizeof(Header));
+                        if (Header[0] >= ProcessorCount ||
+                            Header[1] != Expected[Header[0]]++)
+                        {
+                            Errors.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }, 64, 0xFFFFFFFF, &Count);
+                    if (Count)
+                    {
+                        Consumed += Count;
+                        Waiter.Reset();
+                    }
+                    else
+                    {
+                        Waiter.Wait();
+                    }
+                }
+            });
+        }
+
+        std::vector<std::thread> Producers;
+        for (std::uint32_t i = 0; i < ProcessorCount; ++i)
+        {
+            Producers.emplace_back([&, i]()
+            {
+                ::Mile::HyperV::Benchmark::PinCurrentThread(
+                    i % HardwareCount);
+                std::vector<HV_UINT8> Payload(PayloadSize, 0x69);
+                Backoff Waiter;
+                for (std::uint64_t j = 0; j < PacketsPerProcessor;)
+                {
+                    std::uint64_t Header[2] = { i, j };
+                    std::memcpy(Payload.data(), Header, sizeof(Header));
+                    if (NT_SUCCESS(Group.Write(
+                        i,
+                        VmbusPacketTypeDataInBand,
+                        0,
+                        j,
+                        Payload.data(),
+                        PayloadSize)))
+                    {
+                        Waiter.Reset();
+                        ++j;
+                    }
+                    else
+                    {
+                        Waiter.Wait();
+                    }
+                }
+            });
+        }
+
+        for (std::thread& Producer : Producers)
+        {
+            Producer.join();
+        }
+        for (std::thread& Consumer : Consumers)
+        {
+            Consumer.join();
+        }
+        Result.Seconds = Watch.Seconds();
+        Result.Errors += Errors.load();
+
+        std::uint64_t Packets = 0;
+        std::uint64_t Minimum = ~0ULL;
+        std::uint64_t Maximum = 0;
+        for (std::uint32_t i = 0; i < QueueCount; ++i)
+        {
+            VmbusChannelQueueLoad Load = Queues[i].Load();
+            Packets += Load.Packets;
+            Minimum = std::min(Minimum, Load.Packets);
+            Maximum = std::max(Maximum, Load.Packets);
+            Result.Busy += Load.Busy;
+        }
+        Result.Imbalance = Minimum
+            ? static_cast<double>(Maximum) / static_cast<double>(Minimum)
+            : 0.0;
+        if (Packets != ProcessorCount * PacketsPerProcessor)
+        {
+            ++Result.Errors;
+        }
+        return Result;
+    }
+
+    struct TopologyResult
+    {
+        std::uint32_t Modifies;
+        std::uint32_t Responses;
+        std::uint32_t Rejected;
+        std::uint64_t Errors;
+    };
+
+    /**
+     * @brief Opens a primary channel with three subchannels on the host
+     *        emulator, then follows processors going online and offline.
+     */
+    TopologyResult MeasureTopology()
+    {
+        const HV_UINT32 QueueCount = 4;
+        // The host accepts interrupts on the first 8 processors only.
+        const HV_VP_INDEX HostProcessorCount = 8;
+        TopologyResult Result = {};
+
+        std::vector<HV_MESSAGE> ToHostSlots(16);
+        std::vector<HV_MESSAGE> ToGuestSlots(16);
+        VmbusSynicMessageQueue ToHost;
+        VmbusSynicMessageQueue ToGuest;
+        ToHost.Initialize(ToHostSlots.data(), 16);
+        ToGuest.Initialize(ToGuestSlots.data(), 16);
+        std::vector<VmbusHostChannel> Channels(QueueCount);
+        std::vector<VmbusHostGpadl> Gpadls(QueueCount);
+        std::vector<HV_UINT64> Words(QueueCount * 8);
+        VmbusHostEmulator Host;
+        Host.Initialize(
+            &ToHost,
+            &ToGuest,
+            Channels.data(),
+            QueueCount,
+            Gpadls.data(),
+            QueueCount,
+            Words.data(),
+            8);
+        auto OnEvent = [&](VmbusHostEvent Event, VmbusHostChannel& Channel)
+        {
+            if (Event == VmbusHostEvent::Modify &&
+                Channel.TargetVp >= HostProcessorCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            return STATUS_SUCCESS;
+        };
+
+        HV_GUID InterfaceType = VMSCSI_CLASS_ID;
+        HV_GUID InterfaceInstance = {};
+        InterfaceInstance.Data1 = 0xE1E10;
+        for (HV_UINT16 i = 0; i < QueueCount; ++i)
+        {
+            HV_UINT32 ChildRelId = 0;
+            if (!NT_SUCCESS(Host.Offer(
+                InterfaceType,
+                InterfaceInstance,
+                i,
+                0,
+                nullptr,
+                &ChildRelId)) ||
+                ChildRelId != i + 1u)
+            {
+                ++Result.Errors;
+            }
+        }
+
+        // Sends a message and returns the type of the reply, if any.
+        auto Exchange = [&](
+            const void* Message,
+            HV_UINT32 MessageSize,
+            HV_MESSAGE* Reply) -> HV_UINT32
+        {
+            if (!NT_SUCCESS(ToHost.Post(
+                static_cast<HV_MESSAGE_TYPE>(VMBUS_MESSAGE_TYPE),
+                Message,
+                MessageSize)))
+            {
+                ++Result.Errors;
+            }
+            Host.Process(OnEvent);
+            HV_MESSAGE Received;
+            if (!NT_SUCCESS(ToGuest.Receive(Received)))
+            {
+                return ChannelMessageInvalid;
+            }
+            if (Reply)
+            {
+                *Reply = Received;
+            }
+            VMBUS_CHANNEL_MESSAGE_HEADER Header;
+            std::memcpy(&Header, Received.Payload, sizeof(Header));
+            return Header.MessageType;
+        };
+
+        VMBUS_CHANNEL_INITIATE_CONTACT Contact = {};
+        Contact.Header.MessageType = ChannelMessageInitiateContact;
+        Contact.VMBusVersionRequested = VMBUS_VERSION_COPPER;
+        if (Exchange(&Contact, sizeof(Contact), nullptr) !=
+            ChannelMessageVersionResponse)
+        {
+            ++Result.Errors;
+        }
+        VMBUS_CHANNEL_REQUEST_OFFERS Request = {};
+        Request.MessageType = ChannelMessageRequestOffers;
+        for (HV_UINT32 Type = Exchange(&Request, sizeof(Request), nullptr);
+            Type != ChannelMessageAllOffersDelivered;)
+        {
+            HV_MESSAGE Received;
+            Host.Process(OnEvent);
+            if (!NT_SUCCESS(ToGuest.Receive(Received)))
+            {
+                ++Result.Errors;
+                break;
+            }
+            std::memcpy(&Type, Received.Payload, sizeof(Type));
+        }
+
+        // Every channel gets a GPADL of one ring page in each direction,
+        // which the host emulator never touches here.
+        std::vector<std::unique_ptr<SharedMemory>> Memories;
+        std::vector<VmbusRing> Rings;
+        for (HV_UINT32 i = 0; i < QueueCount; ++i)
+        {
+            HV_UINT32 ChildRelId = i + 1;
+            VmbusGpadlRange Range = { 4 * VmbusGpadlPageSize, 0 };
+            VmbusGpadlEncoder Encoder;
+            Encoder.Initialize(ChildRelId, ChildRelId, &Range, 1);
+            HV_UINT64 NextPfn = 0x100000 + i * 4;
+            auto Source = [&NextPfn](HV_UINT64& Pfn) -> bool
+            {
+                Pfn = NextPfn++;
+                return true;
+            };
+            HV_UINT8 Buffer[MAXIMUM_SYNIC_MESSAGE_BYTES];
+            HV_UINT32 Size = 0;
+            if (!NT_SUCCESS(Encoder.Next(Source, Buffer, &Size)) ||
+                !Encoder.IsComplete() ||
+                Exchange(Buffer, Size, nullptr) != ChannelMessageGpadlCreated)
+            {
+                ++Result.Errors;
+            }
+            VMBUS_CHANNEL_OPEN_CHANNEL Open = {};
+            Open.Header.MessageType = ChannelMessageOpenChannel;
+            Open.ChildRelId = ChildRelId;
+            Open.OpenId = ChildRelId;
+            Open.RingBufferGpadlHandle = ChildRelId;
+            Open.DownstreamRingBufferPageOffset = 2;
+            Open.TargetVp = 0;
+            if (Exchange(&Open, sizeof(Open), nullptr) !=
+                ChannelMessageOpenChannelResult)
+            {
+                ++Result.Errors;
+            }
+            Memories.push_back(std::make_unique<SharedMemory>(
+                VmbusRingControlPageSize + VmbusGpadlPageSize));
+            Rings.push_back(
+                ::Mile::HyperV::Benchmark::CreateRing(*Memories.back()));
+        }
+
+        std::vector<VmbusChannelQueue> Queues(QueueCount);
+        std::vector<HV_UINT16> ProcessorMap(64);
+        VmbusChannelGroup Group;
+        Group.Initialize(
+            Queues.data(),
+            QueueCount,
+            ProcessorMap.data(),
+            static_cast<HV_UINT32>(ProcessorMap.size()));
+        for (HV_UINT32 i = 0; i < QueueCount; ++i)
+        {
+            if (!NT_SUCCESS(Group.Add(
+                static_cast<HV_UINT16>(i),
+                i + 1,
+                0,
+                Rings[i])))
+            {
+                ++Result.Errors;
+            }
+        }
+
+        auto Send = [&](const void* Message, HV_UINT32 MessageSize)
+        {
+            ++Result.Modifies;
+            HV_MESSAGE Reply;
+            if (Exchange(Message, MessageSize, &Reply) !=
+                ChannelMessageModifyChannelResponse ||
+                !NT_SUCCESS(Group.OnModifyChannelResponse(
+                    Reply.Payload,
+                    Reply.Header.PayloadSize)))
+            {
+                ++Result.Errors;
+                return STATUS_SUCCESS;
+            }
+            ++Result.Responses;
+            VMBUS_CHANNEL_MODIFY_CHANNEL_RESPONSE Response;
+            std::memcpy(&Response, Reply.Payload, sizeof(Response));
+            if (!NT_SUCCESS(Response.Status))
+            {
+                ++Result.Rejected;
+            }
+            return STATUS_SUCCESS;
+        };
+
+        // Four processors, then two of them go offline, then the guest moves
+        // to processors the host does not accept, then back to eight.
+        const HV_VP_INDEX FourProcessors[] = { 0, 1, 2, 3 };
+        const HV_VP_INDEX TwoProcessors[] = { 0, 1 };
+        const HV_VP_INDEX FarProcessors[] = { 16, 17 };
+        const HV_VP_INDEX EightProcessors[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+        struct Step
+        {
+            const HV_VP_INDEX* Processors;
+            HV_UINT32 Count;
+        };
+        const Step Steps[] =
+        {
+            { FourProcessors, 4 },
+            { TwoProcessors, 2 },
+            { FarProcessors, 2 },
+            { EightProcessors, 8 },
+        };
+        for (Step const& Current : Steps)
+        {
+            if (!NT_SUCCESS(Group.Rebalance(
+                Current.Processors,
+                Current.Count,
+                Send)))
+            {
+                ++Result.Errors;
+            }
+            for (HV_UINT32 i = 0; i < QueueCount; ++i)
+            {
+                VmbusHostChannel* Channel = Host.Channel(i + 1);
+                if (!Channel ||
+                    Channel->TargetVp != Queues[i].TargetVp() ||
+                    Queues[i].IsModifyPending())
+                {
+                    ++Result.Errors;
+                }
+            }
+            for (HV_UINT32 i = 0; i < Current.Count; ++i)
+            {
+                if (Group.QueueOf(i) != &Queues[i % QueueCount])
+                {
+                    ++Result.Errors;
+                }
+            }
+        }
+
+        // A host before VMBUS_VERSION_IRON never responds, so the retarget
+        // stays outstanding and a second rebalance is refused until the
+        // guest forgets it.
+        auto SendWithoutResponse = [](const void*, HV_UINT32)
+        {
+            return STATUS_SUCCESS;
+        };
+        if (!NT_SUCCESS(Group.Rebalance(
+            FarProcessors,
+            2,
+            SendWithoutResponse)) ||
+            Group.Rebalance(
+                TwoProcessors,
+                2,
+                SendWithoutResponse) != STATUS_DEVICE_BUSY)
+        {
+            ++Result.Errors;
+        }
+        Group.CompleteModifies();
+        if (!NT_SUCCESS(Group.Rebalance(
+            TwoProcessors,
+            2,
+            SendWithoutResponse)))
+        {
+            ++Result.Errors;
+        }
+
+        // A failing Send leaves the messages sent before it outstanding, so
+        // the retry waits for them as well.
+        Group.CompleteModifies();
+        HV_UINT32 Sent = 0;
+        auto SendOnce = [&Sent](const void*, HV_UINT32)
+        {
+            return (Sent++ == 0)
+                ? STATUS_SUCCESS
+                : STATUS_INSUFFICIENT_RESOURCES;
+        };
+        if (Group.Rebalance(
+            FarProcessors,
+            2,
+            SendOnce) != STATUS_INSUFFICIENT_RESOURCES ||
+            Group.Rebalance(
+                FarProcessors,
+                2,
+                SendWithoutResponse) != STATUS_DEVICE_BUSY)
+        {
+            ++Result.Errors;
+        }
+        Group.CompleteModifies();
+        if (!NT_SUCCESS(Group.Rebalance(
+            FarProcessors,
+            2,
+            SendWithoutResponse)))
+        {
+            ++Result.Errors;
+        }
+        for (HV_UINT32 i = 0; i < QueueCount; ++i)
+        {
+            if (Queues[i].TargetVp() != FarProcessors[i % 2])
+            {
+                ++Result.Errors;
+            }
+        }
+
+        Result.Errors += Host.ProtocolErrors();
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunChannelGroup(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const std::uint32_t ProcessorCounts[] = { 1, 2, 4 };
+    const HV_UINT32 PayloadSizes[] = { 64, 1024 };
+    const std::uint64_t PacketsPerProcessor = 200000;
+
+    std::printf(
+        "Hardware threads: %u\n",
+        std::thread::hardware_concurrency());
+    std::printf(
+        "%-14s %10s %8s %12s %10s %10s %8s\n",
+        "Mode",
+        "Processors",
+        "Payload",
+        "Packets/s",
+        "Imbalance",
+        "Busy",
+        "Errors");
+    for (HV_UINT32 PayloadSize : PayloadSizes)
+    {
+        for (std::uint32_t ProcessorCount : ProcessorCounts)
+        {
+            for (QueueMode Mode :
+                { QueueMode::Shared, QueueMode::PerProcessor })
+            {
+                ChannelGroupResult Result = ::MeasureChannelGroup(
+                    Mode,
+                    ProcessorCount,
+                    PayloadSize,
+                    PacketsPerProcessor);
+                std::printf(
+                    "%-14s %10u %8u %12.0f %10.2f %10llu %8llu\n",
+                    Mode == QueueMode::Shared ? "Shared" : "PerProcessor",
+                    ProcessorCount,
+                    PayloadSize,
+                    ProcessorCount * PacketsPerProcessor / Result.Seconds,
+                    Result.Imbalance,
+                    static_cast<unsigned long long>(Result.Busy),
+                    static_cast<unsigned long long>(Result.Errors));
+            }
+        }
+    }
+
+    TopologyResult Topology = ::MeasureTopology();
+    std::printf(
+        "Topology changes: %u ModifyChannel, %u responses, %u rejected, "
+        "%llu errors\n",
+        Topology.Modifies,
+        Topology.Responses,
+        Topology.Rejected,
+        static_cast<unsigned long long>(Topology.Errors));
+
+    return 0;
+}
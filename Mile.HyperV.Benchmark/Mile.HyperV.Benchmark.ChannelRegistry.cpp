@@ -0,0 +1,324 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.ChannelRegistry.cpp
+ * PURPOSE:    Implementation for Mile.HyperV channel registry benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.ChannelRegistry.h>
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    const HV_UINT32 ChannelCount = 32;
+    const HV_UINT32 WorkerCount = 4;
+    const HV_UINT32 SendsPerQuiesce = 64;
+    const HV_UINT32 PacketSize = 64;
+
+    /**
+     * @brief A channel whose mapping is poisoned and whose generation is
+     *        bumped when it is reclaimed, so a send through a stale pointer
+     *        is detected even if the channel is offered again meanwhile.
+     */
+    struct StressChannel
+    {
+        // Used by the reference counting mode only.
+        alignas(64) std::atomic<HV_UINT32> References;
+        std::atomic<bool> IsRescinded;
+        // Cleared when the mapping is torn down.
+        std::atomic<bool> IsMapped;
+        std::atomic<std::uint64_t> Generation;
+        PHV_UINT8 Mapping;
+        std::uint64_t Reclaims;
+    };
+
+    void ReclaimChannel(
+        void* Context,
+        void* Channel,
+        HV_UINT32 ChildRelId)
+    {
+        (void)Context;
+        (void)ChildRelId;
+        StressChannel* Current = static_cast<StressChannel*>(Channel);
+        Current->IsMapped.store(false, std::memory_order_relaxed);
+        Current->Generation.fetch_add(1, std::memory_order_relaxed);
+        std::memset(Current->Mapping, 0xDD, WorkerCount * PacketSize);
+        ++Current->Reclaims;
+    }
+
+    struct RegistryResult
+    {
+        double SendNanoseconds;
+        double SendsPerSecond;
+        double RescindsPerSecond;
+        std::uint64_t Misses;
+        std::uint64_t Errors;
+    };
+
+    /**
+     * @brief Sends from several workers to a set of channels for a while,
+     *        optionally while another thread keeps rescinding and offering
+     *        them again.
+     * @param UseEpochs Whether to protect the channels with the registry
+     *                  epochs instead of a reference count per send.
+     * @param Rescind Whether to rescind channels meanwhile.
+     * @param Seconds How long to run.
+     */
+    RegistryResult MeasureRegistry(
+        bool UseEpochs,
+        bool Rescind,
+        double Seconds)
+    {
+        RegistryResult Result = {};
+
+        SharedMemory Memory(ChannelCount * 4096);
+        std::unique_ptr<StressChannel[]> Channels(
+            new StressChannel[ChannelCount]);
+        std::vector<VmbusChannelRegistryEntry> Entries(ChannelCount + 1);
+        std::vector<VmbusChannelRegistryReader> Readers(WorkerCount);
+        std::vector<VmbusChannelRegistryRetired> Retired(4);
+        VmbusChannelRegistry Registry;
+        if (!NT_SUCCESS(Registry.Initialize(
+            Entries.data(),
+            ChannelCount + 1,
+            Readers.data(),
+            WorkerCount,
+            Retired.data(),
+            static_cast<HV_UINT32>(Retired.size()))))
+        {
+            ++Result.Errors;
+            return Result;
+        }
+        for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+        {
+            StressChannel& Channel = Channels[i];
+            Channel.References.store(0, std::memory_order_relaxed);
+            Channel.IsRescinded.store(false, std::memory_order_relaxed);
+            Channel.IsMapped.store(true, std::memory_order_relaxed);
+            Channel.Generation.store(0, std::memory_order_relaxed);
+            Channel.Mapping =
+                static_cast<PHV_UINT8>(Memory.Buffer()) + i * 4096;
+            Channel.Reclaims = 0;
+            Registry.Publish(i + 1, &Channel);
+        }
+
+        std::atomic<bool> Stop = false;
+        std::atomic<std::uint64_t> Sends = 0;
+        std::atomic<std::uint64_t> Misses = 0;
+        std::atomic<std::uint64_t> Errors = 0;
+
+        auto Worker = [&](HV_UINT32 Index)
+        {
+            HV_UINT8 Packet[PacketSize];
+            std::memset(Packet, static_cast<int>(Index + 1), sizeof(Packet));
+            std::uint64_t LocalSends = 0;
+            std::uint64_t LocalMisses = 0;
+            std::uint64_t LocalErrors = 0;
+            HV_UINT32 ChildRelId = Index;
+            Registry.Online(Index);
+            while (!Stop.load(std::memory_order_relaxed))
+            {
+                // Workers keep the channel they look up for a whole batch.
+                ChildRelId = ChildRelId % ChannelCount + 1;
+                StressChannel* Channel = static_cast<StressChannel*>(
+                    Registry.Lookup(ChildRelId));
+                if (!Channel)
+                {
+                    ++LocalMisses;
+                }
+                std::uint64_t Generation = Channel
+                    ? Channel->Generation.load(std::memory_order_relaxed)
+                    : 0;
+                for (HV_UINT32 i = 0; Channel && i < SendsPerQuiesce; ++i)
+                {
+                    if (!UseEpochs)
+                    {
+                        Channel->References.fetch_add(1);
+                        if (Channel->IsRescinded.load())
+                        {
+                            Channel->References.fetch_sub(1);
+                            ++LocalMisses;
+                            break;
+                        }
+                        // The reference only covers this send.
+                        Generation = Channel->Generation.load();
+                    }
+                    if (!Channel->IsMapped.load(std::memory_order_relaxed))
+                    {
+                        ++LocalErrors;
+                    }
+                    std::memcpy(
+                        Channel->Mapping + Index * PacketSize,
+                        Packet,
+                        PacketSize);
+                    if (!Channel->IsMapped.load(std::memory_order_relaxed) ||
+                        Channel->Generation.load() != Generation)
+                    {
+                        ++LocalErrors;
+                    }
+                    if (!UseEpochs)
+                    {
+                        Channel->References.fetch_sub(1);
+                    }
+                    ++LocalSends;
+                }
+                Registry.Quiesce(Index);
+            }
+            Registry.Offline(Index);
+            Sends.fetch_add(LocalSends);
+            Misses.fetch_add(LocalMisses);
+            Errors.fetch_add(LocalErrors);
+        };
+
+        std::vector<std::thread> Workers;
+        for (HV_UINT32 i = 0; i < WorkerCount; ++i)
+        {
+            Workers.emplace_back(Worker, i);
+        }
+
+        // The control plane rescinds a channel, waits until it is reclaimed
+        // and offers it again.
+        std::uint64_t Rescinds = 0;
+        Stopwatch Watch;
+        while (Watch.Seconds() < Seconds)
+        {
+            if (!Rescind)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            HV_UINT32 ChildRelId =
+                static_cast<HV_UINT32>(Rescinds * 7 % ChannelCount) + 1;
+            StressChannel& Channel = Channels[ChildRelId - 1];
+            Backoff Wait;
+            if (UseEpochs)
+            {
+                if (!NT_SUCCESS(Registry.Retire(
+                    ChildRelId,
+                    ::ReclaimChannel,
+                    nullptr)))
+                {
+                    ++Result.Errors;
+                    break;
+                }
+                while (!Registry.Reclaim())
+                {
+                    Wait.Wait();
+                }
+                Channel.IsMapped.store(true, std::memory_order_relaxed);
+            }
+            else
+            {
+                Channel.IsRescinded.store(true);
+                Entries[ChildRelId].Channel.store(nullptr);
+                while (Channel.References.load())
+                {
+                    Wait.Wait();
+                }
+                ::ReclaimChannel(nullptr, &Channel, ChildRelId);
+                // Senders which still hold the pointer may use the channel
+                // again as soon as it is no longer marked rescinded.
+                Channel.IsMapped.store(true);
+                Channel.IsRescinded.store(false);
+            }
+            if (!NT_SUCCESS(Registry.Publish(ChildRelId, &Channel)))
+            {
+                ++Result.Errors;
+            }
+            ++Rescinds;
+        }
+        double Elapsed = Watch.Seconds();
+        Stop.store(true);
+        for (std::thread& Current : Workers)
+        {
+            Current.join();
+        }
+
+        std::uint64_t Reclaims = 0;
+        for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+        {
+            Reclaims += Channels[i].Reclaims;
+        }
+        if (Reclaims != Rescinds ||
+            Registry.RetiredCount() ||
+            (UseEpochs && Registry.ReclaimedCount() != Rescinds))
+        {
+            ++Result.Errors;
+        }
+        Result.Errors += Errors.load();
+        Result.Misses = Misses.load();
+        Result.SendsPerSecond = Sends.load() / Elapsed;
+        // Every worker runs for the whole time.
+        Result.SendNanoseconds = Sends.load()
+            ? Elapsed * 1e9 * WorkerCount / Sends.load()
+            : 0.0;
+        Result.RescindsPerSecond = Rescinds / Elapsed;
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunChannelRegistry(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    struct RegistryMode
+    {
+        const char* Name;
+        bool UseEpochs;
+        bool Rescind;
+    };
+    const RegistryMode Modes[] =
+    {
+        { "Refcount", false, false },
+        { "Epoch", true, false },
+        { "Refcount+Rescind", false, true },
+        { "Epoch+Rescind", true, true },
+    };
+
+    std::printf(
+        "%u workers, %u channels, %u-byte sends, quiesce every %u sends\n",
+        WorkerCount,
+        ChannelCount,
+        PacketSize,
+        SendsPerQuiesce);
+    std::printf(
+        "%-18s %10s %14s %12s %12s %8s\n",
+        "Mode",
+        "ns/Send",
+        "Sends/s",
+        "Rescinds/s",
+        "Misses",
+        "Errors");
+    for (RegistryMode const& Mode : Modes)
+    {
+        RegistryResult Result = ::MeasureRegistry(
+            Mode.UseEpochs,
+            Mode.Rescind,
+            1.0);
+        std::printf(
+            "%-18s %10.1f %14.0f %12.0f %12llu %8llu\n",
+            Mode.Name,
+            Result.SendNanoseconds,
+            Result.SendsPerSecond,
+            Result.RescindsPerSecond,
+            static_cast<unsigned long long>(Result.Misses),
+            static_cast<unsigned long long>(Result.Errors));
+    }
+
+    return 0;
+}
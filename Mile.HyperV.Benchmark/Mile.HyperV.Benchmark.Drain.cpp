@@ -0,0 +1,164 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.Drain.cpp
+ * PURPOSE:    Implementation for Mile.HyperV ring drain benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    enum class DrainMode
+    {
+        // Publish Out and re-check the interrupt mask after every packet.
+        PerPacket,
+        // Publish Out once per batch and re-arm with unmask then re-check.
+        Batched,
+    };
+
+    struct DrainResult
+    {
+        double Seconds;
+        std::uint64_t Publishes;
+    };
+
+    DrainResult MeasureDrain(
+        DrainMode Mode,
+        HV_UINT32 PayloadSize,
+        HV_UINT32 RingSize,
+        HV_UINT32 BatchSize,
+        std::uint64_t PacketCount)
+    {
+        SharedMemory Memory(VmbusRingControlPageSize + RingSize);
+        VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        VmbusRingWriter Writer(Ring);
+        VmbusRingReader Reader(Ring);
+
+        std::vector<HV_UINT8> Payload(PayloadSize, 0x5A);
+        std::vector<HV_UINT8> Buffer(
+            sizeof(VMPACKET_DESCRIPTOR) + PayloadSize + VmbusRingPacketAlignment);
+
+        Stopwatch Watch;
+
+        std::thread Producer([&]()
+        {
+            Backoff Waiter;
+            for (std::uint64_t i = 0; i < PacketCount;)
+            {
+                NTSTATUS Status = Writer.Write(
+                    VmbusPacketTypeDataInBand,
+                    0,
+                    i,
+                    Payload.data(),
+                    PayloadSize);
+                if (NT_SUCCESS(Status))
+                {
+                    Waiter.Reset();
+                    ++i;
+                }
+                else
+                {
+                    Waiter.Wait();
+                }
+            }
+        });
+
+        DrainResult Result = {};
+        std::uint64_t Consumed = 0;
+        Backoff Waiter;
+        while (Consumed < PacketCount)
+        {
+            HV_UINT32 Count = 0;
+            if (Mode == DrainMode::PerPacket)
+            {
+                if (NT_SUCCESS(Reader.Read(
+                    Buffer.data(),
+                    static_cast<HV_UINT32>(Buffer.size()))))
+                {
+                    Count = 1;
+                    ++Result.Publishes;
+                    Reader.EnableInterrupts();
+                }
+            }
+            else
+            {
+                Reader.Drain([&](VmbusRingPacket const& Packet)
+                {
+                    Packet.CopyPayload(
+                        Buffer.data(),
+                        static_cast<HV_UINT32>(Buffer.size()));
+                }, BatchSize, 0xFFFFFFFF, &Count);
+                if (Count)
+                {
+                    ++Result.Publishes;
+                }
+            }
+
+            if (Count)
+            {
+                Consumed += Count;
+                Waiter.Reset();
+            }
+            else
+            {
+                Waiter.Wait();
+            }
+        }
+
+        Producer.join();
+        Result.Seconds = Watch.Seconds();
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunDrain(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const HV_UINT32 PayloadSizes[] = { 16, 64, 256, 1024, 4096 };
+    const HV_UINT32 RingSize = 256 * 1024;
+    const HV_UINT32 BatchSize = 64;
+    const std::uint64_t PacketCount = 1000000;
+
+    std::printf(
+        "%-10s %8s %12s %10s %12s\n",
+        "Mode",
+        "Payload",
+        "Packets/s",
+        "MB/s",
+        "Publishes");
+    for (HV_UINT32 PayloadSize : PayloadSizes)
+    {
+        for (DrainMode Mode : { DrainMode::PerPacket, DrainMode::Batched })
+        {
+            DrainResult Result = ::MeasureDrain(
+                Mode,
+                PayloadSize,
+                RingSize,
+                BatchSize,
+                PacketCount);
+            double PacketsPerSecond = PacketCount / Result.Seconds;
+            std::printf(
+                "%-10s %8u %12.0f %10.1f %12llu\n",
+                Mode == DrainMode::PerPacket ? "PerPacket" : "Batched",
+                PayloadSize,
+                PacketsPerSecond,
+                PacketsPerSecond * PayloadSize / 1e6,
+                static_cast<unsigned long long>(Result.Publishes));
+        }
+    }
+
+    return 0;
+}
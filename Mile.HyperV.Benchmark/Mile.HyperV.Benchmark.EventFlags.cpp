@@ -0,0 +1,224 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.EventFlags.cpp
+ * PURPOSE:    Implementation for Mile.HyperV event flags benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.EventFlags.h>
+
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    enum class ScanMode
+    {
+        // Test and clear every flag up to the highest ChildRelId.
+        Bitwise,
+        // Exchange every non-zero 32-bit word with zero.
+        Word,
+        // VmbusScanEventFlags.
+        Vector,
+        // VmbusChannelDispatchTable::Dispatch.
+        Table,
+    };
+
+    const char* ScanModeName(
+        ScanMode Mode)
+    {
+        switch (Mode)
+        {
+        case ScanMode::Bitwise:
+            return "Bitwise";
+        case ScanMode::Word:
+            return "Word";
+        case ScanMode::Vector:
+            return "Vector";
+        default:
+            return "Table";
+        }
+    }
+
+    void OnChannelInterrupt(
+        void* Context,
+        HV_UINT32 ChildRelId)
+    {
+        *static_cast<std::uint64_t*>(Context) += ChildRelId;
+    }
+
+    struct EventFlagsResult
+    {
+        double Nanoseconds;
+        std::uint64_t Errors;
+    };
+
+    EventFlagsResult MeasureEventFlags(
+        ScanMode Mode,
+        HV_UINT32 ActiveCount,
+        HV_UINT32 Rounds)
+    {
+        EventFlagsResult Result = {};
+
+        // Every ChildRelId is offered, and the active ones are spread over
+        // the bitmap in a fixed pseudo-random order.
+        alignas(64) HV_SYNIC_EVENT_FLAGS Pattern = {};
+        std::uint64_t Expected = 0;
+        std::uint64_t State = 0x2545F4914F6CDD1DULL;
+        for (HV_UINT32 Set = 0; Set < ActiveCount;)
+        {
+            State ^= State << 13;
+            State ^= State >> 7;
+            State ^= State << 17;
+            HV_UINT32 Flag = (ActiveCount == HV_EVENT_FLAGS_COUNT)
+                ? Set
+                : static_cast<HV_UINT32>(State % HV_EVENT_FLAGS_COUNT);
+            if (!(Pattern.Flags32[Flag / 32] & (1u << (Flag % 32))))
+            {
+                Pattern.Flags32[Flag / 32] |= 1u << (Flag % 32);
+                Expected += Flag;
+                ++Set;
+            }
+        }
+
+        std::vector<VmbusChannelDispatchEntry> Entries(VMBUS_MAX_CHANNELS);
+        VmbusChannelDispatchTable Table;
+        Table.Initialize(Entries.data(), VMBUS_MAX_CHANNELS);
+        std::uint64_t Sum = 0;
+        for (HV_UINT32 i = 0; i < VMBUS_MAX_CHANNELS; ++i)
+        {
+            if (!NT_SUCCESS(Table.Register(i, ::OnChannelInterrupt, &Sum)))
+            {
+                ++Result.Errors;
+            }
+        }
+        // A registered flag keeps its routine until it is unregistered.
+        if (Table.Register(0, ::OnChannelInterrupt, nullptr) !=
+            STATUS_OBJECT_NAME_COLLISION ||
+            !NT_SUCCESS(Table.Unregister(0)) ||
+            !NT_SUCCESS(Table.Register(0, ::OnChannelInterrupt, &Sum)))
+        {
+            ++Result.Errors;
+        }
+
+        alignas(64) volatile HV_SYNIC_EVENT_FLAGS Flags = {};
+        HV_SYNIC_EVENT_FLAGS& Plain = const_cast<HV_SYNIC_EVENT_FLAGS&>(Flags);
+        auto OnFlag = [&Sum](HV_UINT32 Flag)
+        {
+            ::OnChannelInterrupt(&Sum, Flag);
+        };
+
+        Stopwatch Watch;
+        for (HV_UINT32 Round = 0; Round < Rounds; ++Round)
+        {
+            // Raise the interrupts, as the hypervisor would.
+            std::memcpy(&Plain, &Pattern, sizeof(Pattern));
+            switch (Mode)
+            {
+            case ScanMode::Bitwise:
+                for (HV_UINT32 Flag = 0; Flag < HV_EVENT_FLAGS_COUNT; ++Flag)
+                {
+                    std::atomic_ref<HV_UINT32> Word(Plain.Flags32[Flag / 32]);
+                    HV_UINT32 Mask = 1u << (Flag % 32);
+                    if ((Word.load(std::memory_order_relaxed) & Mask) &&
+                        (Word.fetch_and(~Mask) & Mask))
+                    {
+                        OnFlag(Flag);
+                    }
+                }
+                break;
+            case ScanMode::Word:
+                for (HV_UINT32 i = 0; i < HV_EVENT_FLAGS_DWORD_COUNT; ++i)
+                {
+                    std::atomic_ref<HV_UINT32> Word(Plain.Flags32[i]);
+                    if (!Word.load(std::memory_order_relaxed))
+                    {
+                        continue;
+                    }
+                    for (HV_UINT32 Value = Word.exchange(0);
+                        Value;
+                        Value &= Value - 1)
+                    {
+                        OnFlag(i * 32 + std::countr_zero(Value));
+                    }
+                }
+                break;
+            case ScanMode::Vector:
+                ::Mile::HyperV::VmbusScanEventFlags(
+                    Flags,
+                    HV_EVENT_FLAGS_COUNT,
+                    OnFlag);
+                break;
+            default:
+                Table.Dispatch(Flags);
+                break;
+            }
+        }
+        Result.Nanoseconds = Watch.Seconds() * 1e9 / Rounds;
+
+        if (Sum != Expected * Rounds || Table.Unhandled())
+        {
+            ++Result.Errors;
+        }
+        for (HV_UINT32 i = 0; i < HV_EVENT_FLAGS_DWORD_COUNT; ++i)
+        {
+            if (Plain.Flags32[i])
+            {
+                ++Result.Errors;
+            }
+        }
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunEventFlags(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const HV_UINT32 ActiveCounts[] = { 1, 64, HV_EVENT_FLAGS_COUNT };
+    const ScanMode Modes[] =
+    {
+        ScanMode::Bitwise,
+        ScanMode::Word,
+        ScanMode::Vector,
+        ScanMode::Table,
+    };
+
+    std::printf(
+        "Chunk: %u bytes, every scan refills the 256-byte bitmap\n",
+        VmbusEventFlagsChunkBytes);
+    std::printf(
+        "%-10s %8s %14s %8s\n",
+        "Mode",
+        "Active",
+        "ns/Interrupt",
+        "Errors");
+    for (HV_UINT32 ActiveCount : ActiveCounts)
+    {
+        for (ScanMode Mode : Modes)
+        {
+            EventFlagsResult Result = ::MeasureEventFlags(
+                Mode,
+                ActiveCount,
+                (1u << 24) / (ActiveCount + 64));
+            std::printf(
+                "%-10s %8u %14.1f %8llu\n",
+                ::ScanModeName(Mode),
+                ActiveCount,
+                Result.Nanoseconds,
+                static_cast<unsigned long long>(Result.Errors));
+        }
+    }
+
+    return 0;
+}
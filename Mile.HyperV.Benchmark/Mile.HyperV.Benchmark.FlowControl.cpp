@@ -0,0 +1,164 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.FlowControl.cpp
+ * PURPOSE:    Implementation for Mile.HyperV ring flow control benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <atomic>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    enum class SendMode
+    {
+        // Retry the write until the ring has room.
+        Spin,
+        // Record the needed space in PendingSendSize and sleep until the
+        // reader signals.
+        PendingSendSize,
+    };
+
+    struct FlowControlResult
+    {
+        double Seconds;
+        double SenderCpuSeconds;
+        std::uint64_t Signals;
+    };
+
+    FlowControlResult MeasureFlowControl(
+        SendMode Mode,
+        HV_UINT32 PayloadSize,
+        HV_UINT32 RingSize,
+        std::uint64_t PacketCount)
+    {
+        SharedMemory Memory(VmbusRingControlPageSize + RingSize);
+        VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        VmbusRingWriter Writer(Ring);
+        VmbusRingReader Reader(Ring);
+        SignalEvent WriterEvent;
+
+        std::vector<HV_UINT8> Payload(PayloadSize, 0xA5);
+        VmbusRingSegment Segment = { Payload.data(), PayloadSize };
+
+        FlowControlResult Result = {};
+        Stopwatch Watch;
+
+        std::thread Sender([&]()
+        {
+            double CpuStart = ::Mile::HyperV::Benchmark::ThreadCpuSeconds();
+            Backoff Waiter;
+            for (std::uint64_t i = 0; i < PacketCount; ++i)
+            {
+                VMPACKET_DESCRIPTOR Descriptor =
+                    VmbusRingWriter::InBandDescriptor(
+                        VmbusPacketTypeDataInBand,
+                        0,
+                        i);
+                if (Mode == SendMode::Spin)
+                {
+                    while (!NT_SUCCESS(Writer.WritePacket(
+                        Descriptor,
+                        &Segment,
+                        1)))
+                    {
+                        Waiter.Wait();
+                    }
+                    Waiter.Reset();
+                }
+                else
+                {
+                    Writer.WritePacketWait(
+                        Descriptor,
+                        &Segment,
+                        1,
+                        [&]() -> bool
+                    {
+                        // The timeout only guards the benchmark against a
+                        // lost signal, which would show up as a slow run.
+                        WriterEvent.Wait(std::chrono::milliseconds(100));
+                        return true;
+                    });
+                }
+            }
+            Result.SenderCpuSeconds =
+                ::Mile::HyperV::Benchmark::ThreadCpuSeconds() - CpuStart;
+        });
+
+        // The receiver handles a small batch, then stalls as if it was busy
+        // completing the requests, which keeps the ring full.
+        std::uint64_t Received = 0;
+        while (Received < PacketCount)
+        {
+            HV_UINT32 Count = 0;
+            bool Signal = false;
+            Reader.ReadBatch(
+                [](VmbusRingPacket const&) {},
+                16,
+                0xFFFFFFFF,
+                &Count,
+                &Signal);
+            Received += Count;
+            if (Signal)
+            {
+                ++Result.Signals;
+                WriterEvent.Set();
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+
+        Sender.join();
+        Result.Seconds = Watch.Seconds();
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunFlowControl(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const HV_UINT32 PayloadSizes[] = { 256, 4096 };
+    const HV_UINT32 RingSize = 64 * 1024;
+    const std::uint64_t PacketCount = 20000;
+
+    std::printf(
+        "%-16s %8s %10s %12s %10s %10s\n",
+        "Mode",
+        "Payload",
+        "Seconds",
+        "SenderCpu",
+        "CpuPct",
+        "Signals");
+    for (HV_UINT32 PayloadSize : PayloadSizes)
+    {
+        for (SendMode Mode : { SendMode::Spin, SendMode::PendingSendSize })
+        {
+            FlowControlResult Result = ::MeasureFlowControl(
+                Mode,
+                PayloadSize,
+                RingSize,
+                PacketCount);
+            std::printf(
+                "%-16s %8u %10.3f %12.3f %9.1f%% %10llu\n",
+                Mode == SendMode::Spin ? "Spin" : "PendingSendSize",
+                PayloadSize,
+                Result.Seconds,
+                Result.SenderCpuSeconds,
+                100.0 * Result.SenderCpuSeconds / Result.Seconds,
+                static_cast<unsigned long long>(Result.Signals));
+        }
+    }
+
+    return 0;
+}
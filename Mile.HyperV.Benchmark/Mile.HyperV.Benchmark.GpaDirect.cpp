@@ -0,0 +1,251 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.GpaDirect.cpp
+ * PURPOSE:    Implementation for Mile.HyperV GPA direct builder benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.GpaDirect.h>
+
+#include <random>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    enum class BuildMode
+    {
+        // Emit one GPA_RANGE per fragment.
+        PerFragment,
+        // Merge fragments with VmbusGpaDirectBuilder.
+        Coalesced,
+    };
+
+    struct GpaDirectResult
+    {
+        std::uint64_t Ranges;
+        std::uint64_t RingBytes;
+        double PacketsPerSecond;
+        std::uint64_t ByteErrors;
+    };
+
+    NTSTATUS WritePerFragment(
+        VmbusRingWriter& Writer,
+        std::vector<VmbusGpaFragment> const& Fragments,
+        std::vector<HV_UINT64>& Words,
+        HV_UINT32* RangeCount)
+    {
+        Words.clear();
+        for (VmbusGpaFragment const& Fragment : Fragments)
+        {
+            GPA_RANGE Header;
+            Header.ByteCount = Fragment.ByteCount;
+            Header.ByteOffset = Fragment.ByteOffset % VmbusGpadlPageSize;
+            HV_UINT64 Word;
+            std::memcpy(&Word, &Header, sizeof(Word));
+            Words.push_back(Word);
+            HV_UINT64 Pfn =
+                Fragment.Pfn + Fragment.ByteOffset / VmbusGpadlPageSize;
+            VmbusGpadlRange Range = { Header.ByteCount, Header.ByteOffset };
+            for (HV_UINT64 i = 0;
+                i < ::Mile::HyperV::VmbusGpadlRangePfnCount(Range);
+                ++i)
+            {
+                Words.push_back(Pfn + i);
+            }
+        }
+        *RangeCount = static_cast<HV_UINT32>(Fragments.size());
+
+        VMPACKET_DESCRIPTOR Descriptor = VmbusRingWriter::InBandDescriptor(
+            VmbusPacketTypeDataUsingGpaDirect,
+            VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED,
+            1);
+        Descriptor.DataOffset8 = static_cast<HV_UINT16>(
+            (offsetof(VMDATA_GPA_DIRECT, Range)
+                + Words.size() * VmbusGpadlWordSize)
+            / VmbusRingPacketAlignment);
+        HV_UINT32 RangeHeader[2] = { 0, *RangeCount };
+        VmbusRingSegment Segments[2] =
+        {
+            { RangeHeader, sizeof(RangeHeader) },
+            {
+                Words.data(),
+                static_cast<HV_UINT32>(Words.size() * VmbusGpadlWordSize)
+            },
+        };
+        return Writer.WritePacket(Descriptor, Segments, 2);
+    }
+
+    GpaDirectResult MeasureGpaDirect(
+        BuildMode Mode,
+        std::vector<VmbusGpaFragment> const& Fragments,
+        std::uint64_t PacketCount)
+    {
+        const HV_UINT32 RingSize = 1024 * 1024;
+        SharedMemory Memory(VmbusRingControlPageSize + RingSize);
+        VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        VmbusRingWriter Writer(Ring);
+        VmbusRingReader Reader(Ring);
+
+        std::uint64_t ExpectedBytes = 0;
+        for (VmbusGpaFragment const& Fragment : Fragments)
+        {
+            ExpectedBytes += Fragment.ByteCount;
+        }
+
+        std::vector<HV_UINT64> Words;
+        Words.reserve(2 * Fragments.size() + 1024);
+        VmbusGpaDirectBuilder Builder;
+        Builder.Initialize(
+            Words.data(),
+            static_cast<HV_UINT32>(Words.capacity()));
+
+        GpaDirectResult Result = {};
+        Stopwatch Watch;
+        for (std::uint64_t i = 0; i < PacketCount; ++i)
+        {
+            HV_UINT32 RangeCount = 0;
+            if (Mode == BuildMode::PerFragment)
+            {
+                ::WritePerFragment(Writer, Fragments, Words, &RangeCount);
+            }
+            else
+            {
+                Builder.Reset();
+                Builder.Append(Fragments.data(), Fragments.size());
+                Builder.Write(
+                    Writer,
+                    VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED,
+                    1,
+                    nullptr,
+                    0);
+                RangeCount = Builder.RangeCount();
+            }
+
+            // The receiver walks the ranges, as a VSP would to map them.
+            Reader.ReadBatch([&](VmbusRingPacket const& Packet)
+            {
+                std::uint64_t Bytes = 0;
+                VmbusGpaDirectBuilder::EnumerateRanges(
+                    Packet,
+                    [&](HV_UINT16, VmbusGpadlRange const& Range)
+                    {
+                        Bytes += Range.ByteCount;
+                    },
+                    [](HV_UINT64) {});
+                if (Bytes != ExpectedBytes)
+                {
+                    ++Result.ByteErrors;
+                }
+                Result.RingBytes = Packet.Size() + VmbusRingTrailerSize;
+            }, 1);
+            Result.Ranges = RangeCount;
+        }
+        Result.PacketsPerSecond = PacketCount / Watch.Seconds();
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunGpaDirect(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const HV_UINT32 IoSize = 256 * 1024;
+    std::mt19937_64 Random(0x1E10);
+    auto RandomPfn = [&]() -> HV_UINT64
+    {
+        return 0x100000 + (Random() & 0xFFFFF);
+    };
+
+    struct GpaDirectLayout
+    {
+        const char* Name;
+        std::vector<VmbusGpaFragment> Fragments;
+    };
+    std::vector<GpaDirectLayout> Layouts;
+
+    // A buffer from a physically contiguous allocation, described page by
+    // page, as an MDL walk produces it.
+    {
+        GpaDirectLayout Layout = { "Pages-Contiguous", {} };
+        for (HV_UINT32 i = 0; i < IoSize / VmbusGpadlPageSize; ++i)
+        {
+            Layout.Fragments.push_back({ 0x100000 + i, 0, 4096 });
+        }
+        Layouts.push_back(Layout);
+    }
+
+    // A virtually contiguous buffer on scattered physical pages.
+    {
+        GpaDirectLayout Layout = { "Pages-Scattered", {} };
+        for (HV_UINT32 i = 0; i < IoSize / VmbusGpadlPageSize; ++i)
+        {
+            Layout.Fragments.push_back({ RandomPfn(), 0, 4096 });
+        }
+        Layouts.push_back(Layout);
+    }
+
+    // A scatter list of 512-byte sectors from a contiguous buffer.
+    {
+        GpaDirectLayout Layout = { "Sectors", {} };
+        for (HV_UINT32 i = 0; i < IoSize / 512; ++i)
+        {
+            Layout.Fragments.push_back({ 0x100000, i * 512, 512 });
+        }
+        Layouts.push_back(Layout);
+    }
+
+    // Unrelated small buffers, which can not be merged.
+    {
+        GpaDirectLayout Layout = { "Unaligned", {} };
+        for (HV_UINT32 i = 0; i < 64; ++i)
+        {
+            Layout.Fragments.push_back({
+                RandomPfn(),
+                static_cast<HV_UINT32>(16 + (Random() % 2048)),
+                static_cast<HV_UINT32>(512 + (Random() % 8192)) });
+        }
+        Layouts.push_back(Layout);
+    }
+
+    const std::uint64_t PacketCount = 100000;
+
+    std::printf(
+        "%-18s %-12s %10s %12s %12s %10s\n",
+        "Layout",
+        "Mode",
+        "Ranges",
+        "RingBytes",
+        "Packets/s",
+        "Errors");
+    for (GpaDirectLayout const& Layout : Layouts)
+    {
+        for (BuildMode Mode : { BuildMode::PerFragment, BuildMode::Coalesced })
+        {
+            GpaDirectResult Result = ::MeasureGpaDirect(
+                Mode,
+                Layout.Fragments,
+                PacketCount);
+            std::printf(
+                "%-18s %-12s %10llu %12llu %12.0f %10llu\n",
+                Layout.Name,
+                Mode == BuildMode::PerFragment ? "PerFragment" : "Coalesced",
+                static_cast<unsigned long long>(Result.Ranges),
+                static_cast<unsigned long long>(Result.RingBytes),
+                Result.PacketsPerSecond,
+                static_cast<unsigned long long>(Result.ByteErrors));
+        }
+    }
+
+    return 0;
+}
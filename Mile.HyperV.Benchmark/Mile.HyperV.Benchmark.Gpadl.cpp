@@ -0,0 +1,261 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.Gpadl.cpp
+ * PURPOSE:    Implementation for Mile.HyperV GPADL encoder benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.Gpadl.h>
+
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    struct GpadlResult
+    {
+        double EncodeSeconds;
+        double DecodeSeconds;
+        std::uint64_t Messages;
+        std::uint64_t Mismatches;
+    };
+
+    GpadlResult MeasureGpadl(
+        std::vector<VmbusGpadlRange> const& Ranges,
+        std::uint32_t Iterations)
+    {
+        std::uint64_t PfnCount = 0;
+        for (VmbusGpadlRange const& Range : Ranges)
+        {
+            PfnCount += ::Mile::HyperV::VmbusGpadlRangePfnCount(Range);
+        }
+
+        // Scatter the PFNs, so nothing can be coalesced or predicted.
+        std::vector<HV_UINT64> Pfns(static_cast<std::size_t>(PfnCount));
+        for (std::size_t i = 0; i < Pfns.size(); ++i)
+        {
+            Pfns[i] = 0x100000 + ((i * 0x9E3779B1ULL) & 0xFFFFFFF);
+        }
+
+        // The messages are kept, as a real sender would post each one to
+        // the hypervisor before producing the next.
+        VmbusGpadlEncoder Encoder;
+        Encoder.Initialize(
+            1,
+            0xE1E10,
+            Ranges.data(),
+            static_cast<HV_UINT16>(Ranges.size()));
+        std::vector<HV_UINT8> Messages(static_cast<std::size_t>(
+            Encoder.MessageCount() * MAXIMUM_SYNIC_MESSAGE_BYTES));
+        std::vector<HV_UINT32> MessageSizes(
+            static_cast<std::size_t>(Encoder.MessageCount()));
+
+        GpadlResult Result = {};
+        Result.Messages = Encoder.MessageCount();
+
+        Stopwatch EncodeWatch;
+        for (std::uint32_t i = 0; i < Iterations; ++i)
+        {
+            Encoder.Initialize(
+                1,
+                0xE1E10,
+                Ranges.data(),
+                static_cast<HV_UINT16>(Ranges.size()));
+            std::size_t Next = 0;
+            auto Source = [&](HV_UINT64& Pfn) -> bool
+            {
+                if (Next >= Pfns.size())
+                {
+                    return false;
+                }
+                Pfn = Pfns[Next++];
+                return true;
+            };
+            for (std::size_t j = 0;
+                NT_SUCCESS(Encoder.Next(
+                    Source,
+                    &Messages[j * MAXIMUM_SYNIC_MESSAGE_BYTES],
+                    &MessageSizes[j])) && !Encoder.IsComplete();
+                ++j)
+            {
+            }
+        }
+        Result.EncodeSeconds = EncodeWatch.Seconds() / Iterations;
+
+        Stopwatch DecodeWatch;
+        for (std::uint32_t i = 0; i < Iterations; ++i)
+        {
+            VmbusGpadlDecoder Decoder;
+            std::size_t Next = 0;
+            std::uint64_t Mismatches = 0;
+            auto OnRange = [](HV_UINT16, VmbusGpadlRange const&) {};
+            auto OnPfn = [&](HV_UINT64 Pfn)
+            {
+                if (Next >= Pfns.size() || Pfns[Next++] != Pfn)
+                {
+                    ++Mismatches;
+                }
+            };
+            NTSTATUS Status = Decoder.DecodeHeader(
+                &Messages[0],
+                MessageSizes[0],
+                OnRange,
+                OnPfn);
+            for (std::size_t j = 1; Status == STATUS_MORE_ENTRIES; ++j)
+            {
+                Status = Decoder.DecodeBody(
+                    &Messages[j * MAXIMUM_SYNIC_MESSAGE_BYTES],
+                    MessageSizes[j],
+                    OnRange,
+                    OnPfn);
+            }
+            if (Status != STATUS_SUCCESS || Next != Pfns.size())
+            {
+                ++Mismatches;
+            }
+            Result.Mismatches += Mismatches;
+        }
+        Result.DecodeSeconds = DecodeWatch.Seconds() / Iterations;
+
+        return Result;
+    }
+
+    /**
+     * @brief Checks that body messages out of sequence are refused without
+     *        disturbing the GPADL in progress.
+     */
+    std::uint64_t CheckGpadlSequence()
+    {
+        std::uint64_t Errors = 0;
+        VmbusGpadlRange Range = { 1024 * 1024, 0 };
+        VmbusGpadlEncoder Encoder;
+        Encoder.Initialize(1, 0xE1E10, &Range, 1);
+        std::vector<std::vector<HV_UINT8>> Messages;
+        HV_UINT64 NextPfn = 0x100000;
+        auto Source = [&NextPfn](HV_UINT64& Pfn) -> bool
+        {
+            Pfn = NextPfn++;
+            return true;
+        };
+        while (!Encoder.IsComplete())
+        {
+            std::vector<HV_UINT8> Message(MAXIMUM_SYNIC_MESSAGE_BYTES);
+            HV_UINT32 Size = 0;
+            if (!NT_SUCCESS(Encoder.Next(Source, Message.data(), &Size)))
+            {
+                return ++Errors;
+            }
+            Message.resize(Size);
+            Messages.push_back(Message);
+        }
+        if (Messages.size() < 3)
+        {
+            return ++Errors;
+        }
+
+        VmbusGpadlDecoder Decoder;
+        HV_UINT64 Expected = 0x100000;
+        auto OnRange = [](HV_UINT16, VmbusGpadlRange const&) {};
+        auto OnPfn = [&](HV_UINT64 Pfn)
+        {
+            if (Pfn != Expected++)
+            {
+                ++Errors;
+            }
+        };
+        auto Decode = [&](std::size_t Index)
+        {
+            return Decoder.DecodeBody(
+                Messages[Index].data(),
+                static_cast<HV_UINT32>(Messages[Index].size()),
+                OnRange,
+                OnPfn);
+        };
+        if (Decoder.DecodeHeader(
+            Messages[0].data(),
+            static_cast<HV_UINT32>(Messages[0].size()),
+            OnRange,
+            OnPfn) != STATUS_MORE_ENTRIES ||
+            Decode(2) != STATUS_INVALID_PARAMETER ||
+            Decode(1) != STATUS_MORE_ENTRIES ||
+            Decode(1) != STATUS_INVALID_PARAMETER)
+        {
+            ++Errors;
+        }
+        NTSTATUS Status = STATUS_MORE_ENTRIES;
+        for (std::size_t i = 2; i < Messages.size(); ++i)
+        {
+            Status = Decode(i);
+        }
+        if (Status != STATUS_SUCCESS || !Decoder.IsComplete())
+        {
+            ++Errors;
+        }
+        return Errors;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunGpadl(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    struct GpadlLayout
+    {
+        const char* Name;
+        std::vector<VmbusGpadlRange> Ranges;
+    };
+    const HV_UINT32 HalfGiB = 512 * 1024 * 1024;
+    const GpadlLayout Layouts[] =
+    {
+        { "16MiB", { { 16 * 1024 * 1024, 0 } } },
+        { "1GiB", { { HalfGiB, 0 }, { HalfGiB, 0 } } },
+        { "1GiB-Unaligned", { { HalfGiB, 0x800 }, { HalfGiB, 0x10 } } },
+    };
+    const std::uint32_t Iterations = 10;
+
+    std::printf(
+        "%-16s %10s %12s %12s %12s %12s\n",
+        "Layout",
+        "Messages",
+        "Encode(ms)",
+        "Decode(ms)",
+        "ns/Message",
+        "Mismatches");
+    for (GpadlLayout const& Layout : Layouts)
+    {
+        GpadlResult Result = ::MeasureGpadl(Layout.Ranges, Iterations);
+        std::printf(
+            "%-16s %10llu %12.3f %12.3f %12.1f %12llu\n",
+            Layout.Name,
+            static_cast<unsigned long long>(Result.Messages),
+            Result.EncodeSeconds * 1e3,
+            Result.DecodeSeconds * 1e3,
+            Result.EncodeSeconds * 1e9 / Result.Messages,
+            static_cast<unsigned long long>(Result.Mismatches));
+    }
+
+    // A single range can not describe more than GPA_RANGE_MAX_PFN_COUNT
+    // pages, which a 4 GiB range starting inside its first page exceeds.
+    VmbusGpadlRange Oversized = { 0xFFFFFFFF, 0x10 };
+    VmbusGpadlEncoder Encoder;
+    NTSTATUS Status = Encoder.Initialize(1, 0xE1E10, &Oversized, 1);
+    std::printf(
+        "Oversized range: 0x%08X%s\n",
+        static_cast<unsigned int>(Status),
+        Status == STATUS_INTEGER_OVERFLOW ? " (rejected)" : "");
+    std::printf(
+        "Sequence checks: %llu errors\n",
+        static_cast<unsigned long long>(::CheckGpadlSequence()));
+
+    return 0;
+}
@@ -0,0 +1,476 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.HostEmulator.cpp
+ * PURPOSE:    Implementation for Mile.HyperV host emulator benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.HostEmulator.h>
+
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    // The PFN of the first page of the emulated guest memory.
+    const HV_UINT64 GuestBasePfn = 0x100000;
+
+    struct HostEmulatorResult
+    {
+        double CyclesPerSecond;
+        std::uint64_t MessagesPerCycle;
+        std::uint64_t Errors;
+    };
+
+    /**
+     * @brief The guest half of the benchmark, which drives the emulator
+     *        through its message queues the way a VMBus driver would.
+     */
+    class GuestDriver
+    {
+    private:
+
+        VmbusSynicMessageQueue& m_ToHost;
+        VmbusSynicMessageQueue& m_ToGuest;
+        VmbusHostEmulator& m_Host;
+        std::uint64_t m_Messages = 0;
+
+    public:
+
+        std::uint64_t Errors = 0;
+        std::uint32_t Opens = 0;
+        std::uint32_t Closes = 0;
+
+        GuestDriver(
+            VmbusSynicMessageQueue& ToHost,
+            VmbusSynicMessageQueue& ToGuest,
+            VmbusHostEmulator& Host) :
+            m_ToHost(ToHost),
+            m_ToGuest(ToGuest),
+            m_Host(Host)
+        {
+        }
+
+        std::uint64_t Messages() const
+        {
+            return m_Messages;
+        }
+
+        NTSTATUS OnEvent(
+            VmbusHostEvent Event,
+            VmbusHostChannel&)
+        {
+            if (Event == VmbusHostEvent::Open)
+            {
+                ++Opens;
+            }
+            else if (Event == VmbusHostEvent::Close)
+            {
+                ++Closes;
+            }
+            return STATUS_SUCCESS;
+        }
+
+        void Post(
+            const void* Message,
+            HV_UINT32 MessageSize)
+        {
+            if (!NT_SUCCESS(m_ToHost.Post(
+                static_cast<HV_MESSAGE_TYPE>(VMBUS_MESSAGE_TYPE),
+                Message,
+                MessageSize)))
+            {
+                ++Errors;
+            }
+            ++m_Messages;
+        }
+
+        /**
+         * @brief Lets the host run and receives its next message.
+         * @param MessageType The expected channel message type.
+         * @param Message Receives the message.
+         * @return Whether a message of the expected type arrived.
+         */
+        bool Expect(
+            VMBUS_CHANNEL_MESSAGE_TYPE MessageType,
+            HV_MESSAGE& Message)
+        {
+            m_Host.Process([this](
+                VmbusHostEvent Event,
+                VmbusHostChannel& Channel)
+            {
+                return this->OnEvent(Event, Channel);
+            });
+            VMBUS_CHANNEL_MESSAGE_HEADER Header = {};
+            if (!NT_SUCCESS(m_ToGuest.Receive(Message)) ||
+                Message.Header.PayloadSize < sizeof(Header))
+            {
+                ++Errors;
+                return false;
+            }
+            ++m_Messages;
+            std::memcpy(&Header, Message.Payload, sizeof(Header));
+            if (Header.MessageType != MessageType)
+            {
+                ++Errors;
+                return false;
+            }
+            return true;
+        }
+
+        void Connect()
+        {
+            VMBUS_CHANNEL_INITIATE_CONTACT Contact = {};
+            Contact.Header.MessageType = ChannelMessageInitiateContact;
+            Contact.VMBusVersionRequested = VMBUS_VERSION_COPPER;
+            Contact.FeatureFlags =
+                VMBUS_FEATURE_FLAG_GUEST_SPECIFIED_SIGNAL_PARAMETERS;
+            this->Post(&Contact, sizeof(Contact));
+            HV_MESSAGE Message;
+            if (this->Expect(ChannelMessageVersionResponse, Message))
+            {
+                VMBUS_CHANNEL_VERSION_RESPONSE Response;
+                std::memcpy(&Response, Message.Payload, sizeof(Response));
+                if (!Response.VersionSupported)
+                {
+                    ++Errors;
+                }
+            }
+        }
+
+        /**
+         * @brief Requests the offers.
+         * @return The number of offers received.
+         */
+        std::uint32_t RequestOffers()
+        {
+            VMBUS_CHANNEL_REQUEST_OFFERS Request = {};
+            Request.MessageType = ChannelMessageRequestOffers;
+            this->Post(&Request, sizeof(Request));
+            std::uint32_t Offers = 0;
+            for (;;)
+            {
+                m_Host.Process([this](
+                    VmbusHostEvent Event,
+                    VmbusHostChannel& Channel)
+                {
+                    return this->OnEvent(Event, Channel);
+                });
+                HV_MESSAGE Message;
+                if (!NT_SUCCESS(m_ToGuest.Receive(Message)))
+                {
+                    ++Errors;
+                    break;
+                }
+                ++m_Messages;
+                VMBUS_CHANNEL_MESSAGE_HEADER Header;
+                std::memcpy(&Header, Message.Payload, sizeof(Header));
+                if (Header.MessageType == ChannelMessageAllOffersDelivered)
+                {
+                    break;
+                }
+                if (Header.MessageType == ChannelMessageOfferChannel)
+                {
+                    ++Offers;
+                }
+            }
+            return Offers;
+        }
+
+        /**
+         * @brief Creates a GPADL which describes a run of guest pages.
+         */
+        void CreateGpadl(
+            HV_UINT32 ChildRelId,
+            HV_UINT32 Handle,
+            HV_UINT64 FirstPfn,
+            HV_UINT32 PageCount)
+        {
+            VmbusGpadlRange Range = { PageCount * VmbusGpadlPageSize, 0 };
+            VmbusGpadlEncoder Encoder;
+            Encoder.Initialize(ChildRelId, Handle, &Range, 1);
+            HV_UINT64 NextPfn = FirstPfn;
+            auto Source = [&NextPfn](HV_UINT64& Pfn) -> bool
+            {
+                Pfn = NextPfn++;
+                return true;
+            };
+            HV_UINT8 Buffer[MAXIMUM_SYNIC_MESSAGE_BYTES];
+            HV_UINT32 Size = 0;
+            while (NT_SUCCESS(Encoder.Next(Source, Buffer, &Size)))
+            {
+                this->Post(Buffer, Size);
+                if (Encoder.IsComplete())
+                {
+                    break;
+                }
+            }
+            HV_MESSAGE Message;
+            if (this->Expect(ChannelMessageGpadlCreated, Message))
+            {
+                VMBUS_CHANNEL_GPADL_CREATED Created;
+                std::memcpy(&Created, Message.Payload, sizeof(Created));
+                if (Created.CreationStatus != STATUS_SUCCESS)
+                {
+                    ++Errors;
+                }
+            }
+        }
+
+        void OpenChannel(
+            HV_UINT32 ChildRelId,
+            HV_UINT32 Handle,
+            HV_UINT32 DownstreamPageOffset)
+        {
+            VMBUS_CHANNEL_OPEN_CHANNEL Open = {};
+            Open.Header.MessageType = ChannelMessageOpenChannel;
+            Open.ChildRelId = ChildRelId;
+            Open.OpenId = ChildRelId;
+            Open.RingBufferGpadlHandle = Handle;
+            Open.DownstreamRingBufferPageOffset = DownstreamPageOffset;
+            Open.EventFlag = static_cast<HV_UINT16>(ChildRelId);
+            this->Post(&Open, sizeof(Open));
+            HV_MESSAGE Message;
+            if (this->Expect(ChannelMessageOpenChannelResult, Message))
+            {
+                VMBUS_CHANNEL_OPEN_RESULT Result;
+                std::memcpy(&Result, Message.Payload, sizeof(Result));
+                if (Result.Status != STATUS_SUCCESS ||
+                    Result.OpenId != ChildRelId)
+                {
+                    ++Errors;
+                }
+            }
+        }
+
+        void CloseChannel(
+            HV_UINT32 ChildRelId,
+            HV_UINT32 Handle)
+        {
+            VMBUS_CHANNEL_CLOSE_CHANNEL Close = {};
+            Close.Header.MessageType = ChannelMessageCloseChannel;
+            Close.ChildRelId = ChildRelId;
+            this->Post(&Close, sizeof(Close));
+
+            VMBUS_CHANNEL_GPADL_TEARDOWN Teardown = {};
+            Teardown.Header.MessageType = ChannelMessageGpadlTeardown;
+            Teardown.ChildRelId = ChildRelId;
+            Teardown.Gpadl = Handle;
+            this->Post(&Teardown, sizeof(Teardown));
+            HV_MESSAGE Message;
+            this->Expect(ChannelMessageGpadlTorndown, Message);
+        }
+
+        void Unload()
+        {
+            VMBUS_CHANNEL_UNLOAD Unload = {};
+            Unload.MessageType = ChannelMessageUnload;
+            this->Post(&Unload, sizeof(Unload));
+            HV_MESSAGE Message;
+            this->Expect(ChannelMessageUnloadComplete, Message);
+        }
+    };
+
+    HostEmulatorResult MeasureHostEmulator(
+        HV_UINT32 RingPages,
+        HV_UINT32 ChannelCount,
+        HV_UINT32 Cycles,
+        bool ExchangePacket)
+    {
+        // Every channel has its own pair of rings in the guest memory, each
+        // with its control page.
+        const HV_UINT32 PagesPerChannel = 2 * (1 + RingPages);
+        SharedMemory GuestMemory(static_cast<std::size_t>(ChannelCount)
+            * PagesPerChannel * VmbusGpadlPageSize);
+        PHV_UINT8 GuestBase = reinterpret_cast<PHV_UINT8>(GuestMemory.Buffer());
+        auto MapPage = [&](HV_UINT64 Pfn) -> PHV_UINT8
+        {
+            HV_UINT64 Index = Pfn - GuestBasePfn;
+            return (Index < static_cast<HV_UINT64>(ChannelCount)
+                * PagesPerChannel)
+                ? GuestBase + Index * VmbusGpadlPageSize
+                : nullptr;
+        };
+
+        std::vector<HV_MESSAGE> ToHostSlots(16);
+        std::vector<HV_MESSAGE> ToGuestSlots(16);
+        VmbusSynicMessageQueue ToHost;
+        VmbusSynicMessageQueue ToGuest;
+        ToHost.Initialize(ToHostSlots.data(), 16);
+        ToGuest.Initialize(ToGuestSlots.data(), 16);
+
+        std::vector<VmbusHostChannel> Channels(ChannelCount);
+        std::vector<VmbusHostGpadl> Gpadls(ChannelCount);
+        const HV_UINT32 WordsPerGpadl = 1 + PagesPerChannel;
+        std::vector<HV_UINT64> Words(
+            static_cast<std::size_t>(ChannelCount) * WordsPerGpadl);
+        VmbusHostEmulator Host;
+        Host.Initialize(
+            &ToHost,
+            &ToGuest,
+            Channels.data(),
+            ChannelCount,
+            Gpadls.data(),
+            ChannelCount,
+            Words.data(),
+            WordsPerGpadl);
+
+        HostEmulatorResult Result = {};
+        HV_GUID InterfaceType = {};
+        InterfaceType.Data1 = 0xE1E10;
+        for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+        {
+            HV_GUID InterfaceInstance = {};
+            InterfaceInstance.Data1 = i;
+            HV_UINT32 ChildRelId = 0;
+            if (!NT_SUCCESS(Host.Offer(
+                InterfaceType,
+                InterfaceInstance,
+                0,
+                0,
+                nullptr,
+                &ChildRelId)))
+            {
+                ++Result.Errors;
+            }
+        }
+
+        GuestDriver Guest(ToHost, ToGuest, Host);
+        Guest.Connect();
+        if (Guest.RequestOffers() != ChannelCount)
+        {
+            ++Result.Errors;
+        }
+
+        std::uint64_t FirstMessages = Guest.Messages();
+        Stopwatch Watch;
+        for (HV_UINT32 Cycle = 0; Cycle < Cycles; ++Cycle)
+        {
+            HV_UINT32 Index = Cycle % ChannelCount;
+            HV_UINT32 ChildRelId = Index + 1;
+            HV_UINT32 Handle = 0xE1E10000 + Cycle;
+            Guest.CreateGpadl(
+                ChildRelId,
+                Handle,
+                GuestBasePfn + static_cast<HV_UINT64>(Index)
+                    * PagesPerChannel,
+                PagesPerChannel);
+            Guest.OpenChannel(ChildRelId, Handle, 1 + RingPages);
+
+            if (ExchangePacket)
+            {
+                // Send one packet from the guest and read it on the host
+                // through its own view of the GPADL, as a device would.
+                VmbusRing HostInbound;
+                VmbusRing HostOutbound;
+                if (!NT_SUCCESS(Host.MapRings(
+                    ChildRelId,
+                    MapPage,
+                    HostInbound,
+                    HostOutbound)))
+                {
+                    ++Result.Errors;
+                }
+                else
+                {
+                    VmbusRing GuestOutbound;
+                    GuestOutbound.Initialize(
+                        GuestBase + static_cast<std::size_t>(Index)
+                            * PagesPerChannel * VmbusGpadlPageSize,
+                        (1 + RingPages) * VmbusGpadlPageSize);
+                    VmbusRingWriter Writer(GuestOutbound);
+                    VmbusRingReader Reader(HostInbound);
+                    HV_UINT64 Payload = Cycle;
+                    HV_UINT8 Packet[64];
+                    HV_UINT32 PacketSize = 0;
+                    if (!NT_SUCCESS(Writer.Write(
+                        VmbusPacketTypeDataInBand,
+                        0,
+                        Cycle,
+                        &Payload,
+                        sizeof(Payload))) ||
+                        !NT_SUCCESS(Reader.Read(
+                            Packet,
+                            sizeof(Packet),
+                            &PacketSize)) ||
+                        0 != std::memcmp(
+                            Packet + sizeof(VMPACKET_DESCRIPTOR),
+                            &Payload,
+                            sizeof(Payload)))
+                    {
+                        ++Result.Errors;
+                    }
+                }
+            }
+
+            Guest.CloseChannel(ChildRelId, Handle);
+        }
+        double Seconds = Watch.Seconds();
+        Result.CyclesPerSecond = Cycles / Seconds;
+        Result.MessagesPerCycle = (Guest.Messages() - FirstMessages) / Cycles;
+
+        Guest.Unload();
+        Result.Errors += Guest.Errors + Host.ProtocolErrors();
+        if (Guest.Opens != Cycles || Guest.Closes != Cycles)
+        {
+            ++Result.Errors;
+        }
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunHostEmulator(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    struct HostEmulatorLayout
+    {
+        const char* Name;
+        HV_UINT32 RingPages;
+        HV_UINT32 ChannelCount;
+        bool ExchangePacket;
+    };
+    const HostEmulatorLayout Layouts[] =
+    {
+        { "4KiB-Rings", 1, 1, false },
+        { "4KiB-Rings-64Ch", 1, 64, false },
+        { "256KiB-Rings", 64, 1, false },
+        { "256KiB-Rings+IO", 64, 1, true },
+    };
+    const HV_UINT32 Cycles = 100000;
+
+    std::printf(
+        "%-18s %12s %14s %12s %10s\n",
+        "Layout",
+        "Msg/Cycle",
+        "Cycles/s",
+        "us/Cycle",
+        "Errors");
+    for (HostEmulatorLayout const& Layout : Layouts)
+    {
+        HostEmulatorResult Result = ::MeasureHostEmulator(
+            Layout.RingPages,
+            Layout.ChannelCount,
+            Cycles,
+            Layout.ExchangePacket);
+        std::printf(
+            "%-18s %12llu %14.0f %12.3f %10llu\n",
+            Layout.Name,
+            static_cast<unsigned long long>(Result.MessagesPerCycle),
+            Result.CyclesPerSecond,
+            1e6 / Result.CyclesPerSecond,
+            static_cast<unsigned long long>(Result.Errors));
+    }
+
+    return 0;
+}
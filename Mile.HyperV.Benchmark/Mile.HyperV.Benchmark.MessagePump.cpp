@@ -0,0 +1,376 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.MessagePump.cpp
+ * PURPOSE:    Implementation for Mile.HyperV SynIC message pump benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.MessagePump.h>
+
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    // The message types posted, in the order of the posts.
+    const HV_UINT32 PostedTypes[] =
+    {
+        VMBUS_MESSAGE_TYPE,
+        VMBUS_MESSAGE_TYPE,
+        HvMessageTimerExpired,
+        VMBUS_MESSAGE_TYPE,
+        HvMessageTypeEventLogBufferComplete,
+    };
+    const HV_UINT32 PostedTypeCount =
+        sizeof(PostedTypes) / sizeof(*PostedTypes);
+
+    struct MessageSums
+    {
+        std::uint64_t Vmbus;
+        std::uint64_t Timer;
+        std::uint64_t EventLog;
+    };
+
+    void OnVmbusMessage(
+        void* Context,
+        HV_MESSAGE const& Message)
+    {
+        static_cast<MessageSums*>(Context)->Vmbus += Message.Payload[0];
+    }
+
+    void OnTimerMessage(
+        void* Context,
+        HV_MESSAGE const& Message)
+    {
+        static_cast<MessageSums*>(Context)->Timer += Message.Payload[0];
+    }
+
+    void OnEventLogMessage(
+        void* Context,
+        HV_MESSAGE const& Message)
+    {
+        static_cast<MessageSums*>(Context)->EventLog += Message.Payload[0];
+    }
+
+    // A write to the EOM register exits to the hypervisor, which the
+    // simulator does not, so its cost is added to the measured time.
+    const double EomExitSeconds = 1e-6;
+
+    struct MessagePumpResult
+    {
+        double MessagesPerSecond;
+        double EomsPerMessage;
+        double ExitedMessagesPerSecond;
+        std::uint64_t Errors;
+    };
+
+    /**
+     * @brief Posts bursts of messages to a simulated SINT slot and drains
+     *        them after every burst, either with a pump which writes EOM
+     *        after every message and dispatches with a switch, or with
+     *        VmbusMessagePump.
+     * @param UsePump Whether to drain with VmbusMessagePump.
+     * @param BurstSize The number of messages posted per interrupt.
+     * @param Messages The number of messages to post.
+     */
+    MessagePumpResult MeasureMessagePump(
+        bool UsePump,
+        HV_UINT32 BurstSize,
+        HV_UINT32 Messages)
+    {
+        MessagePumpResult Result = {};
+
+        alignas(64) volatile HV_MESSAGE Slot;
+        std::vector<HV_MESSAGE> Backlog(64);
+        VmbusSynicMessageSlotSimulator Simulator;
+        if (!NT_SUCCESS(Simulator.Initialize(
+            &Slot,
+            Backlog.data(),
+            static_cast<HV_UINT32>(Backlog.size()))))
+        {
+            ++Result.Errors;
+            return Result;
+        }
+
+        MessageSums Sums = {};
+        VmbusMessagePump Pump;
+        if (!NT_SUCCESS(Pump.Register(
+            VMBUS_MESSAGE_TYPE,
+            ::OnVmbusMessage,
+            &Sums)) ||
+            !NT_SUCCESS(Pump.Register(
+                HvMessageTimerExpired,
+                ::OnTimerMessage,
+                &Sums)) ||
+            !NT_SUCCESS(Pump.Register(
+                HvMessageTypeEventLogBufferComplete,
+                ::OnEventLogMessage,
+                &Sums)))
+        {
+            ++Result.Errors;
+        }
+
+        MessageSums Expected = {};
+        HV_MESSAGE& Plain = const_cast<HV_MESSAGE&>(Slot);
+        auto WriteEom = [&Simulator]()
+        {
+            Simulator.Eom();
+        };
+
+        Stopwatch Watch;
+        for (HV_UINT32 Posted = 0; Posted < Messages;)
+        {
+            for (HV_UINT32 i = 0; i < BurstSize && Posted < Messages; ++i)
+            {
+                HV_UINT64 Payload[4] = { Posted + 1ULL, 0, 0, 0 };
+                HV_UINT32 MessageType = PostedTypes[Posted % PostedTypeCount];
+                if (!NT_SUCCESS(Simulator.Post(
+                    MessageType,
+                    Payload,
+                    sizeof(Payload))))
+                {
+                    ++Result.Errors;
+                }
+                if (MessageType == VMBUS_MESSAGE_TYPE)
+                {
+                    Expected.Vmbus += Payload[0];
+                }
+                else if (MessageType == HvMessageTimerExpired)
+                {
+                    Expected.Timer += Payload[0];
+                }
+                else
+                {
+                    Expected.EventLog += Payload[0];
+                }
+                ++Posted;
+            }
+
+            if (UsePump)
+            {
+                Pump.Pump(Slot, WriteEom);
+                continue;
+            }
+
+            std::atomic_ref<HV_MESSAGE_TYPE> MessageType(
+                Plain.Header.MessageType);
+            for (;;)
+            {
+                HV_UINT32 Type = MessageType.load(std::memory_order_acquire);
+                if (Type == HvMessageTypeNone)
+                {
+                    break;
+                }
+                HV_MESSAGE Message;
+                std::memcpy(&Message, &Plain, sizeof(Message));
+                switch (Type)
+                {
+                case VMBUS_MESSAGE_TYPE:
+                    ::OnVmbusMessage(&Sums, Message);
+                    break;
+                case HvMessageTimerExpired:
+                    ::OnTimerMessage(&Sums, Message);
+                    break;
+                case HvMessageTypeEventLogBufferComplete:
+                    ::OnEventLogMessage(&Sums, Message);
+                    break;
+                default:
+                    ++Result.Errors;
+                    break;
+                }
+                MessageType.store(
+                    HvMessageTypeNone,
+                    std::memory_order_release);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                WriteEom();
+            }
+        }
+        double Seconds = Watch.Seconds();
+
+        Result.MessagesPerSecond = Messages / Seconds;
+        Result.EomsPerMessage =
+            static_cast<double>(Simulator.Eoms()) / Messages;
+        Result.ExitedMessagesPerSecond =
+            Messages / (Seconds + Simulator.Eoms() * EomExitSeconds);
+        if (Sums.Vmbus != Expected.Vmbus ||
+            Sums.Timer != Expected.Timer ||
+            Sums.EventLog != Expected.EventLog ||
+            Simulator.BacklogCount() ||
+            Slot.Header.MessageType != HvMessageTypeNone ||
+            Pump.Unhandled())
+        {
+            ++Result.Errors;
+        }
+        if (UsePump && Pump.Messages() != Messages)
+        {
+            ++Result.Errors;
+        }
+        return Result;
+    }
+
+    /**
+     * @brief Checks the jump table and the limit of a pump.
+     * @return The number of failed checks.
+     */
+    std::uint64_t CheckMessagePump()
+    {
+        std::uint64_t Errors = 0;
+        MessageSums Sums = {};
+        VmbusMessagePump Pump;
+
+        if (Pump.Register(HvMessageTypeNone, ::OnVmbusMessage, &Sums)
+            != STATUS_INVALID_PARAMETER ||
+            !NT_SUCCESS(Pump.Register(
+                HvMessageTypeUnmappedGpa,
+                ::OnVmbusMessage,
+                &Sums)) ||
+            !NT_SUCCESS(Pump.Register(
+                HvMessageTypeSchedulerVpSignalBitset,
+                ::OnTimerMessage,
+                &Sums)) ||
+            !NT_SUCCESS(Pump.Unregister(HvMessageTypeUnmappedGpa)) ||
+            Pump.Unregister(HvMessageTypeUnmappedGpa)
+                != STATUS_INVALID_PARAMETER)
+        {
+            ++Errors;
+        }
+
+        // Every defined message type has an entry of its own.
+        const HV_UINT32 Types[] =
+        {
+            HvMessageTypeUnmappedGpa,
+            HvMessageTypeGpaIntercept,
+            HvMessageTypeUnacceptedGpa,
+            HvMessageTypeGpaAttributeIntercept,
+            HvMessageTypeEnablePartitionVtlIntercept,
+            HvMessageTimerExpired,
+            HvMessageTypeInvalidVpRegisterValue,
+            HvMessageTypeUnrecoverableException,
+            HvMessageTypeUnsupportedFeature,
+            HvMessageTypeEventLogBufferComplete,
+            HvMessageTypeSchedulerVpSignalBitset,
+            VMBUS_MESSAGE_TYPE,
+        };
+        bool Used[VmbusMessagePumpTableSize] = {};
+        for (HV_UINT32 Type : Types)
+        {
+            HV_UINT32 Key = ::Mile::HyperV::VmbusMessagePumpKey(Type);
+            if (Used[Key])
+            {
+                ++Errors;
+            }
+            Used[Key] = true;
+        }
+
+        // A limited pump leaves the rest for the next call.
+        alignas(64) volatile HV_MESSAGE Slot;
+        HV_MESSAGE Backlog[8];
+        VmbusSynicMessageSlotSimulator Simulator;
+        Simulator.Initialize(&Slot, Backlog, 8);
+        Pump.Register(VMBUS_MESSAGE_TYPE, ::OnVmbusMessage, &Sums);
+        for (HV_UINT64 i = 1; i <= 9; ++i)
+        {
+            if (!NT_SUCCESS(Simulator.Post(VMBUS_MESSAGE_TYPE, &i, sizeof(i))))
+            {
+                ++Errors;
+            }
+        }
+        HV_UINT64 Overflow = 10;
+        if (Simulator.Post(VMBUS_MESSAGE_TYPE, &Overflow, sizeof(Overflow))
+            != STATUS_INSUFFICIENT_RESOURCES)
+        {
+            ++Errors;
+        }
+        HV_UINT32 Processed = 0;
+        auto WriteEom = [&Simulator]()
+        {
+            Simulator.Eom();
+        };
+        if (Pump.Pump(Slot, WriteEom, 4, &Processed) != STATUS_MORE_ENTRIES ||
+            Processed != 4 ||
+            Pump.Pump(Slot, WriteEom, 16, &Processed) != STATUS_SUCCESS ||
+            Processed != 5 ||
+            Sums.Vmbus != 45 ||
+            Simulator.Eoms() != 8 ||
+            Simulator.Interrupts() != 9)
+        {
+            ++Errors;
+        }
+
+        // Types without a routine go to the default routine, or are counted.
+        Simulator.Post(HvMessageTimerExpired, &Overflow, sizeof(Overflow));
+        Pump.Pump(Slot, WriteEom);
+        if (Pump.Unhandled() != 1)
+        {
+            ++Errors;
+        }
+        Pump.SetDefault(::OnEventLogMessage, &Sums);
+        Simulator.Post(HvMessageTimerExpired, &Overflow, sizeof(Overflow));
+        Pump.Pump(Slot, WriteEom);
+        if (Pump.Unhandled() != 1 || Sums.EventLog != Overflow)
+        {
+            ++Errors;
+        }
+        return Errors;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunMessagePump(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    struct PumpMode
+    {
+        const char* Name;
+        bool UsePump;
+    };
+    const PumpMode Modes[] =
+    {
+        { "EomAlways", false },
+        { "Pump", true },
+    };
+    const HV_UINT32 BurstSizes[] = { 1, 4, 16, 64 };
+    const HV_UINT32 Messages = 1 << 22;
+
+    std::printf(
+        "Checks: %llu errors\n",
+        static_cast<unsigned long long>(::CheckMessagePump()));
+    std::printf(
+        "%-10s %6s %14s %10s %14s %8s\n",
+        "Mode",
+        "Burst",
+        "Messages/s",
+        "EOMs/Msg",
+        "WithExits/s",
+        "Errors");
+    for (HV_UINT32 BurstSize : BurstSizes)
+    {
+        for (PumpMode const& Mode : Modes)
+        {
+            MessagePumpResult Result = ::MeasureMessagePump(
+                Mode.UsePump,
+                BurstSize,
+                Messages);
+            std::printf(
+                "%-10s %6u %14.0f %10.3f %14.0f %8llu\n",
+                Mode.Name,
+                BurstSize,
+                Result.MessagesPerSecond,
+                Result.EomsPerMessage,
+                Result.ExitedMessagesPerSecond,
+                static_cast<unsigned long long>(Result.Errors));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,371 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.Monitor.cpp
+ * PURPOSE:    Implementation for Mile.HyperV monitor page benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.Monitor.h>
+
+#include <cmath>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    // The simulated time advances in 100ns units, as monitor page times do.
+    const HV_UINT32 TicksPerSecond = 10000000;
+
+    // How often the hypervisor scans the monitor page.
+    const HV_UINT32 ScanPeriod = 100;
+
+    // How long the host takes from a signal to draining the ring.
+    const HV_UINT32 ServiceTime = 200;
+
+    struct MonitorResult
+    {
+        double SignalsPerSecond;
+        double PacketsPerSignal;
+        double MeanDelayMicroseconds;
+        std::uint64_t Errors;
+    };
+
+    /**
+     * @brief Simulates one second of channels receiving packets at random,
+     *        signaled either with one HvSignalEvent whenever the host is not
+     *        already about to drain the ring, or through a monitor page.
+     * @param UseMonitor Whether to signal through the monitor page.
+     * @param Latency The latency of every monitor ID, in 100ns units.
+     * @param ChannelCount The number of channels.
+     * @param PacketsPerSecond The mean packet rate of every channel.
+     */
+    MonitorResult MeasureMonitor(
+        bool UseMonitor,
+        HV_UINT16 Latency,
+        HV_UINT32 ChannelCount,
+        double PacketsPerSecond)
+    {
+        MonitorResult Result = {};
+
+        HV_MONITOR_PAGE Page;
+        VmbusMonitorPage Monitor;
+        VmbusMonitorAllocator Allocator;
+        Monitor.Initialize(&Page, true);
+        std::vector<HV_UINT8> MonitorIds(ChannelCount);
+        for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+        {
+            HV_CONNECTION_ID ConnectionId = {};
+            ConnectionId.Id = 0x10000 + i;
+            if (!NT_SUCCESS(Allocator.Allocate(&MonitorIds[i])) ||
+                !NT_SUCCESS(Monitor.Arm(
+                    MonitorIds[i],
+                    ConnectionId,
+                    static_cast<HV_UINT16>(i),
+                    Latency,
+                    0)))
+            {
+                ++Result.Errors;
+            }
+        }
+        std::vector<HV_UINT32> ChannelOfMonitorId(VmbusMonitorIdCount);
+        for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+        {
+            ChannelOfMonitorId[MonitorIds[i]] = i;
+        }
+
+        struct Channel
+        {
+            double NextArrival;
+            // When the host drains the ring for the last signal delivered.
+            std::uint64_t DrainAt;
+            // The packets waiting for a signal and their summed arrivals.
+            std::uint64_t Waiting;
+            double WaitingSince;
+        };
+        std::vector<Channel> Channels(ChannelCount);
+        const double MeanInterval = TicksPerSecond / PacketsPerSecond;
+        std::uint64_t State = 0x9E3779B97F4A7C15ULL;
+        auto NextInterval = [&]() -> double
+        {
+            State ^= State << 13;
+            State ^= State >> 7;
+            State ^= State << 17;
+            double Uniform = ((State >> 11) + 0.5) / 9007199254740992.0;
+            return -std::log(Uniform) * MeanInterval;
+        };
+        for (Channel& Current : Channels)
+        {
+            Current = {};
+            Current.NextArrival = NextInterval();
+        }
+
+        std::uint64_t Packets = 0;
+        std::uint64_t Signals = 0;
+        double Delay = 0.0;
+        auto Drain = [&](Channel& Current, std::uint64_t At)
+        {
+            Delay += Current.Waiting * static_cast<double>(At)
+                - Current.WaitingSince;
+            Current.Waiting = 0;
+            Current.WaitingSince = 0.0;
+        };
+
+        for (std::uint64_t Now = 0; Now < TicksPerSecond; Now += ScanPeriod)
+        {
+            std::uint64_t End = Now + ScanPeriod;
+            for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+            {
+                Channel& Current = Channels[i];
+                while (Current.NextArrival < End)
+                {
+                    double Arrival = Current.NextArrival;
+                    Current.NextArrival += NextInterval();
+                    ++Packets;
+                    if (UseMonitor)
+                    {
+                        Monitor.Signal(MonitorIds[i]);
+                        ++Current.Waiting;
+                        Current.WaitingSince += Arrival;
+                    }
+                    else if (Current.DrainAt > Arrival)
+                    {
+                        // The host has not drained the ring yet, so it
+                        // picks the packet up without another signal.
+                        Delay += Current.DrainAt - Arrival;
+                    }
+                    else
+                    {
+                        ++Signals;
+                        Current.DrainAt =
+                            static_cast<std::uint64_t>(Arrival) + ServiceTime;
+                        Delay += Current.DrainAt - Arrival;
+                    }
+                }
+            }
+            if (UseMonitor)
+            {
+                Signals += Monitor.Scan(
+                    static_cast<HV_UINT32>(End),
+                    [&](HV_UINT8 MonitorId, HV_MONITOR_PARAMETER const&)
+                {
+                    Drain(Channels[ChannelOfMonitorId[MonitorId]],
+                        End + ServiceTime);
+                });
+            }
+        }
+        for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+        {
+            // Packets still pending when the simulation ends are counted as
+            // delivered by the next scan.
+            if (Channels[i].Waiting)
+            {
+                if (!Monitor.IsPending(MonitorIds[i]))
+                {
+                    ++Result.Errors;
+                }
+                Drain(Channels[i], TicksPerSecond + ServiceTime);
+            }
+        }
+
+        Result.SignalsPerSecond = static_cast<double>(Signals);
+        Result.PacketsPerSignal = Signals
+            ? static_cast<double>(Packets) / static_cast<double>(Signals)
+            : 0.0;
+        Result.MeanDelayMicroseconds = Packets
+            ? Delay / static_cast<double>(Packets) / 10.0
+            : 0.0;
+        return Result;
+    }
+
+    /**
+     * @brief Measures the processor time of signaling through the monitor
+     *        page and of scanning it.
+     */
+    void MeasureMonitorCost(
+        double& SignalNanoseconds,
+        double& ScanNanoseconds)
+    {
+        HV_MONITOR_PAGE Page;
+        VmbusMonitorPage Monitor;
+        Monitor.Initialize(&Page, true);
+        for (HV_UINT32 i = 0; i < VmbusMonitorIdCount; ++i)
+        {
+            HV_CONNECTION_ID ConnectionId = {};
+            ConnectionId.Id = i;
+            Monitor.Arm(static_cast<HV_UINT8>(i), ConnectionId, 0, 0, 0);
+        }
+
+        const HV_UINT32 Rounds = 1 << 20;
+        std::uint64_t Sum = 0;
+        Stopwatch SignalWatch;
+        for (HV_UINT32 Round = 0; Round < Rounds; ++Round)
+        {
+            Sum += Monitor.Signal(
+                static_cast<HV_UINT8>((Round * 37) % VmbusMonitorIdCount));
+            if ((Round % VmbusMonitorIdCount) == 0)
+            {
+                Monitor.Scan(Round, [](HV_UINT8, HV_MONITOR_PARAMETER const&)
+                {
+                });
+            }
+        }
+        SignalNanoseconds = SignalWatch.Seconds() * 1e9 / Rounds;
+
+        // Every scan delivers 8 signals spread over the trigger groups.
+        Stopwatch ScanWatch;
+        for (HV_UINT32 Round = 0; Round < Rounds; ++Round)
+        {
+            for (HV_UINT32 i = 0; i < 8; ++i)
+            {
+                Monitor.Signal(static_cast<HV_UINT8>(i * 16 + Round % 16));
+            }
+            Sum += Monitor.Scan(
+                Round,
+                [&Sum](HV_UINT8 MonitorId, HV_MONITOR_PARAMETER const&)
+            {
+                Sum += MonitorId;
+            });
+        }
+        ScanNanoseconds = ScanWatch.Seconds() * 1e9 / Rounds;
+        if (!Sum)
+        {
+            std::printf("Unexpected checksum\n");
+        }
+    }
+
+    /**
+     * @brief Checks that signals stay due when the clock crosses the sign
+     *        bit or wraps, and after the page sat idle for more than half
+     *        the range of the clock.
+     */
+    std::uint64_t CheckMonitorClock()
+    {
+        std::uint64_t Errors = 0;
+        HV_MONITOR_PAGE Page;
+        VmbusMonitorPage Monitor;
+        Monitor.Initialize(&Page, true);
+        HV_UINT32 Delivered = 0;
+        auto OnTrigger = [&Delivered](HV_UINT8, HV_MONITOR_PARAMETER const&)
+        {
+            ++Delivered;
+        };
+        auto Expect = [&](HV_UINT32 Now, HV_UINT32 Expected)
+        {
+            Delivered = 0;
+            if (Monitor.Scan(Now, OnTrigger) != Expected ||
+                Delivered != Expected)
+            {
+                ++Errors;
+            }
+        };
+        HV_CONNECTION_ID ConnectionId = {};
+        const HV_UINT16 Latency = 1000;
+
+        // Armed just before the sign bit, signaled across it.
+        HV_UINT32 Now = 0x80000000 - Latency / 2;
+        if (!NT_SUCCESS(Monitor.Arm(0, ConnectionId, 0, Latency, Now)))
+        {
+            ++Errors;
+        }
+        Monitor.Signal(0);
+        Expect(Now, 1);
+        Monitor.Signal(0);
+        Expect(Now + Latency - 1, 0);
+        Expect(Now + Latency, 1);
+
+        // Armed in the upper half of the clock, then wrapping around zero.
+        Now = 0xFFFFFFFF - Latency / 2;
+        if (!NT_SUCCESS(Monitor.Arm(1, ConnectionId, 1, Latency, Now)))
+        {
+            ++Errors;
+        }
+        Monitor.Signal(1);
+        Expect(Now, 1);
+        Monitor.Signal(1);
+        Expect(Now + Latency, 1);
+
+        // Idle for more than 2^31 ticks after the last delivery.
+        Now += Latency;
+        Monitor.Signal(1);
+        Expect(Now + 0x80000000 + Latency, 1);
+        Monitor.Signal(1);
+        Expect(Now + 0xC0000000, 1);
+        return Errors;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunMonitor(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    struct MonitorMode
+    {
+        const char* Name;
+        bool UseMonitor;
+        HV_UINT16 Latency;
+    };
+    const MonitorMode Modes[] =
+    {
+        { "Direct", false, 0 },
+        { "Monitor-0us", true, 0 },
+        { "Monitor-100us", true, 1000 },
+        { "Monitor-1ms", true, 10000 },
+    };
+    const double Rates[] = { 1000.0, 10000.0, 100000.0 };
+    const HV_UINT32 ChannelCount = 64;
+
+    double SignalNanoseconds = 0.0;
+    double ScanNanoseconds = 0.0;
+    std::printf(
+        "Clock checks: %llu errors\n",
+        static_cast<unsigned long long>(::CheckMonitorClock()));
+    ::MeasureMonitorCost(SignalNanoseconds, ScanNanoseconds);
+    std::printf(
+        "Signal: %.1f ns, scan with 8 deliveries: %.1f ns\n",
+        SignalNanoseconds,
+        ScanNanoseconds);
+    std::printf(
+        "Simulated: %u channels, %u us scan period, %u us service time\n",
+        ChannelCount,
+        ScanPeriod / 10,
+        ServiceTime / 10);
+    std::printf(
+        "%-14s %12s %12s %12s %12s %8s\n",
+        "Mode",
+        "Packets/s",
+        "Signals/s",
+        "Pkts/Signal",
+        "Delay(us)",
+        "Errors");
+    for (double Rate : Rates)
+    {
+        for (MonitorMode const& Mode : Modes)
+        {
+            MonitorResult Result = ::MeasureMonitor(
+                Mode.UseMonitor,
+                Mode.Latency,
+                ChannelCount,
+                Rate);
+            std::printf(
+                "%-14s %12.0f %12.0f %12.2f %12.1f %8llu\n",
+                Mode.Name,
+                Rate * ChannelCount,
+                Result.SignalsPerSecond,
+                Result.PacketsPerSignal,
+                Result.MeanDelayMicroseconds,
+                static_cast<unsigned long long>(Result.Errors));
+        }
+    }
+
+    return 0;
+}
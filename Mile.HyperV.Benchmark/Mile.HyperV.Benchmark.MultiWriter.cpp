@@ -0,0 +1,178 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.MultiWriter.cpp
+ * PURPOSE:    Implementation for Mile.HyperV multi-producer ring benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    enum class ProducerMode
+    {
+        // Serialize the producers with a lock around VmbusRingWriter.
+        Locked,
+        // Let the producers reserve and fill in parallel.
+        MultiWriter,
+    };
+
+    struct MultiWriterResult
+    {
+        double Seconds;
+        std::uint64_t OrderErrors;
+    };
+
+    MultiWriterResult MeasureMultiWriter(
+        ProducerMode Mode,
+        std::uint32_t ProducerCount,
+        HV_UINT32 PayloadSize,
+        std::uint64_t PacketsPerProducer)
+    {
+        const HV_UINT32 RingSize = 256 * 1024;
+        SharedMemory Memory(VmbusRingControlPageSize + RingSize);
+        VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        VmbusRingWriter Writer(Ring);
+        VmbusRingMultiWriter MultiWriter(Ring);
+        VmbusRingReader Reader(Ring);
+        std::mutex WriterLock;
+
+        MultiWriterResult Result = {};
+        Stopwatch Watch;
+
+        std::vector<std::thread> Producers;
+        for (std::uint32_t i = 0; i < ProducerCount; ++i)
+        {
+            Producers.emplace_back([&, i]()
+            {
+                // The payload starts with the producer index and a sequence
+                // number, so the reader can check every producer's packets
+                // arrive in order and intact.
+                std::vector<HV_UINT8> Payload(PayloadSize, 0x69);
+                Backoff Waiter;
+                for (std::uint64_t j = 0; j < PacketsPerProducer;)
+                {
+                    std::uint64_t Header[2] = { i, j };
+                    std::memcpy(Payload.data(), Header, sizeof(Header));
+                    NTSTATUS Status;
+                    if (Mode == ProducerMode::Locked)
+                    {
+                        std::lock_guard<std::mutex> Guard(WriterLock);
+                        Status = Writer.Write(
+                            VmbusPacketTypeDataInBand,
+                            0,
+                            j,
+                            Payload.data(),
+                            PayloadSize);
+                    }
+                    else
+                    {
+                        Status = MultiWriter.Write(
+                            VmbusPacketTypeDataInBand,
+                            0,
+                            j,
+                            Payload.data(),
+                            PayloadSize);
+                    }
+                    if (NT_SUCCESS(Status))
+                    {
+                        Waiter.Reset();
+                        ++j;
+                    }
+                    else
+                    {
+                        Waiter.Wait();
+                    }
+                }
+            });
+        }
+
+        std::vector<std::uint64_t> Expected(ProducerCount, 0);
+        std::uint64_t Total = ProducerCount * PacketsPerProducer;
+        std::uint64_t Consumed = 0;
+        Backoff Waiter;
+        while (Consumed < Total)
+        {
+            HV_UINT32 Count = 0;
+            Reader.ReadBatch([&](VmbusRingPacket const& Packet)
+            {
+                std::uint64_t Header[2] = {};
+                Packet.CopyPayload(Header, sizeof(Header));
+                if (Header[0] >= ProducerCount ||
+                    Header[1] != Expected[Header[0]]++)
+                {
+                    ++Result.OrderErrors;
+                }
+            }, 64, 0xFFFFFFFF, &Count);
+
+            if (Count)
+            {
+                Consumed += Count;
+                Waiter.Reset();
+            }
+            else
+            {
+                Waiter.Wait();
+            }
+        }
+
+        for (std::thread& Producer : Producers)
+        {
+            Producer.join();
+        }
+        Result.Seconds = Watch.Seconds();
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunMultiWriter(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const std::uint32_t ProducerCounts[] = { 1, 2, 4, 8 };
+    const HV_UINT32 PayloadSizes[] = { 64, 1024 };
+    const std::uint64_t PacketsPerProducer = 200000;
+
+    std::printf(
+        "%-12s %10s %8s %12s %12s\n",
+        "Mode",
+        "Producers",
+        "Payload",
+        "Packets/s",
+        "OrderErrors");
+    for (HV_UINT32 PayloadSize : PayloadSizes)
+    {
+        for (std::uint32_t ProducerCount : ProducerCounts)
+        {
+            for (ProducerMode Mode :
+                { ProducerMode::Locked, ProducerMode::MultiWriter })
+            {
+                MultiWriterResult Result = ::MeasureMultiWriter(
+                    Mode,
+                    ProducerCount,
+                    PayloadSize,
+                    PacketsPerProducer);
+                std::printf(
+                    "%-12s %10u %8u %12.0f %12llu\n",
+                    Mode == ProducerMode::Locked ? "Locked" : "MultiWriter",
+                    ProducerCount,
+                    PayloadSize,
+                    ProducerCount * PacketsPerProducer / Result.Seconds,
+                    static_cast<unsigned long long>(Result.OrderErrors));
+            }
+        }
+    }
+
+    return 0;
+}
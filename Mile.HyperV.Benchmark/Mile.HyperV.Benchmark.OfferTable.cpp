@@ -0,0 +1,275 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.OfferTable.cpp
+ * PURPOSE:    Implementation for Mile.HyperV offer table benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.OfferTable.h>
+
+#include <cstring>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    /**
+     * @brief Builds the offers of a VM with many devices, most of them of
+     *        well-known classes and some of them unknown, in a fixed
+     *        pseudo-random order.
+     */
+    std::vector<VMBUS_CHANNEL_OFFER_CHANNEL> CreateOffers(
+        HV_UINT32 Count)
+    {
+        std::vector<VMBUS_CHANNEL_OFFER_CHANNEL> Offers(Count);
+        HV_UINT64 State = 0x2545F4914F6CDD1DULL;
+        for (HV_UINT32 i = 0; i < Count; ++i)
+        {
+            State ^= State << 13;
+            State ^= State >> 7;
+            State ^= State << 17;
+            VMBUS_CHANNEL_OFFER_CHANNEL& Offer = Offers[i];
+            Offer.Header.MessageType = ChannelMessageOfferChannel;
+            if (State % 4)
+            {
+                Offer.InterfaceType = VmbusWellKnownGuids[
+                    State % VmbusWellKnownGuidCount].Guid;
+            }
+            else
+            {
+                Offer.InterfaceType.Data1 = static_cast<HV_UINT32>(State);
+                Offer.InterfaceType.Data2 = 0xE1E1;
+            }
+            // A few devices with several subchannels share an instance.
+            Offer.InterfaceInstance.Data1 = i / 4;
+            Offer.InterfaceInstance.Data4[7] = 0x10;
+            Offer.SubChannelIndex = static_cast<HV_UINT16>(i % 4);
+            Offer.ChildRelId = i + 1;
+        }
+        return Offers;
+    }
+
+    const VmbusWellKnownGuid* ClassifyLinear(
+        HV_GUID const& InterfaceType)
+    {
+        for (VmbusWellKnownGuid const& Entry : VmbusWellKnownGuids)
+        {
+            if (0 == std::memcmp(
+                &Entry.Guid,
+                &InterfaceType,
+                sizeof(HV_GUID)))
+            {
+                return &Entry;
+            }
+        }
+        return nullptr;
+    }
+
+    struct LinearOffer
+    {
+        VmbusOfferKey Key;
+        HV_UINT32 ChildRelId;
+    };
+
+    const LinearOffer* FindLinear(
+        std::vector<LinearOffer> const& Offers,
+        VMBUS_CHANNEL_OFFER_CHANNEL const& Offer)
+    {
+        for (LinearOffer const& Entry : Offers)
+        {
+            if (Entry.Key.SubChannelIndex == Offer.SubChannelIndex &&
+                0 == std::memcmp(
+                    &Entry.Key.InterfaceType,
+                    &Offer.InterfaceType,
+                    sizeof(HV_GUID)) &&
+                0 == std::memcmp(
+                    &Entry.Key.InterfaceInstance,
+                    &Offer.InterfaceInstance,
+                    sizeof(HV_GUID)))
+            {
+                return &Entry;
+            }
+        }
+        return nullptr;
+    }
+
+    struct OfferTableResult
+    {
+        double LinearClassifyNanoseconds;
+        double HashClassifyNanoseconds;
+        double LinearLookupNanoseconds;
+        double HashLookupNanoseconds;
+        std::uint64_t Errors;
+    };
+
+    OfferTableResult MeasureOfferTable(
+        HV_UINT32 Count,
+        HV_UINT32 Rounds)
+    {
+        std::vector<VMBUS_CHANNEL_OFFER_CHANNEL> Offers =
+            ::CreateOffers(Count);
+        OfferTableResult Result = {};
+        const double Operations = static_cast<double>(Count) * Rounds;
+
+        // Classify every offer by its class ID, as the device manager does
+        // before it picks a driver.
+        std::uint64_t LinearKnown = 0;
+        Stopwatch LinearClassifyWatch;
+        for (HV_UINT32 Round = 0; Round < Rounds; ++Round)
+        {
+            for (VMBUS_CHANNEL_OFFER_CHANNEL const& Offer : Offers)
+            {
+                LinearKnown += !!::ClassifyLinear(Offer.InterfaceType);
+            }
+        }
+        Result.LinearClassifyNanoseconds =
+            LinearClassifyWatch.Seconds() * 1e9 / Operations;
+
+        std::uint64_t HashKnown = 0;
+        Stopwatch HashClassifyWatch;
+        for (HV_UINT32 Round = 0; Round < Rounds; ++Round)
+        {
+            for (VMBUS_CHANNEL_OFFER_CHANNEL const& Offer : Offers)
+            {
+                HashKnown += !!::Mile::HyperV::VmbusFindWellKnownGuid(
+                    Offer.InterfaceType);
+            }
+        }
+        Result.HashClassifyNanoseconds =
+            HashClassifyWatch.Seconds() * 1e9 / Operations;
+        if (LinearKnown != HashKnown)
+        {
+            ++Result.Errors;
+        }
+
+        // Register the offers once, then look every offer up, as happens
+        // when subchannels and rescinds are matched to their devices.
+        std::vector<LinearOffer> LinearOffers;
+        for (VMBUS_CHANNEL_OFFER_CHANNEL const& Offer : Offers)
+        {
+            LinearOffer Entry = {};
+            Entry.Key.InterfaceType = Offer.InterfaceType;
+            Entry.Key.InterfaceInstance = Offer.InterfaceInstance;
+            Entry.Key.SubChannelIndex = Offer.SubChannelIndex;
+            Entry.ChildRelId = Offer.ChildRelId;
+            LinearOffers.push_back(Entry);
+        }
+        HV_UINT32 Capacity = 4;
+        while (Capacity / 4 * 3 < Count)
+        {
+            Capacity *= 2;
+        }
+        std::vector<VmbusOfferEntry> Entries(Capacity);
+        VmbusOfferRegistry Registry;
+        Registry.Initialize(Entries.data(), Capacity);
+        for (VMBUS_CHANNEL_OFFER_CHANNEL const& Offer : Offers)
+        {
+            if (!NT_SUCCESS(Registry.Insert(Offer, nullptr)))
+            {
+                ++Result.Errors;
+            }
+        }
+
+        std::uint64_t LinearSum = 0;
+        Stopwatch LinearLookupWatch;
+        for (HV_UINT32 Round = 0; Round < Rounds; ++Round)
+        {
+            for (VMBUS_CHANNEL_OFFER_CHANNEL const& Offer : Offers)
+            {
+                const LinearOffer* Entry = ::FindLinear(LinearOffers, Offer);
+                LinearSum += Entry ? Entry->ChildRelId : 0;
+            }
+        }
+        Result.LinearLookupNanoseconds =
+            LinearLookupWatch.Seconds() * 1e9 / Operations;
+
+        std::uint64_t HashSum = 0;
+        Stopwatch HashLookupWatch;
+        for (HV_UINT32 Round = 0; Round < Rounds; ++Round)
+        {
+            for (VMBUS_CHANNEL_OFFER_CHANNEL const& Offer : Offers)
+            {
+                const VmbusOfferEntry* Entry = Registry.Find(
+                    Offer.InterfaceType,
+                    Offer.InterfaceInstance,
+                    Offer.SubChannelIndex);
+                HashSum += Entry ? Entry->ChildRelId : 0;
+            }
+        }
+        Result.HashLookupNanoseconds =
+            HashLookupWatch.Seconds() * 1e9 / Operations;
+        if (LinearSum != HashSum ||
+            HashSum != static_cast<std::uint64_t>(Count) * (Count + 1) / 2
+                * Rounds)
+        {
+            ++Result.Errors;
+        }
+
+        // Rescind every other offer and check the rest is still found.
+        for (HV_UINT32 i = 0; i < Count; i += 2)
+        {
+            VmbusOfferKey Key = LinearOffers[i].Key;
+            if (!NT_SUCCESS(Registry.Remove(Key)))
+            {
+                ++Result.Errors;
+            }
+        }
+        for (HV_UINT32 i = 0; i < Count; ++i)
+        {
+            const VmbusOfferEntry* Entry = Registry.Find(LinearOffers[i].Key);
+            if ((i % 2) != !!Entry ||
+                (Entry && Entry->ChildRelId != i + 1))
+            {
+                ++Result.Errors;
+            }
+        }
+
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunOfferTable(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const HV_UINT32 Counts[] = { 16, 256, 2048 };
+
+    std::printf(
+        "Well-known GUIDs: %zu, perfect hash seed: %llu\n",
+        VmbusWellKnownGuidCount,
+        static_cast<unsigned long long>(VmbusWellKnownGuidHash.Seed()));
+    std::printf(
+        "%-8s %14s %14s %14s %14s %8s\n",
+        "Offers",
+        "Classify-Lin",
+        "Classify-Hash",
+        "Lookup-Lin",
+        "Lookup-Hash",
+        "Errors");
+    for (HV_UINT32 Count : Counts)
+    {
+        OfferTableResult Result = ::MeasureOfferTable(
+            Count,
+            (1u << 22) / (Count * Count / 16 + Count));
+        std::printf(
+            "%-8u %11.1f ns %11.1f ns %11.1f ns %11.1f ns %8llu\n",
+            Count,
+            Result.LinearClassifyNanoseconds,
+            Result.HashClassifyNanoseconds,
+            Result.LinearLookupNanoseconds,
+            Result.HashLookupNanoseconds,
+            static_cast<unsigned long long>(Result.Errors));
+    }
+
+    return 0;
+}
@@ -0,0 +1,561 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.PipeArrival.cpp
+ * PURPOSE:    Implementation for Mile.HyperV pipe channel arrival benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#ifdef __linux__
+#include <Mile.HyperV.VMBus.PipeArrival.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    const GUID ArrivalInterfaceType =
+    {
+        0x4D696C65, 0x5069, 0x7065,
+        { 0x41, 0x72, 0x72, 0x69, 0x76, 0x00, 0x00, 0x01 }
+    };
+
+    GUID ArrivalInterfaceInstance(
+        HV_UINT32 Index)
+    {
+        GUID Instance =
+        {
+            0x4D696C65, 0x5069, 0x7065,
+            { 0x49, 0x6E, 0x73, 0x74, 0x00, 0x00, 0x00, 0x00 }
+        };
+        std::memcpy(&Instance.Data4[4], &Index, sizeof(Index));
+        return Instance;
+    }
+
+    DWORD OfferChannel(
+        HV_UINT32 Index,
+        HANDLE& PipeHandle)
+    {
+        VMBUS_PIPE_SERVER_OFFER_EX Offer = {};
+        Offer.Version = 1;
+        Offer.Size = sizeof(Offer);
+        Offer.InterfaceType = ArrivalInterfaceType;
+        Offer.InterfaceInstance = ::ArrivalInterfaceInstance(Index);
+        return ::VmbusPipeServerOfferChannelEx(&Offer, 0, 0, &PipeHandle);
+    }
+
+    /**
+     * @brief Pushes from several threads at once and checks that every
+     *        arrival is popped once and in the order of its producer.
+     */
+    std::uint64_t CheckArrivalQueue()
+    {
+        const HV_UINT32 ProducerCount = 4;
+        const HV_UINT32 PushesPerProducer = 100000;
+
+        std::uint64_t Errors = 0;
+        VmbusPipeArrivalQueue Queue;
+        if (Queue.Initialize() != ERROR_SUCCESS)
+        {
+            return 1;
+        }
+
+        std::vector<std::thread> Producers;
+        for (HV_UINT32 i = 0; i < ProducerCount; ++i)
+        {
+            Producers.emplace_back([&Queue, i]()
+            {
+                for (HV_UINT32 j = 0; j < PushesPerProducer; ++j)
+                {
+                    VmbusPipeArrival* Arrival = new VmbusPipeArrival();
+                    // The producer and the sequence number.
+                    Arrival->Context = reinterpret_cast<void*>(
+                        (static_cast<std::uintptr_t>(i) << 32) | j);
+                    Queue.Push(Arrival);
+                }
+            });
+        }
+
+        std::vector<HV_UINT32> Expected(ProducerCount);
+        std::uint64_t Popped = 0;
+        while (Popped < ProducerCount * PushesPerProducer)
+        {
+            // Every push after the acknowledgement signals again, so the
+            // consumer cannot sleep through the last ones.
+            if (!Queue.Wait(1000))
+            {
+                ++Errors;
+                break;
+            }
+            while (VmbusPipeArrival* Arrival = Queue.Pop())
+            {
+                std::uintptr_t Value =
+                    reinterpret_cast<std::uintptr_t>(Arrival->Context);
+                HV_UINT32 Producer = static_cast<HV_UINT32>(Value >> 32);
+                HV_UINT32 Sequence = static_cast<HV_UINT32>(Value);
+                if (Producer >= ProducerCount ||
+                    Sequence != Expected[Producer]++)
+                {
+                    ++Errors;
+                }
+                delete Arrival;
+                ++Popped;
+            }
+        }
+        for (std::thread& Producer : Producers)
+        {
+            Producer.join();
+        }
+        if (Queue.Pop())
+        {
+            ++Errors;
+        }
+        return Errors;
+    }
+
+    /**
+     * @brief Checks the arrivals of existing and new channels, pre-opened
+     *        handles, adapters sharing a queue and unregistration.
+     */
+    std::uint64_t CheckArrivalAdapter()
+    {
+        std::uint64_t Errors = 0;
+        auto Expect = [&](bool Condition)
+        {
+            if (!Condition)
+            {
+                ++Errors;
+            }
+        };
+
+        VmbusPipeArrivalQueue Queue;
+        Expect(Queue.Initialize() == ERROR_SUCCESS);
+        Expect(Queue.WaitableObject() >= 0);
+
+        HANDLE Servers[3] =
+        {
+            INVALID_HANDLE_VALUE,
+            INVALID_HANDLE_VALUE,
+            INVALID_HANDLE_VALUE,
+        };
+        Expect(ERROR_SUCCESS == ::OfferChannel(1, Servers[0]));
+
+        int PreOpenTag = 0;
+        int PlainTag = 0;
+        VmbusPipeArrivalAdapter PreOpen;
+        VmbusPipeArrivalAdapter Plain;
+        Expect(ERROR_SUCCESS == PreOpen.Register(
+            Queue,
+            &ArrivalInterfaceType,
+            nullptr,
+            &PreOpenTag,
+            true,
+            0,
+            4096,
+            true));
+        Expect(ERROR_SUCCESS == Plain.Register(
+            Queue,
+            &ArrivalInterfaceType,
+            nullptr,
+            &PlainTag,
+            false,
+            0,
+            0,
+            false));
+
+        // Only the adapter which asked for existing channels sees the first
+        // one.
+        Expect(Queue.Wait(1000));
+        VmbusPipeArrival* Arrival = Queue.Pop();
+        Expect(Arrival && Arrival->Context == &PreOpenTag &&
+            Arrival->PipeHandle != INVALID_HANDLE_VALUE &&
+            Arrival->OpenError == ERROR_SUCCESS);
+        Expect(!Queue.Pop());
+        // Deleting an arrival closes the handle nobody took.
+        delete Arrival;
+
+        Expect(ERROR_SUCCESS == ::OfferChannel(2, Servers[1]));
+        Expect(Queue.Wait(1000));
+        VmbusPipeArrival* First = Queue.Pop();
+        VmbusPipeArrival* Second = Queue.Pop();
+        Expect(First && Second && !Queue.Pop());
+        if (First && Second)
+        {
+            if (First->Context != &PreOpenTag)
+            {
+                std::swap(First, Second);
+            }
+            Expect(First->Context == &PreOpenTag);
+            Expect(Second->Context == &PlainTag);
+            Expect(Second->PipeHandle == INVALID_HANDLE_VALUE);
+            Expect(0 == std::memcmp(
+                &First->ChannelInfo,
+                &Second->ChannelInfo,
+                sizeof(VMBUS_PIPE_CHANNEL_INFO)));
+
+            // The pre-opened handle is ready for I/O as soon as the server
+            // connects.
+            HANDLE Client = First->PipeHandle;
+            First->PipeHandle = INVALID_HANDLE_VALUE;
+            Expect(TRUE == ::VmbusPipeServerConnectPipe(Servers[1], nullptr));
+            HV_UINT32 Request = 0x4D696C65;
+            HV_UINT32 Response = 0;
+            DWORD Transferred = 0;
+            Expect(TRUE == ::WriteFile(
+                Client,
+                &Request,
+                sizeof(Request),
+                &Transferred,
+                nullptr));
+            Expect(TRUE == ::ReadFile(
+                Servers[1],
+                &Response,
+                sizeof(Response),
+                &Transferred,
+                nullptr));
+            Expect(Response == Request);
+            Expect(TRUE == ::CloseHandle(Client));
+        }
+        delete First;
+        delete Second;
+
+        PreOpen.Unregister();
+        Plain.Unregister();
+        Expect(ERROR_SUCCESS == ::OfferChannel(3, Servers[2]));
+        Expect(!Queue.Wait(10));
+        Expect(!Queue.Pop());
+        Expect(PreOpen.ArrivalCount() == 2 && Plain.ArrivalCount() == 1);
+        Expect(!PreOpen.DroppedCount() && !Plain.DroppedCount());
+
+        for (HANDLE Server : Servers)
+        {
+            ::CloseHandle(Server);
+        }
+        return Errors;
+    }
+
+    enum class ArrivalMode
+    {
+        // The callback hands the channel to the event loop thread through a
+        // locked queue, and the event loop opens it.
+        ThreadHop,
+        // The adapter posts to the lock-free queue, and the event loop opens
+        // the channel.
+        Queue,
+        // The adapter opens the channel in the callback, then posts it.
+        PreOpen,
+    };
+
+    /**
+     * @brief The locked queue the callback posts to without the adapter.
+     */
+    struct ThreadHopContext
+    {
+        std::mutex Mutex;
+        std::deque<VMBUS_PIPE_CHANNEL_INFO> Channels;
+        VmbusPipeLinuxEvent Event;
+    };
+
+    VOID CALLBACK OnThreadHopArrival(
+        LPVOID ClientContext,
+        PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+        VMBUS_PIPE_CHANNEL_NOTIFICATION_TYPE NotificationType)
+    {
+        if (NotificationType != ChannelNotificationArrival)
+        {
+            return;
+        }
+        ThreadHopContext* Context =
+            static_cast<ThreadHopContext*>(ClientContext);
+        {
+            std::lock_guard<std::mutex> Guard(Context->Mutex);
+            Context->Channels.push_back(*ChannelInfo);
+        }
+        Context->Event.Set();
+    }
+
+    struct ArrivalResult
+    {
+        double LoopMicroseconds;
+        double ReadyP50;
+        double ReadyP99;
+        std::uint64_t Errors;
+    };
+
+    std::uint64_t Nanoseconds(
+        std::chrono::steady_clock::time_point Start)
+    {
+        return static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - Start).count());
+    }
+
+    /**
+     * @brief Offers channels one at a time, and measures how long it takes
+     *        until the event loop holds the handle of a channel, and how
+     *        long the event loop spends on every arrival.
+     * @param Mode How the arrivals reach the event loop.
+     * @param BusyMicroseconds The time the event loop spends on other events
+     *                         every time it wakes up.
+     * @param Count The number of channels.
+     */
+    ArrivalResult MeasureArrivals(
+        ArrivalMode Mode,
+        HV_UINT32 BusyMicroseconds,
+        HV_UINT32 Count)
+    {
+        ArrivalResult Result = {};
+
+        std::vector<std::chrono::steady_clock::time_point> OfferTimes(Count);
+        std::vector<std::uint64_t> ReadyLatencies(Count);
+        std::atomic<HV_UINT32> Ready = 0;
+        std::atomic<bool> Stop = false;
+
+        ThreadHopContext HopContext;
+        VmbusPipeArrivalQueue Queue;
+        VmbusPipeArrivalAdapter Adapter;
+        HVMBUS_PIPE_NOTIFICATION Notification = nullptr;
+        int WaitableObject = -1;
+        if (Mode == ArrivalMode::ThreadHop)
+        {
+            if (!NT_SUCCESS(HopContext.Event.Create()))
+            {
+                ++Result.Errors;
+                return Result;
+            }
+            Notification = ::VmbusPipeClientRegisterChannelNotification(
+                &ArrivalInterfaceType,
+                nullptr,
+                0,
+                ::OnThreadHopArrival,
+                &HopContext);
+            if (!Notification)
+            {
+                ++Result.Errors;
+                return Result;
+            }
+            ::VmbusPipeClientReadyForChannelNotification(Notification, FALSE);
+            WaitableObject = HopContext.Event.FileDescriptor();
+        }
+        else
+        {
+            if (Queue.Initialize() != ERROR_SUCCESS ||
+                Adapter.Register(
+                    Queue,
+                    &ArrivalInterfaceType,
+                    nullptr,
+                    nullptr,
+                    Mode == ArrivalMode::PreOpen,
+                    0,
+                    0,
+                    false) != ERROR_SUCCESS)
+            {
+                ++Result.Errors;
+                return Result;
+            }
+            WaitableObject = Queue.WaitableObject();
+        }
+
+        std::uint64_t LoopErrors = 0;
+        std::uint64_t LoopNanoseconds = 0;
+        std::thread EventLoop([&]()
+        {
+            HV_UINT32 Index = 0;
+            auto Complete = [&](HANDLE PipeHandle)
+            {
+                if (PipeHandle == INVALID_HANDLE_VALUE)
+                {
+                    ++LoopErrors;
+                }
+                else
+                {
+                    ::CloseHandle(PipeHandle);
+                }
+                ReadyLatencies[Index] = ::Nanoseconds(OfferTimes[Index]);
+                ++Index;
+                Ready.store(Index, std::memory_order_release);
+            };
+
+            pollfd Descriptor = {};
+            Descriptor.fd = WaitableObject;
+            Descriptor.events = POLLIN;
+            while (!Stop.load(std::memory_order_acquire))
+            {
+                if (::poll(&Descriptor, 1, 10) <= 0)
+                {
+                    continue;
+                }
+                // Other events the event loop handles.
+                Stopwatch Busy;
+                while (Busy.Seconds() * 1e6 < BusyMicroseconds)
+                {
+                }
+                auto HandleStart = std::chrono::steady_clock::now();
+
+                if (Mode == ArrivalMode::ThreadHop)
+                {
+                    HV_UINT64 Value = 0;
+                    (void)::read(WaitableObject, &Value, sizeof(Value));
+                    for (;;)
+                    {
+                        VMBUS_PIPE_CHANNEL_INFO Info;
+                        {
+                            std::lock_guard<std::mutex> Guard(
+                                HopContext.Mutex);
+                            if (HopContext.Channels.empty())
+                            {
+                                break;
+                            }
+                            Info = HopContext.Channels.front();
+                            HopContext.Channels.pop_front();
+                        }
+                        Complete(::VmbusPipeClientOpenChannel(&Info, 0));
+                    }
+                    LoopNanoseconds += ::Nanoseconds(HandleStart);
+                    continue;
+                }
+
+                Queue.Acknowledge();
+                while (VmbusPipeArrival* Arrival = Queue.Pop())
+                {
+                    HANDLE PipeHandle = Arrival->PipeHandle;
+                    Arrival->PipeHandle = INVALID_HANDLE_VALUE;
+                    if (Mode == ArrivalMode::Queue)
+                    {
+                        PipeHandle = ::VmbusPipeClientOpenChannel(
+                            &Arrival->ChannelInfo,
+                            0);
+                    }
+                    delete Arrival;
+                    Complete(PipeHandle);
+                }
+                LoopNanoseconds += ::Nanoseconds(HandleStart);
+            }
+        });
+
+        // The offering thread stands in for the thread which delivers the
+        // notifications.
+        for (HV_UINT32 i = 0; i < Count; ++i)
+        {
+            HANDLE Server = INVALID_HANDLE_VALUE;
+            OfferTimes[i] = std::chrono::steady_clock::now();
+            if (::OfferChannel(1000 + i, Server) != ERROR_SUCCESS)
+            {
+                ++Result.Errors;
+                break;
+            }
+            Backoff Wait;
+            while (Ready.load(std::memory_order_acquire) <= i)
+            {
+                Wait.Wait();
+            }
+            ::CloseHandle(Server);
+        }
+        Stop.store(true, std::memory_order_release);
+        EventLoop.join();
+
+        if (Notification)
+        {
+            ::VmbusPipeClientUnregisterChannelNotification(
+                Notification,
+                TRUE);
+        }
+        Adapter.Unregister();
+
+        Result.Errors += LoopErrors;
+        std::sort(ReadyLatencies.begin(), ReadyLatencies.end());
+        Result.LoopMicroseconds = LoopNanoseconds / 1000.0 / Count;
+        Result.ReadyP50 = ReadyLatencies[Count / 2] / 1000.0;
+        Result.ReadyP99 = ReadyLatencies[Count * 99 / 100] / 1000.0;
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunPipeArrival(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf(
+        "Arrival queue check: %llu errors\n",
+        static_cast<unsigned long long>(::CheckArrivalQueue()));
+    std::printf(
+        "Arrival adapter check: %llu errors\n\n",
+        static_cast<unsigned long long>(::CheckArrivalAdapter()));
+
+    struct ModeInfo
+    {
+        const char* Name;
+        ArrivalMode Mode;
+    };
+    const ModeInfo Modes[] =
+    {
+        { "ThreadHop", ArrivalMode::ThreadHop },
+        { "Queue", ArrivalMode::Queue },
+        { "PreOpen", ArrivalMode::PreOpen },
+    };
+
+    const HV_UINT32 Count = 2000;
+    std::printf(
+        "%u channels, latency from offer in microseconds\n",
+        Count);
+    std::printf(
+        "%-10s %8s %10s %10s %10s %8s\n",
+        "Mode",
+        "Busy us",
+        "Loop us",
+        "Ready p50",
+        "Ready p99",
+        "Errors");
+    for (HV_UINT32 BusyMicroseconds : { 0u, 50u })
+    {
+        for (ModeInfo const& Mode : Modes)
+        {
+            ArrivalResult Result = ::MeasureArrivals(
+                Mode.Mode,
+                BusyMicroseconds,
+                Count);
+            std::printf(
+                "%-10s %8u %10.2f %10.1f %10.1f %8llu\n",
+                Mode.Name,
+                BusyMicroseconds,
+                Result.LoopMicroseconds,
+                Result.ReadyP50,
+                Result.ReadyP99,
+                static_cast<unsigned long long>(Result.Errors));
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+int Mile::HyperV::Benchmark::RunPipeArrival(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf("The pipe arrival benchmark only runs on Linux.\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,602 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.PipeAsync.cpp
+ * PURPOSE:    Implementation for Mile.HyperV pipe asynchronous channel
+ *             benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#ifdef __linux__
+#include <Mile.HyperV.VMBus.PipeAsync.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#ifdef __linux__
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    const GUID AsyncInterfaceType =
+    {
+        0x4D696C65, 0x5069, 0x7065,
+        { 0x41, 0x73, 0x79, 0x6E, 0x63, 0x00, 0x00, 0x01 }
+    };
+
+    GUID AsyncInterfaceInstance(
+        HV_UINT32 Index)
+    {
+        GUID Instance =
+        {
+            0x4D696C65, 0x5069, 0x7065,
+            { 0x49, 0x6E, 0x73, 0x74, 0x00, 0x00, 0x00, 0x00 }
+        };
+        std::memcpy(&Instance.Data4[4], &Index, sizeof(Index));
+        return Instance;
+    }
+
+    HV_UINT8 PatternByte(
+        std::uint64_t Position)
+    {
+        return static_cast<HV_UINT8>(Position ^ (Position >> 11));
+    }
+
+    const HV_UINT32 PatternSize = 64 * 1024 + 4096;
+    const HV_UINT32 ChunkSize = 64 * 1024;
+
+    /**
+     * @brief The bytes every stream sends, long enough to be checked against
+     *        in place at any offset within the pattern period.
+     */
+    std::vector<HV_UINT8> const& PatternSource()
+    {
+        static std::vector<HV_UINT8> Source = []()
+        {
+            std::vector<HV_UINT8> Result(PatternSize + ChunkSize);
+            for (std::size_t i = 0; i < Result.size(); ++i)
+            {
+                Result[i] = ::PatternByte(i % PatternSize);
+            }
+            return Result;
+        }();
+        return Source;
+    }
+
+    /**
+     * @brief One offered channel with its server side and its client side.
+     */
+    struct AsyncStream
+    {
+        HANDLE Server = INVALID_HANDLE_VALUE;
+        VMBUS_PIPE_CHANNEL_INFO Info;
+        VmbusPipeAsyncChannel ServerChannel;
+        VmbusPipeAsyncChannel ClientChannel;
+        std::uint64_t Received = 0;
+        std::uint64_t Errors = 0;
+    };
+
+    /**
+     * @brief Offers a channel, opens it through the client side and connects
+     *        the server side.
+     */
+    DWORD ConnectStream(
+        VmbusPipeIoEngine& Engine,
+        AsyncStream& Stream,
+        HV_UINT32 Index,
+        VmbusPipeRingTuner* Tuner,
+        DWORD RingSize)
+    {
+        VMBUS_PIPE_SERVER_OFFER_EX Offer = {};
+        Offer.Version = 1;
+        Offer.Size = sizeof(Offer);
+        Offer.InterfaceType = AsyncInterfaceType;
+        Offer.InterfaceInstance = ::AsyncInterfaceInstance(Index);
+        DWORD Error = ::VmbusPipeServerOfferChannelEx(
+            &Offer,
+            0,
+            0,
+            &Stream.Server);
+        if (Error != ERROR_SUCCESS)
+        {
+            return Error;
+        }
+        if (!::VmbusPipeClientWaitChannel(
+            &AsyncInterfaceType,
+            &Offer.InterfaceInstance,
+            0,
+            &Stream.Info))
+        {
+            return ::GetLastError();
+        }
+        Error = Stream.ClientChannel.Open(
+            Engine,
+            &Stream.Info,
+            Tuner,
+            RingSize);
+        if (Error != ERROR_SUCCESS)
+        {
+            return Error;
+        }
+        if (!::VmbusPipeServerConnectPipe(Stream.Server, nullptr))
+        {
+            return ::GetLastError();
+        }
+        // The channel owns the server handle from now on.
+        HANDLE Server = Stream.Server;
+        Stream.Server = INVALID_HANDLE_VALUE;
+        return Stream.ServerChannel.Attach(Engine, Server);
+    }
+
+    VmbusPipeAsyncTask SendStream(
+        VmbusPipeAsyncChannel& Channel,
+        std::uint64_t TotalBytes,
+        HV_UINT32 WriteSize,
+        std::uint64_t& Errors)
+    {
+        const HV_UINT8* Source = ::PatternSource().data();
+        std::uint64_t Sent = 0;
+        while (Sent < TotalBytes)
+        {
+            DWORD Size = static_cast<DWORD>(
+                std::min<std::uint64_t>(WriteSize, TotalBytes - Sent));
+            VmbusPipeIoResult Result = co_await Channel.AsyncWrite(
+                Source + Sent % PatternSize,
+                Size);
+            if (Result.Error != ERROR_SUCCESS ||
+                Result.BytesTransferred != Size)
+            {
+                ++Errors;
+                break;
+            }
+            Sent += Size;
+        }
+        // Closing ends the stream of the receiver.
+        Channel.Close();
+    }
+
+    VmbusPipeAsyncTask ReceiveStream(
+        VmbusPipeAsyncChannel& Channel,
+        std::uint64_t& Received,
+        std::uint64_t& Errors)
+    {
+        const HV_UINT8* Source = ::PatternSource().data();
+        std::unique_ptr<HV_UINT8[]> Buffer(new HV_UINT8[ChunkSize]);
+        for (;;)
+        {
+            VmbusPipeIoResult Result = co_await Channel.AsyncRead(
+                Buffer.get(),
+                ChunkSize);
+            if (Result.Error != ERROR_SUCCESS)
+            {
+                if (Result.Error != ERROR_BROKEN_PIPE)
+                {
+                    ++Errors;
+                }
+                break;
+            }
+            if (0 != std::memcmp(
+                Buffer.get(),
+                Source + Received % PatternSize,
+                Result.BytesTransferred))
+            {
+                ++Errors;
+            }
+            Received += Result.BytesTransferred;
+        }
+        Channel.Close();
+    }
+
+    VmbusPipeAsyncTask EchoRequests(
+        VmbusPipeAsyncChannel& Channel,
+        std::uint64_t& Errors)
+    {
+        HV_UINT8 Buffer[256];
+        for (;;)
+        {
+            VmbusPipeIoResult Result = co_await Channel.AsyncRead(
+                Buffer,
+                sizeof(Buffer));
+            if (Result.Error != ERROR_SUCCESS)
+            {
+                if (Result.Error != ERROR_BROKEN_PIPE)
+                {
+                    ++Errors;
+                }
+                break;
+            }
+            Result = co_await Channel.AsyncWrite(
+                Buffer,
+                Result.BytesTransferred);
+            if (Result.Error != ERROR_SUCCESS)
+            {
+                ++Errors;
+                break;
+            }
+        }
+    }
+
+    VmbusPipeAsyncTask SendRequests(
+        VmbusPipeAsyncChannel& Channel,
+        HV_UINT32 Count,
+        std::uint64_t& Errors)
+    {
+        for (HV_UINT32 i = 0; i < Count; ++i)
+        {
+            HV_UINT32 Request[16];
+            for (HV_UINT32& Word : Request)
+            {
+                Word = i;
+            }
+            VmbusPipeIoResult Result = co_await Channel.AsyncWrite(
+                Request,
+                sizeof(Request));
+            if (Result.Error != ERROR_SUCCESS)
+            {
+                ++Errors;
+                break;
+            }
+            HV_UINT32 Response[16];
+            DWORD Received = 0;
+            while (Received < sizeof(Response))
+            {
+                Result = co_await Channel.AsyncRead(
+                    reinterpret_cast<HV_UINT8*>(Response) + Received,
+                    sizeof(Response) - Received);
+                if (Result.Error != ERROR_SUCCESS)
+                {
+                    ++Errors;
+                    co_return;
+                }
+                Received += Result.BytesTransferred;
+            }
+            if (0 != std::memcmp(Request, Response, sizeof(Request)))
+            {
+                ++Errors;
+            }
+        }
+        Channel.Close();
+    }
+
+    /**
+     * @brief Checks request and response exchanges, errors on closed
+     *        channels, and the ring tuner decisions.
+     */
+    std::uint64_t CheckPipeAsync()
+    {
+        std::uint64_t Errors = 0;
+        {
+            VmbusPipeIoEngine Engine;
+            if (Engine.Start(2) != ERROR_SUCCESS)
+            {
+                return 1;
+            }
+            AsyncStream Stream;
+            if (ERROR_SUCCESS != ::ConnectStream(
+                Engine,
+                Stream,
+                1,
+                nullptr,
+                4096))
+            {
+                return 1;
+            }
+            std::uint64_t ServerErrors = 0;
+            {
+                VmbusPipeAsyncTask Server = ::EchoRequests(
+                    Stream.ServerChannel,
+                    ServerErrors);
+                VmbusPipeAsyncTask Client = ::SendRequests(
+                    Stream.ClientChannel,
+                    1000,
+                    Errors);
+            }
+            Errors += ServerErrors;
+
+            // The client closed, so the server side sees the broken pipe.
+            HV_UINT8 Byte = 0;
+            std::uint64_t Failures = 0;
+            auto Write = [&]() -> VmbusPipeAsyncTask
+            {
+                VmbusPipeIoResult Result =
+                    co_await Stream.ServerChannel.AsyncWrite(&Byte, 1);
+                if (Result.Error != ERROR_NO_DATA)
+                {
+                    ++Failures;
+                }
+            };
+            Write().Wait();
+            Errors += Failures;
+            ::CloseHandle(Stream.Server);
+        }
+
+        // The sizes are in pages, so the check holds with any page size.
+        HV_UINT32 Page = ::Mile::HyperV::VmbusPipeRingPageSize();
+        VmbusPipeRingTuner Tuner;
+        if (!NT_SUCCESS(Tuner.Initialize(Page, 4 * Page)) ||
+            NT_SUCCESS(Tuner.Initialize(Page + 1, 4 * Page)) ||
+            NT_SUCCESS(Tuner.Initialize(Page / 2, 4 * Page)))
+        {
+            ++Errors;
+        }
+        Tuner.Initialize(Page, 4 * Page);
+        // Too short to count.
+        Tuner.Report(Page, Page, 1000);
+        if (Tuner.RingSize() != Page)
+        {
+            ++Errors;
+        }
+        Tuner.Report(Page, 256 * Page, 1000);
+        if (Tuner.RingSize() != 2 * Page)
+        {
+            ++Errors;
+        }
+        // Better, but not by enough.
+        Tuner.Report(2 * Page, 256 * Page + 1, 1000);
+        if (Tuner.RingSize() != Page || !Tuner.IsSettled())
+        {
+            ++Errors;
+        }
+        return Errors;
+    }
+
+    struct PipeAsyncResult
+    {
+        double MegabytesPerSecond;
+        std::uint64_t Errors;
+    };
+
+    /**
+     * @brief Streams bytes over several channels at once, either with a
+     *        pair of blocking threads per channel, or with coroutines on an
+     *        engine with a fixed number of threads.
+     */
+    PipeAsyncResult MeasureStreams(
+        bool UseCoroutines,
+        HV_UINT32 ChannelCount,
+        HV_UINT32 ThreadCount,
+        std::uint64_t TotalBytes)
+    {
+        PipeAsyncResult Result = {};
+        VmbusPipeIoEngine Engine;
+        if (Engine.Start(ThreadCount) != ERROR_SUCCESS)
+        {
+            ++Result.Errors;
+            return Result;
+        }
+        std::vector<std::unique_ptr<AsyncStream>> Streams;
+        for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+        {
+            Streams.emplace_back(new AsyncStream());
+            if (ERROR_SUCCESS != ::ConnectStream(
+                Engine,
+                *Streams.back(),
+                100 + i,
+                nullptr,
+                64 * 1024))
+            {
+                ++Result.Errors;
+                return Result;
+            }
+        }
+        std::uint64_t BytesPerChannel = TotalBytes / ChannelCount;
+
+        Stopwatch Watch;
+        if (UseCoroutines)
+        {
+            std::vector<VmbusPipeAsyncTask> Tasks;
+            for (auto& Stream : Streams)
+            {
+                Tasks.push_back(::ReceiveStream(
+                    Stream->ServerChannel,
+                    Stream->Received,
+                    Stream->Errors));
+                Tasks.push_back(::SendStream(
+                    Stream->ClientChannel,
+                    BytesPerChannel,
+                    ChunkSize,
+                    Stream->Errors));
+            }
+        }
+        else
+        {
+            std::vector<std::thread> Threads;
+            for (auto& Stream : Streams)
+            {
+                AsyncStream* Current = Stream.get();
+                Threads.emplace_back([Current, BytesPerChannel]()
+                {
+                    const HV_UINT8* Source = ::PatternSource().data();
+                    HANDLE Pipe = Current->ClientChannel.Handle();
+                    std::uint64_t Sent = 0;
+                    while (Sent < BytesPerChannel)
+                    {
+                        DWORD Size = static_cast<DWORD>(std::min<std::uint64_t>(
+                            ChunkSize,
+                            BytesPerChannel - Sent));
+                        DWORD Written = 0;
+                        if (!::WriteFile(
+                            Pipe,
+                            Source + Sent % PatternSize,
+                            Size,
+                            &Written,
+                            nullptr))
+                        {
+                            ++Current->Errors;
+                            break;
+                        }
+                        Sent += Size;
+                    }
+                    Current->ClientChannel.Close();
+                });
+                Threads.emplace_back([Current]()
+                {
+                    const HV_UINT8* Source = ::PatternSource().data();
+                    HANDLE Pipe = Current->ServerChannel.Handle();
+                    std::unique_ptr<HV_UINT8[]> Buffer(
+                        new HV_UINT8[ChunkSize]);
+                    DWORD BytesRead = 0;
+                    while (::ReadFile(
+                        Pipe,
+                        Buffer.get(),
+                        ChunkSize,
+                        &BytesRead,
+                        nullptr))
+                    {
+                        if (0 != std::memcmp(
+                            Buffer.get(),
+                            Source + Current->Received % PatternSize,
+                            BytesRead))
+                        {
+                            ++Current->Errors;
+                        }
+                        Current->Received += BytesRead;
+                    }
+                    Current->ServerChannel.Close();
+                });
+            }
+            for (std::thread& Thread : Threads)
+            {
+                Thread.join();
+            }
+        }
+        double Elapsed = Watch.Seconds();
+
+        std::uint64_t Received = 0;
+        for (auto& Stream : Streams)
+        {
+            Result.Errors += Stream->Errors;
+            if (Stream->Received != BytesPerChannel)
+            {
+                ++Result.Errors;
+            }
+            Received += Stream->Received;
+            ::CloseHandle(Stream->Server);
+        }
+        Result.MegabytesPerSecond = Received / Elapsed / (1024.0 * 1024.0);
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunPipeAsync(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf(
+        "Async check: %llu errors\n\n",
+        static_cast<unsigned long long>(::CheckPipeAsync()));
+
+    const std::uint64_t TotalBytes = 256ull * 1024 * 1024;
+    const HV_UINT32 EngineThreads = 2;
+    std::printf(
+        "%-12s %9s %8s %12s %8s\n",
+        "Mode",
+        "Channels",
+        "Threads",
+        "MB/s",
+        "Errors");
+    for (HV_UINT32 ChannelCount : { 1u, 4u, 16u })
+    {
+        for (bool UseCoroutines : { false, true })
+        {
+            PipeAsyncResult Result = ::MeasureStreams(
+                UseCoroutines,
+                ChannelCount,
+                EngineThreads,
+                TotalBytes);
+            std::printf(
+                "%-12s %9u %8u %12.1f %8llu\n",
+                UseCoroutines ? "Coroutines" : "Blocking",
+                ChannelCount,
+                UseCoroutines ? EngineThreads : 2 * ChannelCount,
+                Result.MegabytesPerSecond,
+                static_cast<unsigned long long>(Result.Errors));
+        }
+    }
+
+    // Every session streams through a new channel opened with the size the
+    // tuner picks, until the tuner settles.
+    std::printf(
+        "\n%8s %10s %12s %8s\n",
+        "Session",
+        "Ring",
+        "MB/s",
+        "Errors");
+    VmbusPipeIoEngine Engine;
+    VmbusPipeRingTuner Tuner;
+    if (Engine.Start(EngineThreads) != ERROR_SUCCESS ||
+        !NT_SUCCESS(Tuner.Initialize(
+            ::Mile::HyperV::VmbusPipeRingPageSize(),
+            1024 * 1024)))
+    {
+        return 1;
+    }
+    for (HV_UINT32 Session = 0; Session < 12 && !Tuner.IsSettled(); ++Session)
+    {
+        AsyncStream Stream;
+        HV_UINT32 RingSize = Tuner.RingSize();
+        if (ERROR_SUCCESS != ::ConnectStream(
+            Engine,
+            Stream,
+            200 + Session,
+            &Tuner,
+            0))
+        {
+            return 1;
+        }
+        const std::uint64_t SessionBytes = 64ull * 1024 * 1024;
+        Stopwatch Watch;
+        {
+            VmbusPipeAsyncTask Receiver = ::ReceiveStream(
+                Stream.ServerChannel,
+                Stream.Received,
+                Stream.Errors);
+            VmbusPipeAsyncTask Sender = ::SendStream(
+                Stream.ClientChannel,
+                SessionBytes,
+                ChunkSize,
+                Stream.Errors);
+        }
+        double Elapsed = Watch.Seconds();
+        if (Stream.Received != SessionBytes)
+        {
+            ++Stream.Errors;
+        }
+        std::printf(
+            "%8u %10u %12.1f %8llu\n",
+            Session,
+            RingSize,
+            Stream.Received / Elapsed / (1024.0 * 1024.0),
+            static_cast<unsigned long long>(Stream.Errors));
+    }
+    std::printf("Settled ring size: %u\n", Tuner.RingSize());
+
+    return 0;
+}
+
+#else
+
+int Mile::HyperV::Benchmark::RunPipeAsync(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf("The asynchronous pipe benchmark only runs on Linux.\n");
+    return 0;
+}
+
+#endif
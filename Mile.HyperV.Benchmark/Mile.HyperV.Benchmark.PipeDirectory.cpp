@@ -0,0 +1,438 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.PipeDirectory.cpp
+ * PURPOSE:    Implementation for Mile.HyperV pipe channel directory
+ *             benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#ifdef __linux__
+#include <Mile.HyperV.VMBus.PipeDirectory.h>
+#endif
+
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    GUID DirectoryInterfaceType(
+        HV_UINT8 Index)
+    {
+        GUID Type =
+        {
+            0x4D696C65, 0x5069, 0x7065,
+            { 0x44, 0x69, 0x72, 0x00, 0x00, 0x00, 0x00, 0x00 }
+        };
+        Type.Data4[7] = Index;
+        return Type;
+    }
+
+    GUID DirectoryInterfaceInstance(
+        HV_UINT32 Index)
+    {
+        GUID Instance =
+        {
+            0x4D696C65, 0x5069, 0x7065,
+            { 0x49, 0x6E, 0x73, 0x74, 0x00, 0x00, 0x00, 0x00 }
+        };
+        std::memcpy(&Instance.Data4[4], &Index, sizeof(Index));
+        return Instance;
+    }
+
+    /**
+     * @brief Offers a channel with the instance index in UserDefined.
+     */
+    DWORD OfferChannel(
+        GUID const& InterfaceType,
+        HV_UINT32 Index,
+        HANDLE& PipeHandle)
+    {
+        VMBUS_PIPE_SERVER_OFFER_EX Offer = {};
+        Offer.Version = 1;
+        Offer.Size = sizeof(Offer);
+        Offer.InterfaceType = InterfaceType;
+        Offer.InterfaceInstance = ::DirectoryInterfaceInstance(Index);
+        std::memcpy(Offer.UserDefined, &Index, sizeof(Index));
+        return ::VmbusPipeServerOfferChannelEx(&Offer, 0, 0, &PipeHandle);
+    }
+
+    bool HasIndex(
+        VmbusPipeDirectoryChannel const& Channel,
+        HV_UINT32 Index)
+    {
+        return Channel.IsUserDefinedValid &&
+            0 == std::memcmp(Channel.UserDefined, &Index, sizeof(Index));
+    }
+
+    /**
+     * @brief Checks the initial enumeration, arrivals, refreshes, removals,
+     *        the generations and the device path parsing.
+     */
+    std::uint64_t CheckPipeDirectory()
+    {
+        std::uint64_t Errors = 0;
+        auto Expect = [&](bool Condition)
+        {
+            if (!Condition)
+            {
+                ++Errors;
+            }
+        };
+
+        const GUID TypeA = ::DirectoryInterfaceType(1);
+        const GUID TypeB = ::DirectoryInterfaceType(2);
+        std::vector<HANDLE> Servers;
+        auto Offer = [&](GUID const& Type, HV_UINT32 Index) -> HANDLE
+        {
+            HANDLE Server = INVALID_HANDLE_VALUE;
+            Expect(ERROR_SUCCESS == ::OfferChannel(Type, Index, Server));
+            Servers.push_back(Server);
+            return Server;
+        };
+
+        // The device path holds the type followed by the instance.
+        {
+            VMBUS_PIPE_CHANNEL_INFO Info = {};
+            std::wcscpy(
+                Info.DevicePath,
+                L"\\\\?\\VMBUS#{4D696C65-5069-7065-4469-720000000001}"
+                L"#{4d696c65-5069-7065-496e-737407000000}#x");
+            GUID Instance = {};
+            Expect(::VmbusPipeParseDevicePath(Info, TypeA, Instance));
+            Expect(::VmbusGuidEquals(
+                Instance,
+                ::DirectoryInterfaceInstance(7)));
+            Expect(!::VmbusPipeParseDevicePath(Info, TypeB, Instance));
+            std::wcscpy(
+                Info.DevicePath,
+                L"\\\\?\\VMBUS#{4D696C65-5069-7065-4469-720000000001}"
+                L"#{4d696c65-5069-7065-496e-7374070000}");
+            Expect(!::VmbusPipeParseDevicePath(Info, TypeA, Instance));
+        }
+
+        for (HV_UINT32 i = 1; i <= 3; ++i)
+        {
+            Offer(TypeA, i);
+        }
+
+        VmbusPipeChannelDirectory Directory;
+        Expect(ERROR_INVALID_HANDLE == Directory.StartWatching(TypeA));
+        Expect(ERROR_SUCCESS == Directory.Initialize(16));
+        Expect(ERROR_SUCCESS == Directory.StartWatching(TypeA));
+        Expect(ERROR_ALREADY_EXISTS == Directory.StartWatching(TypeA));
+        Expect(Directory.Count() == 3);
+        VmbusPipeDirectoryChannel Channel;
+        for (HV_UINT32 i = 1; i <= 3; ++i)
+        {
+            Expect(Directory.Find(
+                TypeA,
+                ::DirectoryInterfaceInstance(i),
+                &Channel) && ::HasIndex(Channel, i));
+        }
+        Expect(!Directory.Find(
+            TypeA,
+            ::DirectoryInterfaceInstance(4),
+            nullptr));
+
+        // An arrival is applied without an enumeration, so its UserDefined
+        // is not known until the next refresh.
+        HV_UINT64 Generation = Directory.Generation();
+        HV_UINT64 GenerationA = Directory.TypeGeneration(TypeA);
+        Offer(TypeA, 4);
+        Expect(Directory.Find(
+            TypeA,
+            ::DirectoryInterfaceInstance(4),
+            &Channel));
+        Expect(!Channel.IsUserDefinedValid);
+        Expect(Channel.Generation == Directory.Generation());
+        Expect(Directory.Generation() == Generation + 1);
+        Expect(Directory.TypeGeneration(TypeA) == GenerationA + 1);
+
+        Expect(ERROR_SUCCESS == Directory.StartWatching(TypeB));
+        GenerationA = Directory.TypeGeneration(TypeA);
+        Offer(TypeB, 1);
+        Expect(Directory.Find(TypeB, ::DirectoryInterfaceInstance(1), nullptr));
+        Expect(Directory.TypeGeneration(TypeA) == GenerationA);
+        Expect(Directory.TypeGeneration(TypeB) == 1);
+
+        VmbusPipeDirectoryChannel Channels[8];
+        HV_UINT64 ListGeneration = 0;
+        Expect(4 == Directory.List(TypeA, Channels, 8, &ListGeneration));
+        Expect(ListGeneration == GenerationA);
+        Expect(4 == Directory.List(TypeA, Channels, 2, nullptr));
+
+        // A rescind is only seen by a refresh, which also fills in the
+        // UserDefined of arrived channels.
+        ::CloseHandle(Servers[1]);
+        Servers[1] = INVALID_HANDLE_VALUE;
+        Expect(Directory.Find(TypeA, ::DirectoryInterfaceInstance(2), nullptr));
+        Expect(ERROR_SUCCESS == Directory.Refresh(&TypeA));
+        Expect(!Directory.Find(
+            TypeA,
+            ::DirectoryInterfaceInstance(2),
+            nullptr));
+        Expect(Directory.Find(
+            TypeA,
+            ::DirectoryInterfaceInstance(4),
+            &Channel) && ::HasIndex(Channel, 4));
+        Expect(Directory.Count() == 4);
+        Expect(Directory.Find(
+            TypeB,
+            ::DirectoryInterfaceInstance(1),
+            &Channel));
+        Expect(!Channel.IsUserDefinedValid);
+        GenerationA = Directory.TypeGeneration(TypeA);
+        Expect(ERROR_SUCCESS == Directory.Refresh());
+        Expect(Directory.Find(
+            TypeB,
+            ::DirectoryInterfaceInstance(1),
+            &Channel) && ::HasIndex(Channel, 1));
+        Expect(Directory.TypeGeneration(TypeA) == GenerationA);
+        Generation = Directory.Generation();
+        Expect(ERROR_SUCCESS == Directory.Refresh());
+        Expect(Directory.Generation() == Generation);
+        GUID TypeC = ::DirectoryInterfaceType(3);
+        Expect(ERROR_FILE_NOT_FOUND == Directory.Refresh(&TypeC));
+
+        Expect(ERROR_SUCCESS == Directory.Remove(
+            TypeA,
+            ::DirectoryInterfaceInstance(1)));
+        Expect(ERROR_FILE_NOT_FOUND == Directory.Remove(
+            TypeA,
+            ::DirectoryInterfaceInstance(1)));
+        Expect(Directory.Generation() == Generation + 1);
+
+        // Channels beyond the capacity are counted, not added.
+        VmbusPipeChannelDirectory Small;
+        Expect(ERROR_SUCCESS == Small.Initialize(2));
+        Expect(ERROR_SUCCESS == Small.StartWatching(TypeA));
+        Expect(Small.Count() == 2 && Small.OverflowCount() == 1);
+
+        // Refreshes of the same type overlap each other and Close, which
+        // waits for them before it frees the watches.
+        VmbusPipeChannelDirectory Racing;
+        for (HV_UINT32 Round = 0; Round < 32; ++Round)
+        {
+            Expect(ERROR_SUCCESS == Racing.Initialize(16));
+            Expect(ERROR_SUCCESS == Racing.StartWatching(TypeA));
+            std::atomic<std::uint64_t> Failures = 0;
+            std::vector<std::thread> Refreshers;
+            for (HV_UINT32 i = 0; i < 2; ++i)
+            {
+                Refreshers.emplace_back([&, Round]()
+                {
+                    for (HV_UINT32 j = 0; j < 16; ++j)
+                    {
+                        // The type is not watched any more once Close
+                        // took the watches.
+                        DWORD Error = Racing.Refresh(&TypeA);
+                        if (Error != ERROR_SUCCESS &&
+                            !((Round % 2) && Error == ERROR_FILE_NOT_FOUND))
+                        {
+                            ++Failures;
+                        }
+                    }
+                });
+            }
+            if (Round % 2)
+            {
+                Racing.Close();
+            }
+            for (std::thread& Refresher : Refreshers)
+            {
+                Refresher.join();
+            }
+            Expect(!Failures);
+            Expect(ERROR_SUCCESS == Racing.Refresh());
+            Expect(Racing.Count() == ((Round % 2) ? 0 : 3));
+        }
+        Racing.Close();
+
+        Directory.Close();
+        Small.Close();
+        Expect(Directory.Count() == 0);
+        Expect(Directory.TypeGeneration(TypeA) == 0);
+        Offer(TypeA, 5);
+        Expect(Directory.Count() == 0);
+
+        for (HANDLE Server : Servers)
+        {
+            ::CloseHandle(Server);
+        }
+        return Errors;
+    }
+
+    struct FindContext
+    {
+        GUID InterfaceInstance;
+        bool IsFound;
+    };
+
+    VOID CALLBACK OnFindOffer(
+        LPVOID HostContext,
+        LPBYTE UserDefined,
+        PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+        LPCGUID InstanceGuid)
+    {
+        (void)UserDefined;
+        (void)ChannelInfo;
+        FindContext* Context = static_cast<FindContext*>(HostContext);
+        if (::VmbusGuidEquals(*InstanceGuid, Context->InterfaceInstance))
+        {
+            Context->IsFound = true;
+        }
+    }
+
+    struct DirectoryResult
+    {
+        double StartMicroseconds;
+        double EnumerateNanoseconds;
+        double FindNanoseconds;
+        double GenerationNanoseconds;
+        std::uint64_t Errors;
+    };
+
+    /**
+     * @brief Offers a number of channels, then looks random ones up by
+     *        enumerating the pipes, and through the directory.
+     */
+    DirectoryResult MeasureDirectory(
+        HV_UINT32 ChannelCount,
+        HV_UINT32 LookupCount)
+    {
+        DirectoryResult Result = {};
+        const GUID Type = ::DirectoryInterfaceType(0x10);
+        std::vector<HANDLE> Servers(ChannelCount, INVALID_HANDLE_VALUE);
+        for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+        {
+            if (ERROR_SUCCESS != ::OfferChannel(Type, i, Servers[i]))
+            {
+                ++Result.Errors;
+            }
+        }
+
+        std::mt19937 Random(ChannelCount);
+        std::vector<GUID> Instances(LookupCount);
+        for (GUID& Instance : Instances)
+        {
+            Instance = ::DirectoryInterfaceInstance(Random() % ChannelCount);
+        }
+
+        Stopwatch Watch;
+        for (GUID const& Instance : Instances)
+        {
+            FindContext Context = { Instance, false };
+            ::VmbusPipeClientEnumeratePipes(&Type, &Context, ::OnFindOffer);
+            if (!Context.IsFound)
+            {
+                ++Result.Errors;
+            }
+        }
+        Result.EnumerateNanoseconds = Watch.Seconds() * 1e9 / LookupCount;
+
+        VmbusPipeChannelDirectory Directory;
+        Watch = Stopwatch();
+        if (ERROR_SUCCESS != Directory.Initialize(ChannelCount) ||
+            ERROR_SUCCESS != Directory.StartWatching(Type))
+        {
+            ++Result.Errors;
+        }
+        Result.StartMicroseconds = Watch.Seconds() * 1e6;
+
+        VmbusPipeDirectoryChannel Channel;
+        Watch = Stopwatch();
+        for (GUID const& Instance : Instances)
+        {
+            if (!Directory.Find(Type, Instance, &Channel))
+            {
+                ++Result.Errors;
+            }
+        }
+        Result.FindNanoseconds = Watch.Seconds() * 1e9 / LookupCount;
+
+        // Callers which cache what they derived from the channels only
+        // check the generation.
+        HV_UINT64 Seen = Directory.Generation();
+        Watch = Stopwatch();
+        for (HV_UINT32 i = 0; i < LookupCount; ++i)
+        {
+            if (Directory.Generation() != Seen)
+            {
+                ++Result.Errors;
+            }
+        }
+        Result.GenerationNanoseconds = Watch.Seconds() * 1e9 / LookupCount;
+
+        Directory.Close();
+        for (HANDLE Server : Servers)
+        {
+            ::CloseHandle(Server);
+        }
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunPipeDirectory(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf(
+        "Directory check: %llu errors\n\n",
+        static_cast<unsigned long long>(::CheckPipeDirectory()));
+
+    const HV_UINT32 LookupCount = 2000;
+    std::printf(
+        "%9s %10s %14s %10s %14s %8s\n",
+        "Channels",
+        "Start us",
+        "Enumerate ns",
+        "Find ns",
+        "Generation ns",
+        "Errors");
+    for (HV_UINT32 ChannelCount : { 64u, 256u, 1024u })
+    {
+        DirectoryResult Result = ::MeasureDirectory(
+            ChannelCount,
+            LookupCount);
+        std::printf(
+            "%9u %10.1f %14.1f %10.1f %14.2f %8llu\n",
+            ChannelCount,
+            Result.StartMicroseconds,
+            Result.EnumerateNanoseconds,
+            Result.FindNanoseconds,
+            Result.GenerationNanoseconds,
+            static_cast<unsigned long long>(Result.Errors));
+    }
+
+    return 0;
+}
+
+#else
+
+int Mile::HyperV::Benchmark::RunPipeDirectory(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf("The pipe directory benchmark only runs on Linux.\n");
+    return 0;
+}
+
+#endif
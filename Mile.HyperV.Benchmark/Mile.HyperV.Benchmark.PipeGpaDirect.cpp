@@ -0,0 +1,556 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.PipeGpaDirect.cpp
+ * PURPOSE:    Implementation for Mile.HyperV pipe GPA direct benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.PipeGpaDirect.h>
+
+#ifdef __linux__
+#include <Mile.HyperV.Linux.GpaSpace.h>
+#endif
+
+#include <vector>
+
+#ifdef __linux__
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    enum class TransferMode
+    {
+        // Copy the bytes through the ring with the pipe byte stream.
+        Ring,
+        // Hand the bytes over by reference with a GPA direct buffer.
+        GpaDirect,
+    };
+
+    struct PipeGpaDirectResult
+    {
+        double MegabytesPerSecond;
+        std::uint64_t RingBytes;
+        std::uint64_t Errors;
+    };
+
+    const HV_UINT64 GuestBasePfn = 0x100000;
+    const HV_UINT32 GuestBufferHandle = 1;
+
+    // Marks both ends of a transfer with its sequence number, which the
+    // receiver checks.
+    void StampTransfer(
+        HV_UINT8* Data,
+        HV_UINT32 Size,
+        std::uint64_t Sequence)
+    {
+        std::memcpy(Data, &Sequence, sizeof(Sequence));
+        std::memcpy(
+            Data + Size - sizeof(Sequence),
+            &Sequence,
+            sizeof(Sequence));
+    }
+
+    bool CheckTransfer(
+        const HV_UINT8* Data,
+        HV_UINT32 Size,
+        std::uint64_t Sequence)
+    {
+        std::uint64_t First;
+        std::uint64_t Last;
+        std::memcpy(&First, Data, sizeof(First));
+        std::memcpy(&Last, Data + Size - sizeof(Last), sizeof(Last));
+        return First == Sequence && Last == Sequence;
+    }
+
+    /**
+     * @brief Checks that a registration is refused when its range list does
+     *        not fit into one pipe message, or its size exceeds the ranges,
+     *        and that completions are matched with their indications.
+     */
+    std::uint64_t CheckBuffer()
+    {
+        std::uint64_t Errors = 0;
+        SharedMemory Memory(VmbusRingControlPageSize + 64 * 1024);
+        VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        VmbusRingWriter Writer(Ring);
+
+        // One range of as many pages as the message holds words.
+        const HV_UINT32 PageCount =
+            VMPIPE_MAXIMUM_PIPE_PACKET_SIZE / VmbusGpadlWordSize;
+        std::vector<HV_UINT64> Words(1 + PageCount);
+        VmbusGpaDirectBuilder Builder;
+        Builder.Initialize(Words.data(), static_cast<HV_UINT32>(Words.size()));
+        VmbusGpaFragment Fragment = {};
+        Fragment.Pfn = GuestBasePfn;
+        Fragment.ByteCount = PageCount * VmbusGpadlPageSize;
+        Builder.Append(Fragment);
+        VmbusPipeGpaDirectBuffer Buffer;
+        if (Buffer.Register(
+            Writer,
+            GuestBufferHandle,
+            false,
+            Builder,
+            Fragment.ByteCount) != STATUS_BUFFER_OVERFLOW)
+        {
+            ++Errors;
+        }
+
+        Builder.Reset();
+        Fragment.ByteCount = 4 * VmbusGpadlPageSize;
+        Builder.Append(Fragment);
+        if (Buffer.Register(
+            Writer,
+            GuestBufferHandle,
+            false,
+            Builder,
+            Fragment.ByteCount + 1) != STATUS_INVALID_PARAMETER ||
+            !NT_SUCCESS(Buffer.Register(
+                Writer,
+                GuestBufferHandle,
+                false,
+                Builder,
+                Fragment.ByteCount)))
+        {
+            ++Errors;
+        }
+
+        VmbusPipeGpaDirectIndication First =
+        {
+            GuestBufferHandle,
+            VmbusGpadlPageSize,
+            0
+        };
+        VmbusPipeGpaDirectIndication Second = First;
+        Second.ByteOffset = VmbusGpadlPageSize;
+        VmbusPipeGpaDirectIndication Stray = First;
+        Stray.ByteOffset = 2 * VmbusGpadlPageSize;
+        VmbusPipeGpaDirectIndication Foreign = First;
+        Foreign.Handle = GuestBufferHandle + 1;
+        if (!NT_SUCCESS(Buffer.Indicate(
+            Writer,
+            First.ByteOffset,
+            First.ByteCount)) ||
+            !NT_SUCCESS(Buffer.Indicate(
+                Writer,
+                Second.ByteOffset,
+                Second.ByteCount)) ||
+            Buffer.Complete(Stray) != STATUS_INVALID_DEVICE_STATE ||
+            Buffer.Complete(Foreign) != STATUS_NOT_FOUND ||
+            !NT_SUCCESS(Buffer.Complete(First)) ||
+            Buffer.Complete(First) != STATUS_INVALID_DEVICE_STATE ||
+            Buffer.Outstanding() != 1 ||
+            !NT_SUCCESS(Buffer.Complete(Second)) ||
+            Buffer.Outstanding())
+        {
+            ++Errors;
+        }
+        return Errors;
+    }
+
+    PipeGpaDirectResult MeasureRing(
+        HV_UINT32 TransferSize,
+        std::uint64_t TransferCount)
+    {
+        const HV_UINT32 RingSize = 256 * 1024;
+        SharedMemory Memory(VmbusRingControlPageSize + RingSize);
+        VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        VmbusPipeStreamWriter Writer(Ring);
+        VmbusPipeStreamReader Reader(Ring);
+
+        std::vector<HV_UINT8> Source(TransferSize, 0x5A);
+        std::vector<HV_UINT8> Destination(TransferSize);
+
+        PipeGpaDirectResult Result = {};
+        Stopwatch Watch;
+
+        std::thread Guest([&]()
+        {
+            Backoff Waiter;
+            for (std::uint64_t i = 0; i < TransferCount; ++i)
+            {
+                ::StampTransfer(Source.data(), TransferSize, i);
+                HV_UINT32 Sent = 0;
+                while (Sent < TransferSize)
+                {
+                    HV_UINT32 Written = 0;
+                    Writer.Write(
+                        Source.data() + Sent,
+                        TransferSize - Sent,
+                        &Written);
+                    if (Written)
+                    {
+                        Sent += Written;
+                        Waiter.Reset();
+                    }
+                    else
+                    {
+                        Waiter.Wait();
+                    }
+                }
+            }
+        });
+
+        Backoff Waiter;
+        for (std::uint64_t i = 0; i < TransferCount; ++i)
+        {
+            HV_UINT32 Received = 0;
+            while (Received < TransferSize)
+            {
+                HV_UINT32 Read = 0;
+                NTSTATUS Status = Reader.Read(
+                    Destination.data() + Received,
+                    TransferSize - Received,
+                    &Read);
+                if (Status == STATUS_NO_MORE_ENTRIES)
+                {
+                    Waiter.Wait();
+                    continue;
+                }
+                if (!NT_SUCCESS(Status))
+                {
+                    ++Result.Errors;
+                    break;
+                }
+                Received += Read;
+                Waiter.Reset();
+            }
+            if (!::CheckTransfer(Destination.data(), TransferSize, i))
+            {
+                ++Result.Errors;
+            }
+        }
+
+        Guest.join();
+        Result.MegabytesPerSecond = static_cast<double>(TransferSize)
+            * TransferCount / Watch.Seconds() / (1024.0 * 1024.0);
+        // Every packet carries its descriptor, pipe header and trailer.
+        HV_UINT32 Packets = (TransferSize + VMPIPE_MAXIMUM_PIPE_PACKET_SIZE - 1)
+            / VMPIPE_MAXIMUM_PIPE_PACKET_SIZE;
+        Result.RingBytes = TransferSize
+            + Packets * (VmbusPipePacketOverhead + VmbusRingTrailerSize);
+        return Result;
+    }
+
+    PipeGpaDirectResult MeasureGpaDirect(
+        HV_UINT32 TransferSize,
+        std::uint64_t TransferCount)
+    {
+        const HV_UINT32 RingSize = 256 * 1024;
+        SharedMemory ToHostMemory(VmbusRingControlPageSize + RingSize);
+        SharedMemory ToGuestMemory(VmbusRingControlPageSize + RingSize);
+        VmbusRing ToHostRing =
+            ::Mile::HyperV::Benchmark::CreateRing(ToHostMemory);
+        VmbusRing ToGuestRing =
+            ::Mile::HyperV::Benchmark::CreateRing(ToGuestMemory);
+        VmbusRingWriter GuestWriter(ToHostRing);
+        VmbusRingReader HostReader(ToHostRing);
+        VmbusRingWriter HostWriter(ToGuestRing);
+        VmbusRingReader GuestReader(ToGuestRing);
+
+        // The guest owns two transfer slots in its emulated physical memory,
+        // and the host maps the same pages on its own. Every slot is a
+        // buffer of its own, as the range list of a registration has to fit
+        // into one pipe message.
+        const HV_UINT32 SlotCount = 2;
+        HV_UINT32 SlotPageCount = TransferSize / VmbusGpadlPageSize;
+        HV_UINT32 PageCount = SlotCount * SlotPageCount;
+        VmbusGpaSpaceMapping GuestSpace;
+        VmbusGpaSpaceMapping HostSpace;
+        GuestSpace.Create(GuestBasePfn, PageCount);
+        HostSpace.Open(GuestSpace.FileDescriptor(), GuestBasePfn, PageCount);
+
+        std::vector<HV_UINT64> GuestWords(SlotCount * (1 + SlotPageCount));
+        std::vector<VmbusGpaDirectBuilder> Builders(SlotCount);
+        std::vector<HV_UINT64> HostWords(SlotCount * (1 + SlotPageCount));
+        std::vector<VmbusPipeGpaDirectRegion> Regions(SlotCount);
+        for (HV_UINT32 i = 0; i < SlotCount; ++i)
+        {
+            Builders[i].Initialize(
+                &GuestWords[i * (1 + SlotPageCount)],
+                1 + SlotPageCount);
+            VmbusGpaFragment Fragment = {};
+            GuestSpace.Describe(
+                GuestSpace.Base() + i * TransferSize,
+                TransferSize,
+                Fragment);
+            Builders[i].Append(Fragment);
+            Regions[i].Initialize(
+                &HostWords[i * (1 + SlotPageCount)],
+                1 + SlotPageCount);
+        }
+        VmbusPipeGpaDirectTable Table;
+        Table.Initialize(Regions.data(), SlotCount);
+
+        std::vector<HV_UINT8> Destination(TransferSize);
+
+        PipeGpaDirectResult Result = {};
+        std::uint64_t GuestErrors = 0;
+        Stopwatch Watch;
+
+        std::thread Guest([&]()
+        {
+            Backoff Waiter;
+            std::vector<VmbusPipeGpaDirectBuffer> Buffers(SlotCount);
+            for (HV_UINT32 i = 0; i < SlotCount; ++i)
+            {
+                while (!NT_SUCCESS(Buffers[i].Register(
+                    GuestWriter,
+                    GuestBufferHandle + i,
+                    false,
+                    Builders[i],
+                    TransferSize)))
+                {
+                    Waiter.Wait();
+                }
+            }
+            auto Outstanding = [&]()
+            {
+                HV_UINT32 Count = 0;
+                for (VmbusPipeGpaDirectBuffer const& Buffer : Buffers)
+                {
+                    Count += Buffer.Outstanding();
+                }
+                return Count;
+            };
+
+            auto ReapCompletions = [&]()
+            {
+                return GuestReader.ReadBatch([&](VmbusRingPacket const& Packet)
+                {
+                    VmbusPipeGpaDirectIndication Indication;
+                    if (!NT_SUCCESS(::Mile::HyperV::VmbusPipeReadIndication(
+                        Packet,
+                        Indication)) ||
+                        Indication.Handle - GuestBufferHandle >= SlotCount ||
+                        !NT_SUCCESS(Buffers[
+                            Indication.Handle - GuestBufferHandle].Complete(
+                                Indication)))
+                    {
+                        ++GuestErrors;
+                    }
+                }, SlotCount);
+            };
+
+            for (std::uint64_t i = 0; i < TransferCount; ++i)
+            {
+                while (Outstanding() == SlotCount)
+                {
+                    if (ReapCompletions())
+                    {
+                        Waiter.Reset();
+                    }
+                    else
+                    {
+                        Waiter.Wait();
+                    }
+                }
+
+                // The guest produces the bytes in place, in the slot the host
+                // has given back.
+                HV_UINT32 Slot = static_cast<HV_UINT32>(i % SlotCount);
+                ::StampTransfer(
+                    GuestSpace.Base() + Slot * TransferSize,
+                    TransferSize,
+                    i);
+                while (!NT_SUCCESS(Buffers[Slot].Indicate(
+                    GuestWriter,
+                    0,
+                    TransferSize)))
+                {
+                    Waiter.Wait();
+                }
+            }
+
+            while (Outstanding())
+            {
+                if (!ReapCompletions())
+                {
+                    Waiter.Wait();
+                }
+            }
+            for (VmbusPipeGpaDirectBuffer& Buffer : Buffers)
+            {
+                while (!NT_SUCCESS(Buffer.Teardown(GuestWriter)))
+                {
+                    Waiter.Wait();
+                }
+            }
+        });
+
+        auto MapPage = [&](HV_UINT64 Pfn)
+        {
+            return HostSpace.MapPfn(Pfn);
+        };
+        HV_UINT32 TornDown = 0;
+        std::uint64_t Expected = 0;
+        Backoff Waiter;
+        while (TornDown < SlotCount)
+        {
+            HV_UINT32 Count = HostReader.ReadBatch(
+                [&](VmbusRingPacket const& Packet)
+            {
+                VMPIPE_PROTOCOL_HEADER Header;
+                HV_UINT32 BodyOffset = 0;
+                if (!NT_SUCCESS(::Mile::HyperV::VmbusPipeReadHeader(
+                    Packet,
+                    Header,
+                    &BodyOffset)))
+                {
+                    ++Result.Errors;
+                    return;
+                }
+
+                if (Header.PacketType == VmPipeMessageSetupGpaDirect)
+                {
+                    if (!NT_SUCCESS(Table.Setup(Packet)))
+                    {
+                        ++Result.Errors;
+                    }
+                }
+                else if (Header.PacketType == VmPipeMessageTeardownGpaDirect)
+                {
+                    if (!NT_SUCCESS(Table.Teardown(Packet)))
+                    {
+                        ++Result.Errors;
+                    }
+                    ++TornDown;
+                }
+                else if (Header.PacketType == VmPipeMessageIndicationComplete)
+                {
+                    // Only the steady state messages count, not the setup and
+                    // teardown.
+                    Result.RingBytes += Packet.Size() + VmbusRingTrailerSize;
+                    VmbusPipeGpaDirectIndication Indication;
+                    ::Mile::HyperV::VmbusPipeReadIndication(Packet, Indication);
+                    VmbusPipeGpaDirectRegion* Found =
+                        Table.Find(Indication.Handle);
+                    if (!Found ||
+                        !NT_SUCCESS(Found->Read(
+                            Indication.ByteOffset,
+                            Destination.data(),
+                            Indication.ByteCount,
+                            MapPage)) ||
+                        !::CheckTransfer(
+                            Destination.data(),
+                            Indication.ByteCount,
+                            Expected))
+                    {
+                        ++Result.Errors;
+                    }
+                    ++Expected;
+
+                    // The slot goes back to the guest.
+                    Backoff Retry;
+                    while (!NT_SUCCESS(::Mile::HyperV::VmbusPipeWriteIndication(
+                        HostWriter,
+                        Indication)))
+                    {
+                        Retry.Wait();
+                    }
+                }
+                else
+                {
+                    ++Result.Errors;
+                }
+            }, 16);
+            if (Count)
+            {
+                Waiter.Reset();
+            }
+            else
+            {
+                Waiter.Wait();
+            }
+        }
+
+        Guest.join();
+        Result.MegabytesPerSecond = static_cast<double>(TransferSize)
+            * TransferCount / Watch.Seconds() / (1024.0 * 1024.0);
+        Result.Errors += GuestErrors;
+        if (Expected != TransferCount)
+        {
+            ++Result.Errors;
+        }
+        for (VmbusPipeGpaDirectRegion const& Region : Regions)
+        {
+            if (Region.IsLoaded())
+            {
+                ++Result.Errors;
+            }
+        }
+        Result.RingBytes /= TransferCount;
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunPipeGpaDirect(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const HV_UINT32 TransferSizes[] =
+    {
+        64 * 1024,
+        256 * 1024,
+        1024 * 1024,
+        4 * 1024 * 1024,
+    };
+    const std::uint64_t TotalBytes = 512ull * 1024 * 1024;
+
+    std::printf(
+        "Buffer checks: %llu errors\n",
+        static_cast<unsigned long long>(::CheckBuffer()));
+    std::printf(
+        "%-10s %10s %10s %12s %12s %8s\n",
+        "Mode",
+        "Transfer",
+        "Transfers",
+        "MB/s",
+        "RingBytes",
+        "Errors");
+    for (HV_UINT32 TransferSize : TransferSizes)
+    {
+        std::uint64_t TransferCount = TotalBytes / TransferSize;
+        for (TransferMode Mode :
+            { TransferMode::Ring, TransferMode::GpaDirect })
+        {
+            PipeGpaDirectResult Result = (Mode == TransferMode::Ring)
+                ? ::MeasureRing(TransferSize, TransferCount)
+                : ::MeasureGpaDirect(TransferSize, TransferCount);
+            std::printf(
+                "%-10s %10u %10llu %12.1f %12llu %8llu\n",
+                Mode == TransferMode::Ring ? "Ring" : "GpaDirect",
+                TransferSize,
+                static_cast<unsigned long long>(TransferCount),
+                Result.MegabytesPerSecond,
+                static_cast<unsigned long long>(Result.RingBytes),
+                static_cast<unsigned long long>(Result.Errors));
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+int Mile::HyperV::Benchmark::RunPipeGpaDirect(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf("The emulated GPA space is only implemented on Linux.\n");
+    return 0;
+}
+
+#endif
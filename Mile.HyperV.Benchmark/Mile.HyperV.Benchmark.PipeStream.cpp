@@ -0,0 +1,213 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.PipeStream.cpp
+ * PURPOSE:    Implementation for Mile.HyperV pipe byte stream benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.PipeStream.h>
+
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    struct PipeStreamResult
+    {
+        double MegabytesPerSecond;
+        std::uint64_t Reads;
+        std::uint64_t Errors;
+    };
+
+    HV_UINT8 PatternByte(
+        std::uint64_t Position)
+    {
+        return static_cast<HV_UINT8>(Position ^ (Position >> 11));
+    }
+
+    PipeStreamResult MeasurePipeStream(
+        HV_UINT32 WriteSize,
+        HV_UINT32 ReadSize,
+        HV_UINT32 ReadBufferCount,
+        std::uint64_t TotalBytes)
+    {
+        const HV_UINT32 RingSize = 256 * 1024;
+        SharedMemory Memory(VmbusRingControlPageSize + RingSize);
+        VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        VmbusPipeStreamWriter Writer(Ring);
+        VmbusPipeStreamReader Reader(Ring);
+
+        // The source repeats with a period of 64 KiB plus one page, so every
+        // write starts at a different pattern offset.
+        const HV_UINT32 PatternSize = 64 * 1024 + 4096;
+        std::vector<HV_UINT8> Source(PatternSize + WriteSize);
+        for (std::size_t i = 0; i < Source.size(); ++i)
+        {
+            Source[i] = ::PatternByte(i % PatternSize);
+        }
+
+        Stopwatch Watch;
+
+        std::thread Sender([&]()
+        {
+            Backoff Waiter;
+            std::uint64_t Sent = 0;
+            while (Sent < TotalBytes)
+            {
+                HV_UINT32 Size = WriteSize;
+                if (Size > TotalBytes - Sent)
+                {
+                    Size = static_cast<HV_UINT32>(TotalBytes - Sent);
+                }
+
+                // Gather each write from two pieces, as a caller prepending a
+                // record header would.
+                const HV_UINT8* Start = Source.data() + Sent % PatternSize;
+                VmbusRingSegment Segments[2] =
+                {
+                    { Start, Size / 2 },
+                    { Start + Size / 2, Size - Size / 2 },
+                };
+                HV_UINT32 Written = 0;
+                Writer.Writev(Segments, 2, &Written);
+                if (Written)
+                {
+                    Sent += Written;
+                    Waiter.Reset();
+                }
+                else
+                {
+                    Waiter.Wait();
+                }
+            }
+            while (!NT_SUCCESS(Writer.Shutdown()))
+            {
+                Waiter.Wait();
+            }
+        });
+
+        PipeStreamResult Result = {};
+        std::vector<HV_UINT8> Buffer(ReadSize);
+        std::vector<VmbusPipeBuffer> Pieces(ReadBufferCount);
+        HV_UINT32 PieceSize = ReadSize / ReadBufferCount;
+        for (HV_UINT32 i = 0; i < ReadBufferCount; ++i)
+        {
+            Pieces[i].Buffer = Buffer.data() + i * PieceSize;
+            Pieces[i].Size = (i + 1 == ReadBufferCount)
+                ? ReadSize - i * PieceSize
+                : PieceSize;
+        }
+
+        std::uint64_t Received = 0;
+        Backoff Waiter;
+        for (;;)
+        {
+            HV_UINT32 Read = 0;
+            NTSTATUS Status = Reader.Readv(
+                Pieces.data(),
+                Pieces.size(),
+                &Read);
+            if (Status == STATUS_END_OF_FILE)
+            {
+                break;
+            }
+            if (Status == STATUS_NO_MORE_ENTRIES)
+            {
+                Waiter.Wait();
+                continue;
+            }
+            if (!NT_SUCCESS(Status))
+            {
+                ++Result.Errors;
+                break;
+            }
+            Waiter.Reset();
+            ++Result.Reads;
+
+            // Check the first and last byte of every read, which catches
+            // lost, duplicated and reordered bytes without dominating the
+            // measurement.
+            if (Buffer[0] != ::PatternByte(Received % PatternSize) ||
+                Buffer[Read - 1] !=
+                ::PatternByte((Received + Read - 1) % PatternSize))
+            {
+                ++Result.Errors;
+            }
+            Received += Read;
+        }
+
+        Sender.join();
+        if (Received != TotalBytes)
+        {
+            ++Result.Errors;
+        }
+        Result.MegabytesPerSecond =
+            TotalBytes / Watch.Seconds() / (1024.0 * 1024.0);
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunPipeStream(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    struct PipeStreamLayout
+    {
+        HV_UINT32 WriteSize;
+        HV_UINT32 ReadSize;
+        HV_UINT32 ReadBufferCount;
+    };
+    const PipeStreamLayout Layouts[] =
+    {
+        // Reads smaller than a packet leave it partially consumed.
+        { 64 * 1024, 1500, 1 },
+        { 64 * 1024, 4096, 1 },
+        // Reads matching the packet size.
+        { 64 * 1024, 16384, 1 },
+        { 64 * 1024, 16384, 4 },
+        // Reads spanning several packets.
+        { 64 * 1024, 64 * 1024, 1 },
+        { 64 * 1024, 64 * 1024, 16 },
+        // Writes smaller than a packet.
+        { 1024, 64 * 1024, 1 },
+        { 4096, 64 * 1024, 1 },
+    };
+    const std::uint64_t TotalBytes = 1024ull * 1024 * 1024;
+
+    std::printf(
+        "%10s %10s %8s %12s %12s %8s\n",
+        "WriteSize",
+        "ReadSize",
+        "Buffers",
+        "MB/s",
+        "Reads",
+        "Errors");
+    for (PipeStreamLayout const& Layout : Layouts)
+    {
+        PipeStreamResult Result = ::MeasurePipeStream(
+            Layout.WriteSize,
+            Layout.ReadSize,
+            Layout.ReadBufferCount,
+            TotalBytes);
+        std::printf(
+            "%10u %10u %8u %12.1f %12llu %8llu\n",
+            Layout.WriteSize,
+            Layout.ReadSize,
+            Layout.ReadBufferCount,
+            Result.MegabytesPerSecond,
+            static_cast<unsigned long long>(Result.Reads),
+            static_cast<unsigned long long>(Result.Errors));
+    }
+
+    return 0;
+}
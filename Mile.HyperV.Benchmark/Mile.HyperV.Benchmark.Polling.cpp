@@ -0,0 +1,173 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.Polling.cpp
+ * PURPOSE:    Implementation for Mile.HyperV hybrid polling benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.Polling.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    struct PollingResult
+    {
+        double ReceiverCpuPercent;
+        std::uint64_t P50;
+        std::uint64_t P99;
+        VmbusRingPollCounters Counters;
+        std::chrono::nanoseconds FinalWindow;
+    };
+
+    PollingResult MeasurePolling(
+        std::chrono::nanoseconds PollWindow,
+        std::chrono::nanoseconds MaximumPollWindow,
+        std::chrono::microseconds Interval,
+        std::uint64_t PacketCount)
+    {
+        const HV_UINT32 RingSize = 64 * 1024;
+        SharedMemory Memory(VmbusRingControlPageSize + RingSize);
+        VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        VmbusRingWriter Writer(Ring);
+        VmbusRingReader Reader(Ring);
+        VmbusRingPoller Poller(Reader, PollWindow, MaximumPollWindow);
+        SignalEvent ReaderEvent;
+
+        std::vector<std::uint64_t> Latencies;
+        Latencies.reserve(static_cast<std::size_t>(PacketCount));
+
+        // The sender paces packets at a moderate rate, which is where the
+        // signal round trip dominates the latency.
+        std::thread Sender([&]()
+        {
+            std::chrono::steady_clock::time_point Next =
+                std::chrono::steady_clock::now();
+            for (std::uint64_t i = 0; i < PacketCount; ++i)
+            {
+                Next += Interval;
+                std::this_thread::sleep_until(Next);
+                std::uint64_t Timestamp =
+                    ::Mile::HyperV::Benchmark::TimestampNanoseconds();
+                bool Signal = false;
+                while (!NT_SUCCESS(Writer.Write(
+                    VmbusPacketTypeDataInBand,
+                    0,
+                    i,
+                    &Timestamp,
+                    sizeof(Timestamp),
+                    &Signal)))
+                {
+                    std::this_thread::yield();
+                }
+                if (Signal)
+                {
+                    ReaderEvent.Set();
+                }
+            }
+        });
+
+        PollingResult Result = {};
+        Stopwatch Watch;
+        double CpuStart = ::Mile::HyperV::Benchmark::ThreadCpuSeconds();
+        std::uint64_t Received = 0;
+        while (Received < PacketCount)
+        {
+            HV_UINT32 Count = 0;
+            Poller.Receive([&](VmbusRingPacket const& Packet)
+            {
+                std::uint64_t Timestamp;
+                Packet.CopyPayload(&Timestamp, sizeof(Timestamp));
+                Latencies.push_back(
+                    ::Mile::HyperV::Benchmark::TimestampNanoseconds()
+                    - Timestamp);
+            }, [&]() -> bool
+            {
+                ReaderEvent.Wait(std::chrono::milliseconds(100));
+                return true;
+            }, 64, &Count);
+            Received += Count;
+        }
+        Result.ReceiverCpuPercent = 100.0
+            * (::Mile::HyperV::Benchmark::ThreadCpuSeconds() - CpuStart)
+            / Watch.Seconds();
+        Sender.join();
+
+        std::sort(Latencies.begin(), Latencies.end());
+        Result.P50 = Latencies[Latencies.size() / 2];
+        Result.P99 = Latencies[Latencies.size() * 99 / 100];
+        Result.Counters = Poller.Counters();
+        Result.FinalWindow = Poller.PollWindow();
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunPolling(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    struct PollingMode
+    {
+        const char* Name;
+        std::chrono::nanoseconds PollWindow;
+        std::chrono::nanoseconds MaximumPollWindow;
+    };
+    const PollingMode Modes[] =
+    {
+        { "Interrupt", std::chrono::nanoseconds::zero(), {} },
+        { "Poll5us", std::chrono::microseconds(5), {} },
+        { "Poll50us", std::chrono::microseconds(50), {} },
+        { "Poll200us", std::chrono::microseconds(200), {} },
+        { "Poll1ms", std::chrono::milliseconds(1), {} },
+        {
+            "Adaptive",
+            std::chrono::nanoseconds::zero(),
+            std::chrono::milliseconds(1)
+        },
+    };
+    const std::chrono::microseconds Interval(100);
+    const std::uint64_t PacketCount = 5000;
+
+    std::printf(
+        "%-10s %10s %10s %8s %12s %10s %10s %10s\n",
+        "Mode",
+        "P50(ns)",
+        "P99(ns)",
+        "CpuPct",
+        "Polls",
+        "Avoided",
+        "Wakeups",
+        "Window(ns)");
+    for (PollingMode const& Mode : Modes)
+    {
+        PollingResult Result = ::MeasurePolling(
+            Mode.PollWindow,
+            Mode.MaximumPollWindow,
+            Interval,
+            PacketCount);
+        std::printf(
+            "%-10s %10llu %10llu %7.1f%% %12llu %10llu %10llu %10lld\n",
+            Mode.Name,
+            static_cast<unsigned long long>(Result.P50),
+            static_cast<unsigned long long>(Result.P99),
+            Result.ReceiverCpuPercent,
+            static_cast<unsigned long long>(Result.Counters.Polls),
+            static_cast<unsigned long long>(Result.Counters.InterruptsAvoided),
+            static_cast<unsigned long long>(Result.Counters.Wakeups),
+            static_cast<long long>(Result.FinalWindow.count()));
+    }
+
+    return 0;
+}
@@ -0,0 +1,603 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.Servicing.cpp
+ * PURPOSE:    Implementation for Mile.HyperV servicing benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.HostEmulator.h>
+#include <Mile.HyperV.VMBus.Servicing.h>
+
+#include <atomic>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    const std::size_t RingSize = 64 * 1024;
+
+    /**
+     * @brief The control messages of a guest and the host emulator, which
+     *        answers every message as soon as it is posted.
+     */
+    class ControlPath
+    {
+    private:
+
+        std::vector<HV_MESSAGE> m_ToHostSlots;
+        std::vector<HV_MESSAGE> m_ToGuestSlots;
+        std::vector<VmbusHostChannel> m_Channels;
+        std::vector<VmbusHostGpadl> m_Gpadls;
+        std::vector<HV_UINT64> m_Words;
+
+    public:
+
+        VmbusSynicMessageQueue ToHost;
+        VmbusSynicMessageQueue ToGuest;
+        VmbusHostEmulator Host;
+        std::uint64_t Errors = 0;
+
+        ControlPath() :
+            m_ToHostSlots(16),
+            m_ToGuestSlots(16),
+            m_Channels(4),
+            m_Gpadls(1),
+            m_Words(8)
+        {
+            ToHost.Initialize(m_ToHostSlots.data(), 16);
+            ToGuest.Initialize(m_ToGuestSlots.data(), 16);
+            Host.Initialize(
+                &ToHost,
+                &ToGuest,
+                m_Channels.data(),
+                static_cast<HV_UINT32>(m_Channels.size()),
+                m_Gpadls.data(),
+                1,
+                m_Words.data(),
+                8);
+        }
+
+        static NTSTATUS OnEvent(
+            VmbusHostEvent,
+            VmbusHostChannel&)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Posts a message to the host and lets it run.
+         */
+        NTSTATUS Send(
+            const void* Message,
+            HV_UINT32 MessageSize)
+        {
+            NTSTATUS Status = ToHost.Post(
+                static_cast<HV_MESSAGE_TYPE>(VMBUS_MESSAGE_TYPE),
+                Message,
+                MessageSize);
+            if (NT_SUCCESS(Status))
+            {
+                Host.Process(ControlPath::OnEvent);
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Receives the next message of the host.
+         * @return The channel message type, or ChannelMessageInvalid.
+         */
+        HV_UINT32 Receive()
+        {
+            HV_MESSAGE Message;
+            VMBUS_CHANNEL_MESSAGE_HEADER Header = {};
+            if (!NT_SUCCESS(ToGuest.Receive(Message)) ||
+                Message.Header.PayloadSize < sizeof(Header))
+            {
+                return ChannelMessageInvalid;
+            }
+            std::memcpy(&Header, Message.Payload, sizeof(Header));
+            return Header.MessageType;
+        }
+
+        /**
+         * @brief Negotiates VMBUS_VERSION_COPPER.
+         * @param FeatureFlags The features the guest asks for.
+         * @return The features the host granted.
+         */
+        HV_UINT32 Connect(
+            HV_UINT32 FeatureFlags)
+        {
+            VMBUS_CHANNEL_INITIATE_CONTACT Contact = {};
+            Contact.Header.MessageType = ChannelMessageInitiateContact;
+            Contact.VMBusVersionRequested = VMBUS_VERSION_COPPER;
+            Contact.FeatureFlags = FeatureFlags;
+            this->Send(&Contact, sizeof(Contact));
+            HV_MESSAGE Message;
+            VMBUS_CHANNEL_VERSION_RESPONSE Response = {};
+            if (!NT_SUCCESS(ToGuest.Receive(Message)))
+            {
+                ++Errors;
+                return 0;
+            }
+            std::memcpy(&Response, Message.Payload, sizeof(Response));
+            if (Response.Header.MessageType != ChannelMessageVersionResponse ||
+                !Response.VersionSupported)
+            {
+                ++Errors;
+            }
+            VMBUS_CHANNEL_REQUEST_OFFERS Request = {};
+            Request.MessageType = ChannelMessageRequestOffers;
+            this->Send(&Request, sizeof(Request));
+            if (this->Receive() != ChannelMessageAllOffersDelivered)
+            {
+                ++Errors;
+            }
+            return Response.SupportedFeatures;
+        }
+    };
+
+    /**
+     * @brief Checks the pause protocol of the controller and the host
+     *        emulator.
+     * @return The number of failed checks.
+     */
+    std::uint64_t CheckServicing()
+    {
+        std::uint64_t Errors = 0;
+        auto Now = []() -> HV_UINT64
+        {
+            return ::Mile::HyperV::Benchmark::TimestampNanoseconds();
+        };
+
+        // Without VMBUS_FEATURE_FLAG_PAUSE_RESUME nothing is paused.
+        {
+            ControlPath Control;
+            HV_UINT32 Granted = Control.Connect(0);
+            VmbusServicingChannel Channel = {};
+            VmbusServicingController Controller;
+            Controller.Initialize(&Channel, 1, Granted);
+            auto Send = [&](const void* Message, HV_UINT32 Size)
+            {
+                return Control.Send(Message, Size);
+            };
+            if (Controller.Pause(Send, Now) != STATUS_NOT_SUPPORTED ||
+                Channel.Gate.IsClosed())
+            {
+                ++Errors;
+            }
+            VMBUS_CHANNEL_PAUSE Pause = {};
+            Pause.MessageType = ChannelMessagePause;
+            Control.Send(&Pause, sizeof(Pause));
+            if (Control.Host.IsPaused() ||
+                Control.Host.ProtocolErrors() != 1 ||
+                Control.Errors)
+            {
+                ++Errors;
+            }
+        }
+
+        // A resume retried after a failed Send counts a violation once.
+        {
+            ControlPath Control;
+            HV_UINT32 Granted = Control.Connect(
+                VMBUS_FEATURE_FLAG_PAUSE_RESUME);
+            SharedMemory Memory(VmbusRingControlPageSize + 4096);
+            VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+            VmbusServicingChannel Channel = {};
+            Channel.Outbound = &Ring;
+            VmbusServicingController Controller;
+            Controller.Initialize(&Channel, 1, Granted);
+            auto Send = [&](const void* Message, HV_UINT32 Size)
+            {
+                return Control.Send(Message, Size);
+            };
+            auto FailingSend = [](const void*, HV_UINT32) -> NTSTATUS
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            };
+            if (!NT_SUCCESS(Controller.Pause(Send, Now)) ||
+                Control.Receive() != ChannelMessagePauseResponse ||
+                !NT_SUCCESS(Controller.OnPauseResponse()) ||
+                Controller.Poll(Now) != STATUS_SUCCESS)
+            {
+                ++Errors;
+            }
+            // A write which bypassed the closed gate moves the ring.
+            HV_UINT64 Payload = 0;
+            VmbusRingWriter Writer(Ring);
+            if (!NT_SUCCESS(Writer.Write(
+                VmbusPacketTypeDataInBand,
+                0,
+                0,
+                &Payload,
+                sizeof(Payload))) ||
+                Controller.Resume(FailingSend, Now) !=
+                STATUS_INSUFFICIENT_RESOURCES ||
+                Controller.Metrics().Violations ||
+                !Channel.Gate.IsClosed() ||
+                !NT_SUCCESS(Controller.Resume(Send, Now)) ||
+                Controller.Metrics().Violations != 1 ||
+                Control.Host.IsPaused() ||
+                Control.Host.ProtocolErrors() ||
+                Control.Errors)
+            {
+                ++Errors;
+            }
+        }
+
+        // Offers wait for the resume, and transactions in flight are kept.
+        ControlPath Control;
+        HV_UINT32 Granted = Control.Connect(VMBUS_FEATURE_FLAG_PAUSE_RESUME);
+        std::vector<VmbusTransactionSlot> Slots(8);
+        VmbusTransactionTable Transactions;
+        Transactions.Initialize(Slots.data(), 8);
+        HV_UINT64 Pending[2] = {};
+        Transactions.Allocate(nullptr, 0, &Pending[0]);
+        Transactions.Allocate(nullptr, 0, &Pending[1]);
+        HV_UINT64 InFlight[8] = {};
+        VmbusServicingChannel Channel = {};
+        Channel.Transactions = &Transactions;
+        Channel.InFlight = InFlight;
+        Channel.InFlightCapacity = 8;
+        VmbusServicingController Controller;
+        Controller.Initialize(&Channel, 1, Granted);
+        auto Send = [&](const void* Message, HV_UINT32 Size)
+        {
+            return Control.Send(Message, Size);
+        };
+
+        if (!(Granted & VMBUS_FEATURE_FLAG_PAUSE_RESUME) ||
+            !Channel.Gate.TryEnter() ||
+            !NT_SUCCESS(Controller.Pause(Send, Now)) ||
+            Channel.Gate.TryEnter() ||
+            !Control.Host.IsPaused() ||
+            Control.Receive() != ChannelMessagePauseResponse ||
+            !NT_SUCCESS(Controller.OnPauseResponse()) ||
+            Controller.Poll(Now) != STATUS_PENDING)
+        {
+            ++Errors;
+        }
+        // The submission which entered before the pause still completes it.
+        Channel.Gate.Leave();
+        HV_UINT32 ChildRelId = 0;
+        HV_GUID InterfaceType = {};
+        HV_GUID InterfaceInstance = {};
+        if (Controller.Poll(Now) != STATUS_SUCCESS ||
+            Channel.InFlightCount != 2 ||
+            InFlight[0] != Pending[0] ||
+            InFlight[1] != Pending[1] ||
+            Channel.Gate.Deferred() != 1 ||
+            Control.Host.Offer(
+                InterfaceType,
+                InterfaceInstance,
+                0,
+                0,
+                nullptr,
+                &ChildRelId) != STATUS_DEVICE_BUSY ||
+            !NT_SUCCESS(Controller.Resume(Send, Now)) ||
+            Control.Host.IsPaused() ||
+            !Channel.Gate.TryEnter() ||
+            !NT_SUCCESS(Control.Host.Offer(
+                InterfaceType,
+                InterfaceInstance,
+                0,
+                0,
+                nullptr,
+                &ChildRelId)) ||
+            Control.Receive() != ChannelMessageOfferChannel ||
+            Controller.Metrics().Pauses != 1 ||
+            Controller.Metrics().Violations ||
+            Control.Host.ProtocolErrors() ||
+            Control.Errors)
+        {
+            ++Errors;
+        }
+        Channel.Gate.Leave();
+        return Errors;
+    }
+
+    struct ServicingResult
+    {
+        double PauseMicroseconds;
+        double MaximumPauseMicroseconds;
+        double ResumeMicroseconds;
+        double MaximumResumeMicroseconds;
+        double PacketsPerSecond;
+        double InFlightPerPause;
+        std::uint64_t Deferred;
+        std::uint64_t Errors;
+    };
+
+    /**
+     * @brief Streams requests through a gated channel to a host thread which
+     *        completes them, while the control plane pauses and resumes.
+     * @param Cycles The number of pause and resume cycles.
+     * @param HoldMicroseconds How long every pause lasts.
+     */
+    ServicingResult MeasureServicing(
+        std::uint32_t Cycles,
+        std::uint32_t HoldMicroseconds)
+    {
+        ServicingResult Result = {};
+
+        SharedMemory RequestMemory(RingSize);
+        SharedMemory CompletionMemory(RingSize);
+        VmbusRing RequestRing =
+            ::Mile::HyperV::Benchmark::CreateRing(RequestMemory);
+        VmbusRing CompletionRing =
+            ::Mile::HyperV::Benchmark::CreateRing(CompletionMemory);
+
+        std::vector<VmbusTransactionSlot> Slots(64);
+        VmbusTransactionTable Transactions;
+        Transactions.Initialize(Slots.data(), 64);
+        std::vector<HV_UINT64> InFlight(64);
+        VmbusServicingChannel Channel = {};
+        Channel.Outbound = &RequestRing;
+        Channel.Transactions = &Transactions;
+        Channel.InFlight = InFlight.data();
+        Channel.InFlightCapacity = 64;
+
+        ControlPath Control;
+        VmbusServicingController Controller;
+        Controller.Initialize(
+            &Channel,
+            1,
+            Control.Connect(VMBUS_FEATURE_FLAG_PAUSE_RESUME));
+
+        std::atomic<bool> Stop = false;
+        std::atomic<std::uint64_t> Completed = 0;
+        std::uint64_t Sent = 0;
+        std::uint64_t Received = 0;
+        std::uint64_t HostErrors = 0;
+
+        // The host consumes the requests in order and completes them.
+        std::thread HostThread([&]()
+        {
+            VmbusRingReader Reader(RequestRing);
+            VmbusRingWriter Writer(CompletionRing);
+            Backoff Wait;
+            HV_UINT8 Buffer[64];
+            for (;;)
+            {
+                if (!NT_SUCCESS(Reader.Read(Buffer, sizeof(Buffer))))
+                {
+                    if (Stop.load(std::memory_order_acquire) &&
+                        !Reader.BytesAvailable())
+                    {
+                        break;
+                    }
+                    Wait.Wait();
+                    continue;
+                }
+                Wait.Reset();
+                VMPACKET_DESCRIPTOR Descriptor;
+                std::uint64_t Sequence = 0;
+                std::memcpy(&Descriptor, Buffer, sizeof(Descriptor));
+                std::memcpy(
+                    &Sequence,
+                    Buffer + Descriptor.DataOffset8 * 8,
+                    sizeof(Sequence));
+                if (Sequence != Received)
+                {
+                    ++HostErrors;
+                }
+                Received = Sequence + 1;
+                while (!NT_SUCCESS(Writer.Write(
+                    VmbusPacketTypeCompletion,
+                    0,
+                    Descriptor.TransactionId,
+                    nullptr,
+                    0)))
+                {
+                    Wait.Wait();
+                }
+            }
+        });
+
+        // The guest submits requests whenever the gate lets it, and keeps
+        // the request it could not submit for the next attempt.
+        auto OnCompletion = [](
+            void* Context,
+            HV_UINT64,
+            VmbusTransactionResult const&)
+        {
+            static_cast<std::atomic<std::uint64_t>*>(Context)->fetch_add(
+                1,
+                std::memory_order_relaxed);
+        };
+        std::thread GuestThread([&]()
+        {
+            VmbusRingWriter Writer(RequestRing);
+            VmbusRingReader Reader(CompletionRing);
+            Backoff Wait;
+            HV_UINT8 Buffer[64];
+            while (!Stop.load(std::memory_order_acquire))
+            {
+                while (NT_SUCCESS(Reader.Read(Buffer, sizeof(Buffer))))
+                {
+                    VMPACKET_DESCRIPTOR Descriptor;
+                    std::memcpy(&Descriptor, Buffer, sizeof(Descriptor));
+                    Transactions.Complete(
+                        Descriptor.TransactionId,
+                        STATUS_SUCCESS,
+                        nullptr,
+                        0);
+                }
+                if (!Channel.Gate.TryEnter())
+                {
+                    Wait.Wait();
+                    continue;
+                }
+                HV_UINT64 TransactionId = 0;
+                bool Written = false;
+                if (NT_SUCCESS(Transactions.Allocate(
+                    nullptr,
+                    0,
+                    OnCompletion,
+                    &Completed,
+                    &TransactionId)))
+                {
+                    Written = NT_SUCCESS(Writer.Write(
+                        VmbusPacketTypeDataInBand,
+                        VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED,
+                        TransactionId,
+                        &Sent,
+                        sizeof(Sent)));
+                    if (!Written)
+                    {
+                        Transactions.Release(TransactionId);
+                    }
+                }
+                Channel.Gate.Leave();
+                if (Written)
+                {
+                    ++Sent;
+                    Wait.Reset();
+                }
+                else
+                {
+                    Wait.Wait();
+                }
+            }
+            // Collect the completions of the requests still in flight.
+            while (Transactions.Snapshot(nullptr, 0))
+            {
+                if (NT_SUCCESS(Reader.Read(Buffer, sizeof(Buffer))))
+                {
+                    VMPACKET_DESCRIPTOR Descriptor;
+                    std::memcpy(&Descriptor, Buffer, sizeof(Descriptor));
+                    Transactions.Complete(
+                        Descriptor.TransactionId,
+                        STATUS_SUCCESS,
+                        nullptr,
+                        0);
+                }
+                else
+                {
+                    Wait.Wait();
+                }
+            }
+        });
+
+        auto Now = []() -> HV_UINT64
+        {
+            return ::Mile::HyperV::Benchmark::TimestampNanoseconds();
+        };
+        auto Send = [&](const void* Message, HV_UINT32 Size)
+        {
+            return Control.Send(Message, Size);
+        };
+        std::uint64_t InFlightTotal = 0;
+        Stopwatch Watch;
+        for (std::uint32_t Cycle = 0; Cycle < Cycles; ++Cycle)
+        {
+            // Let the traffic flow between the pauses.
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+            if (!NT_SUCCESS(Controller.Pause(Send, Now)) ||
+                Control.Receive() != ChannelMessagePauseResponse ||
+                !NT_SUCCESS(Controller.OnPauseResponse()))
+            {
+                ++Result.Errors;
+                break;
+            }
+            Backoff Wait;
+            while (Controller.Poll(Now) == STATUS_PENDING)
+            {
+                Wait.Wait();
+            }
+            InFlightTotal += Channel.InFlightCount;
+
+            std::uint64_t HoldUntil = Now() + HoldMicroseconds * 1000ULL;
+            while (Now() < HoldUntil)
+            {
+                std::this_thread::yield();
+            }
+
+            if (!NT_SUCCESS(Controller.Resume(Send, Now)))
+            {
+                ++Result.Errors;
+                break;
+            }
+        }
+        double Seconds = Watch.Seconds();
+        Stop.store(true, std::memory_order_release);
+        GuestThread.join();
+        HostThread.join();
+
+        VmbusServicingMetrics const& Metrics = Controller.Metrics();
+        if (Metrics.Pauses)
+        {
+            Result.PauseMicroseconds =
+                Metrics.TotalPauseLatency / 1e3 / Metrics.Pauses;
+            Result.ResumeMicroseconds =
+                Metrics.TotalResumeLatency / 1e3 / Metrics.Pauses;
+            Result.InFlightPerPause =
+                static_cast<double>(InFlightTotal) / Metrics.Pauses;
+        }
+        Result.MaximumPauseMicroseconds = Metrics.MaximumPauseLatency / 1e3;
+        Result.MaximumResumeMicroseconds = Metrics.MaximumResumeLatency / 1e3;
+        Result.PacketsPerSecond = Sent / Seconds;
+        Result.Deferred = Channel.Gate.Deferred();
+        // Every request arrives once and in order, and is completed once.
+        Result.Errors += HostErrors + Metrics.Violations + Control.Errors;
+        if (Received != Sent ||
+            Completed.load(std::memory_order_relaxed) != Sent ||
+            Metrics.Pauses != Cycles ||
+            Control.Host.ProtocolErrors())
+        {
+            ++Result.Errors;
+        }
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunServicing(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const std::uint32_t HoldTimes[] = { 0, 100, 1000 };
+    const std::uint32_t Cycles = 200;
+
+    std::printf(
+        "Checks: %llu errors\n",
+        static_cast<unsigned long long>(::CheckServicing()));
+    std::printf(
+        "%8s %10s %10s %10s %10s %12s %8s %10s %8s\n",
+        "Hold(us)",
+        "Pause(us)",
+        "Max(us)",
+        "Resume(us)",
+        "Max(us)",
+        "Packets/s",
+        "InFlight",
+        "Deferred",
+        "Errors");
+    for (std::uint32_t HoldTime : HoldTimes)
+    {
+        ServicingResult Result = ::MeasureServicing(Cycles, HoldTime);
+        std::printf(
+            "%8u %10.1f %10.1f %10.1f %10.1f %12.0f %8.1f %10llu %8llu\n",
+            HoldTime,
+            Result.PauseMicroseconds,
+            Result.MaximumPauseMicroseconds,
+            Result.ResumeMicroseconds,
+            Result.MaximumResumeMicroseconds,
+            Result.PacketsPerSecond,
+            Result.InFlightPerPause,
+            static_cast<unsigned long long>(Result.Deferred),
+            static_cast<unsigned long long>(Result.Errors));
+    }
+
+    return 0;
+}
@@ -0,0 +1,394 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.Sweep.cpp
+ * PURPOSE:    Implementation for Mile.HyperV ring throughput and latency sweep
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    enum class OutputFormat
+    {
+        Text,
+        Csv,
+        Json,
+    };
+
+    struct SweepOptions
+    {
+        OutputFormat Format = OutputFormat::Text;
+        std::uint64_t MaximumPackets = 100000;
+        std::uint32_t WriterProcessor = 0;
+        std::uint32_t ReaderProcessor = 1;
+    };
+
+    struct SweepResult
+    {
+        HV_UINT32 PayloadSize;
+        HV_UINT32 RingSize;
+        HV_UINT32 BatchSize;
+        std::uint64_t PacketCount;
+        double Seconds;
+        std::uint64_t P50;
+        std::uint64_t P99;
+        std::uint64_t P999;
+    };
+
+    bool ParseOptions(
+        int argc,
+        char* argv[],
+        SweepOptions& Options)
+    {
+        for (int i = 0; i < argc; ++i)
+        {
+            const char* Name = argv[i];
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            const char* Value = argv[++i];
+
+            if (0 == std::strcmp(Name, "--format"))
+            {
+                if (0 == std::strcmp(Value, "text"))
+                {
+                    Options.Format = OutputFormat::Text;
+                }
+                else if (0 == std::strcmp(Value, "csv"))
+                {
+                    Options.Format = OutputFormat::Csv;
+                }
+                else if (0 == std::strcmp(Value, "json"))
+                {
+                    Options.Format = OutputFormat::Json;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            else if (0 == std::strcmp(Name, "--packets"))
+            {
+                Options.MaximumPackets = std::strtoull(Value, nullptr, 10);
+                if (!Options.MaximumPackets)
+                {
+                    return false;
+                }
+            }
+            else if (0 == std::strcmp(Name, "--writer-cpu"))
+            {
+                Options.WriterProcessor = static_cast<std::uint32_t>(
+                    std::strtoul(Value, nullptr, 10));
+            }
+            else if (0 == std::strcmp(Name, "--reader-cpu"))
+            {
+                Options.ReaderProcessor = static_cast<std::uint32_t>(
+                    std::strtoul(Value, nullptr, 10));
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::uint64_t Percentile(
+        std::vector<std::uint64_t> const& Sorted,
+        double Fraction)
+    {
+        if (Sorted.empty())
+        {
+            return 0;
+        }
+        std::size_t Index = static_cast<std::size_t>(
+            Fraction * static_cast<double>(Sorted.size() - 1) + 0.5);
+        return Sorted[Index];
+    }
+
+    SweepResult MeasureSweep(
+        SweepOptions const& Options,
+        HV_UINT32 PayloadSize,
+        HV_UINT32 RingSize,
+        HV_UINT32 BatchSize,
+        std::uint64_t PacketCount)
+    {
+        SharedMemory Memory(VmbusRingControlPageSize + RingSize);
+        VmbusRing Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        VmbusRingWriter Writer(Ring);
+        VmbusRingReader Reader(Ring);
+
+        std::vector<HV_UINT8> Payload(PayloadSize, 0x96);
+        std::vector<HV_UINT8> Buffer(PayloadSize);
+        std::vector<std::uint64_t> Latencies;
+        Latencies.reserve(static_cast<std::size_t>(PacketCount));
+
+        SweepResult Result = {};
+        Result.PayloadSize = PayloadSize;
+        Result.RingSize = RingSize;
+        Result.BatchSize = BatchSize;
+        Result.PacketCount = PacketCount;
+
+        Stopwatch Watch;
+
+        std::thread Producer([&]()
+        {
+            ::Mile::HyperV::Benchmark::PinCurrentThread(
+                Options.WriterProcessor);
+            Backoff Waiter;
+            for (std::uint64_t i = 0; i < PacketCount;)
+            {
+                // Every payload starts with the time it was published, so
+                // the reader can measure how long it waited in the ring.
+                std::uint64_t Timestamp =
+                    ::Mile::HyperV::Benchmark::TimestampNanoseconds();
+                std::memcpy(Payload.data(), &Timestamp, sizeof(Timestamp));
+                if (NT_SUCCESS(Writer.Write(
+                    VmbusPacketTypeDataInBand,
+                    0,
+                    i,
+                    Payload.data(),
+                    PayloadSize)))
+                {
+                    Waiter.Reset();
+                    ++i;
+                }
+                else
+                {
+                    Waiter.Wait();
+                }
+            }
+        });
+
+        std::thread Consumer([&]()
+        {
+            ::Mile::HyperV::Benchmark::PinCurrentThread(
+                Options.ReaderProcessor);
+            std::uint64_t Consumed = 0;
+            Backoff Waiter;
+            while (Consumed < PacketCount)
+            {
+                HV_UINT32 Count = 0;
+                Reader.ReadBatch([&](VmbusRingPacket const& Packet)
+                {
+                    Packet.CopyPayload(
+                        Buffer.data(),
+                        static_cast<HV_UINT32>(Buffer.size()));
+                    std::uint64_t Timestamp;
+                    std::memcpy(&Timestamp, Buffer.data(), sizeof(Timestamp));
+                    Latencies.push_back(
+                        ::Mile::HyperV::Benchmark::TimestampNanoseconds()
+                        - Timestamp);
+                }, BatchSize, 0xFFFFFFFF, &Count);
+
+                if (Count)
+                {
+                    Consumed += Count;
+                    Waiter.Reset();
+                }
+                else
+                {
+                    Waiter.Wait();
+                }
+            }
+        });
+
+        Producer.join();
+        Consumer.join();
+        Result.Seconds = Watch.Seconds();
+
+        std::sort(Latencies.begin(), Latencies.end());
+        Result.P50 = ::Percentile(Latencies, 0.5);
+        Result.P99 = ::Percentile(Latencies, 0.99);
+        Result.P999 = ::Percentile(Latencies, 0.999);
+        return Result;
+    }
+
+    void PrintHeader(
+        SweepOptions const& Options)
+    {
+        switch (Options.Format)
+        {
+        case OutputFormat::Csv:
+            std::printf(
+                "payload_bytes,ring_bytes,batch_packets,packets,seconds,"
+                "packets_per_second,gigabytes_per_second,"
+                "p50_ns,p99_ns,p999_ns\n");
+            break;
+        case OutputFormat::Json:
+            std::printf(
+                "{\n"
+                "  \"scenario\": \"sweep\",\n"
+                "  \"writer_cpu\": %u,\n"
+                "  \"reader_cpu\": %u,\n"
+                "  \"results\": [",
+                Options.WriterProcessor,
+                Options.ReaderProcessor);
+            break;
+        default:
+            std::printf(
+                "%8s %8s %6s %10s %12s %8s %10s %10s %10s\n",
+                "Payload",
+                "Ring",
+                "Batch",
+                "Packets",
+                "Packets/s",
+                "GB/s",
+                "P50(ns)",
+                "P99(ns)",
+                "P999(ns)");
+            break;
+        }
+    }
+
+    void PrintResult(
+        SweepOptions const& Options,
+        SweepResult const& Result,
+        bool First)
+    {
+        double PacketsPerSecond = Result.PacketCount / Result.Seconds;
+        double GigabytesPerSecond =
+            PacketsPerSecond * Result.PayloadSize / 1e9;
+        switch (Options.Format)
+        {
+        case OutputFormat::Csv:
+            std::printf(
+                "%u,%u,%u,%llu,%.6f,%.0f,%.4f,%llu,%llu,%llu\n",
+                Result.PayloadSize,
+                Result.RingSize,
+                Result.BatchSize,
+                static_cast<unsigned long long>(Result.PacketCount),
+                Result.Seconds,
+                PacketsPerSecond,
+                GigabytesPerSecond,
+                static_cast<unsigned long long>(Result.P50),
+                static_cast<unsigned long long>(Result.P99),
+                static_cast<unsigned long long>(Result.P999));
+            break;
+        case OutputFormat::Json:
+            std::printf(
+                "%s\n"
+                "    {"
+                " \"payload_bytes\": %u,"
+                " \"ring_bytes\": %u,"
+                " \"batch_packets\": %u,"
+                " \"packets\": %llu,"
+                " \"seconds\": %.6f,"
+                " \"packets_per_second\": %.0f,"
+                " \"gigabytes_per_second\": %.4f,"
+                " \"p50_ns\": %llu,"
+                " \"p99_ns\": %llu,"
+                " \"p999_ns\": %llu }",
+                First ? "" : ",",
+                Result.PayloadSize,
+                Result.RingSize,
+                Result.BatchSize,
+                static_cast<unsigned long long>(Result.PacketCount),
+                Result.Seconds,
+                PacketsPerSecond,
+                GigabytesPerSecond,
+                static_cast<unsigned long long>(Result.P50),
+                static_cast<unsigned long long>(Result.P99),
+                static_cast<unsigned long long>(Result.P999));
+            break;
+        default:
+            std::printf(
+                "%8u %8u %6u %10llu %12.0f %8.3f %10llu %10llu %10llu\n",
+                Result.PayloadSize,
+                Result.RingSize,
+                Result.BatchSize,
+                static_cast<unsigned long long>(Result.PacketCount),
+                PacketsPerSecond,
+                GigabytesPerSecond,
+                static_cast<unsigned long long>(Result.P50),
+                static_cast<unsigned long long>(Result.P99),
+                static_cast<unsigned long long>(Result.P999));
+            break;
+        }
+        std::fflush(stdout);
+    }
+
+    void PrintFooter(
+        SweepOptions const& Options)
+    {
+        if (Options.Format == OutputFormat::Json)
+        {
+            std::printf("\n  ]\n}\n");
+        }
+    }
+}
+
+int Mile::HyperV::Benchmark::RunSweep(
+    int argc,
+    char* argv[])
+{
+    SweepOptions Options;
+    if (std::thread::hardware_concurrency() < 2)
+    {
+        Options.ReaderProcessor = 0;
+    }
+
+    if (!::ParseOptions(argc, argv, Options))
+    {
+        std::fprintf(
+            stderr,
+            "Usage: Mile.HyperV.Benchmark sweep [--format text|csv|json] "
+            "[--packets Count] [--writer-cpu Index] [--reader-cpu Index]\n");
+        return 1;
+    }
+
+    // Payload sizes step by four from the smallest useful packet up to the
+    // largest packet a VMBus pipe accepts.
+    std::vector<HV_UINT32> PayloadSizes;
+    for (HV_UINT32 Size = 16;
+        Size <= VMPIPE_MAXIMUM_PIPE_PACKET_SIZE;
+        Size *= 4)
+    {
+        PayloadSizes.push_back(Size);
+    }
+    const HV_UINT32 RingSizes[] = { 64 * 1024, 256 * 1024, 1024 * 1024 };
+    const HV_UINT32 BatchSizes[] = { 1, 16, 64 };
+
+    // Keep the bytes moved per configuration bounded so large payloads do
+    // not dominate the run time.
+    const std::uint64_t MaximumBytes = 256ULL * 1024 * 1024;
+
+    ::PrintHeader(Options);
+    bool First = true;
+    for (HV_UINT32 PayloadSize : PayloadSizes)
+    {
+        std::uint64_t PacketCount = std::min(
+            Options.MaximumPackets,
+            std::max<std::uint64_t>(MaximumBytes / PayloadSize, 1000));
+        for (HV_UINT32 RingSize : RingSizes)
+        {
+            for (HV_UINT32 BatchSize : BatchSizes)
+            {
+                SweepResult Result = ::MeasureSweep(
+                    Options,
+                    PayloadSize,
+                    RingSize,
+                    BatchSize,
+                    PacketCount);
+                ::PrintResult(Options, Result, First);
+                First = false;
+            }
+        }
+    }
+    ::PrintFooter(Options);
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.Transaction.cpp
+ * PURPOSE:    Implementation for Mile.HyperV transaction tracker benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.Transaction.h>
+
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    /**
+     * @brief The mutex protected map most channel clients use today.
+     */
+    class MutexTransactionMap
+    {
+    private:
+
+        struct Request
+        {
+            void* ResponseBuffer;
+            HV_UINT32 ResponseBufferSize;
+        };
+
+        std::mutex m_Mutex;
+        std::unordered_map<HV_UINT64, Request> m_Requests;
+        HV_UINT64 m_NextTransactionId = 1;
+
+    public:
+
+        HV_UINT64 Allocate(
+            void* ResponseBuffer,
+            HV_UINT32 ResponseBufferSize)
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            HV_UINT64 TransactionId = m_NextTransactionId++;
+            m_Requests.emplace(
+                TransactionId,
+                Request{ ResponseBuffer, ResponseBufferSize });
+            return TransactionId;
+        }
+
+        bool Complete(
+            HV_UINT64 TransactionId,
+            const void* Response,
+            HV_UINT32 ResponseSize)
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            auto Iterator = m_Requests.find(TransactionId);
+            if (Iterator == m_Requests.end())
+            {
+                return false;
+            }
+            if (ResponseSize > Iterator->second.ResponseBufferSize)
+            {
+                ResponseSize = Iterator->second.ResponseBufferSize;
+            }
+            if (ResponseSize)
+            {
+                std::memcpy(
+                    Iterator->second.ResponseBuffer,
+                    Response,
+                    ResponseSize);
+            }
+            m_Requests.erase(Iterator);
+            return true;
+        }
+    };
+
+    // Every thread keeps a window of requests outstanding and completes the
+    // oldest one before issuing the next, like a channel with a queue depth.
+    const std::size_t QueueDepth = 32;
+
+    double MeasureMutexMap(
+        std::uint32_t ThreadCount,
+        std::uint64_t Iterations)
+    {
+        MutexTransactionMap Map;
+        Stopwatch Watch;
+        std::vector<std::thread> Threads;
+        for (std::uint32_t i = 0; i < ThreadCount; ++i)
+        {
+            Threads.emplace_back([&]()
+            {
+                HV_UINT64 Response = 0;
+                std::vector<HV_UINT64> Window(QueueDepth);
+                for (std::size_t j = 0; j < QueueDepth; ++j)
+                {
+                    Window[j] = Map.Allocate(&Response, sizeof(Response));
+                }
+                for (std::uint64_t j = 0; j < Iterations; ++j)
+                {
+                    HV_UINT64& Slot = Window[j % QueueDepth];
+                    Map.Complete(Slot, &j, sizeof(j));
+                    Slot = Map.Allocate(&Response, sizeof(Response));
+                }
+                for (HV_UINT64 TransactionId : Window)
+                {
+                    Map.Complete(TransactionId, nullptr, 0);
+                }
+            });
+        }
+        for (std::thread& Thread : Threads)
+        {
+            Thread.join();
+        }
+        return Watch.Seconds();
+    }
+
+    double MeasureTable(
+        std::uint32_t ThreadCount,
+        std::uint64_t Iterations)
+    {
+        std::vector<VmbusTransactionSlot> Slots(ThreadCount * QueueDepth);
+        VmbusTransactionTable Table;
+        Table.Initialize(Slots.data(), static_cast<HV_UINT32>(Slots.size()));
+        Stopwatch Watch;
+        std::vector<std::thread> Threads;
+        for (std::uint32_t i = 0; i < ThreadCount; ++i)
+        {
+            Threads.emplace_back([&]()
+            {
+                HV_UINT64 Response = 0;
+                std::vector<HV_UINT64> Window(QueueDepth);
+                for (std::size_t j = 0; j < QueueDepth; ++j)
+                {
+                    Table.Allocate(&Response, sizeof(Response), &Window[j]);
+                }
+                for (std::uint64_t j = 0; j < Iterations; ++j)
+                {
+                    HV_UINT64& Slot = Window[j % QueueDepth];
+                    VmbusTransactionResult Result;
+                    Table.Complete(Slot, STATUS_SUCCESS, &j, sizeof(j));
+                    Table.Poll(Slot, &Result);
+                    Table.Allocate(&Response, sizeof(Response), &Slot);
+                }
+                for (HV_UINT64 TransactionId : Window)
+                {
+                    Table.Release(TransactionId);
+                }
+            });
+        }
+        for (std::thread& Thread : Threads)
+        {
+            Thread.join();
+        }
+        return Watch.Seconds();
+    }
+}
+
+int Mile::HyperV::Benchmark::RunTransaction(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    const std::uint32_t ThreadCounts[] = { 1, 2, 4 };
+    const std::uint64_t Iterations = 1000000;
+
+    std::printf(
+        "%-10s %8s %14s\n",
+        "Tracker",
+        "Threads",
+        "Transactions/s");
+    for (std::uint32_t ThreadCount : ThreadCounts)
+    {
+        double Transactions = static_cast<double>(ThreadCount) * Iterations;
+        std::printf(
+            "%-10s %8u %14.0f\n",
+            "MutexMap",
+            ThreadCount,
+            Transactions / ::MeasureMutexMap(ThreadCount, Iterations));
+        std::printf(
+            "%-10s %8u %14.0f\n",
+            "Table",
+            ThreadCount,
+            Transactions / ::MeasureTable(ThreadCount, Iterations));
+    }
+
+    return 0;
+}
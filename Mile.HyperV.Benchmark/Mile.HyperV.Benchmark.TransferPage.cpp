@@ -0,0 +1,306 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.TransferPage.cpp
+ * PURPOSE:    Implementation for Mile.HyperV transfer page receive benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <Mile.HyperV.VMBus.TransferPage.h>
+
+#include <vector>
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    enum class CompletionMode
+    {
+        // Write one completion packet per receive.
+        PerPacket,
+        // Collect the completions of a burst into one batched write.
+        Batched,
+    };
+
+    struct TransferPageResult
+    {
+        double ReceiveNanosecondsPerPacket;
+        double CompleteNanosecondsPerPacket;
+        std::uint64_t Publications;
+        std::uint64_t Signals;
+        std::uint64_t Errors;
+    };
+
+    const HV_UINT16 ReceiveBufferId = 0xCAFE;
+    const HV_UINT32 SectionSize = 2048;
+    const HV_UINT32 SectionCount = 1024;
+
+    void SendReceives(
+        VmbusRingWriter& Writer,
+        std::uint64_t First,
+        HV_UINT32 Count,
+        HV_UINT32 RangesPerPacket,
+        HV_UINT32 FrameSize)
+    {
+        struct
+        {
+            NVSP_MESSAGE_HEADER Header;
+            NVSP_1_MESSAGE_SEND_RNDIS_PACKET Body;
+        } Message = {};
+        Message.Header.MessageType = NvspMessage1TypeSendRNDISPacket;
+        Message.Body.SendBufferSectionIndex = 0xFFFFFFFF;
+
+        std::vector<VMTRANSFER_PAGE_RANGE> Ranges(RangesPerPacket);
+        for (HV_UINT32 i = 0; i < Count; ++i)
+        {
+            std::uint64_t TransactionId = First + i;
+            for (HV_UINT32 j = 0; j < RangesPerPacket; ++j)
+            {
+                Ranges[j].ByteOffset = static_cast<HV_UINT32>(
+                    ((TransactionId * RangesPerPacket + j) % SectionCount)
+                    * SectionSize);
+                Ranges[j].ByteCount = FrameSize;
+            }
+
+            // TransferPageSetId, SenderOwnsSet, Reserved and RangeCount.
+            struct
+            {
+                HV_UINT16 TransferPageSetId;
+                HV_UINT8 SenderOwnsSet;
+                HV_UINT8 Reserved;
+                HV_UINT32 RangeCount;
+            } Header = { ReceiveBufferId, 0, 0, RangesPerPacket };
+            VmbusRingSegment Segments[3] =
+            {
+                { &Header, sizeof(Header) },
+                {
+                    Ranges.data(),
+                    static_cast<HV_UINT32>(
+                        Ranges.size() * sizeof(VMTRANSFER_PAGE_RANGE))
+                },
+                { &Message, sizeof(Message) },
+            };
+            VMPACKET_DESCRIPTOR Descriptor = VmbusRingWriter::InBandDescriptor(
+                VmbusPacketTypeDataUsingTransferPages,
+                VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED,
+                TransactionId);
+            Descriptor.DataOffset8 = static_cast<HV_UINT16>(
+                (sizeof(VMPACKET_DESCRIPTOR) + Segments[0].Size
+                    + Segments[1].Size) / VmbusRingPacketAlignment);
+            Writer.WritePacket(Descriptor, Segments, 3);
+        }
+    }
+
+    TransferPageResult MeasureTransferPage(
+        CompletionMode Mode,
+        HV_UINT32 RangesPerPacket,
+        HV_UINT32 FrameSize,
+        HV_UINT32 Burst,
+        std::uint64_t PacketCount)
+    {
+        const HV_UINT32 RingSize = 256 * 1024;
+        SharedMemory ReceiveMemory(VmbusRingControlPageSize + RingSize);
+        SharedMemory CompletionMemory(VmbusRingControlPageSize + RingSize);
+        VmbusRing ReceiveRing =
+            ::Mile::HyperV::Benchmark::CreateRing(ReceiveMemory);
+        VmbusRing CompletionRing =
+            ::Mile::HyperV::Benchmark::CreateRing(CompletionMemory);
+        VmbusRingWriter HostWriter(ReceiveRing);
+        VmbusRingReader GuestReader(ReceiveRing);
+        VmbusRingWriter GuestWriter(CompletionRing);
+        VmbusRingReader HostReader(CompletionRing);
+
+        std::vector<HV_UINT8> ReceiveBuffer(SectionSize * SectionCount, 0x69);
+        VmbusTransferPageSet Sets[1] =
+        {
+            { ReceiveBufferId, ReceiveBuffer },
+        };
+
+        struct
+        {
+            NVSP_MESSAGE_HEADER Header;
+            NVSP_1_MESSAGE_SEND_RNDIS_PACKET_COMPLETE Body;
+        } Complete = {};
+        Complete.Header.MessageType = NvspMessage1TypeSendRNDISPacketComplete;
+        Complete.Body.Status = NvspStatusSuccess;
+
+        // Both modes collect the transaction IDs while receiving, so only
+        // the completion writes differ.
+        std::vector<HV_UINT64> TransactionIds(Burst);
+        VmbusTransferPageCompletionBatch Batch;
+        Batch.Initialize(
+            TransactionIds.data(),
+            Burst,
+            &Complete,
+            sizeof(Complete));
+
+        TransferPageResult Result = {};
+        std::uint64_t ReceiveNanoseconds = 0;
+        std::uint64_t CompleteNanoseconds = 0;
+        std::uint64_t Sent = 0;
+        std::uint64_t ExpectedCompletion = 0;
+        while (ExpectedCompletion < PacketCount)
+        {
+            HV_UINT32 Count = Burst;
+            if (Count > PacketCount - Sent)
+            {
+                Count = static_cast<HV_UINT32>(PacketCount - Sent);
+            }
+            ::SendReceives(HostWriter, Sent, Count, RangesPerPacket, FrameSize);
+            Sent += Count;
+
+            std::uint64_t Start =
+                ::Mile::HyperV::Benchmark::TimestampNanoseconds();
+            HV_UINT32 Received = 0;
+            GuestReader.ReadBatch([&](VmbusRingPacket const& Packet)
+            {
+                VmbusTransferPagePacket Receive;
+                if (!NT_SUCCESS(Receive.Initialize(Packet, Sets, 1)))
+                {
+                    ++Result.Errors;
+                    return;
+                }
+                std::uint64_t Bytes = 0;
+                for (VmbusTransferPageRange const& Range : Receive)
+                {
+                    if (Range.Data.size() != FrameSize ||
+                        Range.Data[0] != 0x69)
+                    {
+                        ++Result.Errors;
+                    }
+                    Bytes += Range.Data.size();
+                }
+                if (Bytes != static_cast<std::uint64_t>(FrameSize)
+                    * RangesPerPacket)
+                {
+                    ++Result.Errors;
+                }
+
+                if (Mode == CompletionMode::PerPacket)
+                {
+                    TransactionIds[Received++] = Receive.TransactionId();
+                }
+                else
+                {
+                    Batch.Add(Receive.TransactionId());
+                }
+            }, Burst);
+            std::uint64_t Middle =
+                ::Mile::HyperV::Benchmark::TimestampNanoseconds();
+
+            if (Mode == CompletionMode::PerPacket)
+            {
+                for (HV_UINT32 i = 0; i < Received; ++i)
+                {
+                    bool Signal = false;
+                    GuestWriter.Write(
+                        VmbusPacketTypeCompletion,
+                        0,
+                        TransactionIds[i],
+                        &Complete,
+                        sizeof(Complete),
+                        &Signal);
+                    ++Result.Publications;
+                    Result.Signals += Signal;
+                }
+            }
+            else
+            {
+                bool Signal = false;
+                Batch.Flush(GuestWriter, &Signal);
+                ++Result.Publications;
+                Result.Signals += Signal;
+            }
+            std::uint64_t End =
+                ::Mile::HyperV::Benchmark::TimestampNanoseconds();
+            ReceiveNanoseconds += Middle - Start;
+            CompleteNanoseconds += End - Middle;
+
+            // The host recycles the receive buffer sections in order.
+            HostReader.ReadBatch([&](VmbusRingPacket const& Packet)
+            {
+                if (Packet.Descriptor().Type != VmbusPacketTypeCompletion ||
+                    Packet.Descriptor().TransactionId != ExpectedCompletion)
+                {
+                    ++Result.Errors;
+                }
+                ++ExpectedCompletion;
+            }, Burst);
+        }
+
+        Result.ReceiveNanosecondsPerPacket =
+            static_cast<double>(ReceiveNanoseconds) / PacketCount;
+        Result.CompleteNanosecondsPerPacket =
+            static_cast<double>(CompleteNanoseconds) / PacketCount;
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunTransferPage(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    struct TransferPageLayout
+    {
+        const char* Name;
+        HV_UINT32 RangesPerPacket;
+        HV_UINT32 FrameSize;
+    };
+    const TransferPageLayout Layouts[] =
+    {
+        { "Small", 1, 64 },
+        { "Mtu", 1, 1514 },
+        { "Coalesced", 8, 1514 },
+    };
+    const HV_UINT32 Bursts[] = { 1, 16, 64 };
+    const std::uint64_t PacketCount = 1000000;
+
+    std::printf(
+        "%-10s %6s %-10s %12s %12s %14s %10s %8s\n",
+        "Layout",
+        "Burst",
+        "Mode",
+        "Receive(ns)",
+        "Complete(ns)",
+        "Publications",
+        "Signals",
+        "Errors");
+    for (TransferPageLayout const& Layout : Layouts)
+    {
+        for (HV_UINT32 Burst : Bursts)
+        {
+            for (CompletionMode Mode :
+                { CompletionMode::PerPacket, CompletionMode::Batched })
+            {
+                TransferPageResult Result = ::MeasureTransferPage(
+                    Mode,
+                    Layout.RangesPerPacket,
+                    Layout.FrameSize,
+                    Burst,
+                    PacketCount);
+                std::printf(
+                    "%-10s %6u %-10s %12.1f %12.1f %14llu %10llu %8llu\n",
+                    Layout.Name,
+                    Burst,
+                    Mode == CompletionMode::PerPacket
+                        ? "PerPacket"
+                        : "Batched",
+                    Result.ReceiveNanosecondsPerPacket,
+                    Result.CompleteNanosecondsPerPacket,
+                    static_cast<unsigned long long>(Result.Publications),
+                    static_cast<unsigned long long>(Result.Signals),
+                    static_cast<unsigned long long>(Result.Errors));
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,556 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.VmbusPipe.cpp
+ * PURPOSE:    Implementation for Mile.HyperV VMBus pipe API benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#ifdef __linux__
+#include <Mile.HyperV.Linux.VMBusPipe.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+
+#ifdef __linux__
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    const GUID BenchmarkInterfaceType =
+    {
+        0x4D696C65, 0x5069, 0x7065,
+        { 0x42, 0x65, 0x6E, 0x63, 0x68, 0x00, 0x00, 0x01 }
+    };
+
+    GUID BenchmarkInterfaceInstance(
+        HV_UINT32 Index)
+    {
+        GUID Instance =
+        {
+            0x4D696C65, 0x5069, 0x7065,
+            { 0x49, 0x6E, 0x73, 0x74, 0x00, 0x00, 0x00, 0x00 }
+        };
+        std::memcpy(&Instance.Data4[4], &Index, sizeof(Index));
+        return Instance;
+    }
+
+    HV_UINT8 PatternByte(
+        std::uint64_t Position)
+    {
+        return static_cast<HV_UINT8>(Position ^ (Position >> 11));
+    }
+
+    /**
+     * @brief Offers a channel the way a service does, with everything but
+     *        the identity left at zero.
+     */
+    DWORD OfferChannel(
+        GUID const& InterfaceInstance,
+        HANDLE& PipeHandle)
+    {
+        VMBUS_PIPE_SERVER_OFFER_EX Offer = {};
+        Offer.Version = 1;
+        Offer.Size = sizeof(Offer);
+        Offer.InterfaceType = BenchmarkInterfaceType;
+        Offer.InterfaceInstance = InterfaceInstance;
+        std::memcpy(&Offer.UserDefined, &InterfaceInstance.Data4[4], 4);
+        return ::VmbusPipeServerOfferChannelEx(&Offer, 0, 0, &PipeHandle);
+    }
+
+    HANDLE OpenChannel(
+        GUID const& InterfaceInstance,
+        DWORD RingSize)
+    {
+        VMBUS_PIPE_CHANNEL_INFO Info;
+        if (!::VmbusPipeClientWaitChannel(
+            &BenchmarkInterfaceType,
+            &InterfaceInstance,
+            INFINITE,
+            &Info))
+        {
+            return INVALID_HANDLE_VALUE;
+        }
+        VMBUS_PIPE_CLIENT_CHANNEL_SETTINGS Settings = {};
+        Settings.Version = VMBUS_PIPE_CLIENT_CHANNEL_CURRENT_VERSION;
+        Settings.Size = sizeof(Settings);
+        Settings.IncomingSize = RingSize;
+        Settings.OutgoingSize = RingSize;
+        return ::VmbusPipeClientOpenChannelEx(&Info, 0, &Settings);
+    }
+
+    /**
+     * @brief Reads exactly the given number of bytes.
+     */
+    bool ReadExactly(
+        HANDLE PipeHandle,
+        void* Buffer,
+        DWORD Size)
+    {
+        DWORD Received = 0;
+        while (Received < Size)
+        {
+            DWORD BytesRead = 0;
+            if (!::ReadFile(
+                PipeHandle,
+                static_cast<HV_UINT8*>(Buffer) + Received,
+                Size - Received,
+                &BytesRead,
+                nullptr))
+            {
+                return false;
+            }
+            Received += BytesRead;
+        }
+        return true;
+    }
+
+    struct ArrivalCounter
+    {
+        std::atomic<HV_UINT32> Arrivals;
+    };
+
+    VOID CALLBACK OnChannelArrival(
+        LPVOID ClientContext,
+        PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+        VMBUS_PIPE_CHANNEL_NOTIFICATION_TYPE NotificationType)
+    {
+        (void)ChannelInfo;
+        if (NotificationType == ChannelNotificationArrival)
+        {
+            static_cast<ArrivalCounter*>(ClientContext)->Arrivals.fetch_add(1);
+        }
+    }
+
+    VOID CALLBACK OnChannelOffer(
+        LPVOID HostContext,
+        LPBYTE UserDefined,
+        PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+        LPCGUID InstanceGuid)
+    {
+        (void)ChannelInfo;
+        // The benchmark offers put the instance index in UserDefined.
+        if (0 == std::memcmp(UserDefined, &InstanceGuid->Data4[4], 4))
+        {
+            ++*static_cast<HV_UINT32*>(HostContext);
+        }
+    }
+
+    /**
+     * @brief Walks through the offer, discovery, open, connect, I/O and close
+     *        paths and their failures, and counts the unexpected results.
+     */
+    std::uint64_t CheckVmbusPipe()
+    {
+        std::uint64_t Errors = 0;
+        auto Expect = [&](bool Condition)
+        {
+            if (!Condition)
+            {
+                ++Errors;
+            }
+        };
+
+        ArrivalCounter Counter = {};
+        HVMBUS_PIPE_NOTIFICATION Notification =
+            ::VmbusPipeClientRegisterChannelNotification(
+                &BenchmarkInterfaceType,
+                nullptr,
+                0,
+                ::OnChannelArrival,
+                &Counter);
+        Expect(Notification != nullptr);
+
+        // Offers made before the registration is ready are reported by
+        // ReadyForChannelNotification, later ones as they arrive.
+        GUID Instance = ::BenchmarkInterfaceInstance(1);
+        HANDLE Server = INVALID_HANDLE_VALUE;
+        Expect(ERROR_SUCCESS == ::OfferChannel(Instance, Server));
+        Expect(Counter.Arrivals.load() == 0);
+        ::VmbusPipeClientReadyForChannelNotification(Notification, TRUE);
+        Expect(Counter.Arrivals.load() == 1);
+        HANDLE Other = INVALID_HANDLE_VALUE;
+        Expect(ERROR_SUCCESS == ::OfferChannel(
+            ::BenchmarkInterfaceInstance(2),
+            Other));
+        Expect(Counter.Arrivals.load() == 2);
+        HANDLE Duplicate = INVALID_HANDLE_VALUE;
+        Expect(ERROR_ALREADY_EXISTS == ::OfferChannel(Instance, Duplicate));
+        Expect(Duplicate == INVALID_HANDLE_VALUE);
+
+        HV_UINT32 Offers = 0;
+        Expect(TRUE == ::VmbusPipeClientEnumeratePipes(
+            &BenchmarkInterfaceType,
+            &Offers,
+            ::OnChannelOffer));
+        Expect(Offers == 2);
+
+        VMBUS_PIPE_CHANNEL_INFO Info;
+        GUID Missing = ::BenchmarkInterfaceInstance(3);
+        Expect(FALSE == ::VmbusPipeClientWaitChannel(
+            &BenchmarkInterfaceType,
+            &Missing,
+            10,
+            &Info));
+        Expect(::GetLastError() == ERROR_SEM_TIMEOUT);
+
+        // I/O before the client connects is refused.
+        HV_UINT8 Byte = 0;
+        DWORD Transferred = 0;
+        Expect(FALSE == ::WriteFile(Server, &Byte, 1, &Transferred, nullptr));
+        Expect(::GetLastError() == ERROR_PIPE_LISTENING);
+
+        HANDLE Client = ::OpenChannel(Instance, 4096);
+        Expect(Client != INVALID_HANDLE_VALUE);
+        Expect(TRUE == ::VmbusPipeClientWaitChannel(
+            &BenchmarkInterfaceType,
+            &Instance,
+            0,
+            &Info));
+        Expect(INVALID_HANDLE_VALUE ==
+            ::VmbusPipeClientOpenChannelEx(&Info, 0, nullptr));
+        Expect(::GetLastError() == ERROR_PIPE_BUSY);
+        Expect(TRUE == ::VmbusPipeServerConnectPipe(Server, nullptr));
+        Expect(FALSE == ::VmbusPipeServerConnectPipe(Server, nullptr));
+        Expect(::GetLastError() == ERROR_PIPE_CONNECTED);
+
+        // More bytes than a 4 KiB ring holds, so both sides block.
+        std::vector<HV_UINT8> Request(64 * 1024);
+        for (std::size_t i = 0; i < Request.size(); ++i)
+        {
+            Request[i] = ::PatternByte(i);
+        }
+        std::vector<HV_UINT8> Echo(Request.size());
+        std::thread Service([&]()
+        {
+            std::vector<HV_UINT8> Buffer(1000);
+            for (;;)
+            {
+                DWORD BytesRead = 0;
+                if (!::ReadFile(
+                    Server,
+                    Buffer.data(),
+                    static_cast<DWORD>(Buffer.size()),
+                    &BytesRead,
+                    nullptr))
+                {
+                    Expect(::GetLastError() == ERROR_BROKEN_PIPE);
+                    break;
+                }
+                DWORD BytesWritten = 0;
+                Expect(TRUE == ::WriteFile(
+                    Server,
+                    Buffer.data(),
+                    BytesRead,
+                    &BytesWritten,
+                    nullptr));
+                Expect(BytesWritten == BytesRead);
+            }
+            Expect(FALSE == ::WriteFile(
+                Server,
+                Buffer.data(),
+                1,
+                &Transferred,
+                nullptr));
+            Expect(::GetLastError() == ERROR_NO_DATA);
+        });
+        std::thread Receiver([&]()
+        {
+            Expect(::ReadExactly(
+                Client,
+                Echo.data(),
+                static_cast<DWORD>(Echo.size())));
+        });
+        DWORD BytesWritten = 0;
+        Expect(TRUE == ::WriteFile(
+            Client,
+            Request.data(),
+            static_cast<DWORD>(Request.size()),
+            &BytesWritten,
+            nullptr));
+        Expect(BytesWritten == Request.size());
+        Receiver.join();
+        Expect(Echo == Request);
+        Expect(TRUE == ::CloseHandle(Client));
+        Service.join();
+
+        // Closing the server handle rescinds the offer.
+        Expect(TRUE == ::CloseHandle(Server));
+        Offers = 0;
+        ::VmbusPipeClientEnumeratePipes(
+            &BenchmarkInterfaceType,
+            &Offers,
+            ::OnChannelOffer);
+        Expect(Offers == 1);
+        Expect(INVALID_HANDLE_VALUE ==
+            ::VmbusPipeClientOpenChannelEx(&Info, 0, nullptr));
+        Expect(::GetLastError() == ERROR_FILE_NOT_FOUND);
+        Expect(TRUE == ::CloseHandle(Other));
+
+        // Closed handles and values which are not pipe handles are refused.
+        Expect(FALSE == ::CloseHandle(Other));
+        Expect(::GetLastError() == ERROR_INVALID_HANDLE);
+        Expect(FALSE == ::ReadFile(Client, &Byte, 1, &Transferred, nullptr));
+        Expect(::GetLastError() == ERROR_INVALID_HANDLE);
+        Expect(FALSE == ::CloseHandle(&Byte));
+        Expect(::GetLastError() == ERROR_INVALID_HANDLE);
+
+        ::VmbusPipeClientUnregisterChannelNotification(Notification, TRUE);
+        Expect(Counter.Arrivals.load() == 2);
+        return Errors;
+    }
+
+    struct VmbusPipeResult
+    {
+        double MegabytesPerSecond;
+        double RoundTripMicroseconds;
+        std::uint64_t Errors;
+    };
+
+    /**
+     * @brief Streams bytes from a client to a service through the pipe API.
+     * @param RingSize The size of each ring in bytes.
+     * @param WriteSize The number of bytes per WriteFile.
+     * @param TotalBytes The number of bytes to stream.
+     */
+    VmbusPipeResult MeasureStream(
+        HV_UINT32 RingSize,
+        HV_UINT32 WriteSize,
+        std::uint64_t TotalBytes)
+    {
+        VmbusPipeResult Result = {};
+        GUID Instance = ::BenchmarkInterfaceInstance(100);
+
+        HANDLE Server = INVALID_HANDLE_VALUE;
+        if (ERROR_SUCCESS != ::OfferChannel(Instance, Server))
+        {
+            ++Result.Errors;
+            return Result;
+        }
+
+        // The source repeats with a period of 64 KiB plus one page, so every
+        // write starts at a different pattern offset. It is long enough for
+        // the reads to be checked against it in place too.
+        const HV_UINT32 PatternSize = 64 * 1024 + 4096;
+        const HV_UINT32 ReadSize = 64 * 1024;
+        std::vector<HV_UINT8> Source(
+            PatternSize + std::max(WriteSize, ReadSize));
+        for (std::size_t i = 0; i < Source.size(); ++i)
+        {
+            Source[i] = ::PatternByte(i % PatternSize);
+        }
+
+        Stopwatch Watch;
+        std::thread Client([&]()
+        {
+            HANDLE Pipe = ::OpenChannel(Instance, RingSize);
+            if (Pipe == INVALID_HANDLE_VALUE)
+            {
+                return;
+            }
+            std::uint64_t Sent = 0;
+            while (Sent < TotalBytes)
+            {
+                DWORD Size = static_cast<DWORD>(
+                    std::min<std::uint64_t>(WriteSize, TotalBytes - Sent));
+                DWORD BytesWritten = 0;
+                if (!::WriteFile(
+                    Pipe,
+                    Source.data() + Sent % PatternSize,
+                    Size,
+                    &BytesWritten,
+                    nullptr))
+                {
+                    break;
+                }
+                Sent += BytesWritten;
+            }
+            ::CloseHandle(Pipe);
+        });
+
+        std::uint64_t Received = 0;
+        if (::VmbusPipeServerConnectPipe(Server, nullptr))
+        {
+            std::vector<HV_UINT8> Buffer(ReadSize);
+            DWORD BytesRead = 0;
+            while (::ReadFile(
+                Server,
+                Buffer.data(),
+                ReadSize,
+                &BytesRead,
+                nullptr))
+            {
+                if (0 != std::memcmp(
+                    Buffer.data(),
+                    Source.data() + Received % PatternSize,
+                    BytesRead))
+                {
+                    ++Result.Errors;
+                }
+                Received += BytesRead;
+            }
+        }
+        Client.join();
+        double Elapsed = Watch.Seconds();
+        ::CloseHandle(Server);
+
+        if (Received != TotalBytes)
+        {
+            ++Result.Errors;
+        }
+        Result.MegabytesPerSecond = Received / Elapsed / (1024.0 * 1024.0);
+        return Result;
+    }
+
+    /**
+     * @brief Sends requests and waits for their responses, so every
+     *        round trip wakes both sides through the eventfds.
+     * @param MessageSize The size of each request and response.
+     * @param RoundTrips The number of round trips.
+     */
+    VmbusPipeResult MeasureRoundTrip(
+        HV_UINT32 MessageSize,
+        std::uint64_t RoundTrips)
+    {
+        VmbusPipeResult Result = {};
+        GUID Instance = ::BenchmarkInterfaceInstance(101);
+
+        HANDLE Server = INVALID_HANDLE_VALUE;
+        if (ERROR_SUCCESS != ::OfferChannel(Instance, Server))
+        {
+            ++Result.Errors;
+            return Result;
+        }
+
+        std::thread Service([&]()
+        {
+            if (!::VmbusPipeServerConnectPipe(Server, nullptr))
+            {
+                return;
+            }
+            std::vector<HV_UINT8> Message(MessageSize);
+            while (::ReadExactly(Server, Message.data(), MessageSize))
+            {
+                DWORD BytesWritten = 0;
+                if (!::WriteFile(
+                    Server,
+                    Message.data(),
+                    MessageSize,
+                    &BytesWritten,
+                    nullptr))
+                {
+                    break;
+                }
+            }
+        });
+
+        HANDLE Client = ::OpenChannel(Instance, 0);
+        std::vector<HV_UINT8> Request(MessageSize);
+        std::vector<HV_UINT8> Response(MessageSize);
+        Stopwatch Watch;
+        for (std::uint64_t i = 0; i < RoundTrips; ++i)
+        {
+            std::memcpy(Request.data(), &i, sizeof(i));
+            DWORD BytesWritten = 0;
+            if (!::WriteFile(
+                Client,
+                Request.data(),
+                MessageSize,
+                &BytesWritten,
+                nullptr) ||
+                !::ReadExactly(Client, Response.data(), MessageSize))
+            {
+                ++Result.Errors;
+                break;
+            }
+            if (Response != Request)
+            {
+                ++Result.Errors;
+            }
+        }
+        Result.RoundTripMicroseconds = Watch.Seconds() * 1e6 / RoundTrips;
+        ::CloseHandle(Client);
+        Service.join();
+        ::CloseHandle(Server);
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunVmbusPipe(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf(
+        "API check: %llu errors\n\n",
+        static_cast<unsigned long long>(::CheckVmbusPipe()));
+
+    const HV_UINT32 RingSizes[] = { 16 * 1024, 64 * 1024, 256 * 1024 };
+    const HV_UINT32 WriteSizes[] = { 64, 4096, 65536 };
+    const std::uint64_t TotalBytes = 256ull * 1024 * 1024;
+
+    std::printf(
+        "%10s %10s %12s %8s\n",
+        "Ring",
+        "WriteSize",
+        "MB/s",
+        "Errors");
+    for (HV_UINT32 RingSize : RingSizes)
+    {
+        for (HV_UINT32 WriteSize : WriteSizes)
+        {
+            // Small writes are dominated by the per call cost.
+            std::uint64_t Bytes = WriteSize < 4096
+                ? TotalBytes / 16
+                : TotalBytes;
+            VmbusPipeResult Result = ::MeasureStream(
+                RingSize,
+                WriteSize,
+                Bytes);
+            std::printf(
+                "%10u %10u %12.1f %8llu\n",
+                RingSize,
+                WriteSize,
+                Result.MegabytesPerSecond,
+                static_cast<unsigned long long>(Result.Errors));
+        }
+    }
+
+    std::printf("\n%12s %14s %8s\n", "MessageSize", "RoundTrip(us)", "Errors");
+    const HV_UINT32 MessageSizes[] = { 64, 4096 };
+    for (HV_UINT32 MessageSize : MessageSizes)
+    {
+        VmbusPipeResult Result = ::MeasureRoundTrip(MessageSize, 20000);
+        std::printf(
+            "%12u %14.2f %8llu\n",
+            MessageSize,
+            Result.RoundTripMicroseconds,
+            static_cast<unsigned long long>(Result.Errors));
+    }
+
+    return 0;
+}
+
+#else
+
+int Mile::HyperV::Benchmark::RunVmbusPipe(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf("The VMBus pipe backend is only implemented on Linux.\n");
+    return 0;
+}
+
+#endif
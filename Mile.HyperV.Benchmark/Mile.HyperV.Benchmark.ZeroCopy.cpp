@@ -0,0 +1,241 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.ZeroCopy.cpp
+ * PURPOSE:    Implementation for Mile.HyperV zero-copy ring benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#ifdef __linux__
+#include <Mile.HyperV.Linux.VMBusRing.h>
+#endif
+
+#include <vector>
+
+#ifdef __linux__
+
+namespace
+{
+    using namespace ::Mile::HyperV;
+    using namespace ::Mile::HyperV::Benchmark;
+
+    // Touches every word of the payload, so both modes pay for reading it.
+    std::uint64_t Checksum(
+        const HV_UINT8* Data,
+        std::size_t Size)
+    {
+        std::uint64_t Sum = 0;
+        std::size_t Words = Size / sizeof(std::uint64_t);
+        for (std::size_t i = 0; i < Words; ++i)
+        {
+            std::uint64_t Word;
+            std::memcpy(&Word, Data + i * sizeof(Word), sizeof(Word));
+            Sum += Word;
+        }
+        return Sum;
+    }
+
+    enum class ReadMode
+    {
+        // Copy every packet out of the ring with VmbusRingReader::Read.
+        Copy,
+        // Use packets in place, bouncing only those which wrap around.
+        InPlace,
+        // Use packets in place from a mirrored mapping, which never wraps.
+        Mirrored,
+    };
+
+    const char* ReadModeName(
+        ReadMode Mode)
+    {
+        switch (Mode)
+        {
+        case ReadMode::Copy:
+            return "Copy";
+        case ReadMode::InPlace:
+            return "InPlace";
+        default:
+            return "Mirrored";
+        }
+    }
+
+    struct ZeroCopyResult
+    {
+        double Seconds;
+        std::uint64_t BytesCopied;
+        std::uint64_t Checksum;
+    };
+
+    ZeroCopyResult MeasureZeroCopy(
+        ReadMode Mode,
+        HV_UINT32 PayloadSize,
+        HV_UINT32 RingSize,
+        std::uint64_t PacketCount)
+    {
+        bool Mirrored = (Mode == ReadMode::Mirrored);
+        SharedMemory Memory(
+            Mirrored ? 0 : VmbusRingControlPageSize + RingSize);
+        VmbusRingMirrorMapping Mapping;
+        VmbusRing Ring;
+        if (Mirrored)
+        {
+            Mapping.Create(RingSize);
+            Ring = Mapping.Ring();
+            Ring.Reset(true);
+        }
+        else
+        {
+            Ring = ::Mile::HyperV::Benchmark::CreateRing(Memory);
+        }
+        VmbusRingWriter Writer(Ring);
+        VmbusRingReader Reader(Ring);
+
+        std::vector<HV_UINT8> Payload(PayloadSize, 0x3C);
+        std::vector<HV_UINT8> Bounce(
+            sizeof(VMPACKET_DESCRIPTOR) + PayloadSize);
+
+        ZeroCopyResult Result = {};
+        Stopwatch Watch;
+
+        std::thread Producer([&]()
+        {
+            Backoff Waiter;
+            for (std::uint64_t i = 0; i < PacketCount;)
+            {
+                if (NT_SUCCESS(Writer.Write(
+                    VmbusPacketTypeDataInBand,
+                    0,
+                    i,
+                    Payload.data(),
+                    PayloadSize)))
+                {
+                    Waiter.Reset();
+                    ++i;
+                }
+                else
+                {
+                    Waiter.Wait();
+                }
+            }
+        });
+
+        std::uint64_t Consumed = 0;
+        Backoff Waiter;
+        while (Consumed < PacketCount)
+        {
+            HV_UINT32 Count = 0;
+            if (Mode == ReadMode::Copy)
+            {
+                HV_UINT32 Size = 0;
+                if (NT_SUCCESS(Reader.Read(
+                    Bounce.data(),
+                    static_cast<HV_UINT32>(Bounce.size()),
+                    &Size)))
+                {
+                    Count = 1;
+                    Result.BytesCopied += Size;
+                    Result.Checksum += ::Checksum(
+                        Bounce.data() + sizeof(VMPACKET_DESCRIPTOR),
+                        Size - sizeof(VMPACKET_DESCRIPTOR));
+                }
+            }
+            else
+            {
+                Reader.ReadBatch([&](VmbusRingPacket const& Packet)
+                {
+                    std::span<const HV_UINT8> InPlace = Packet.Payload();
+                    if (InPlace.empty())
+                    {
+                        HV_UINT32 Size = Packet.CopyPayload(
+                            Bounce.data(),
+                            static_cast<HV_UINT32>(Bounce.size()));
+                        Result.BytesCopied += Size;
+                        InPlace = std::span<const HV_UINT8>(
+                            Bounce.data(),
+                            Size);
+                    }
+                    Result.Checksum += ::Checksum(
+                        InPlace.data(),
+                        InPlace.size());
+                }, 64, 0xFFFFFFFF, &Count);
+            }
+
+            if (Count)
+            {
+                Consumed += Count;
+                Waiter.Reset();
+            }
+            else
+            {
+                Waiter.Wait();
+            }
+        }
+
+        Producer.join();
+        Result.Seconds = Watch.Seconds();
+        return Result;
+    }
+}
+
+int Mile::HyperV::Benchmark::RunZeroCopy(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    // Ring sizes are chosen so the packet stride does not divide them, which
+    // makes a share of the packets straddle the end of the ring.
+    const HV_UINT32 PayloadSizes[] = { 4096, 16384, 65536, 262144 };
+    const std::uint64_t TotalBytes = 4ULL * 1024 * 1024 * 1024;
+
+    std::printf(
+        "%-10s %8s %10s %10s %14s\n",
+        "Mode",
+        "Payload",
+        "Packets",
+        "GB/s",
+        "BytesCopied");
+    for (HV_UINT32 PayloadSize : PayloadSizes)
+    {
+        HV_UINT32 RingSize = (PayloadSize < 65536) ? 1024 * 1024 : 4096 * 1024;
+        std::uint64_t PacketCount = TotalBytes / PayloadSize / 4;
+        for (ReadMode Mode :
+            { ReadMode::Copy, ReadMode::InPlace, ReadMode::Mirrored })
+        {
+            ZeroCopyResult Result = ::MeasureZeroCopy(
+                Mode,
+                PayloadSize,
+                RingSize,
+                PacketCount);
+            std::printf(
+                "%-10s %8u %10llu %10.2f %14llu\n",
+                ::ReadModeName(Mode),
+                PayloadSize,
+                static_cast<unsigned long long>(PacketCount),
+                PacketCount * PayloadSize / Result.Seconds / 1e9,
+                static_cast<unsigned long long>(Result.BytesCopied));
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+int Mile::HyperV::Benchmark::RunZeroCopy(
+    int argc,
+    char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    std::printf("The mirrored ring mapping is only implemented on Linux.\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,79 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.cpp
+ * PURPOSE:    Implementation for Mile.HyperV Benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Mile.HyperV.Benchmark.h"
+
+#include <cstring>
+
+namespace
+{
+    struct BenchmarkScenario
+    {
+        const char* Name;
+        int (*Entry)(int, char*[]);
+    };
+
+    const BenchmarkScenario g_Scenarios[] =
+    {
+        { "drain", ::Mile::HyperV::Benchmark::RunDrain },
+        { "flowcontrol", ::Mile::HyperV::Benchmark::RunFlowControl },
+        { "zerocopy", ::Mile::HyperV::Benchmark::RunZeroCopy },
+        { "sweep", ::Mile::HyperV::Benchmark::RunSweep },
+        { "transaction", ::Mile::HyperV::Benchmark::RunTransaction },
+        { "polling", ::Mile::HyperV::Benchmark::RunPolling },
+        { "multiwriter", ::Mile::HyperV::Benchmark::RunMultiWriter },
+        { "gpadl", ::Mile::HyperV::Benchmark::RunGpadl },
+        { "gpadirect", ::Mile::HyperV::Benchmark::RunGpaDirect },
+        { "transferpage", ::Mile::HyperV::Benchmark::RunTransferPage },
+        { "pipestream", ::Mile::HyperV::Benchmark::RunPipeStream },
+        { "pipegpadirect", ::Mile::HyperV::Benchmark::RunPipeGpaDirect },
+        { "hostemulator", ::Mile::HyperV::Benchmark::RunHostEmulator },
+        { "offertable", ::Mile::HyperV::Benchmark::RunOfferTable },
+        { "channelgroup", ::Mile::HyperV::Benchmark::RunChannelGroup },
+        { "monitor", ::Mile::HyperV::Benchmark::RunMonitor },
+        { "eventflags", ::Mile::HyperV::Benchmark::RunEventFlags },
+        { "messagepump", ::Mile::HyperV::Benchmark::RunMessagePump },
+        { "servicing", ::Mile::HyperV::Benchmark::RunServicing },
+        { "registry", ::Mile::HyperV::Benchmark::RunChannelRegistry },
+        { "vmbuspipe", ::Mile::HyperV::Benchmark::RunVmbusPipe },
+        { "pipeasync", ::Mile::HyperV::Benchmark::RunPipeAsync },
+        { "pipearrival", ::Mile::HyperV::Benchmark::RunPipeArrival },
+        { "pipedirectory", ::Mile::HyperV::Benchmark::RunPipeDirectory },
+    };
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        int Result = 0;
+        for (BenchmarkScenario const& Scenario : g_Scenarios)
+        {
+            Result |= Scenario.Entry(0, nullptr);
+        }
+        return Result;
+    }
+
+    for (BenchmarkScenario const& Scenario : g_Scenarios)
+    {
+        if (0 == std::strcmp(argv[1], Scenario.Name))
+        {
+            return Scenario.Entry(argc - 2, argv + 2);
+        }
+    }
+
+    std::fprintf(stderr, "Usage: Mile.HyperV.Benchmark [Scenario]\n");
+    std::fprintf(stderr, "Scenarios:\n");
+    for (BenchmarkScenario const& Scenario : g_Scenarios)
+    {
+        std::fprintf(stderr, "    %s\n", Scenario.Name);
+    }
+    return 1;
+}
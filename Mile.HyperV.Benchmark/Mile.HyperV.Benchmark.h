@@ -0,0 +1,391 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Benchmark.h
+ * PURPOSE:    Definition for Mile.HyperV Benchmark
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_BENCHMARK
+#define MILE_HYPERV_BENCHMARK
+
+// Mile.HyperV checks the MSVC architecture macros, so provide them when the
+// benchmark is built with GCC or Clang.
+#ifndef _MSC_VER
+#if defined(__x86_64__) && !defined(_M_AMD64)
+#define _M_AMD64 1
+#elif defined(__aarch64__) && !defined(_M_ARM64)
+#define _M_ARM64 1
+#elif defined(__i386__) && !defined(_M_IX86)
+#define _M_IX86 1
+#endif
+#endif // !_MSC_VER
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#endif
+
+#include <Mile.HyperV.VMBus.Ring.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+namespace Mile::HyperV::Benchmark
+{
+    /**
+     * @brief Page aligned, zero initialized memory which is shareable with
+     *        child processes on Linux, standing in for the GPADL pages of a
+     *        real channel.
+     */
+    class SharedMemory
+    {
+    private:
+
+        void* m_Buffer = nullptr;
+        std::size_t m_Size = 0;
+
+    public:
+
+        SharedMemory() = default;
+
+        explicit SharedMemory(
+            std::size_t Size)
+        {
+#ifdef _WIN32
+            m_Buffer = ::VirtualAlloc(
+                nullptr,
+                Size,
+                MEM_COMMIT | MEM_RESERVE,
+                PAGE_READWRITE);
+#else
+            m_Buffer = ::mmap(
+                nullptr,
+                Size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS,
+                -1,
+                0);
+            if (m_Buffer == MAP_FAILED)
+            {
+                m_Buffer = nullptr;
+            }
+#endif
+            if (m_Buffer)
+            {
+                m_Size = Size;
+            }
+        }
+
+        ~SharedMemory()
+        {
+            if (m_Buffer)
+            {
+#ifdef _WIN32
+                ::VirtualFree(m_Buffer, 0, MEM_RELEASE);
+#else
+                ::munmap(m_Buffer, m_Size);
+#endif
+            }
+        }
+
+        SharedMemory(SharedMemory const&) = delete;
+        SharedMemory& operator=(SharedMemory const&) = delete;
+
+        void* Buffer() const
+        {
+            return m_Buffer;
+        }
+
+        std::size_t Size() const
+        {
+            return m_Size;
+        }
+    };
+
+    /**
+     * @brief Lays out an empty ring over a shared memory region.
+     * @param Memory The memory region, which must outlive the ring.
+     * @return The ring, which is invalid if the region is unusable.
+     */
+    inline VmbusRing CreateRing(
+        SharedMemory const& Memory)
+    {
+        VmbusRing Ring;
+        if (NT_SUCCESS(Ring.Initialize(Memory.Buffer(), Memory.Size())))
+        {
+            Ring.Reset(true);
+        }
+        return Ring;
+    }
+
+    /**
+     * @brief Spins briefly, then yields, so spinning endpoints still make
+     *        progress when they share a processor.
+     */
+    class Backoff
+    {
+    private:
+
+        std::uint32_t m_Spins = 0;
+
+    public:
+
+        void Wait()
+        {
+            if (++m_Spins < 64)
+            {
+                ::Mile::HyperV::VmbusRingCpuRelax();
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        void Reset()
+        {
+            m_Spins = 0;
+        }
+    };
+
+    /**
+     * @brief Binds the calling thread to a single processor.
+     * @param Processor The zero-based processor index.
+     * @return true if the affinity was applied.
+     */
+    inline bool PinCurrentThread(
+        std::uint32_t Processor)
+    {
+#ifdef _WIN32
+        if (Processor >= sizeof(DWORD_PTR) * 8)
+        {
+            return false;
+        }
+        return 0 != ::SetThreadAffinityMask(
+            ::GetCurrentThread(),
+            static_cast<DWORD_PTR>(1) << Processor);
+#else
+        if (Processor >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        cpu_set_t Set;
+        CPU_ZERO(&Set);
+        CPU_SET(Processor, &Set);
+        return 0 == ::pthread_setaffinity_np(
+            ::pthread_self(),
+            sizeof(Set),
+            &Set);
+#endif
+    }
+
+    /**
+     * @brief Gets a monotonic timestamp which is comparable across threads.
+     * @return The timestamp in nanoseconds.
+     */
+    inline std::uint64_t TimestampNanoseconds()
+    {
+        return static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    class Stopwatch
+    {
+    private:
+
+        std::chrono::steady_clock::time_point m_Start =
+            std::chrono::steady_clock::now();
+
+    public:
+
+        double Seconds() const
+        {
+            return std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - m_Start).count();
+        }
+    };
+
+    /**
+     * @brief Gets the processor time consumed by the calling thread.
+     * @return The processor time in seconds.
+     */
+    inline double ThreadCpuSeconds()
+    {
+#ifdef _WIN32
+        FILETIME CreationTime;
+        FILETIME ExitTime;
+        FILETIME KernelTime;
+        FILETIME UserTime;
+        if (!::GetThreadTimes(
+            ::GetCurrentThread(),
+            &CreationTime,
+            &ExitTime,
+            &KernelTime,
+            &UserTime))
+        {
+            return 0.0;
+        }
+        ULARGE_INTEGER Kernel;
+        Kernel.LowPart = KernelTime.dwLowDateTime;
+        Kernel.HighPart = KernelTime.dwHighDateTime;
+        ULARGE_INTEGER User;
+        User.LowPart = UserTime.dwLowDateTime;
+        User.HighPart = UserTime.dwHighDateTime;
+        return (Kernel.QuadPart + User.QuadPart) / 1e7;
+#else
+        timespec Time;
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &Time);
+        return Time.tv_sec + Time.tv_nsec / 1e9;
+#endif
+    }
+
+    /**
+     * @brief An auto-reset event standing in for a channel interrupt.
+     */
+    class SignalEvent
+    {
+    private:
+
+        std::mutex m_Mutex;
+        std::condition_variable m_Condition;
+        bool m_Signaled = false;
+
+    public:
+
+        void Set()
+        {
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                m_Signaled = true;
+            }
+            m_Condition.notify_one();
+        }
+
+        /**
+         * @brief Waits for the event and resets it.
+         * @param Timeout The maximum time to wait.
+         * @return true if the event was set, false on timeout.
+         */
+        bool Wait(
+            std::chrono::microseconds Timeout)
+        {
+            std::unique_lock<std::mutex> Lock(m_Mutex);
+            bool Signaled = m_Condition.wait_for(Lock, Timeout, [this]()
+            {
+                return m_Signaled;
+            });
+            m_Signaled = false;
+            return Signaled;
+        }
+    };
+
+    int RunDrain(
+        int argc,
+        char* argv[]);
+
+    int RunFlowControl(
+        int argc,
+        char* argv[]);
+
+    int RunZeroCopy(
+        int argc,
+        char* argv[]);
+
+    int RunSweep(
+        int argc,
+        char* argv[]);
+
+    int RunTransaction(
+        int argc,
+        char* argv[]);
+
+    int RunPolling(
+        int argc,
+        char* argv[]);
+
+    int RunMultiWriter(
+        int argc,
+        char* argv[]);
+
+    int RunGpadl(
+        int argc,
+        char* argv[]);
+
+    int RunGpaDirect(
+        int argc,
+        char* argv[]);
+
+    int RunTransferPage(
+        int argc,
+        char* argv[]);
+
+    int RunPipeStream(
+        int argc,
+        char* argv[]);
+
+    int RunPipeGpaDirect(
+        int argc,
+        char* argv[]);
+
+    int RunHostEmulator(
+        int argc,
+        char* argv[]);
+
+    int RunOfferTable(
+        int argc,
+        char* argv[]);
+
+    int RunChannelGroup(
+        int argc,
+        char* argv[]);
+
+    int RunMonitor(
+        int argc,
+        char* argv[]);
+
+    int RunEventFlags(
+        int argc,
+        char* argv[]);
+
+    int RunMessagePump(
+        int argc,
+        char* argv[]);
+
+    int RunServicing(
+        int argc,
+        char* argv[]);
+
+    int RunChannelRegistry(
+        int argc,
+        char* argv[]);
+
+    int RunVmbusPipe(
+        int argc,
+        char* argv[]);
+
+    int RunPipeAsync(
+        int argc,
+        char* argv[]);
+
+    int RunPipeArrival(
+        int argc,
+        char* argv[]);
+
+    int RunPipeDirectory(
+        int argc,
+        char* argv[]);
+}
+
+#endif // !MILE_HYPERV_BENCHMARK
@@ -10,4 +10,25 @@
 
 #include <Mile.Mobility.Portable.Types.h>
 
+#include <Mile.HyperV.VMBus.ChannelGroup.h>
+#include <Mile.HyperV.VMBus.ChannelRegistry.h>
+#include <Mile.HyperV.VMBus.EventFlags.h>
 #include <Mile.HyperV.VMBus.h>
+#include <Mile.HyperV.VMBus.GpaDirect.h>
+#include <Mile.HyperV.VMBus.Gpadl.h>
+#include <Mile.HyperV.VMBus.HostEmulator.h>
+#include <Mile.HyperV.VMBus.MessagePump.h>
+#include <Mile.HyperV.VMBus.Monitor.h>
+#include <Mile.HyperV.VMBus.OfferTable.h>
+#include <Mile.HyperV.VMBus.PipeGpaDirect.h>
+#include <Mile.HyperV.VMBus.PipeStream.h>
+#include <Mile.HyperV.VMBus.Polling.h>
+#include <Mile.HyperV.VMBus.Ring.h>
+#include <Mile.HyperV.VMBus.Servicing.h>
+#include <Mile.HyperV.VMBus.Transaction.h>
+#include <Mile.HyperV.VMBus.TransferPage.h>
+
+#ifndef _WIN32
+#include <Mile.HyperV.Linux.GpaSpace.h>
+#include <Mile.HyperV.Linux.VMBusPipe.h>
+#endif // !_WIN32
@@ -11,4 +11,7 @@
 #include <Windows.h>
 
 #include <Mile.HyperV.VMBus.h>
+#include <Mile.HyperV.VMBus.PipeArrival.h>
+#include <Mile.HyperV.VMBus.PipeAsync.h>
+#include <Mile.HyperV.VMBus.PipeDirectory.h>
 #include <Mile.HyperV.Windows.VMBusPipe.h>
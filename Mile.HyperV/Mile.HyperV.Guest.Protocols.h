@@ -940,7 +940,7 @@ typedef struct _VMTRANSFER_PAGE_RANGES
 //
 
 // {DA0A7802-E377-4AAC-8E77-0558EB1073F8}
-const HV_GUID SYNTHVID_CLASS_ID =
+HV_CONSTEXPR HV_GUID SYNTHVID_CLASS_ID =
 {
     0xDA0A7802,
     0xE377,
@@ -1352,7 +1352,7 @@ typedef struct _SYNTHVID_DIRT_MESSAGE
 //
 
 // {F912AD6D-2B17-48EA-BD65-F927A61C7684}
-const HV_GUID HK_CLASS_ID =
+HV_CONSTEXPR HV_GUID HK_CLASS_ID =
 {
     0xF912AD6D,
     0x2B17,
@@ -1361,7 +1361,7 @@ const HV_GUID HK_CLASS_ID =
 };
 
 // {D34B2567-B9B6-42B9-8778-0A4EC0B955BF}
-const HV_GUID HK_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID HK_INSTANCE_ID =
 {
     0xD34B2567,
     0xB9B6,
@@ -1423,7 +1423,7 @@ typedef struct _HK_MESSAGE_KEYSTROKE
 //
 
 // {CFA8B69E-5B4A-4CC0-B98B-8BA1A1F3F95A}
-const HV_GUID SYNTHHID_CLASS_ID =
+HV_CONSTEXPR HV_GUID SYNTHHID_CLASS_ID =
 {
     0xCFA8B69E,
     0x5B4A,
@@ -1432,7 +1432,7 @@ const HV_GUID SYNTHHID_CLASS_ID =
 };
 
 // {58F75A6D-D949-4320-99E1-A2A2576D581C}
-const HV_GUID SYNTHHID_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID SYNTHHID_INSTANCE_ID =
 {
     0x58F75A6D,
     0xD949,
@@ -1627,7 +1627,7 @@ const HV_UINT8 SYNTHHID_REPORT_DESCRIPTOR[] =
 //
 
 // {BA6163D9-04A1-4D29-B605-72E2FFB1DC7F}
-const HV_GUID VMSCSI_CLASS_ID =
+HV_CONSTEXPR HV_GUID VMSCSI_CLASS_ID =
 {
     0xBA6163D9,
     0x04A1,
@@ -1636,7 +1636,7 @@ const HV_GUID VMSCSI_CLASS_ID =
 };
 
 // {32412632-86CB-44A2-9B5C-50D1417354F5}
-const HV_GUID VMIDE_ACCELERATOR_CLASS_ID =
+HV_CONSTEXPR HV_GUID VMIDE_ACCELERATOR_CLASS_ID =
 {
     0x32412632,
     0x86CB,
@@ -1962,7 +1962,7 @@ typedef struct _ADAPTER_ADDRESS
 //
 
 // {F8615163-DF3E-46C5-913F-F2D2F965ED0E}
-const HV_GUID NVSP_CLASS_ID =
+HV_CONSTEXPR HV_GUID NVSP_CLASS_ID =
 {
     0xF8615163,
     0xDF3E,
@@ -3883,7 +3883,7 @@ typedef struct _RNDIS_OFFLOAD_PARAMETERS
 //
 
 // {44C4F61D-4444-4400-9D52-802E27EDE19F}
-const HV_GUID VPCI_CLASS_ID =
+HV_CONSTEXPR HV_GUID VPCI_CLASS_ID =
 {
     0x44C4F61D,
     0x4444,
@@ -4698,7 +4698,7 @@ typedef struct _VPCI_TDISP_COMMAND
 //
 
 // {C376C1C3-D276-48D2-90A9-C04748072C60}
-const HV_GUID VMBFS_CLASS_ID =
+HV_CONSTEXPR HV_GUID VMBFS_CLASS_ID =
 {
     0xC376C1C3,
     0xD276,
@@ -4707,7 +4707,7 @@ const HV_GUID VMBFS_CLASS_ID =
 };
 
 // {C4E5E7D1-D748-4AFC-979D-683167910A55}
-const HV_GUID VMBFS_IMC_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID VMBFS_IMC_INSTANCE_ID =
 {
     0xC4E5E7D1,
     0xD748,
@@ -4716,7 +4716,7 @@ const HV_GUID VMBFS_IMC_INSTANCE_ID =
 };
 
 // {C63C9BDF-5FA5-4208-B03F-6B458B365592}
-const HV_GUID VMBFS_BOOT_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID VMBFS_BOOT_INSTANCE_ID =
 {
     0xC63C9BDF,
     0x5FA5,
@@ -4876,7 +4876,7 @@ STATIC_ASSERT_VMBFS_MESSAGE_SIZE(VMBFS_MESSAGE_READ_FILE_RDMA_RESPONSE, 8)
 //
 
 // {57164F39-9115-4E78-AB55-382F3BD5422D}
-const HV_GUID IC_HEARTBEAT_CLASS_ID =
+HV_CONSTEXPR HV_GUID IC_HEARTBEAT_CLASS_ID =
 {
     0x57164F39,
     0x9115,
@@ -4885,7 +4885,7 @@ const HV_GUID IC_HEARTBEAT_CLASS_ID =
 };
 
 // {A9A0F4E7-5A45-4D96-B827-8A841E8C03E6}
-const HV_GUID IC_KVP_EXCHANGE_CLASS_ID =
+HV_CONSTEXPR HV_GUID IC_KVP_EXCHANGE_CLASS_ID =
 {
     0xA9A0F4E7,
     0x5A45,
@@ -4894,7 +4894,7 @@ const HV_GUID IC_KVP_EXCHANGE_CLASS_ID =
 };
 
 // {242FF919-07DB-4180-9C2E-B86CB68C8C55}
-const HV_GUID IC_KVP_EXCHANGE_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID IC_KVP_EXCHANGE_INSTANCE_ID =
 {
     0x242FF919,
     0x07DB,
@@ -4903,7 +4903,7 @@ const HV_GUID IC_KVP_EXCHANGE_INSTANCE_ID =
 };
 
 // {0E0B6031-5213-4934-818B-38D90CED39DB}
-const HV_GUID IC_SHUTDOWN_CLASS_ID =
+HV_CONSTEXPR HV_GUID IC_SHUTDOWN_CLASS_ID =
 {
     0x0E0B6031,
     0x5213,
@@ -4912,7 +4912,7 @@ const HV_GUID IC_SHUTDOWN_CLASS_ID =
 };
 
 // {B6650FF7-33BC-4840-8048-E0676786F393}
-const HV_GUID IC_SHUTDOWN_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID IC_SHUTDOWN_INSTANCE_ID =
 {
     0xB6650FF7,
     0x33BC,
@@ -4921,7 +4921,7 @@ const HV_GUID IC_SHUTDOWN_INSTANCE_ID =
 };
 
 // {9527E630-D0AE-497B-ADCE-E80AB0175CAF}
-const HV_GUID IC_TIMESYNC_CLASS_ID =
+HV_CONSTEXPR HV_GUID IC_TIMESYNC_CLASS_ID =
 {
     0x9527E630,
     0xD0AE,
@@ -4930,7 +4930,7 @@ const HV_GUID IC_TIMESYNC_CLASS_ID =
 };
 
 // {2DD1CE17-079E-403C-B352-A1921EE207EE}
-const HV_GUID IC_TIMESYNC_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID IC_TIMESYNC_INSTANCE_ID =
 {
     0x2DD1CE17,
     0x079E,
@@ -4939,7 +4939,7 @@ const HV_GUID IC_TIMESYNC_INSTANCE_ID =
 };
 
 // {35FA2E29-EA23-4236-96AE-3A6EBACBA440}
-const HV_GUID IC_VSS_CLASS_ID =
+HV_CONSTEXPR HV_GUID IC_VSS_CLASS_ID =
 {
     0x35FA2E29,
     0xEA23,
@@ -4948,7 +4948,7 @@ const HV_GUID IC_VSS_CLASS_ID =
 };
 
 // {276AACF4-AC15-426C-98DD-7521AD3F01FE}
-const HV_GUID IC_RDV_CLASS_ID =
+HV_CONSTEXPR HV_GUID IC_RDV_CLASS_ID =
 {
     0x276AACF4,
     0xAC15,
@@ -5537,7 +5537,7 @@ typedef struct _IC_VSS_MSG3_EX
 //
 
 // {3375BAF4-9E15-4B30-B765-67ACB10D607B}
-const HV_GUID INHERITED_ACTIVATION_CLASS_ID =
+HV_CONSTEXPR HV_GUID INHERITED_ACTIVATION_CLASS_ID =
 {
     0x3375BAF4,
     0x9E15,
@@ -6500,7 +6500,7 @@ typedef struct _BOOTEVENT_DEVICE_ENTRY
 } BOOTEVENT_DEVICE_ENTRY, *PBOOTEVENT_DEVICE_ENTRY;
 
 // {8CC6713B-360D-4406-9268-F6B0CFDFCA91}
-const HV_GUID BOOT_EVENT_CHANNEL_GUID =
+HV_CONSTEXPR HV_GUID BOOT_EVENT_CHANNEL_GUID =
 {
     0x8CC6713B,
     0x360D,
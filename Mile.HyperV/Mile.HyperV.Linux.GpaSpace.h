@@ -0,0 +1,258 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Linux.GpaSpace.h
+ * PURPOSE:    Definition for Hyper-V Guest Physical Address Space Emulation
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_LINUX_GPASPACE
+#define MILE_HYPERV_LINUX_GPASPACE
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The GPA space emulation requires C++20 or later.
+#endif // !__cplusplus
+
+#ifdef _WIN32
+#error [Mile.HyperV] The GPA space emulation is not for Windows.
+#endif // _WIN32
+
+#include "Mile.HyperV.VMBus.GpaDirect.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief Emulates a run of guest physical pages with a memfd, so one
+     *        endpoint can describe its buffers by PFN and another endpoint,
+     *        with its own mapping of the same memfd, can access them by PFN.
+     */
+    class VmbusGpaSpaceMapping
+    {
+    private:
+
+        int m_FileDescriptor = -1;
+        PHV_UINT8 m_Base = nullptr;
+        HV_UINT64 m_BasePfn = 0;
+        HV_UINT64 m_PageCount = 0;
+
+        std::size_t MappingSize() const
+        {
+            return static_cast<std::size_t>(m_PageCount * VmbusGpadlPageSize);
+        }
+
+        NTSTATUS Map()
+        {
+            // Guest memory is resident, so fault the pages in up front.
+            void* Base = ::mmap(
+                nullptr,
+                this->MappingSize(),
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE,
+                m_FileDescriptor,
+                0);
+            if (Base == MAP_FAILED)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            m_Base = reinterpret_cast<PHV_UINT8>(Base);
+            return STATUS_SUCCESS;
+        }
+
+    public:
+
+        VmbusGpaSpaceMapping() = default;
+
+        ~VmbusGpaSpaceMapping()
+        {
+            this->Close();
+        }
+
+        VmbusGpaSpaceMapping(VmbusGpaSpaceMapping const&) = delete;
+        VmbusGpaSpaceMapping& operator=(VmbusGpaSpaceMapping const&) = delete;
+
+        /**
+         * @brief Creates a new memfd backed run of pages and maps it.
+         * @param BasePfn The PFN of the first page.
+         * @param PageCount The number of pages.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER or
+         *         STATUS_INSUFFICIENT_RESOURCES.
+         */
+        NTSTATUS Create(
+            HV_UINT64 BasePfn,
+            HV_UINT64 PageCount)
+        {
+            this->Close();
+
+            if (!PageCount || PageCount > ~BasePfn)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            m_FileDescriptor = ::memfd_create(
+                "Mile.HyperV.GpaSpace",
+                MFD_CLOEXEC);
+            if (m_FileDescriptor < 0)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            m_BasePfn = BasePfn;
+            m_PageCount = PageCount;
+
+            NTSTATUS Status = STATUS_INSUFFICIENT_RESOURCES;
+            if (0 == ::ftruncate(
+                m_FileDescriptor,
+                static_cast<off_t>(this->MappingSize())))
+            {
+                Status = this->Map();
+            }
+            if (!NT_SUCCESS(Status))
+            {
+                this->Close();
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Maps pages created by another process or endpoint.
+         * @param FileDescriptor The memfd, which is duplicated.
+         * @param BasePfn The PFN of the first page.
+         * @param PageCount The number of pages.
+         * @return See Create.
+         */
+        NTSTATUS Open(
+            int FileDescriptor,
+            HV_UINT64 BasePfn,
+            HV_UINT64 PageCount)
+        {
+            this->Close();
+
+            if (!PageCount || PageCount > ~BasePfn)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            m_FileDescriptor = ::fcntl(FileDescriptor, F_DUPFD_CLOEXEC, 0);
+            if (m_FileDescriptor < 0)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            m_BasePfn = BasePfn;
+            m_PageCount = PageCount;
+
+            NTSTATUS Status = this->Map();
+            if (!NT_SUCCESS(Status))
+            {
+                this->Close();
+            }
+            return Status;
+        }
+
+        void Close()
+        {
+            if (m_Base)
+            {
+                ::munmap(m_Base, this->MappingSize());
+                m_Base = nullptr;
+            }
+            if (m_FileDescriptor >= 0)
+            {
+                ::close(m_FileDescriptor);
+                m_FileDescriptor = -1;
+            }
+            m_BasePfn = 0;
+            m_PageCount = 0;
+        }
+
+        int FileDescriptor() const
+        {
+            return m_FileDescriptor;
+        }
+
+        PHV_UINT8 Base() const
+        {
+            return m_Base;
+        }
+
+        HV_UINT64 BasePfn() const
+        {
+            return m_BasePfn;
+        }
+
+        HV_UINT64 PageCount() const
+        {
+            return m_PageCount;
+        }
+
+        /**
+         * @brief Gets the local address of a page.
+         * @param Pfn The PFN.
+         * @return The address, or nullptr if the page is not in the mapping.
+         */
+        PHV_UINT8 MapPfn(
+            HV_UINT64 Pfn) const
+        {
+            if (!m_Base || Pfn - m_BasePfn >= m_PageCount)
+            {
+                return nullptr;
+            }
+            return m_Base + (Pfn - m_BasePfn) * VmbusGpadlPageSize;
+        }
+
+        /**
+         * @brief Describes a local buffer inside the mapping by PFN.
+         * @param Buffer The buffer.
+         * @param Size The size of the buffer in bytes.
+         * @param Fragment Receives the description.
+         * @return STATUS_SUCCESS, or STATUS_INVALID_PARAMETER if the buffer is
+         *         empty or not inside the mapping.
+         */
+        NTSTATUS Describe(
+            const void* Buffer,
+            HV_UINT32 Size,
+            VmbusGpaFragment& Fragment) const
+        {
+            const HV_UINT8* Data = reinterpret_cast<const HV_UINT8*>(Buffer);
+            if (!m_Base ||
+                !Size ||
+                Size > this->MappingSize() ||
+                Data < m_Base ||
+                static_cast<std::size_t>(Data - m_Base) > this->MappingSize()
+                    - Size)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            std::size_t Offset = static_cast<std::size_t>(Data - m_Base);
+            Fragment.Pfn = m_BasePfn + Offset / VmbusGpadlPageSize;
+            Fragment.ByteOffset =
+                static_cast<HV_UINT32>(Offset % VmbusGpadlPageSize);
+            Fragment.ByteCount = Size;
+            return STATUS_SUCCESS;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_LINUX_GPASPACE
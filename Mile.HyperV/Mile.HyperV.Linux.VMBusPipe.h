@@ -0,0 +1,1646 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Linux.VMBusPipe.h
+ * PURPOSE:    Definition for Hyper-V VMBus User Mode Pipe API Linux Backend
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+// References
+// - Mile.HyperV.Windows.VMBusPipe.h
+
+#ifndef MILE_HYPERV_LINUX_VMBUSPIPE
+#define MILE_HYPERV_LINUX_VMBUSPIPE
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus pipe Linux backend requires C++20 or later.
+#endif // !__cplusplus
+
+#ifdef _WIN32
+#error [Mile.HyperV] Use Mile.HyperV.Windows.VMBusPipe.h on Windows.
+#endif // _WIN32
+
+#include "Mile.HyperV.Linux.VMBusRing.h"
+#include "Mile.HyperV.VMBus.PipeStream.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <unordered_set>
+#include <vector>
+
+// The subset of the Win32 definitions which the pipe API and the pipe handle
+// I/O use, so the same application code builds against both backends. Each
+// group is skipped when the header which defines it on Windows, or a Win32
+// compatibility layer using the same guards, was included first.
+
+#if !defined(_MINWINDEF_) && !defined(_WINDEF_)
+typedef int BOOL;
+typedef HV_UINT8 BYTE, *LPBYTE;
+typedef HV_UINT16 USHORT;
+typedef HV_UINT32 DWORD, *LPDWORD;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+#endif // !_MINWINDEF_ && !_WINDEF_
+
+#ifndef _WINNT_
+typedef wchar_t WCHAR;
+typedef const WCHAR* LPCWSTR;
+typedef void* HANDLE;
+typedef HANDLE* PHANDLE;
+#endif // !_WINNT_
+
+#ifndef VOID
+#define VOID void
+#endif // !VOID
+
+#ifndef GUID_DEFINED
+#define GUID_DEFINED
+typedef HV_GUID GUID;
+#endif // !GUID_DEFINED
+
+#ifndef __LPCGUID_DEFINED__
+#define __LPCGUID_DEFINED__
+typedef const GUID* LPCGUID;
+#endif // !__LPCGUID_DEFINED__
+
+#ifndef _MINWINBASE_
+typedef struct _OVERLAPPED OVERLAPPED, *LPOVERLAPPED;
+#endif // !_MINWINBASE_
+
+#ifndef WINAPI
+#define WINAPI
+#endif // !WINAPI
+
+#ifndef CALLBACK
+#define CALLBACK
+#endif // !CALLBACK
+
+#ifndef _In_
+#define _In_
+#endif // !_In_
+
+#ifndef _In_opt_
+#define _In_opt_
+#endif // !_In_opt_
+
+#ifndef _Inout_opt_
+#define _Inout_opt_
+#endif // !_Inout_opt_
+
+#ifndef _Out_
+#define _Out_
+#endif // !_Out_
+
+#ifndef _Out_opt_
+#define _Out_opt_
+#endif // !_Out_opt_
+
+#ifndef TRUE
+#define TRUE 1
+#endif // !TRUE
+
+#ifndef FALSE
+#define FALSE 0
+#endif // !FALSE
+
+#ifndef MAX_PATH
+#define MAX_PATH 260
+#endif // !MAX_PATH
+
+#ifndef INFINITE
+#define INFINITE 0xFFFFFFFF
+#endif // !INFINITE
+
+#ifndef INVALID_HANDLE_VALUE
+#define INVALID_HANDLE_VALUE ((HANDLE)(std::intptr_t)-1)
+#endif // !INVALID_HANDLE_VALUE
+
+#ifndef DECLARE_HANDLE
+#define DECLARE_HANDLE(name) struct name##__ { int unused; }; \
+    typedef struct name##__ *name
+#endif // !DECLARE_HANDLE
+
+#ifndef ERROR_SUCCESS
+#define ERROR_SUCCESS 0L
+#endif // !ERROR_SUCCESS
+
+#ifndef ERROR_FILE_NOT_FOUND
+#define ERROR_FILE_NOT_FOUND 2L
+#endif // !ERROR_FILE_NOT_FOUND
+
+#ifndef ERROR_INVALID_HANDLE
+#define ERROR_INVALID_HANDLE 6L
+#endif // !ERROR_INVALID_HANDLE
+
+#ifndef ERROR_NOT_ENOUGH_MEMORY
+#define ERROR_NOT_ENOUGH_MEMORY 8L
+#endif // !ERROR_NOT_ENOUGH_MEMORY
+
+#ifndef ERROR_INVALID_DATA
+#define ERROR_INVALID_DATA 13L
+#endif // !ERROR_INVALID_DATA
+
+#ifndef ERROR_NOT_SUPPORTED
+#define ERROR_NOT_SUPPORTED 50L
+#endif // !ERROR_NOT_SUPPORTED
+
+#ifndef ERROR_INVALID_PARAMETER
+#define ERROR_INVALID_PARAMETER 87L
+#endif // !ERROR_INVALID_PARAMETER
+
+#ifndef ERROR_BROKEN_PIPE
+#define ERROR_BROKEN_PIPE 109L
+#endif // !ERROR_BROKEN_PIPE
+
+#ifndef ERROR_SEM_TIMEOUT
+#define ERROR_SEM_TIMEOUT 121L
+#endif // !ERROR_SEM_TIMEOUT
+
+#ifndef ERROR_ALREADY_EXISTS
+#define ERROR_ALREADY_EXISTS 183L
+#endif // !ERROR_ALREADY_EXISTS
+
+#ifndef ERROR_PIPE_BUSY
+#define ERROR_PIPE_BUSY 231L
+#endif // !ERROR_PIPE_BUSY
+
+#ifndef ERROR_NO_DATA
+#define ERROR_NO_DATA 232L
+#endif // !ERROR_NO_DATA
+
+#ifndef ERROR_PIPE_CONNECTED
+#define ERROR_PIPE_CONNECTED 535L
+#endif // !ERROR_PIPE_CONNECTED
+
+#ifndef ERROR_PIPE_LISTENING
+#define ERROR_PIPE_LISTENING 536L
+#endif // !ERROR_PIPE_LISTENING
+
+#ifndef ERROR_IO_PENDING
+#define ERROR_IO_PENDING 997L
+#endif // !ERROR_IO_PENDING
+
+#include "Mile.HyperV.VMBusPipe.Types.h"
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+namespace Mile::HyperV
+{
+    // The size of each ring when the client does not ask for one.
+    const HV_UINT32 VmbusPipeLinuxDefaultRingSize = 16 * 0x1000;
+
+    // The largest ring size a client may ask for.
+    const HV_UINT32 VmbusPipeLinuxMaximumRingSize = 256 * 0x1000;
+
+    /**
+     * @brief Gets the last error of the calling thread, which the pipe API
+     *        and the pipe handle I/O set on failure like their Win32
+     *        counterparts.
+     * @return The last error.
+     */
+    inline DWORD& VmbusPipeLinuxLastError()
+    {
+        thread_local DWORD LastError = ERROR_SUCCESS;
+        return LastError;
+    }
+
+    inline void VmbusPipeLinuxSetLastError(
+        DWORD ErrorCode)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxLastError() = ErrorCode;
+    }
+
+    inline bool VmbusPipeLinuxIsEqualGuid(
+        GUID const& Left,
+        GUID const& Right)
+    {
+        return 0 == std::memcmp(&Left, &Right, sizeof(GUID));
+    }
+
+    /**
+     * @brief An auto-reset event on top of an eventfd, standing in for one
+     *        direction of a channel interrupt.
+     */
+    class VmbusPipeLinuxEvent
+    {
+    private:
+
+        int m_FileDescriptor = -1;
+
+    public:
+
+        VmbusPipeLinuxEvent() = default;
+
+        ~VmbusPipeLinuxEvent()
+        {
+            if (m_FileDescriptor >= 0)
+            {
+                ::close(m_FileDescriptor);
+            }
+        }
+
+        VmbusPipeLinuxEvent(VmbusPipeLinuxEvent const&) = delete;
+        VmbusPipeLinuxEvent& operator=(VmbusPipeLinuxEvent const&) = delete;
+
+        /**
+         * @brief Creates the eventfd.
+         * @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+         */
+        NTSTATUS Create()
+        {
+            if (m_FileDescriptor < 0)
+            {
+                m_FileDescriptor = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            }
+            return m_FileDescriptor < 0
+                ? STATUS_INSUFFICIENT_RESOURCES
+                : STATUS_SUCCESS;
+        }
+
+        int FileDescriptor() const
+        {
+            return m_FileDescriptor;
+        }
+
+        void Set()
+        {
+            HV_UINT64 Value = 1;
+            while (::write(m_FileDescriptor, &Value, sizeof(Value)) < 0 &&
+                errno == EINTR)
+            {
+            }
+        }
+
+        /**
+         * @brief Waits for the event and resets it.
+         * @param Timeout The maximum time to wait in milliseconds, or -1 to
+         *                wait forever.
+         * @return true if the event was set, false on timeout.
+         */
+        bool Wait(
+            int Timeout = -1)
+        {
+            pollfd Descriptor = {};
+            Descriptor.fd = m_FileDescriptor;
+            Descriptor.events = POLLIN;
+            int Result = ::poll(&Descriptor, 1, Timeout);
+            if (Result <= 0)
+            {
+                return false;
+            }
+            HV_UINT64 Value = 0;
+            return ::read(m_FileDescriptor, &Value, sizeof(Value)) > 0;
+        }
+    };
+
+    /**
+     * @brief One direction of a pipe, a memfd backed ring with the events
+     *        which wake its reader and its writer.
+     */
+    struct VmbusPipeLinuxDirection
+    {
+        VmbusRingMirrorMapping Mapping;
+        // Set by the writer when the ring turns non-empty.
+        VmbusPipeLinuxEvent Readable;
+        // Set by the reader when the free space crosses PendingSendSize.
+        VmbusPipeLinuxEvent Writable;
+
+        NTSTATUS Create(
+            HV_UINT32 DataSize)
+        {
+            NTSTATUS Status = this->Mapping.Create(DataSize);
+            if (NT_SUCCESS(Status))
+            {
+                Status = this->Readable.Create();
+            }
+            if (NT_SUCCESS(Status))
+            {
+                Status = this->Writable.Create();
+            }
+            if (NT_SUCCESS(Status))
+            {
+                this->Mapping.Ring().Reset(true);
+            }
+            return Status;
+        }
+    };
+
+    /**
+     * @brief The state an offered channel shares between the server handle,
+     *        the client handle and the directory.
+     */
+    struct VmbusPipeLinuxChannel
+    {
+        VMBUS_PIPE_CHANNEL_INFO Info;
+        GUID InterfaceType;
+        GUID InterfaceInstance;
+        BYTE UserDefined[112];
+        DWORD OpenMode;
+        DWORD PipeMode;
+
+        // Guarded by the directory lock.
+        bool IsOpening;
+        bool IsConnected;
+        bool IsRescinded;
+
+        // Created by the client when it opens the channel. The first one
+        // carries the server to client bytes.
+        VmbusPipeLinuxDirection Directions[2];
+        // Indexed by whether the endpoint is the client.
+        std::atomic<bool> IsClosed[2];
+    };
+
+    /**
+     * @brief The object behind a pipe handle.
+     */
+    struct VmbusPipeLinuxHandle
+    {
+        std::shared_ptr<VmbusPipeLinuxChannel> Channel;
+        bool IsClient;
+        bool IsConnected;
+        VmbusPipeStreamReader Reader;
+        VmbusPipeStreamWriter Writer;
+
+        VmbusPipeLinuxDirection& Inbound() const
+        {
+            return this->Channel->Directions[this->IsClient ? 0 : 1];
+        }
+
+        VmbusPipeLinuxDirection& Outbound() const
+        {
+            return this->Channel->Directions[this->IsClient ? 1 : 0];
+        }
+
+        bool IsPeerClosed() const
+        {
+            return this->Channel->IsClosed[this->IsClient ? 0 : 1].load(
+                std::memory_order_acquire);
+        }
+
+        void Attach()
+        {
+            this->Reader = VmbusPipeStreamReader(
+                this->Inbound().Mapping.Ring());
+            this->Writer = VmbusPipeStreamWriter(
+                this->Outbound().Mapping.Ring());
+            this->IsConnected = true;
+        }
+    };
+
+    /**
+     * @brief A client registration for channel arrival notifications.
+     */
+    struct VmbusPipeLinuxNotification
+    {
+        GUID InterfaceType;
+        GUID InterfaceInstance;
+        bool MatchAnyInstance;
+        VMBUS_PIPE_CLIENT_CHANNEL_NOTIFICATION_CALLBACK Callback;
+        LPVOID Context;
+
+        // Guarded by the directory lock.
+        bool IsReady;
+        bool IsUnregistered;
+        HV_UINT32 Delivering;
+    };
+
+    /**
+     * @brief The process wide list of offered channels, which stands in for
+     *        the VMBus offers the guest sees.
+     * @remark Channels are only visible inside the process. The rings and
+     *         events are memfds and eventfds, so a future broker can hand
+     *         them to other processes without changing the data path.
+     */
+    class VmbusPipeLinuxDirectory
+    {
+    private:
+
+        std::mutex m_Mutex;
+        std::condition_variable m_Changed;
+        std::vector<std::shared_ptr<VmbusPipeLinuxChannel>> m_Channels;
+        std::vector<VmbusPipeLinuxNotification*> m_Notifications;
+
+        static bool IsMatch(
+            VmbusPipeLinuxNotification const& Notification,
+            VmbusPipeLinuxChannel const& Channel)
+        {
+            return ::Mile::HyperV::VmbusPipeLinuxIsEqualGuid(
+                Notification.InterfaceType,
+                Channel.InterfaceType) &&
+                (Notification.MatchAnyInstance ||
+                    ::Mile::HyperV::VmbusPipeLinuxIsEqualGuid(
+                        Notification.InterfaceInstance,
+                        Channel.InterfaceInstance));
+        }
+
+        /**
+         * @brief Invokes a notification callback for channels, outside the
+         *        lock, and releases the delivery references taken for them.
+         */
+        void Deliver(
+            VmbusPipeLinuxNotification* Notification,
+            std::vector<VMBUS_PIPE_CHANNEL_INFO>& Channels)
+        {
+            for (VMBUS_PIPE_CHANNEL_INFO& Info : Channels)
+            {
+                Notification->Callback(
+                    Notification->Context,
+                    &Info,
+                    ChannelNotificationArrival);
+            }
+
+            bool IsLast = false;
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                IsLast = !--Notification->Delivering &&
+                    Notification->IsUnregistered;
+            }
+            m_Changed.notify_all();
+            if (IsLast)
+            {
+                delete Notification;
+            }
+        }
+
+    public:
+
+        static VmbusPipeLinuxDirectory& Instance()
+        {
+            static VmbusPipeLinuxDirectory Directory;
+            return Directory;
+        }
+
+        /**
+         * @brief Adds a channel and notifies the ready registrations which
+         *        match it.
+         * @param Channel The channel, whose offer fields are filled.
+         * @return ERROR_SUCCESS, or ERROR_ALREADY_EXISTS if a channel with the
+         *         same interface type and instance is offered.
+         */
+        DWORD Offer(
+            std::shared_ptr<VmbusPipeLinuxChannel> const& Channel)
+        {
+            std::vector<VmbusPipeLinuxNotification*> Targets;
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                for (auto const& Current : m_Channels)
+                {
+                    if (::Mile::HyperV::VmbusPipeLinuxIsEqualGuid(
+                        Current->InterfaceType,
+                        Channel->InterfaceType) &&
+                        ::Mile::HyperV::VmbusPipeLinuxIsEqualGuid(
+                            Current->InterfaceInstance,
+                            Channel->InterfaceInstance))
+                    {
+                        return ERROR_ALREADY_EXISTS;
+                    }
+                }
+                m_Channels.push_back(Channel);
+                for (VmbusPipeLinuxNotification* Current : m_Notifications)
+                {
+                    if (Current->IsReady &&
+                        VmbusPipeLinuxDirectory::IsMatch(*Current, *Channel))
+                    {
+                        ++Current->Delivering;
+                        Targets.push_back(Current);
+                    }
+                }
+            }
+            m_Changed.notify_all();
+
+            for (VmbusPipeLinuxNotification* Current : Targets)
+            {
+                std::vector<VMBUS_PIPE_CHANNEL_INFO> Channels(
+                    1,
+                    Channel->Info);
+                this->Deliver(Current, Channels);
+            }
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Removes a channel when its server handle is closed.
+         * @return Whether a client connected to the channel.
+         */
+        bool Rescind(
+            VmbusPipeLinuxChannel* Channel)
+        {
+            bool IsConnected = false;
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                Channel->IsRescinded = true;
+                IsConnected = Channel->IsConnected;
+                for (auto Current = m_Channels.begin();
+                    Current != m_Channels.end();
+                    ++Current)
+                {
+                    if (Current->get() == Channel)
+                    {
+                        m_Channels.erase(Current);
+                        break;
+                    }
+                }
+            }
+            m_Changed.notify_all();
+            return IsConnected;
+        }
+
+        /**
+         * @brief Gets the channels with an interface type.
+         * @param InterfaceType The interface type.
+         * @param InterfaceInstance Optional. The interface instance.
+         * @return The channels.
+         */
+        std::vector<std::shared_ptr<VmbusPipeLinuxChannel>> Find(
+            GUID const& InterfaceType,
+            const GUID* InterfaceInstance)
+        {
+            std::vector<std::shared_ptr<VmbusPipeLinuxChannel>> Result;
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            for (auto const& Current : m_Channels)
+            {
+                if (::Mile::HyperV::VmbusPipeLinuxIsEqualGuid(
+                    Current->InterfaceType,
+                    InterfaceType) &&
+                    (!InterfaceInstance ||
+                        ::Mile::HyperV::VmbusPipeLinuxIsEqualGuid(
+                            Current->InterfaceInstance,
+                            *InterfaceInstance)))
+                {
+                    Result.push_back(Current);
+                }
+            }
+            return Result;
+        }
+
+        /**
+         * @brief Waits until a channel is offered.
+         * @param InterfaceType The interface type.
+         * @param InterfaceInstance The interface instance.
+         * @param Timeout The maximum time to wait in milliseconds, or
+         *                INFINITE.
+         * @param Info Receives the channel information.
+         * @return true if the channel is offered, false on timeout.
+         */
+        bool Wait(
+            GUID const& InterfaceType,
+            GUID const& InterfaceInstance,
+            DWORD Timeout,
+            VMBUS_PIPE_CHANNEL_INFO& Info)
+        {
+            auto Predicate = [&]() -> bool
+            {
+                for (auto const& Current : m_Channels)
+                {
+                    if (::Mile::HyperV::VmbusPipeLinuxIsEqualGuid(
+                        Current->InterfaceType,
+                        InterfaceType) &&
+                        ::Mile::HyperV::VmbusPipeLinuxIsEqualGuid(
+                            Current->InterfaceInstance,
+                            InterfaceInstance))
+                    {
+                        Info = Current->Info;
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            std::unique_lock<std::mutex> Lock(m_Mutex);
+            if (Timeout == INFINITE)
+            {
+                m_Changed.wait(Lock, Predicate);
+                return true;
+            }
+            return m_Changed.wait_for(
+                Lock,
+                std::chrono::milliseconds(Timeout),
+                Predicate);
+        }
+
+        /**
+         * @brief Reserves a channel for a client.
+         * @param Info The channel information from an offer.
+         * @param Channel Receives the channel.
+         * @return ERROR_SUCCESS, ERROR_FILE_NOT_FOUND, or ERROR_PIPE_BUSY if a
+         *         client already opened it.
+         */
+        DWORD BeginOpen(
+            VMBUS_PIPE_CHANNEL_INFO const& Info,
+            std::shared_ptr<VmbusPipeLinuxChannel>& Channel)
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            for (auto const& Current : m_Channels)
+            {
+                if (0 == std::wcsncmp(
+                    Current->Info.DevicePath,
+                    Info.DevicePath,
+                    MAX_PATH + 4))
+                {
+                    if (Current->IsOpening || Current->IsConnected)
+                    {
+                        return ERROR_PIPE_BUSY;
+                    }
+                    Current->IsOpening = true;
+                    Channel = Current;
+                    return ERROR_SUCCESS;
+                }
+            }
+            return ERROR_FILE_NOT_FOUND;
+        }
+
+        /**
+         * @brief Completes the reservation made by BeginOpen, and wakes the
+         *        server if the client connected.
+         * @return Whether the client connected, which fails if the channel
+         *         was rescinded meanwhile.
+         */
+        bool EndOpen(
+            VmbusPipeLinuxChannel* Channel,
+            bool IsConnected)
+        {
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                Channel->IsOpening = false;
+                Channel->IsConnected = IsConnected && !Channel->IsRescinded;
+                IsConnected = Channel->IsConnected;
+            }
+            m_Changed.notify_all();
+            return IsConnected;
+        }
+
+        /**
+         * @brief Waits until a client connects to a channel.
+         * @return true if a client connected, false if the channel was
+         *         rescinded.
+         */
+        bool WaitConnected(
+            VmbusPipeLinuxChannel* Channel)
+        {
+            std::unique_lock<std::mutex> Lock(m_Mutex);
+            m_Changed.wait(Lock, [&]()
+            {
+                return Channel->IsConnected || Channel->IsRescinded;
+            });
+            return Channel->IsConnected;
+        }
+
+        void Register(
+            VmbusPipeLinuxNotification* Notification)
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            m_Notifications.push_back(Notification);
+        }
+
+        /**
+         * @brief Starts the notifications of a registration.
+         * @param Notification The registration.
+         * @param ReportExisting Whether the channels offered before are
+         *                       reported now.
+         */
+        void Ready(
+            VmbusPipeLinuxNotification* Notification,
+            bool ReportExisting)
+        {
+            std::vector<VMBUS_PIPE_CHANNEL_INFO> Channels;
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                if (Notification->IsReady)
+                {
+                    return;
+                }
+                Notification->IsReady = true;
+                if (ReportExisting)
+                {
+                    for (auto const& Current : m_Channels)
+                    {
+                        if (VmbusPipeLinuxDirectory::IsMatch(
+                            *Notification,
+                            *Current))
+                        {
+                            Channels.push_back(Current->Info);
+                        }
+                    }
+                }
+                if (Channels.empty())
+                {
+                    return;
+                }
+                ++Notification->Delivering;
+            }
+            this->Deliver(Notification, Channels);
+        }
+
+        /**
+         * @brief Stops the notifications of a registration and frees it.
+         * @param Notification The registration.
+         * @param Wait Whether to wait for the callbacks in progress. The
+         *             registration is freed by the last of them otherwise.
+         */
+        void Unregister(
+            VmbusPipeLinuxNotification* Notification,
+            bool Wait)
+        {
+            std::unique_lock<std::mutex> Lock(m_Mutex);
+            for (auto Current = m_Notifications.begin();
+                Current != m_Notifications.end();
+                ++Current)
+            {
+                if (*Current == Notification)
+                {
+                    m_Notifications.erase(Current);
+                    break;
+                }
+            }
+            Notification->IsUnregistered = true;
+            if (Wait)
+            {
+                m_Changed.wait(Lock, [&]()
+                {
+                    return !Notification->Delivering;
+                });
+            }
+            if (!Notification->Delivering)
+            {
+                Lock.unlock();
+                delete Notification;
+            }
+        }
+    };
+
+    /**
+     * @brief Rounds a requested ring size up to whole pages of the mapping
+     *        granularity.
+     * @param Size The requested size in bytes, or zero for the default.
+     * @return The ring size, or zero if the size is too large.
+     */
+    inline HV_UINT32 VmbusPipeLinuxRingSize(
+        DWORD Size)
+    {
+        if (!Size)
+        {
+            return VmbusPipeLinuxDefaultRingSize;
+        }
+        if (Size > VmbusPipeLinuxMaximumRingSize)
+        {
+            return 0;
+        }
+        HV_UINT32 PageSize = static_cast<HV_UINT32>(
+            ::Mile::HyperV::VmbusRingMappingGranularity());
+        return (Size + PageSize - 1) & ~(PageSize - 1);
+    }
+
+    /**
+     * @brief Formats the device path of a channel, which is what clients
+     *        pass back to open it.
+     */
+    inline void VmbusPipeLinuxFormatDevicePath(
+        VmbusPipeLinuxChannel& Channel)
+    {
+        GUID const& Type = Channel.InterfaceType;
+        GUID const& Instance = Channel.InterfaceInstance;
+        std::swprintf(
+            Channel.Info.DevicePath,
+            MAX_PATH + 4,
+            L"\\\\?\\VMBUS#{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}"
+            L"#{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
+            Type.Data1, Type.Data2, Type.Data3,
+            Type.Data4[0], Type.Data4[1], Type.Data4[2], Type.Data4[3],
+            Type.Data4[4], Type.Data4[5], Type.Data4[6], Type.Data4[7],
+            Instance.Data1, Instance.Data2, Instance.Data3,
+            Instance.Data4[0], Instance.Data4[1], Instance.Data4[2],
+            Instance.Data4[3], Instance.Data4[4], Instance.Data4[5],
+            Instance.Data4[6], Instance.Data4[7]);
+    }
+
+    /**
+     * @brief The process wide set of open pipe handles, so a value which is
+     *        not a pipe handle, or a handle which was closed already, is
+     *        refused instead of being dereferenced.
+     */
+    class VmbusPipeLinuxHandleTable
+    {
+    private:
+
+        std::mutex m_Mutex;
+        std::unordered_set<HANDLE> m_Handles;
+
+    public:
+
+        static VmbusPipeLinuxHandleTable& Instance()
+        {
+            static VmbusPipeLinuxHandleTable Table;
+            return Table;
+        }
+
+        HANDLE Insert(
+            VmbusPipeLinuxHandle* Handle)
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            m_Handles.insert(Handle);
+            return Handle;
+        }
+
+        bool Contains(
+            HANDLE Handle)
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            return m_Handles.find(Handle) != m_Handles.end();
+        }
+
+        /**
+         * @brief Removes a handle, so only one of several threads closing
+         *        it at once gets to free it.
+         * @return true if the handle was open.
+         */
+        bool Remove(
+            HANDLE Handle)
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            return m_Handles.erase(Handle) != 0;
+        }
+    };
+
+    inline VmbusPipeLinuxHandle* VmbusPipeLinuxFromHandle(
+        HANDLE Handle)
+    {
+        if (!Handle ||
+            Handle == INVALID_HANDLE_VALUE ||
+            !VmbusPipeLinuxHandleTable::Instance().Contains(Handle))
+        {
+            return nullptr;
+        }
+        return static_cast<VmbusPipeLinuxHandle*>(Handle);
+    }
+
+    /**
+     * @brief Reads the bytes available from a pipe handle without waiting.
+     * @param PipeHandle The pipe handle.
+     * @param Buffer The buffer which receives the bytes.
+     * @param Size The size of the buffer in bytes.
+     * @param BytesRead Receives the number of bytes read.
+     * @return ERROR_SUCCESS, ERROR_IO_PENDING if there are no bytes yet, in
+     *         which case the event returned by VmbusPipeLinuxEventDescriptor
+     *         is set once there are, ERROR_BROKEN_PIPE if the opposite
+     *         endpoint closed, ERROR_PIPE_LISTENING, ERROR_INVALID_HANDLE or
+     *         ERROR_INVALID_DATA.
+     */
+    inline DWORD VmbusPipeLinuxTryRead(
+        HANDLE PipeHandle,
+        void* Buffer,
+        DWORD Size,
+        DWORD* BytesRead)
+    {
+        *BytesRead = 0;
+        VmbusPipeLinuxHandle* Handle =
+            ::Mile::HyperV::VmbusPipeLinuxFromHandle(PipeHandle);
+        if (!Handle)
+        {
+            return ERROR_INVALID_HANDLE;
+        }
+        if (!Handle->IsConnected)
+        {
+            return ERROR_PIPE_LISTENING;
+        }
+        if (!Size)
+        {
+            return ERROR_SUCCESS;
+        }
+
+        // The opposite endpoint publishes its last bytes before it closes,
+        // so an empty ring after seeing it closed means no more bytes.
+        bool IsPeerClosed = Handle->IsPeerClosed();
+        HV_UINT32 Bytes = 0;
+        bool SignalRequired = false;
+        NTSTATUS Status = Handle->Reader.Read(
+            Buffer,
+            Size,
+            &Bytes,
+            &SignalRequired);
+        if (SignalRequired)
+        {
+            Handle->Inbound().Writable.Set();
+        }
+        if (NT_SUCCESS(Status))
+        {
+            *BytesRead = Bytes;
+            return ERROR_SUCCESS;
+        }
+        if (Status == STATUS_END_OF_FILE ||
+            (Status == STATUS_NO_MORE_ENTRIES && IsPeerClosed))
+        {
+            return ERROR_BROKEN_PIPE;
+        }
+        if (Status != STATUS_NO_MORE_ENTRIES)
+        {
+            return ERROR_INVALID_DATA;
+        }
+        // The writer signals every time the ring turns non-empty, because
+        // InterruptMask is never set, so the caller can wait for the event.
+        return ERROR_IO_PENDING;
+    }
+
+    /**
+     * @brief Writes as many bytes as fit to a pipe handle without waiting.
+     * @param PipeHandle The pipe handle.
+     * @param Buffer The bytes.
+     * @param Size The number of bytes.
+     * @param BytesWritten Receives the number of bytes written.
+     * @return ERROR_SUCCESS if at least one byte or every byte was written,
+     *         ERROR_IO_PENDING if the ring is full, in which case the event
+     *         returned by VmbusPipeLinuxEventDescriptor is set once there is
+     *         room, ERROR_NO_DATA if the opposite endpoint closed,
+     *         ERROR_PIPE_LISTENING, ERROR_INVALID_HANDLE or
+     *         ERROR_INVALID_DATA.
+     */
+    inline DWORD VmbusPipeLinuxTryWrite(
+        HANDLE PipeHandle,
+        const void* Buffer,
+        DWORD Size,
+        DWORD* BytesWritten)
+    {
+        *BytesWritten = 0;
+        VmbusPipeLinuxHandle* Handle =
+            ::Mile::HyperV::VmbusPipeLinuxFromHandle(PipeHandle);
+        if (!Handle)
+        {
+            return ERROR_INVALID_HANDLE;
+        }
+        if (!Handle->IsConnected)
+        {
+            return ERROR_PIPE_LISTENING;
+        }
+
+        VmbusPipeLinuxDirection& Outbound = Handle->Outbound();
+        PVMRCB Control = Outbound.Mapping.Ring().Control();
+        for (;;)
+        {
+            if (Handle->IsPeerClosed())
+            {
+                return ERROR_NO_DATA;
+            }
+
+            HV_UINT32 Bytes = 0;
+            bool SignalRequired = false;
+            NTSTATUS Status = Handle->Writer.Write(
+                Buffer,
+                Size,
+                &Bytes,
+                &SignalRequired);
+            if (SignalRequired)
+            {
+                Outbound.Readable.Set();
+            }
+            if (NT_SUCCESS(Status))
+            {
+                ::Mile::HyperV::VmbusRingStoreRelaxed(
+                    Control->PendingSendSize,
+                    0);
+                *BytesWritten = Bytes;
+                return ERROR_SUCCESS;
+            }
+            if (Status != STATUS_INSUFFICIENT_RESOURCES)
+            {
+                return ERROR_INVALID_DATA;
+            }
+
+            // Ask the reader to signal once a quarter of the ring or the
+            // bytes fit, whichever is smaller, so a full ring is refilled in
+            // large pieces instead of one small packet per wake up.
+            HV_UINT32 Wanted = Outbound.Mapping.Ring().DataSize() / 4;
+            if (Wanted > Size)
+            {
+                Wanted = Size;
+            }
+            Wanted += VmbusPipePacketOverhead
+                + VmbusRingTrailerSize
+                + VmbusRingPacketAlignment;
+            ::Mile::HyperV::VmbusRingStoreRelaxed(
+                Control->PendingSendSize,
+                Wanted);
+            // Pairs with the fence after the Out store in the reader.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (Handle->Writer.BytesAvailable() <= Wanted)
+            {
+                return ERROR_IO_PENDING;
+            }
+        }
+    }
+
+    /**
+     * @brief Gets the eventfd which is set when a read or a write which
+     *        returned ERROR_IO_PENDING can make progress.
+     * @param PipeHandle The connected pipe handle.
+     * @param IsWrite Whether to get the event for writes.
+     * @return The eventfd, or -1 if the handle is not connected.
+     * @remark The event is shared by every read or every write of the
+     *         handle, so it only suits one outstanding operation of each
+     *         kind. Its counter is never reset by the pipe functions.
+     */
+    inline int VmbusPipeLinuxEventDescriptor(
+        HANDLE PipeHandle,
+        bool IsWrite)
+    {
+        VmbusPipeLinuxHandle* Handle =
+            ::Mile::HyperV::VmbusPipeLinuxFromHandle(PipeHandle);
+        if (!Handle || !Handle->IsConnected)
+        {
+            return -1;
+        }
+        return IsWrite
+            ? Handle->Outbound().Writable.FileDescriptor()
+            : Handle->Inbound().Readable.FileDescriptor();
+    }
+}
+
+inline BOOL WINAPI VmbusPipeClientEnumeratePipes(
+    _In_ LPCGUID InterfaceType,
+    _In_opt_ LPVOID UserContext,
+    _In_ CHANNEL_OFFER_NOTIFICATION OnOfferNotification)
+{
+    using namespace ::Mile::HyperV;
+
+    if (!InterfaceType || !OnOfferNotification)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    // The callbacks run outside the directory lock, so they may open the
+    // channels they are told about.
+    for (auto const& Channel : VmbusPipeLinuxDirectory::Instance().Find(
+        *InterfaceType,
+        nullptr))
+    {
+        VMBUS_PIPE_CHANNEL_INFO Info = Channel->Info;
+        BYTE UserDefined[sizeof(Channel->UserDefined)];
+        std::memcpy(UserDefined, Channel->UserDefined, sizeof(UserDefined));
+        GUID InterfaceInstance = Channel->InterfaceInstance;
+        OnOfferNotification(
+            UserContext,
+            UserDefined,
+            &Info,
+            &InterfaceInstance);
+    }
+    return TRUE;
+}
+
+inline HANDLE WINAPI VmbusPipeClientOpenChannelEx(
+    _In_ PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+    _In_ DWORD OpenMode,
+    _In_ PVMBUS_PIPE_CLIENT_CHANNEL_SETTINGS ChannelSettings)
+{
+    using namespace ::Mile::HyperV;
+
+    (void)OpenMode;
+
+    if (!ChannelInfo)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    DWORD IncomingSize = 0;
+    DWORD OutgoingSize = 0;
+    if (ChannelSettings)
+    {
+        if (ChannelSettings->Version !=
+            VMBUS_PIPE_CLIENT_CHANNEL_CURRENT_VERSION ||
+            ChannelSettings->Size < sizeof(VMBUS_PIPE_CLIENT_CHANNEL_SETTINGS))
+        {
+            ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_PARAMETER);
+            return INVALID_HANDLE_VALUE;
+        }
+        IncomingSize = ChannelSettings->IncomingSize;
+        OutgoingSize = ChannelSettings->OutgoingSize;
+    }
+    HV_UINT32 Sizes[2] =
+    {
+        ::Mile::HyperV::VmbusPipeLinuxRingSize(IncomingSize),
+        ::Mile::HyperV::VmbusPipeLinuxRingSize(OutgoingSize),
+    };
+    if (!Sizes[0] || !Sizes[1])
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    VmbusPipeLinuxDirectory& Directory = VmbusPipeLinuxDirectory::Instance();
+    std::shared_ptr<VmbusPipeLinuxChannel> Channel;
+    DWORD Error = Directory.BeginOpen(*ChannelInfo, Channel);
+    if (Error != ERROR_SUCCESS)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(Error);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // The client allocates the rings, as a guest allocates the GPADL of a
+    // channel it opens.
+    for (HV_UINT32 i = 0; i < 2; ++i)
+    {
+        if (!NT_SUCCESS(Channel->Directions[i].Create(Sizes[i])))
+        {
+            Error = ERROR_NOT_ENOUGH_MEMORY;
+            break;
+        }
+    }
+    VmbusPipeLinuxHandle* Handle = nullptr;
+    if (Error == ERROR_SUCCESS)
+    {
+        Handle = new (std::nothrow) VmbusPipeLinuxHandle();
+        if (!Handle)
+        {
+            Error = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+    if (Error == ERROR_SUCCESS)
+    {
+        Handle->Channel = Channel;
+        Handle->IsClient = true;
+        Handle->Attach();
+        if (!Directory.EndOpen(Channel.get(), true))
+        {
+            delete Handle;
+            ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_FILE_NOT_FOUND);
+            return INVALID_HANDLE_VALUE;
+        }
+        return VmbusPipeLinuxHandleTable::Instance().Insert(Handle);
+    }
+
+    delete Handle;
+    for (HV_UINT32 i = 0; i < 2; ++i)
+    {
+        Channel->Directions[i].Mapping.Close();
+    }
+    Directory.EndOpen(Channel.get(), false);
+    ::Mile::HyperV::VmbusPipeLinuxSetLastError(Error);
+    return INVALID_HANDLE_VALUE;
+}
+
+inline HANDLE WINAPI VmbusPipeClientOpenChannel(
+    _In_ PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+    _In_ DWORD OpenMode)
+{
+    return ::VmbusPipeClientOpenChannelEx(ChannelInfo, OpenMode, nullptr);
+}
+
+inline BOOL WINAPI VmbusPipeClientWaitChannel(
+    _In_ LPCGUID InterfaceType,
+    _In_ LPCGUID InterfaceInstance,
+    _In_ DWORD TimeoutInMsec,
+    _In_ PVMBUS_PIPE_CHANNEL_INFO ChannelInfo)
+{
+    using namespace ::Mile::HyperV;
+
+    if (!InterfaceType || !InterfaceInstance || !ChannelInfo)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (!VmbusPipeLinuxDirectory::Instance().Wait(
+        *InterfaceType,
+        *InterfaceInstance,
+        TimeoutInMsec,
+        *ChannelInfo))
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_SEM_TIMEOUT);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+inline BOOL WINAPI VmbusPipeServerConnectPipe(
+    _In_ HANDLE PipeHandle,
+    _Inout_opt_ LPOVERLAPPED Overlapped)
+{
+    using namespace ::Mile::HyperV;
+
+    VmbusPipeLinuxHandle* Handle =
+        ::Mile::HyperV::VmbusPipeLinuxFromHandle(PipeHandle);
+    if (!Handle || Handle->IsClient)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    if (Overlapped)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+    if (Handle->IsConnected)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_PIPE_CONNECTED);
+        return FALSE;
+    }
+    if (!VmbusPipeLinuxDirectory::Instance().WaitConnected(
+        Handle->Channel.get()))
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_BROKEN_PIPE);
+        return FALSE;
+    }
+    Handle->Attach();
+    return TRUE;
+}
+
+inline DWORD WINAPI VmbusPipeServerOfferChannelEx(
+    PCVMBUS_PIPE_SERVER_OFFER_EX Offer,
+    DWORD OpenMode,
+    DWORD PipeMode,
+    PHANDLE PipeHandle)
+{
+    using namespace ::Mile::HyperV;
+
+    if (!Offer ||
+        Offer->Size < sizeof(VMBUS_PIPE_SERVER_OFFER_EX) ||
+        !PipeHandle)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+    *PipeHandle = INVALID_HANDLE_VALUE;
+
+    std::shared_ptr<VmbusPipeLinuxChannel> Channel(
+        new (std::nothrow) VmbusPipeLinuxChannel());
+    VmbusPipeLinuxHandle* Handle = new (std::nothrow) VmbusPipeLinuxHandle();
+    if (!Channel || !Handle)
+    {
+        delete Handle;
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    Channel->InterfaceType = Offer->InterfaceType;
+    Channel->InterfaceInstance = Offer->InterfaceInstance;
+    std::memcpy(
+        Channel->UserDefined,
+        Offer->UserDefined,
+        sizeof(Channel->UserDefined));
+    Channel->OpenMode = OpenMode;
+    Channel->PipeMode = PipeMode;
+    ::Mile::HyperV::VmbusPipeLinuxFormatDevicePath(*Channel);
+    Handle->Channel = Channel;
+    Handle->IsClient = false;
+
+    DWORD Error = VmbusPipeLinuxDirectory::Instance().Offer(Channel);
+    if (Error != ERROR_SUCCESS)
+    {
+        delete Handle;
+        return Error;
+    }
+    *PipeHandle = VmbusPipeLinuxHandleTable::Instance().Insert(Handle);
+    return ERROR_SUCCESS;
+}
+
+inline HANDLE WINAPI VmbusPipeServerOfferChannel(
+    PVMBUS_PIPE_SERVER_OFFER Offer,
+    DWORD OpenMode,
+    DWORD PipeMode)
+{
+    if (!Offer)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    VMBUS_PIPE_SERVER_OFFER_EX OfferEx = {};
+    OfferEx.Version = 1;
+    OfferEx.Size = sizeof(OfferEx);
+    OfferEx.VmGuid = Offer->VmGuid;
+    OfferEx.InterruptLatencyInMilliseconds =
+        Offer->InterruptLatencyInMilliseconds;
+    OfferEx.InterfaceType = Offer->InterfaceType;
+    OfferEx.InterfaceInstance = Offer->InterfaceInstance;
+    OfferEx.InterfaceRevision = Offer->InterfaceRevision;
+    OfferEx.MmioMegabytes = Offer->MmioMegabytes;
+    OfferEx.Flags = Offer->Flags;
+    std::memcpy(
+        OfferEx.UserDefined,
+        Offer->UserDefined,
+        sizeof(OfferEx.UserDefined));
+
+    HANDLE PipeHandle = INVALID_HANDLE_VALUE;
+    DWORD Error = ::VmbusPipeServerOfferChannelEx(
+        &OfferEx,
+        OpenMode,
+        PipeMode,
+        &PipeHandle);
+    if (Error != ERROR_SUCCESS)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(Error);
+        return INVALID_HANDLE_VALUE;
+    }
+    return PipeHandle;
+}
+
+inline VOID WINAPI VmbusPipeClientReadyForChannelNotification(
+    _In_ HVMBUS_PIPE_NOTIFICATION NotificationContext,
+    _In_ BOOL ReportExistingChannels)
+{
+    using namespace ::Mile::HyperV;
+
+    if (NotificationContext)
+    {
+        VmbusPipeLinuxDirectory::Instance().Ready(
+            reinterpret_cast<VmbusPipeLinuxNotification*>(
+                NotificationContext),
+            ReportExistingChannels);
+    }
+}
+
+inline HVMBUS_PIPE_NOTIFICATION WINAPI
+VmbusPipeClientRegisterChannelNotification(
+    _In_ LPCGUID InterfaceType,
+    _In_ LPCGUID InterfaceInstance,
+    _In_ DWORD Flags,
+    _In_ VMBUS_PIPE_CLIENT_CHANNEL_NOTIFICATION_CALLBACK Callback,
+    _In_opt_ LPVOID ClientContext)
+{
+    using namespace ::Mile::HyperV;
+
+    (void)Flags;
+
+    if (!InterfaceType || !Callback)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_PARAMETER);
+        return nullptr;
+    }
+
+    VmbusPipeLinuxNotification* Notification =
+        new (std::nothrow) VmbusPipeLinuxNotification();
+    if (!Notification)
+    {
+        ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return nullptr;
+    }
+    Notification->InterfaceType = *InterfaceType;
+    // A null instance asks for every instance of the interface.
+    Notification->MatchAnyInstance = !InterfaceInstance;
+    if (InterfaceInstance)
+    {
+        Notification->InterfaceInstance = *InterfaceInstance;
+    }
+    Notification->Callback = Callback;
+    Notification->Context = ClientContext;
+    VmbusPipeLinuxDirectory::Instance().Register(Notification);
+    return reinterpret_cast<HVMBUS_PIPE_NOTIFICATION>(Notification);
+}
+
+inline VOID WINAPI VmbusPipeClientUnregisterChannelNotification(
+    _In_ HVMBUS_PIPE_NOTIFICATION NotificationContext,
+    _In_ BOOL WaitForNotificationsToComplete)
+{
+    using namespace ::Mile::HyperV;
+
+    if (NotificationContext)
+    {
+        VmbusPipeLinuxDirectory::Instance().Unregister(
+            reinterpret_cast<VmbusPipeLinuxNotification*>(
+                NotificationContext),
+            WaitForNotificationsToComplete);
+    }
+}
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief Reads the bytes available from a pipe handle, and waits for the
+     *        opposite endpoint when there are none.
+     * @remark Only one thread may read from a handle at a time, and
+     *         overlapped I/O is not supported.
+     */
+    inline BOOL VmbusPipeLinuxReadFile(
+        HANDLE FileHandle,
+        LPVOID Buffer,
+        DWORD NumberOfBytesToRead,
+        LPDWORD NumberOfBytesRead,
+        LPOVERLAPPED Overlapped)
+    {
+        if (NumberOfBytesRead)
+        {
+            *NumberOfBytesRead = 0;
+        }
+        if (Overlapped)
+        {
+            ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+        VmbusPipeLinuxHandle* Handle =
+            ::Mile::HyperV::VmbusPipeLinuxFromHandle(FileHandle);
+        if (!Handle)
+        {
+            ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_HANDLE);
+            return FALSE;
+        }
+
+        for (;;)
+        {
+            DWORD BytesRead = 0;
+            DWORD Error = ::Mile::HyperV::VmbusPipeLinuxTryRead(
+                FileHandle,
+                Buffer,
+                NumberOfBytesToRead,
+                &BytesRead);
+            if (Error == ERROR_SUCCESS)
+            {
+                if (NumberOfBytesRead)
+                {
+                    *NumberOfBytesRead = BytesRead;
+                }
+                return TRUE;
+            }
+            if (Error != ERROR_IO_PENDING)
+            {
+                ::Mile::HyperV::VmbusPipeLinuxSetLastError(Error);
+                return FALSE;
+            }
+            Handle->Inbound().Readable.Wait();
+        }
+    }
+
+    /**
+     * @brief Writes bytes to a pipe handle, and waits for the opposite
+     *        endpoint to make room while the ring is full.
+     * @remark Only one thread may write to a handle at a time, and
+     *         overlapped I/O is not supported.
+     */
+    inline BOOL VmbusPipeLinuxWriteFile(
+        HANDLE FileHandle,
+        LPCVOID Buffer,
+        DWORD NumberOfBytesToWrite,
+        LPDWORD NumberOfBytesWritten,
+        LPOVERLAPPED Overlapped)
+    {
+        if (NumberOfBytesWritten)
+        {
+            *NumberOfBytesWritten = 0;
+        }
+        if (Overlapped)
+        {
+            ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+        VmbusPipeLinuxHandle* Handle =
+            ::Mile::HyperV::VmbusPipeLinuxFromHandle(FileHandle);
+        if (!Handle)
+        {
+            ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_HANDLE);
+            return FALSE;
+        }
+
+        const HV_UINT8* Source = static_cast<const HV_UINT8*>(Buffer);
+        DWORD Written = 0;
+        do
+        {
+            DWORD BytesWritten = 0;
+            DWORD Error = ::Mile::HyperV::VmbusPipeLinuxTryWrite(
+                FileHandle,
+                Source + Written,
+                NumberOfBytesToWrite - Written,
+                &BytesWritten);
+            if (Error == ERROR_IO_PENDING)
+            {
+                Handle->Outbound().Writable.Wait();
+                continue;
+            }
+            if (Error != ERROR_SUCCESS)
+            {
+                ::Mile::HyperV::VmbusPipeLinuxSetLastError(Error);
+                return FALSE;
+            }
+            Written += BytesWritten;
+            if (NumberOfBytesWritten)
+            {
+                *NumberOfBytesWritten = Written;
+            }
+        } while (Written < NumberOfBytesToWrite);
+        return TRUE;
+    }
+
+    /**
+     * @brief Closes a pipe handle. Closing the server handle rescinds the
+     *        offer, and closing a connected handle ends the stream of the
+     *        opposite endpoint once it read the bytes already written.
+     * @remark Values which are not open pipe handles are refused with
+     *         ERROR_INVALID_HANDLE, which includes handles closed already.
+     */
+    inline BOOL VmbusPipeLinuxCloseHandle(
+        HANDLE Object)
+    {
+        if (!Object ||
+            Object == INVALID_HANDLE_VALUE ||
+            !VmbusPipeLinuxHandleTable::Instance().Remove(Object))
+        {
+            ::Mile::HyperV::VmbusPipeLinuxSetLastError(ERROR_INVALID_HANDLE);
+            return FALSE;
+        }
+        VmbusPipeLinuxHandle* Handle =
+            static_cast<VmbusPipeLinuxHandle*>(Object);
+
+        // A server closed before it waited for the client still has to end
+        // the stream of a client which already connected.
+        bool IsChannelConnected = Handle->IsConnected;
+        if (!Handle->IsClient)
+        {
+            IsChannelConnected = VmbusPipeLinuxDirectory::Instance().Rescind(
+                Handle->Channel.get());
+        }
+        if (IsChannelConnected)
+        {
+            // The end of stream packet is a courtesy, the closed flag is what
+            // the opposite endpoint relies on when the ring is full.
+            if (Handle->IsConnected)
+            {
+                Handle->Writer.Shutdown();
+            }
+            Handle->Channel->IsClosed[Handle->IsClient ? 1 : 0].store(
+                true,
+                std::memory_order_release);
+            Handle->Outbound().Readable.Set();
+            Handle->Inbound().Writable.Set();
+        }
+        delete Handle;
+        return TRUE;
+    }
+}
+
+// The Win32 functions the pipe handles are used with. Define
+// MILE_HYPERV_LINUX_VMBUSPIPE_NO_WIN32_API when another Win32 compatibility
+// layer provides them, and forward pipe handles to the VmbusPipeLinux
+// functions above from there.
+
+#ifndef MILE_HYPERV_LINUX_VMBUSPIPE_NO_WIN32_API
+
+inline DWORD GetLastError()
+{
+    return ::Mile::HyperV::VmbusPipeLinuxLastError();
+}
+
+inline VOID SetLastError(
+    _In_ DWORD ErrorCode)
+{
+    ::Mile::HyperV::VmbusPipeLinuxSetLastError(ErrorCode);
+}
+
+inline BOOL WINAPI ReadFile(
+    _In_ HANDLE FileHandle,
+    _Out_ LPVOID Buffer,
+    _In_ DWORD NumberOfBytesToRead,
+    _Out_opt_ LPDWORD NumberOfBytesRead,
+    _Inout_opt_ LPOVERLAPPED Overlapped)
+{
+    return ::Mile::HyperV::VmbusPipeLinuxReadFile(
+        FileHandle,
+        Buffer,
+        NumberOfBytesToRead,
+        NumberOfBytesRead,
+        Overlapped);
+}
+
+inline BOOL WINAPI WriteFile(
+    _In_ HANDLE FileHandle,
+    _In_ LPCVOID Buffer,
+    _In_ DWORD NumberOfBytesToWrite,
+    _Out_opt_ LPDWORD NumberOfBytesWritten,
+    _Inout_opt_ LPOVERLAPPED Overlapped)
+{
+    return ::Mile::HyperV::VmbusPipeLinuxWriteFile(
+        FileHandle,
+        Buffer,
+        NumberOfBytesToWrite,
+        NumberOfBytesWritten,
+        Overlapped);
+}
+
+inline BOOL WINAPI CloseHandle(
+    _In_ HANDLE Object)
+{
+    return ::Mile::HyperV::VmbusPipeLinuxCloseHandle(Object);
+}
+
+#endif // !MILE_HYPERV_LINUX_VMBUSPIPE_NO_WIN32_API
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_LINUX_VMBUSPIPE
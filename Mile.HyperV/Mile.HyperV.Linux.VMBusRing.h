@@ -0,0 +1,267 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.Linux.VMBusRing.h
+ * PURPOSE:    Definition for Hyper-V VMBus Ring Buffer Linux Mappings
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_LINUX_VMBUSRING
+#define MILE_HYPERV_LINUX_VMBUSRING
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus ring Linux mappings require C++20 or later.
+#endif // !__cplusplus
+
+#ifdef _WIN32
+#error [Mile.HyperV] The VMBus ring Linux mappings are not for Windows.
+#endif // _WIN32
+
+#include "Mile.HyperV.VMBus.Ring.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief Gets the granularity of the ring mappings, which is the page
+     *        size of the system and may be larger than the 4 KiB control
+     *        page of the ring.
+     * @return The mapping granularity in bytes, which is a power of two.
+     */
+    inline std::size_t VmbusRingMappingGranularity()
+    {
+        static const std::size_t Granularity = []() -> std::size_t
+        {
+            long PageSize = ::sysconf(_SC_PAGESIZE);
+            if (PageSize < static_cast<long>(VmbusRingControlPageSize) ||
+                (PageSize & (PageSize - 1)))
+            {
+                return VmbusRingControlPageSize;
+            }
+            return static_cast<std::size_t>(PageSize);
+        }();
+        return Granularity;
+    }
+
+    /**
+     * @brief A ring buffer backed by a memfd whose data pages are mapped twice
+     *        back to back, so packets which wrap around the end of the ring
+     *        are still contiguous in memory and can be used in place.
+     * @remark The control page is padded to the mapping granularity, so the
+     *         data pages start at a page aligned offset of the memfd.
+     */
+    class VmbusRingMirrorMapping
+    {
+    private:
+
+        int m_FileDescriptor = -1;
+        PHV_UINT8 m_Base = nullptr;
+        std::size_t m_DataSize = 0;
+
+        static std::size_t ControlSize()
+        {
+            return ::Mile::HyperV::VmbusRingMappingGranularity();
+        }
+
+        std::size_t MappingSize() const
+        {
+            return this->ControlSize() + 2 * m_DataSize;
+        }
+
+        static bool IsValidDataSize(
+            HV_UINT32 DataSize)
+        {
+            return DataSize &&
+                !(DataSize % ::Mile::HyperV::VmbusRingMappingGranularity());
+        }
+
+        NTSTATUS Map()
+        {
+            // Reserve the address range first, so both views of the data
+            // pages are guaranteed to be adjacent.
+            void* Base = ::mmap(
+                nullptr,
+                this->MappingSize(),
+                PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS,
+                -1,
+                0);
+            if (Base == MAP_FAILED)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            m_Base = reinterpret_cast<PHV_UINT8>(Base);
+
+            if (MAP_FAILED == ::mmap(
+                m_Base,
+                this->ControlSize() + m_DataSize,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED,
+                m_FileDescriptor,
+                0))
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            if (MAP_FAILED == ::mmap(
+                m_Base + this->ControlSize() + m_DataSize,
+                m_DataSize,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED,
+                m_FileDescriptor,
+                static_cast<off_t>(this->ControlSize())))
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            return STATUS_SUCCESS;
+        }
+
+    public:
+
+        VmbusRingMirrorMapping() = default;
+
+        ~VmbusRingMirrorMapping()
+        {
+            this->Close();
+        }
+
+        VmbusRingMirrorMapping(VmbusRingMirrorMapping const&) = delete;
+        VmbusRingMirrorMapping& operator=(
+            VmbusRingMirrorMapping const&) = delete;
+
+        /**
+         * @brief Creates a new memfd backed ring and maps it.
+         * @param DataSize The size of the ring data area in bytes, which must
+         *                 be a non-zero multiple of the mapping granularity.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER or
+         *         STATUS_INSUFFICIENT_RESOURCES.
+         */
+        NTSTATUS Create(
+            HV_UINT32 DataSize)
+        {
+            this->Close();
+
+            if (!VmbusRingMirrorMapping::IsValidDataSize(DataSize))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            m_FileDescriptor = ::memfd_create(
+                "Mile.HyperV.VMBusRing",
+                MFD_CLOEXEC);
+            if (m_FileDescriptor < 0)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            m_DataSize = DataSize;
+
+            NTSTATUS Status = STATUS_INSUFFICIENT_RESOURCES;
+            if (0 == ::ftruncate(
+                m_FileDescriptor,
+                this->ControlSize() + DataSize))
+            {
+                Status = this->Map();
+            }
+            if (!NT_SUCCESS(Status))
+            {
+                this->Close();
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Maps a ring created by another process or endpoint.
+         * @param FileDescriptor The memfd, which is duplicated.
+         * @param DataSize The size of the ring data area in bytes.
+         * @return See Create.
+         */
+        NTSTATUS Open(
+            int FileDescriptor,
+            HV_UINT32 DataSize)
+        {
+            this->Close();
+
+            if (!VmbusRingMirrorMapping::IsValidDataSize(DataSize))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            m_FileDescriptor = ::fcntl(FileDescriptor, F_DUPFD_CLOEXEC, 0);
+            if (m_FileDescriptor < 0)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            m_DataSize = DataSize;
+
+            NTSTATUS Status = this->Map();
+            if (!NT_SUCCESS(Status))
+            {
+                this->Close();
+            }
+            return Status;
+        }
+
+        void Close()
+        {
+            if (m_Base)
+            {
+                ::munmap(m_Base, this->MappingSize());
+                m_Base = nullptr;
+            }
+            if (m_FileDescriptor >= 0)
+            {
+                ::close(m_FileDescriptor);
+                m_FileDescriptor = -1;
+            }
+            m_DataSize = 0;
+        }
+
+        int FileDescriptor() const
+        {
+            return m_FileDescriptor;
+        }
+
+        /**
+         * @brief Gets a mirrored ring view of the mapping.
+         * @return The ring view, which is invalid if nothing is mapped.
+         */
+        VmbusRing Ring() const
+        {
+            if (!m_Base)
+            {
+                return VmbusRing();
+            }
+            return VmbusRing(
+                reinterpret_cast<PVMRCB>(m_Base),
+                m_Base + this->ControlSize(),
+                static_cast<HV_UINT32>(m_DataSize),
+                true);
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_LINUX_VMBUSRING
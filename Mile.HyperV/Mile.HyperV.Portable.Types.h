@@ -138,4 +138,14 @@ typedef struct _HV_GUID
 
 #endif
 
+// Constants such as the VMBus class IDs are constexpr in C++, so they can be
+// used at compile time, and const in C.
+#ifndef HV_CONSTEXPR
+#ifdef __cplusplus
+#define HV_CONSTEXPR constexpr
+#else
+#define HV_CONSTEXPR const
+#endif
+#endif // !HV_CONSTEXPR
+
 #endif // !MILE_HYPERV_PORTABLE_TYPES
@@ -0,0 +1,584 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.ChannelGroup.h
+ * PURPOSE:    Definition for Hyper-V VMBus Multi-Queue Channel Group
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_CHANNELGROUP
+#define MILE_HYPERV_VMBUS_CHANNELGROUP
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus channel group requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.Ring.h"
+
+#include <memory>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_NOT_FOUND
+// The object was not found.
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#endif // !STATUS_NOT_FOUND
+
+#ifndef STATUS_OBJECT_NAME_COLLISION
+// Object Name already exists.
+#define STATUS_OBJECT_NAME_COLLISION ((NTSTATUS)0xC0000035L)
+#endif // !STATUS_OBJECT_NAME_COLLISION
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief The load a queue of a channel group has seen so far.
+     */
+    struct VmbusChannelQueueLoad
+    {
+        HV_UINT64 Packets;
+        HV_UINT64 Bytes;
+        // The submissions which failed because the ring was full.
+        HV_UINT64 Busy;
+        // The number of processors whose submissions go to the queue.
+        HV_UINT32 Processors;
+        HV_VP_INDEX TargetVp;
+    };
+
+    /**
+     * @brief One channel of a channel group, the primary channel or one of its
+     *        subchannels, with the outbound ring submissions go to.
+     */
+    class VmbusChannelQueue
+    {
+    private:
+
+        friend class VmbusChannelGroup;
+
+        VmbusRingMultiWriter m_Writer;
+        HV_UINT32 m_ChildRelId = 0;
+        // The target before the outstanding ChannelMessageModifyChannel,
+        // restored if the host rejects it.
+        HV_VP_INDEX m_PreviousVp = VMBUS_VP_INDEX_DISABLE_INTERRUPT;
+        bool m_InUse = false;
+
+        // Read by Load while Rebalance and the response handler update them.
+        std::atomic<HV_VP_INDEX> m_TargetVp = VMBUS_VP_INDEX_DISABLE_INTERRUPT;
+        std::atomic<HV_UINT32> m_Processors = 0;
+        std::atomic<bool> m_IsModifyPending = false;
+
+        // Updated by every processor mapped to the queue.
+        alignas(64) std::atomic<HV_UINT64> m_Packets = 0;
+        std::atomic<HV_UINT64> m_Bytes = 0;
+        std::atomic<HV_UINT64> m_Busy = 0;
+
+    public:
+
+        VmbusChannelQueue() = default;
+
+        VmbusChannelQueue(VmbusChannelQueue const&) = delete;
+        VmbusChannelQueue& operator=(VmbusChannelQueue const&) = delete;
+
+        bool InUse() const
+        {
+            return m_InUse;
+        }
+
+        HV_UINT32 ChildRelId() const
+        {
+            return m_ChildRelId;
+        }
+
+        HV_VP_INDEX TargetVp() const
+        {
+            return m_TargetVp.load(std::memory_order_relaxed);
+        }
+
+        bool IsModifyPending() const
+        {
+            return m_IsModifyPending.load(std::memory_order_acquire);
+        }
+
+        VmbusRingMultiWriter& Writer()
+        {
+            return m_Writer;
+        }
+
+        /**
+         * @brief Writes a packet to the queue and accounts for it.
+         * @param Descriptor See VmbusRingWriter::WritePacket.
+         * @param Segments See VmbusRingWriter::WritePacket.
+         * @param SegmentCount See VmbusRingWriter::WritePacket.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         * @return See VmbusRingWriter::WritePacket.
+         */
+        NTSTATUS WritePacket(
+            VMPACKET_DESCRIPTOR const& Descriptor,
+            const VmbusRingSegment* Segments,
+            std::size_t SegmentCount,
+            bool* SignalRequired = nullptr)
+        {
+            NTSTATUS Status = m_Writer.WritePacket(
+                Descriptor,
+                Segments,
+                SegmentCount,
+                SignalRequired);
+            if (NT_SUCCESS(Status))
+            {
+                HV_UINT64 Bytes = 0;
+                for (std::size_t i = 0; i < SegmentCount; ++i)
+                {
+                    Bytes += Segments[i].Size;
+                }
+                m_Packets.fetch_add(1, std::memory_order_relaxed);
+                m_Bytes.fetch_add(Bytes, std::memory_order_relaxed);
+            }
+            else if (Status == STATUS_INSUFFICIENT_RESOURCES)
+            {
+                m_Busy.fetch_add(1, std::memory_order_relaxed);
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Gets the load of the queue.
+         * @return The counters, which are read without stopping submissions.
+         */
+        VmbusChannelQueueLoad Load() const
+        {
+            VmbusChannelQueueLoad Load;
+            Load.Packets = m_Packets.load(std::memory_order_relaxed);
+            Load.Bytes = m_Bytes.load(std::memory_order_relaxed);
+            Load.Busy = m_Busy.load(std::memory_order_relaxed);
+            Load.Processors = m_Processors.load(std::memory_order_relaxed);
+            Load.TargetVp = m_TargetVp.load(std::memory_order_relaxed);
+            return Load;
+        }
+    };
+
+    /**
+     * @brief Spreads a primary channel and its subchannels over processors,
+     *        routes submissions to the queue of the submitting processor and
+     *        retargets the interrupts of every queue to a processor which
+     *        submits to it.
+     * @remark Queues are indexed by SubChannelIndex. When there are more
+     *         processors than queues, processors share queues round-robin,
+     *         which VmbusRingMultiWriter makes safe. Adding or removing
+     *         queues must not race with submissions, while Rebalance may.
+     *         Calls to Add, Remove and Rebalance must be serialized.
+     */
+    class VmbusChannelGroup
+    {
+    private:
+
+        VmbusChannelQueue* m_Queues = nullptr;
+        HV_UINT32 m_QueueCapacity = 0;
+        HV_UINT16* m_ProcessorMap = nullptr;
+        HV_UINT32 m_ProcessorCapacity = 0;
+        HV_UINT32 m_ProcessorCount = 0;
+
+    public:
+
+        /**
+         * @brief Initializes the group over caller-owned storage.
+         * @param Queues The queues, which must outlive the group.
+         * @param QueueCapacity The number of queues, the highest
+         *                      SubChannelIndex plus one.
+         * @param ProcessorMap The processor to queue map, which must outlive
+         *                     the group.
+         * @param ProcessorCapacity The number of processors the map holds.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            VmbusChannelQueue* Queues,
+            HV_UINT32 QueueCapacity,
+            HV_UINT16* ProcessorMap,
+            HV_UINT32 ProcessorCapacity)
+        {
+            m_Queues = nullptr;
+            m_QueueCapacity = 0;
+            m_ProcessorMap = nullptr;
+            m_ProcessorCapacity = 0;
+            m_ProcessorCount = 0;
+            if (!Queues ||
+                !QueueCapacity ||
+                QueueCapacity > 0xFFFF ||
+                !ProcessorMap ||
+                !ProcessorCapacity)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            for (HV_UINT32 i = 0; i < QueueCapacity; ++i)
+            {
+                Queues[i].m_InUse = false;
+            }
+            for (HV_UINT32 i = 0; i < ProcessorCapacity; ++i)
+            {
+                ProcessorMap[i] = 0;
+            }
+            m_Queues = Queues;
+            m_QueueCapacity = QueueCapacity;
+            m_ProcessorMap = ProcessorMap;
+            m_ProcessorCapacity = ProcessorCapacity;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Adds the primary channel or a subchannel once it is open.
+         * @param SubChannelIndex The SubChannelIndex of the offer.
+         * @param ChildRelId The ChildRelId of the offer.
+         * @param TargetVp The TargetVp the channel was opened with.
+         * @param Outbound The ring the guest writes to.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER, or
+         *         STATUS_OBJECT_NAME_COLLISION if the index is in use.
+         * @remark Call Rebalance afterwards to route submissions to it.
+         */
+        NTSTATUS Add(
+            HV_UINT16 SubChannelIndex,
+            HV_UINT32 ChildRelId,
+            HV_VP_INDEX TargetVp,
+            VmbusRing const& Outbound)
+        {
+            if (SubChannelIndex >= m_QueueCapacity || !Outbound.Control())
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            VmbusChannelQueue& Queue = m_Queues[SubChannelIndex];
+            if (Queue.m_InUse)
+            {
+                return STATUS_OBJECT_NAME_COLLISION;
+            }
+            std::destroy_at(&Queue.m_Writer);
+            std::construct_at(&Queue.m_Writer, Outbound);
+            Queue.m_ChildRelId = ChildRelId;
+            Queue.m_TargetVp.store(TargetVp, std::memory_order_relaxed);
+            Queue.m_PreviousVp = TargetVp;
+            Queue.m_Processors.store(0, std::memory_order_relaxed);
+            Queue.m_IsModifyPending.store(false, std::memory_order_relaxed);
+            Queue.m_Packets.store(0, std::memory_order_relaxed);
+            Queue.m_Bytes.store(0, std::memory_order_relaxed);
+            Queue.m_Busy.store(0, std::memory_order_relaxed);
+            Queue.m_InUse = true;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Removes a channel, such as when it is rescinded.
+         * @param SubChannelIndex The SubChannelIndex of the offer.
+         * @return STATUS_SUCCESS or STATUS_NOT_FOUND.
+         * @remark Call Rebalance afterwards, so no processor keeps submitting
+         *         to it.
+         */
+        NTSTATUS Remove(
+            HV_UINT16 SubChannelIndex)
+        {
+            if (SubChannelIndex >= m_QueueCapacity ||
+                !m_Queues[SubChannelIndex].m_InUse)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            m_Queues[SubChannelIndex].m_InUse = false;
+            return STATUS_SUCCESS;
+        }
+
+        HV_UINT32 QueueCapacity() const
+        {
+            return m_QueueCapacity;
+        }
+
+        VmbusChannelQueue& Queue(
+            HV_UINT16 SubChannelIndex)
+        {
+            return m_Queues[SubChannelIndex];
+        }
+
+        /**
+         * @brief Gets the queue a processor submits to.
+         * @param Processor The index of the processor, as passed to Rebalance.
+         * @return The queue, or nullptr before the first Rebalance.
+         */
+        VmbusChannelQueue* QueueOf(
+            HV_UINT32 Processor)
+        {
+            HV_UINT32 Count = std::atomic_ref<HV_UINT32>(
+                m_ProcessorCount).load(std::memory_order_acquire);
+            if (!Count)
+            {
+                return nullptr;
+            }
+            if (Processor >= Count)
+            {
+                Processor %= Count;
+            }
+            HV_UINT16 Index = std::atomic_ref<HV_UINT16>(
+                m_ProcessorMap[Processor]).load(std::memory_order_relaxed);
+            return &m_Queues[Index];
+        }
+
+        /**
+         * @brief Writes a packet to the queue of a processor.
+         * @param Processor The index of the submitting processor.
+         * @param Descriptor See VmbusRingWriter::WritePacket.
+         * @param Segments See VmbusRingWriter::WritePacket.
+         * @param SegmentCount See VmbusRingWriter::WritePacket.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         * @return See VmbusRingWriter::WritePacket, or
+         *         STATUS_INVALID_DEVICE_STATE before the first Rebalance.
+         */
+        NTSTATUS WritePacket(
+            HV_UINT32 Processor,
+            VMPACKET_DESCRIPTOR const& Descriptor,
+            const VmbusRingSegment* Segments,
+            std::size_t SegmentCount,
+            bool* SignalRequired = nullptr)
+        {
+            VmbusChannelQueue* Queue = this->QueueOf(Processor);
+            if (!Queue)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            return Queue->WritePacket(
+                Descriptor,
+                Segments,
+                SegmentCount,
+                SignalRequired);
+        }
+
+        NTSTATUS Write(
+            HV_UINT32 Processor,
+            HV_UINT16 Type,
+            HV_UINT16 Flags,
+            HV_UINT64 TransactionId,
+            const void* Buffer,
+            HV_UINT32 Size,
+            bool* SignalRequired = nullptr)
+        {
+            VmbusRingSegment Segment = { Buffer, Size };
+            return this->WritePacket(
+                Processor,
+                VmbusRingWriter::InBandDescriptor(Type, Flags, TransactionId),
+                &Segment,
+                1,
+                SignalRequired);
+        }
+
+        /**
+         * @brief Maps the processors to the queues and retargets the
+         *        interrupts of every queue whose processors changed.
+         * @param Processors The VP indexes of the online processors. The
+         *                   position of a VP in the array is the processor
+         *                   index submissions pass.
+         * @param ProcessorCount The number of processors.
+         * @param Send The callback invoked as NTSTATUS Send(const void*
+         *             Message, HV_UINT32 MessageSize) for every
+         *             ChannelMessageModifyChannel message.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER,
+         *         STATUS_INVALID_DEVICE_STATE if no queue is in use,
+         *         STATUS_DEVICE_BUSY if a ChannelMessageModifyChannel sent
+         *         before is still waiting for its response, or the status of
+         *         Send. The messages sent before a failing Send stay
+         *         outstanding, so Rebalance sends the remaining messages once
+         *         their responses arrived, or after CompleteModifies on hosts
+         *         which never send them.
+         * @remark Processor i submits to the queue i modulo the number of
+         *         queues. Every queue is targeted at the first processor
+         *         which submits to it, and queues without one are spread
+         *         over the processors round-robin. Only one retarget per
+         *         queue is outstanding, so a rejected one always restores
+         *         the target the host last accepted.
+         */
+        template<typename MessageSender>
+        NTSTATUS Rebalance(
+            const HV_VP_INDEX* Processors,
+            HV_UINT32 ProcessorCount,
+            MessageSender&& Send)
+        {
+            if (!m_Queues ||
+                !Processors ||
+                !ProcessorCount ||
+                ProcessorCount > m_ProcessorCapacity)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            HV_UINT32 QueueCount = 0;
+            for (HV_UINT32 i = 0; i < m_QueueCapacity; ++i)
+            {
+                if (m_Queues[i].m_InUse)
+                {
+                    if (m_Queues[i].IsModifyPending())
+                    {
+                        return STATUS_DEVICE_BUSY;
+                    }
+                    ++QueueCount;
+                }
+            }
+            if (!QueueCount)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            for (HV_UINT32 i = 0; i < m_QueueCapacity; ++i)
+            {
+                if (m_Queues[i].m_InUse)
+                {
+                    m_Queues[i].m_Processors.store(
+                        0,
+                        std::memory_order_relaxed);
+                }
+            }
+
+            // Shrink the visible processor count first, so submitters never
+            // index entries which are being rewritten beyond it.
+            HV_UINT32 OldCount = std::atomic_ref<HV_UINT32>(
+                m_ProcessorCount).load(std::memory_order_relaxed);
+            if (ProcessorCount < OldCount)
+            {
+                std::atomic_ref<HV_UINT32>(m_ProcessorCount).store(
+                    ProcessorCount,
+                    std::memory_order_release);
+            }
+            HV_UINT32 Position = 0;
+            for (HV_UINT32 Processor = 0;
+                Processor < ProcessorCount;
+                ++Processor)
+            {
+                while (!m_Queues[Position].m_InUse)
+                {
+                    Position = (Position + 1) % m_QueueCapacity;
+                }
+                std::atomic_ref<HV_UINT16>(m_ProcessorMap[Processor]).store(
+                    static_cast<HV_UINT16>(Position),
+                    std::memory_order_relaxed);
+                m_Queues[Position].m_Processors.fetch_add(
+                    1,
+                    std::memory_order_relaxed);
+                Position = (Position + 1) % m_QueueCapacity;
+            }
+            std::atomic_ref<HV_UINT32>(m_ProcessorCount).store(
+                ProcessorCount,
+                std::memory_order_release);
+
+            // The n-th queue in use is served by processor n, or by processor
+            // n modulo the processor count if there are more queues.
+            HV_UINT32 Ordinal = 0;
+            for (HV_UINT32 i = 0; i < m_QueueCapacity; ++i)
+            {
+                VmbusChannelQueue& Queue = m_Queues[i];
+                if (!Queue.m_InUse)
+                {
+                    continue;
+                }
+                HV_VP_INDEX TargetVp = Processors[Ordinal++ % ProcessorCount];
+                HV_VP_INDEX CurrentVp = Queue.TargetVp();
+                if (CurrentVp == TargetVp)
+                {
+                    continue;
+                }
+                VMBUS_CHANNEL_MODIFY_CHANNEL Modify = {};
+                Modify.Header.MessageType = ChannelMessageModifyChannel;
+                Modify.ChildRelId = Queue.m_ChildRelId;
+                Modify.TargetVp = TargetVp;
+                // The response may arrive before Send returns, so everything
+                // it restores is published before the pending flag.
+                Queue.m_PreviousVp = CurrentVp;
+                Queue.m_TargetVp.store(TargetVp, std::memory_order_relaxed);
+                Queue.m_IsModifyPending.store(true, std::memory_order_release);
+                NTSTATUS Status = Send(&Modify, sizeof(Modify));
+                if (!NT_SUCCESS(Status))
+                {
+                    Queue.m_TargetVp.store(
+                        CurrentVp,
+                        std::memory_order_relaxed);
+                    Queue.m_IsModifyPending.store(
+                        false,
+                        std::memory_order_release);
+                    return Status;
+                }
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Forgets the outstanding retargets, as hosts before
+         *        VMBUS_VERSION_IRON apply ChannelMessageModifyChannel without
+         *        sending a response.
+         */
+        void CompleteModifies()
+        {
+            for (HV_UINT32 i = 0; i < m_QueueCapacity; ++i)
+            {
+                m_Queues[i].m_IsModifyPending.store(
+                    false,
+                    std::memory_order_release);
+            }
+        }
+
+        /**
+         * @brief Handles a ChannelMessageModifyChannelResponse message, which
+         *        hosts send since VMBUS_VERSION_IRON.
+         * @param Message The message.
+         * @param MessageSize The size of the message in bytes.
+         * @return STATUS_SUCCESS, STATUS_BAD_DATA, or STATUS_NOT_FOUND if the
+         *         channel is not in the group or has no retarget outstanding.
+         * @remark A rejected retarget restores the previous target VP.
+         */
+        NTSTATUS OnModifyChannelResponse(
+            const void* Message,
+            HV_UINT32 MessageSize)
+        {
+            VMBUS_CHANNEL_MODIFY_CHANNEL_RESPONSE Response;
+            if (!Message || MessageSize < sizeof(Response))
+            {
+                return STATUS_BAD_DATA;
+            }
+            std::memcpy(&Response, Message, sizeof(Response));
+            if (Response.Header.MessageType !=
+                ChannelMessageModifyChannelResponse)
+            {
+                return STATUS_BAD_DATA;
+            }
+            for (HV_UINT32 i = 0; i < m_QueueCapacity; ++i)
+            {
+                VmbusChannelQueue& Queue = m_Queues[i];
+                if (!Queue.m_InUse ||
+                    Queue.m_ChildRelId != Response.ChildRelId)
+                {
+                    continue;
+                }
+                if (!Queue.IsModifyPending())
+                {
+                    break;
+                }
+                if (!NT_SUCCESS(Response.Status))
+                {
+                    Queue.m_TargetVp.store(
+                        Queue.m_PreviousVp,
+                        std::memory_order_relaxed);
+                }
+                Queue.m_IsModifyPending.store(false, std::memory_order_release);
+                return STATUS_SUCCESS;
+            }
+            return STATUS_NOT_FOUND;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_CHANNELGROUP
@@ -0,0 +1,384 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.ChannelRegistry.h
+ * PURPOSE:    Definition for Hyper-V VMBus Epoch-Based Channel Registry
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_CHANNELREGISTRY
+#define MILE_HYPERV_VMBUS_CHANNELREGISTRY
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus channel registry requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.Guest.Protocols.h"
+
+#include <atomic>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_NOT_FOUND
+// The object was not found.
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#endif // !STATUS_NOT_FOUND
+
+#ifndef STATUS_OBJECT_NAME_COLLISION
+// Object Name already exists.
+#define STATUS_OBJECT_NAME_COLLISION ((NTSTATUS)0xC0000035L)
+#endif // !STATUS_OBJECT_NAME_COLLISION
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief The routine which frees a channel once no reader can reach it,
+     *        such as by unmapping its ring and GPADL pages and sending
+     *        ChannelMessageRelIdReleased.
+     * @param Context The context passed to Retire.
+     * @param Channel The channel.
+     * @param ChildRelId The ChildRelId the channel was published under.
+     */
+    typedef void (*VmbusChannelReclaimRoutine)(
+        void* Context,
+        void* Channel,
+        HV_UINT32 ChildRelId);
+
+    /**
+     * @brief An entry of VmbusChannelRegistry, indexed by ChildRelId.
+     */
+    struct VmbusChannelRegistryEntry
+    {
+        std::atomic<void*> Channel;
+    };
+
+    /**
+     * @brief The epoch a reader of VmbusChannelRegistry last announced, in
+     *        a cache line of its own.
+     */
+    struct alignas(64) VmbusChannelRegistryReader
+    {
+        // Zero while the reader is offline.
+        std::atomic<HV_UINT64> Epoch;
+    };
+
+    /**
+     * @brief A channel which was removed from VmbusChannelRegistry and waits
+     *        for the readers to move past it.
+     */
+    struct VmbusChannelRegistryRetired
+    {
+        void* Channel;
+        HV_UINT32 ChildRelId;
+        VmbusChannelReclaimRoutine Routine;
+        void* Context;
+        // The first epoch in which no reader can reach the channel.
+        HV_UINT64 Epoch;
+    };
+
+    /**
+     * @brief Maps ChildRelIds to channels for the data path, with quiescent
+     *        state based reclamation instead of a reference count per send.
+     * @remark Readers are worker threads which announce a quiescent state
+     *         with Quiesce between batches of I/O, and go Offline before
+     *         they block. A channel returned by Lookup stays valid until the
+     *         reader announces its next quiescent state, so Lookup is one
+     *         plain load and a send touches no shared cache line. Publish,
+     *         Retire and Reclaim are called from the control plane, one
+     *         thread at a time, and a rescinded channel is only reclaimed
+     *         once every online reader announced a later epoch.
+     */
+    class VmbusChannelRegistry
+    {
+    private:
+
+        VmbusChannelRegistryEntry* m_Entries = nullptr;
+        HV_UINT32 m_Capacity = 0;
+        VmbusChannelRegistryReader* m_Readers = nullptr;
+        HV_UINT32 m_ReaderCount = 0;
+        VmbusChannelRegistryRetired* m_Retired = nullptr;
+        HV_UINT32 m_RetiredCapacity = 0;
+        HV_UINT32 m_RetiredCount = 0;
+        HV_UINT64 m_Reclaimed = 0;
+        // Advanced by every Retire, and read by every Quiesce.
+        alignas(64) std::atomic<HV_UINT64> m_Epoch = 1;
+
+        /**
+         * @brief Gets the oldest epoch an online reader may still be in.
+         */
+        HV_UINT64 OldestEpoch() const
+        {
+            // Pairs with the fence in Online: a reader which is seen offline
+            // here can only find the channels which are still published.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            HV_UINT64 Oldest = m_Epoch.load(std::memory_order_acquire);
+            for (HV_UINT32 i = 0; i < m_ReaderCount; ++i)
+            {
+                HV_UINT64 Epoch = m_Readers[i].Epoch.load(
+                    std::memory_order_acquire);
+                if (Epoch && Epoch < Oldest)
+                {
+                    Oldest = Epoch;
+                }
+            }
+            return Oldest;
+        }
+
+    public:
+
+        /**
+         * @brief Initializes the registry over caller-owned storage.
+         * @param Entries The entries, which must outlive the registry.
+         * @param Capacity The number of entries, at most VMBUS_MAX_CHANNELS.
+         * @param Readers The reader slots, one per worker thread. They
+         *                start offline.
+         * @param ReaderCount The number of reader slots.
+         * @param Retired The storage of the channels waiting for reclamation.
+         * @param RetiredCapacity The number of retired channels which can
+         *                        wait at the same time.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            VmbusChannelRegistryEntry* Entries,
+            HV_UINT32 Capacity,
+            VmbusChannelRegistryReader* Readers,
+            HV_UINT32 ReaderCount,
+            VmbusChannelRegistryRetired* Retired,
+            HV_UINT32 RetiredCapacity)
+        {
+            m_Entries = nullptr;
+            m_Capacity = 0;
+            m_Readers = nullptr;
+            m_ReaderCount = 0;
+            m_Retired = nullptr;
+            m_RetiredCapacity = 0;
+            m_RetiredCount = 0;
+            m_Reclaimed = 0;
+            m_Epoch.store(1, std::memory_order_relaxed);
+            if (!Entries ||
+                !Capacity ||
+                Capacity > VMBUS_MAX_CHANNELS ||
+                (!Readers && ReaderCount) ||
+                !Retired ||
+                !RetiredCapacity)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            for (HV_UINT32 i = 0; i < Capacity; ++i)
+            {
+                Entries[i].Channel.store(nullptr, std::memory_order_relaxed);
+            }
+            for (HV_UINT32 i = 0; i < ReaderCount; ++i)
+            {
+                Readers[i].Epoch.store(0, std::memory_order_relaxed);
+            }
+            m_Entries = Entries;
+            m_Capacity = Capacity;
+            m_Readers = Readers;
+            m_ReaderCount = ReaderCount;
+            m_Retired = Retired;
+            m_RetiredCapacity = RetiredCapacity;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Gets the channel published under a ChildRelId.
+         * @param ChildRelId The ChildRelId.
+         * @return The channel, or nullptr. It stays valid until the calling
+         *         reader goes through Quiesce or Offline.
+         * @remark The reader must be online.
+         */
+        void* Lookup(
+            HV_UINT32 ChildRelId) const
+        {
+            if (ChildRelId >= m_Capacity)
+            {
+                return nullptr;
+            }
+            return m_Entries[ChildRelId].Channel.load(
+                std::memory_order_acquire);
+        }
+
+        /**
+         * @brief Lets a reader use Lookup.
+         * @param Reader The index of the reader slot of the calling thread.
+         */
+        void Online(
+            HV_UINT32 Reader)
+        {
+            m_Readers[Reader].Epoch.store(
+                m_Epoch.load(std::memory_order_acquire),
+                std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        /**
+         * @brief Announces the reader holds no channel, which lets the
+         *        channels retired before reclaim.
+         * @param Reader The index of the reader slot of the calling thread.
+         * @remark One load of a mostly read cache line and one store to the
+         *         slot of the reader, so call it every few sends.
+         */
+        void Quiesce(
+            HV_UINT32 Reader)
+        {
+            m_Readers[Reader].Epoch.store(
+                m_Epoch.load(std::memory_order_acquire),
+                std::memory_order_release);
+        }
+
+        /**
+         * @brief Stops a reader from holding back reclamation, before the
+         *        thread blocks or exits.
+         * @param Reader The index of the reader slot of the calling thread.
+         */
+        void Offline(
+            HV_UINT32 Reader)
+        {
+            m_Readers[Reader].Epoch.store(0, std::memory_order_release);
+        }
+
+        /**
+         * @brief Publishes a channel once it is open.
+         * @param ChildRelId The ChildRelId of the channel.
+         * @param Channel The channel.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER, or
+         *         STATUS_OBJECT_NAME_COLLISION if the ChildRelId is in use.
+         */
+        NTSTATUS Publish(
+            HV_UINT32 ChildRelId,
+            void* Channel)
+        {
+            if (ChildRelId >= m_Capacity || !Channel)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            if (m_Entries[ChildRelId].Channel.load(std::memory_order_relaxed))
+            {
+                return STATUS_OBJECT_NAME_COLLISION;
+            }
+            m_Entries[ChildRelId].Channel.store(
+                Channel,
+                std::memory_order_release);
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Removes a channel, for example on
+         *        ChannelMessageRescindChannelOffer, and defers its
+         *        reclamation until no reader can reach it.
+         * @param ChildRelId The ChildRelId of the channel.
+         * @param Routine The routine which reclaims the channel.
+         * @param Context The context passed to the routine.
+         * @return STATUS_SUCCESS, STATUS_NOT_FOUND, or
+         *         STATUS_INSUFFICIENT_RESOURCES if too many channels wait for
+         *         reclamation, in which case the channel stays published.
+         */
+        NTSTATUS Retire(
+            HV_UINT32 ChildRelId,
+            VmbusChannelReclaimRoutine Routine,
+            void* Context)
+        {
+            if (!Routine)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            void* Channel = this->Lookup(ChildRelId);
+            if (!Channel)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            if (m_RetiredCount == m_RetiredCapacity)
+            {
+                this->Reclaim();
+                if (m_RetiredCount == m_RetiredCapacity)
+                {
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+            }
+            m_Entries[ChildRelId].Channel.store(
+                nullptr,
+                std::memory_order_relaxed);
+            // Readers which announce this epoch or a later one have seen the
+            // channel removed.
+            HV_UINT64 Epoch = m_Epoch.fetch_add(
+                1,
+                std::memory_order_seq_cst) + 1;
+            VmbusChannelRegistryRetired& Entry = m_Retired[m_RetiredCount++];
+            Entry.Channel = Channel;
+            Entry.ChildRelId = ChildRelId;
+            Entry.Routine = Routine;
+            Entry.Context = Context;
+            Entry.Epoch = Epoch;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Reclaims the retired channels every online reader moved
+         *        past.
+         * @return The number of channels reclaimed.
+         */
+        HV_UINT32 Reclaim()
+        {
+            if (!m_RetiredCount)
+            {
+                return 0;
+            }
+            HV_UINT64 Oldest = this->OldestEpoch();
+            HV_UINT32 Reclaimed = 0;
+            HV_UINT32 Kept = 0;
+            for (HV_UINT32 i = 0; i < m_RetiredCount; ++i)
+            {
+                VmbusChannelRegistryRetired Entry = m_Retired[i];
+                if (Entry.Epoch > Oldest)
+                {
+                    m_Retired[Kept++] = Entry;
+                    continue;
+                }
+                Entry.Routine(Entry.Context, Entry.Channel, Entry.ChildRelId);
+                ++Reclaimed;
+            }
+            m_RetiredCount = Kept;
+            m_Reclaimed += Reclaimed;
+            return Reclaimed;
+        }
+
+        /**
+         * @brief Gets the number of retired channels not reclaimed yet.
+         */
+        HV_UINT32 RetiredCount() const
+        {
+            return m_RetiredCount;
+        }
+
+        HV_UINT64 ReclaimedCount() const
+        {
+            return m_Reclaimed;
+        }
+
+        HV_UINT64 Epoch() const
+        {
+            return m_Epoch.load(std::memory_order_relaxed);
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_CHANNELREGISTRY
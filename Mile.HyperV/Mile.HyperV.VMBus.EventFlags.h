@@ -0,0 +1,329 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.EventFlags.h
+ * PURPOSE:    Definition for Hyper-V VMBus SynIC Event Flags Dispatcher
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_EVENTFLAGS
+#define MILE_HYPERV_VMBUS_EVENTFLAGS
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus event flags dispatcher requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.Guest.Protocols.h"
+
+#include <atomic>
+#include <bit>
+
+#if defined(_M_AMD64) || defined(_M_IX86)
+#include <immintrin.h>
+#elif defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_OBJECT_NAME_COLLISION
+// Object Name already exists.
+#define STATUS_OBJECT_NAME_COLLISION ((NTSTATUS)0xC0000035L)
+#endif // !STATUS_OBJECT_NAME_COLLISION
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief The number of event flag bytes tested at once, which is the
+     *        width of the widest vector the target has.
+     */
+#if defined(__AVX2__)
+    const HV_UINT32 VmbusEventFlagsChunkBytes = 32;
+#elif defined(_M_AMD64) || defined(_M_IX86) || defined(_M_ARM64)
+    const HV_UINT32 VmbusEventFlagsChunkBytes = 16;
+#else
+    const HV_UINT32 VmbusEventFlagsChunkBytes = 8;
+#endif
+
+    namespace Details
+    {
+        /**
+         * @brief Tests whether a chunk of event flags is all clear without
+         *        any locked operation.
+         * @param Chunk The chunk.
+         * @return true if no flag of the chunk is set.
+         */
+        inline bool VmbusEventFlagsChunkIsClear(
+            const volatile void* Chunk)
+        {
+            const void* Address = const_cast<const void*>(Chunk);
+#if defined(__AVX2__)
+            __m256i Value = ::_mm256_loadu_si256(
+                static_cast<const __m256i*>(Address));
+            return 0 != ::_mm256_testz_si256(Value, Value);
+#elif defined(_M_AMD64) || defined(_M_IX86)
+            __m128i Value = ::_mm_loadu_si128(
+                static_cast<const __m128i*>(Address));
+            return 0xFFFF == ::_mm_movemask_epi8(
+                ::_mm_cmpeq_epi8(Value, ::_mm_setzero_si128()));
+#elif defined(_M_ARM64)
+            uint32x4_t Value = ::vld1q_u32(
+                static_cast<const uint32_t*>(Address));
+            return 0 == ::vmaxvq_u32(Value);
+#else
+            return 0 == *static_cast<const HV_UINT64*>(Address);
+#endif
+        }
+    }
+
+    /**
+     * @brief Clears and collects the set flags of a SINT.
+     * @param Flags The event flags of the SINT, such as the VMBUS_MESSAGE_SINT
+     *              entry of the SynIC event flags page. It must be 8-byte
+     *              aligned, as the page is.
+     * @param FlagCount The number of flags to scan, such as the highest
+     *                  ChildRelId in use plus one. It is rounded up to a whole
+     *                  chunk, and capped at HV_EVENT_FLAGS_COUNT.
+     * @param OnFlag The callback invoked as void OnFlag(HV_UINT32 Flag) for
+     *               every flag which was set, in ascending order.
+     * @return The number of flags collected.
+     * @remark Clear chunks are skipped with one vector test each, and only
+     *         words with flags set are cleared, with one atomic exchange per
+     *         word. A flag set after its chunk was tested raises a new
+     *         interrupt, as it went from clear to set.
+     */
+    template<typename FlagCallback>
+    HV_UINT32 VmbusScanEventFlags(
+        volatile HV_SYNIC_EVENT_FLAGS& Flags,
+        HV_UINT32 FlagCount,
+        FlagCallback&& OnFlag)
+    {
+        const HV_UINT32 ChunkFlags = VmbusEventFlagsChunkBytes * 8;
+        const HV_UINT32 WordsPerChunk =
+            VmbusEventFlagsChunkBytes / sizeof(HV_UINT64);
+        if (FlagCount > HV_EVENT_FLAGS_COUNT)
+        {
+            FlagCount = HV_EVENT_FLAGS_COUNT;
+        }
+        HV_UINT64* Words = reinterpret_cast<HV_UINT64*>(
+            const_cast<HV_SYNIC_EVENT_FLAGS*>(&Flags));
+        HV_UINT32 Collected = 0;
+        for (HV_UINT32 Base = 0; Base < FlagCount; Base += ChunkFlags)
+        {
+            HV_UINT64* Chunk = Words + Base / 64;
+            if (Details::VmbusEventFlagsChunkIsClear(Chunk))
+            {
+                continue;
+            }
+            for (HV_UINT32 i = 0; i < WordsPerChunk; ++i)
+            {
+                std::atomic_ref<HV_UINT64> Word(Chunk[i]);
+                if (!Word.load(std::memory_order_relaxed))
+                {
+                    continue;
+                }
+                HV_UINT64 Value = Word.exchange(0, std::memory_order_acquire);
+                for (; Value; Value &= Value - 1)
+                {
+                    OnFlag(Base + i * 64 + std::countr_zero(Value));
+                    ++Collected;
+                }
+            }
+        }
+        return Collected;
+    }
+
+    /**
+     * @brief The routine a channel interrupt is dispatched to.
+     * @param Context The context the routine was registered with.
+     * @param ChildRelId The ChildRelId of the channel.
+     */
+    typedef void (*VmbusChannelInterruptRoutine)(
+        void* Context,
+        HV_UINT32 ChildRelId);
+
+    /**
+     * @brief An entry of VmbusChannelDispatchTable.
+     */
+    struct VmbusChannelDispatchEntry
+    {
+        std::atomic<VmbusChannelInterruptRoutine> Routine;
+        std::atomic<void*> Context;
+    };
+
+    /**
+     * @brief Maps the event flags of a SINT to the channels they belong to,
+     *        indexed by ChildRelId, which is the event flag of a channel
+     *        unless VMBUS_FEATURE_FLAG_GUEST_SPECIFIED_SIGNAL_PARAMETERS
+     *        gave it another one.
+     * @remark Register and Unregister can run concurrently with Dispatch,
+     *         while calls for the same flag must be serialized. A routine
+     *         may still run once after Unregister returns, so the caller
+     *         waits for in-flight dispatches before freeing Context or
+     *         registering the flag again.
+     */
+    class VmbusChannelDispatchTable
+    {
+    private:
+
+        VmbusChannelDispatchEntry* m_Entries = nullptr;
+        HV_UINT32 m_Capacity = 0;
+        // The highest flag ever registered plus one, which bounds the scan.
+        std::atomic<HV_UINT32> m_FlagCount = 0;
+        std::atomic<HV_UINT64> m_Unhandled = 0;
+
+    public:
+
+        /**
+         * @brief Initializes the table over caller-owned storage.
+         * @param Entries The entries, which must outlive the table.
+         * @param Capacity The number of entries, at most VMBUS_MAX_CHANNELS.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            VmbusChannelDispatchEntry* Entries,
+            HV_UINT32 Capacity)
+        {
+            m_Entries = nullptr;
+            m_Capacity = 0;
+            m_FlagCount.store(0, std::memory_order_relaxed);
+            m_Unhandled.store(0, std::memory_order_relaxed);
+            if (!Entries || !Capacity || Capacity > VMBUS_MAX_CHANNELS)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            for (HV_UINT32 i = 0; i < Capacity; ++i)
+            {
+                Entries[i].Routine.store(nullptr, std::memory_order_relaxed);
+                Entries[i].Context.store(nullptr, std::memory_order_relaxed);
+            }
+            m_Entries = Entries;
+            m_Capacity = Capacity;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Routes the interrupts of a channel to a routine.
+         * @param Flag The event flag of the channel.
+         * @param Routine The routine.
+         * @param Context The context passed to the routine.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER, or
+         *         STATUS_OBJECT_NAME_COLLISION if the flag is registered.
+         * @remark The routine and its context are published as a pair only
+         *         into a free entry, so a registered flag is unregistered
+         *         before it is registered again.
+         */
+        NTSTATUS Register(
+            HV_UINT32 Flag,
+            VmbusChannelInterruptRoutine Routine,
+            void* Context)
+        {
+            if (Flag >= m_Capacity || !Routine)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            if (m_Entries[Flag].Routine.load(std::memory_order_relaxed))
+            {
+                return STATUS_OBJECT_NAME_COLLISION;
+            }
+            m_Entries[Flag].Context.store(Context, std::memory_order_relaxed);
+            m_Entries[Flag].Routine.store(Routine, std::memory_order_release);
+            HV_UINT32 FlagCount = m_FlagCount.load(std::memory_order_relaxed);
+            while (FlagCount <= Flag &&
+                !m_FlagCount.compare_exchange_weak(
+                    FlagCount,
+                    Flag + 1,
+                    std::memory_order_release,
+                    std::memory_order_relaxed))
+            {
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Stops routing the interrupts of a channel.
+         * @param Flag The event flag of the channel.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Unregister(
+            HV_UINT32 Flag)
+        {
+            if (Flag >= m_Capacity)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            m_Entries[Flag].Routine.store(nullptr, std::memory_order_release);
+            return STATUS_SUCCESS;
+        }
+
+        HV_UINT32 FlagCount() const
+        {
+            return m_FlagCount.load(std::memory_order_acquire);
+        }
+
+        /**
+         * @brief Gets the number of flags which were set without a routine,
+         *        such as for channels which were closed meanwhile.
+         */
+        HV_UINT64 Unhandled() const
+        {
+            return m_Unhandled.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Clears the flags of a SINT and runs the routine of every
+         *        channel which was signaled.
+         * @param Flags The event flags of the SINT.
+         * @return The number of routines run.
+         */
+        HV_UINT32 Dispatch(
+            volatile HV_SYNIC_EVENT_FLAGS& Flags)
+        {
+            HV_UINT32 Dispatched = 0;
+            HV_UINT32 Unhandled = 0;
+            ::Mile::HyperV::VmbusScanEventFlags(
+                Flags,
+                this->FlagCount(),
+                [&](HV_UINT32 Flag)
+            {
+                VmbusChannelInterruptRoutine Routine = (Flag < m_Capacity)
+                    ? m_Entries[Flag].Routine.load(std::memory_order_acquire)
+                    : nullptr;
+                if (!Routine)
+                {
+                    ++Unhandled;
+                    return;
+                }
+                Routine(
+                    m_Entries[Flag].Context.load(std::memory_order_relaxed),
+                    Flag);
+                ++Dispatched;
+            });
+            if (Unhandled)
+            {
+                m_Unhandled.fetch_add(Unhandled, std::memory_order_relaxed);
+            }
+            return Dispatched;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_EVENTFLAGS
@@ -0,0 +1,414 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.GpaDirect.h
+ * PURPOSE:    Definition for Hyper-V VMBus GPA Direct Packet Builder
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_GPADIRECT
+#define MILE_HYPERV_VMBUS_GPADIRECT
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus GPA direct builder requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.Gpadl.h"
+#include "Mile.HyperV.VMBus.Ring.h"
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_BUFFER_TOO_SMALL
+// The buffer is too small to contain the entry. No information has been
+// written to the buffer.
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023L)
+#endif // !STATUS_BUFFER_TOO_SMALL
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief A physically contiguous piece of an I/O buffer.
+     */
+    struct VmbusGpaFragment
+    {
+        HV_UINT64 Pfn;
+        // The offset from the start of Pfn, which may exceed the page size.
+        HV_UINT32 ByteOffset;
+        HV_UINT32 ByteCount;
+    };
+
+    /**
+     * @brief Builds the range list of a VmbusPacketTypeDataUsingGpaDirect
+     *        packet from buffer fragments, merging fragments into as few
+     *        GPA_RANGE entries as possible, and writes the packet into a ring
+     *        without an intermediate copy.
+     * @remark A GPA_RANGE describes bytes which are contiguous across its PFN
+     *         list, so a fragment is merged into the previous range when it
+     *         starts exactly where that range ends, or when that range ends on
+     *         a page boundary and the fragment starts on one, whether or not
+     *         the PFNs are adjacent.
+     */
+    class VmbusGpaDirectBuilder
+    {
+    private:
+
+        // The flat range list, as in the GPADL range buffer.
+        HV_UINT64* m_Words = nullptr;
+        HV_UINT32 m_WordCapacity = 0;
+        HV_UINT32 m_WordCount = 0;
+        HV_UINT32 m_RangeCount = 0;
+        // The index of the header word of the last range.
+        HV_UINT32 m_RangeWord = 0;
+        VmbusGpadlRange m_Range = {};
+        HV_UINT32 m_RangePfnCount = 0;
+        HV_UINT64 m_LastPfn = 0;
+
+        void StoreRangeHeader()
+        {
+            GPA_RANGE Header;
+            Header.ByteCount = m_Range.ByteCount;
+            Header.ByteOffset = m_Range.ByteOffset;
+            std::memcpy(
+                &m_Words[m_RangeWord],
+                &Header,
+                VmbusGpadlWordSize);
+        }
+
+        void AppendPfns(
+            HV_UINT64 FirstPfn,
+            HV_UINT32 Count)
+        {
+            for (HV_UINT32 i = 0; i < Count; ++i)
+            {
+                m_Words[m_WordCount++] = FirstPfn + i;
+            }
+            if (Count)
+            {
+                m_LastPfn = FirstPfn + Count - 1;
+            }
+            m_RangePfnCount += Count;
+        }
+
+    public:
+
+        /**
+         * @brief Initializes the builder.
+         * @param Words The buffer which holds the range list.
+         * @param WordCapacity The number of 64-bit words in the buffer. Each
+         *                     range takes one word plus one word per PFN.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            HV_UINT64* Words,
+            HV_UINT32 WordCapacity)
+        {
+            *this = VmbusGpaDirectBuilder();
+            if (!Words || !WordCapacity)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            m_Words = Words;
+            m_WordCapacity = WordCapacity;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Discards the ranges, so the builder can be used for the next
+         *        packet.
+         */
+        void Reset()
+        {
+            m_WordCount = 0;
+            m_RangeCount = 0;
+            m_RangeWord = 0;
+            m_Range = {};
+            m_RangePfnCount = 0;
+            m_LastPfn = 0;
+        }
+
+        /**
+         * @brief Gets the range list built so far.
+         * @return The GPA_RANGE headers, each followed by its PFNs.
+         */
+        const HV_UINT64* Words() const
+        {
+            return m_Words;
+        }
+
+        HV_UINT32 RangeCount() const
+        {
+            return m_RangeCount;
+        }
+
+        /**
+         * @brief Gets the size of the range list.
+         * @return The number of 64-bit words, range headers included.
+         */
+        HV_UINT32 WordCount() const
+        {
+            return m_WordCount;
+        }
+
+        /**
+         * @brief Appends a fragment, merging it into the last range if
+         *        possible.
+         * @param Fragment The fragment.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER if the fragment is
+         *         empty, STATUS_INTEGER_OVERFLOW if it needs more than
+         *         GPA_RANGE_MAX_PFN_COUNT PFNs, or STATUS_BUFFER_TOO_SMALL if
+         *         the range list is full, in which case nothing is appended.
+         */
+        NTSTATUS Append(
+            VmbusGpaFragment const& Fragment)
+        {
+            if (!m_Words || !Fragment.ByteCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            VmbusGpadlRange Range;
+            Range.ByteCount = Fragment.ByteCount;
+            Range.ByteOffset = Fragment.ByteOffset % VmbusGpadlPageSize;
+            HV_UINT64 Pfn =
+                Fragment.Pfn + Fragment.ByteOffset / VmbusGpadlPageSize;
+            NTSTATUS Status = ::Mile::HyperV::VmbusGpadlValidateRange(Range);
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+            HV_UINT32 PfnCount = static_cast<HV_UINT32>(
+                ::Mile::HyperV::VmbusGpadlRangePfnCount(Range));
+
+            if (m_RangeCount)
+            {
+                HV_UINT32 EndOffset = static_cast<HV_UINT32>(
+                    (static_cast<HV_UINT64>(m_Range.ByteOffset)
+                        + m_Range.ByteCount) % VmbusGpadlPageSize);
+                HV_UINT32 NewPfnCount = PfnCount;
+                bool Mergeable = false;
+                if (EndOffset)
+                {
+                    // The fragment continues inside the last page.
+                    Mergeable = Pfn == m_LastPfn
+                        && Range.ByteOffset == EndOffset;
+                    NewPfnCount = PfnCount - 1;
+                }
+                else
+                {
+                    Mergeable = !Range.ByteOffset;
+                }
+                if (Mergeable &&
+                    static_cast<HV_UINT64>(m_Range.ByteCount)
+                        + Range.ByteCount <= 0xFFFFFFFF &&
+                    m_RangePfnCount + NewPfnCount <= GPA_RANGE_MAX_PFN_COUNT)
+                {
+                    if (m_WordCapacity - m_WordCount < NewPfnCount)
+                    {
+                        return STATUS_BUFFER_TOO_SMALL;
+                    }
+                    m_Range.ByteCount += Range.ByteCount;
+                    this->AppendPfns(
+                        Pfn + (PfnCount - NewPfnCount),
+                        NewPfnCount);
+                    this->StoreRangeHeader();
+                    return STATUS_SUCCESS;
+                }
+            }
+
+            if (m_WordCapacity - m_WordCount < 1 + PfnCount)
+            {
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+            m_RangeWord = m_WordCount++;
+            m_Range = Range;
+            m_RangePfnCount = 0;
+            ++m_RangeCount;
+            this->AppendPfns(Pfn, PfnCount);
+            this->StoreRangeHeader();
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Appends fragments in order.
+         * @param Fragments The fragments.
+         * @param FragmentCount The number of fragments.
+         * @return See Append. Fragments before a failing one stay appended.
+         */
+        NTSTATUS Append(
+            const VmbusGpaFragment* Fragments,
+            std::size_t FragmentCount)
+        {
+            for (std::size_t i = 0; i < FragmentCount; ++i)
+            {
+                NTSTATUS Status = this->Append(Fragments[i]);
+                if (!NT_SUCCESS(Status))
+                {
+                    return Status;
+                }
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Gets the size of the VMDATA_GPA_DIRECT header, which is where
+         *        the in-band payload starts.
+         * @return The header size in bytes, descriptor included.
+         */
+        HV_UINT32 HeaderSize() const
+        {
+            return static_cast<HV_UINT32>(
+                offsetof(VMDATA_GPA_DIRECT, Range)
+                + m_WordCount * VmbusGpadlWordSize);
+        }
+
+        /**
+         * @brief Gets the number of ring bytes the packet takes.
+         * @param PayloadSize The size of the in-band payload in bytes.
+         * @return The aligned packet size, trailer included.
+         */
+        HV_UINT64 RingSize(
+            HV_UINT32 PayloadSize) const
+        {
+            return ::Mile::HyperV::VmbusRingAlignSize(
+                static_cast<HV_UINT32>(this->HeaderSize() + PayloadSize))
+                + VmbusRingTrailerSize;
+        }
+
+        /**
+         * @brief Writes a VmbusPacketTypeDataUsingGpaDirect packet with the
+         *        ranges built so far.
+         * @param Writer The VmbusRingWriter or VmbusRingMultiWriter.
+         * @param Flags The packet flags, usually
+         *              VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED.
+         * @param TransactionId The transaction ID.
+         * @param Payload The in-band payload, which follows the ranges.
+         * @param PayloadSize The size of the payload in bytes.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         * @return See VmbusRingWriter::WritePacket, or
+         *         STATUS_INVALID_PARAMETER if there are no ranges.
+         */
+        template<typename RingWriter>
+        NTSTATUS Write(
+            RingWriter& Writer,
+            HV_UINT16 Flags,
+            HV_UINT64 TransactionId,
+            const void* Payload,
+            HV_UINT32 PayloadSize,
+            bool* SignalRequired = nullptr) const
+        {
+            if (!m_RangeCount ||
+                this->HeaderSize() > VmbusRingMaximumPacketSize)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            VMPACKET_DESCRIPTOR Descriptor = VmbusRingWriter::InBandDescriptor(
+                VmbusPacketTypeDataUsingGpaDirect,
+                Flags,
+                TransactionId);
+            Descriptor.DataOffset8 = static_cast<HV_UINT16>(
+                this->HeaderSize() / VmbusRingPacketAlignment);
+
+            // Reserved and RangeCount of VMDATA_GPA_DIRECT.
+            HV_UINT32 RangeHeader[2] = { 0, m_RangeCount };
+            VmbusRingSegment Segments[3] =
+            {
+                { RangeHeader, sizeof(RangeHeader) },
+                { m_Words, m_WordCount * VmbusGpadlWordSize },
+                { Payload, PayloadSize },
+            };
+            return Writer.WritePacket(
+                Descriptor,
+                Segments,
+                PayloadSize ? 3 : 2,
+                SignalRequired);
+        }
+
+        /**
+         * @brief Enumerates the ranges of a received
+         *        VmbusPacketTypeDataUsingGpaDirect packet.
+         * @param Packet The packet.
+         * @param OnRange See VmbusGpadlDecoder::DecodeHeader.
+         * @param OnPfn See VmbusGpadlDecoder::DecodeHeader.
+         * @return STATUS_SUCCESS, STATUS_INTEGER_OVERFLOW if a range exceeds
+         *         GPA_RANGE_MAX_PFN_COUNT, or STATUS_BAD_DATA.
+         */
+        template<typename RangeCallback, typename PfnCallback>
+        static NTSTATUS EnumerateRanges(
+            VmbusRingPacket const& Packet,
+            RangeCallback&& OnRange,
+            PfnCallback&& OnPfn)
+        {
+            HV_UINT32 Offset = offsetof(VMDATA_GPA_DIRECT, Range);
+            HV_UINT32 End =
+                Packet.Descriptor().DataOffset8 * VmbusRingPacketAlignment;
+            HV_UINT32 RangeHeader[2];
+            if (Packet.Descriptor().Type != VmbusPacketTypeDataUsingGpaDirect ||
+                End < Offset ||
+                Packet.Copy(
+                    Offset - sizeof(RangeHeader),
+                    RangeHeader,
+                    sizeof(RangeHeader)) != sizeof(RangeHeader))
+            {
+                return STATUS_BAD_DATA;
+            }
+
+            for (HV_UINT32 i = 0; i < RangeHeader[1]; ++i)
+            {
+                GPA_RANGE Header;
+                if (End - Offset < VmbusGpadlWordSize)
+                {
+                    return STATUS_BAD_DATA;
+                }
+                Packet.Copy(Offset, &Header, VmbusGpadlWordSize);
+                Offset += VmbusGpadlWordSize;
+                VmbusGpadlRange Range;
+                Range.ByteCount = Header.ByteCount;
+                Range.ByteOffset = Header.ByteOffset;
+                NTSTATUS Status =
+                    ::Mile::HyperV::VmbusGpadlValidateRange(Range);
+                if (!NT_SUCCESS(Status))
+                {
+                    return (Status == STATUS_INTEGER_OVERFLOW)
+                        ? Status
+                        : STATUS_BAD_DATA;
+                }
+                HV_UINT64 PfnCount =
+                    ::Mile::HyperV::VmbusGpadlRangePfnCount(Range);
+                if ((End - Offset) / VmbusGpadlWordSize < PfnCount)
+                {
+                    return STATUS_BAD_DATA;
+                }
+                OnRange(static_cast<HV_UINT16>(i), Range);
+                for (HV_UINT64 j = 0; j < PfnCount; ++j)
+                {
+                    HV_UINT64 Pfn;
+                    Packet.Copy(Offset, &Pfn, VmbusGpadlWordSize);
+                    Offset += VmbusGpadlWordSize;
+                    OnPfn(Pfn);
+                }
+            }
+            return STATUS_SUCCESS;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_GPADIRECT
@@ -0,0 +1,567 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.Gpadl.h
+ * PURPOSE:    Definition for Hyper-V VMBus GPADL Message Encoder and Decoder
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+// References
+// - OpenVMM
+//   - vm\devices\vmbus\vmbus_core\src\protocol.rs
+//   - vm\devices\vmbus\vmbus_server\src\channels.rs
+
+#ifndef MILE_HYPERV_VMBUS_GPADL
+#define MILE_HYPERV_VMBUS_GPADL
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus GPADL encoder requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.Guest.Protocols.h"
+
+#include <cstddef>
+#include <cstring>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_NO_MORE_ENTRIES
+// No more entries are available from an enumeration operation.
+#define STATUS_NO_MORE_ENTRIES ((NTSTATUS)0x8000001AL)
+#endif // !STATUS_NO_MORE_ENTRIES
+
+#ifndef STATUS_MORE_ENTRIES
+// Returned by enumeration APIs to indicate more information is available to
+// successive calls.
+#define STATUS_MORE_ENTRIES ((NTSTATUS)0x00000105L)
+#endif // !STATUS_MORE_ENTRIES
+
+#ifndef STATUS_INTEGER_OVERFLOW
+// Integer overflow.
+#define STATUS_INTEGER_OVERFLOW ((NTSTATUS)0xC0000095L)
+#endif // !STATUS_INTEGER_OVERFLOW
+
+namespace Mile::HyperV
+{
+    // GPADL pages are always hypervisor pages, whatever the guest page size.
+    const HV_UINT32 VmbusGpadlPageSize = HV_PAGE_SIZE;
+
+    // The range buffer is a flat array of 64-bit words. Every GPA_RANGE takes
+    // one word for ByteCount and ByteOffset, followed by one word per PFN.
+    const HV_UINT32 VmbusGpadlWordSize = sizeof(HV_UINT64);
+
+    // The number of range buffer words a ChannelMessageGpadlHeader carries.
+    constexpr HV_UINT32 VmbusGpadlHeaderMaximumWords =
+        (MAXIMUM_SYNIC_MESSAGE_BYTES
+            - offsetof(VMBUS_CHANNEL_GPADL_HEADER, Range))
+        / VmbusGpadlWordSize;
+
+    // The number of range buffer words a ChannelMessageGpadlBody carries.
+    constexpr HV_UINT32 VmbusGpadlBodyMaximumWords =
+        (MAXIMUM_SYNIC_MESSAGE_BYTES
+            - offsetof(VMBUS_CHANNEL_GPADL_BODY, Pfn))
+        / VmbusGpadlWordSize;
+
+    /**
+     * @brief Describes one GPA_RANGE of a GPADL without its PFN array.
+     */
+    struct VmbusGpadlRange
+    {
+        HV_UINT32 ByteCount;
+        HV_UINT32 ByteOffset;
+    };
+
+    /**
+     * @brief Gets the number of PFNs a GPA_RANGE needs.
+     * @param Range The range.
+     * @return The number of pages spanned by ByteOffset and ByteCount.
+     */
+    constexpr HV_UINT64 VmbusGpadlRangePfnCount(
+        VmbusGpadlRange const& Range)
+    {
+        return (static_cast<HV_UINT64>(Range.ByteOffset)
+            + Range.ByteCount
+            + (VmbusGpadlPageSize - 1)) / VmbusGpadlPageSize;
+    }
+
+    /**
+     * @brief Gets the number of messages needed to send a range buffer.
+     * @param Words The number of range buffer words.
+     * @return The number of messages, the header included.
+     */
+    constexpr HV_UINT64 VmbusGpadlMessageCount(
+        HV_UINT64 Words)
+    {
+        return (Words <= VmbusGpadlHeaderMaximumWords)
+            ? 1
+            : 1 + (Words - VmbusGpadlHeaderMaximumWords
+                + (VmbusGpadlBodyMaximumWords - 1))
+                / VmbusGpadlBodyMaximumWords;
+    }
+
+    /**
+     * @brief Validates a GPA_RANGE header.
+     * @param Range The range.
+     * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER if the range is empty
+     *         or its offset is not inside the first page, or
+     *         STATUS_INTEGER_OVERFLOW if it needs more than
+     *         GPA_RANGE_MAX_PFN_COUNT PFNs.
+     */
+    constexpr NTSTATUS VmbusGpadlValidateRange(
+        VmbusGpadlRange const& Range)
+    {
+        if (!Range.ByteCount || Range.ByteOffset >= VmbusGpadlPageSize)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (::Mile::HyperV::VmbusGpadlRangePfnCount(Range)
+            > GPA_RANGE_MAX_PFN_COUNT)
+        {
+            return STATUS_INTEGER_OVERFLOW;
+        }
+        return STATUS_SUCCESS;
+    }
+
+    /**
+     * @brief Streams the ChannelMessageGpadlHeader and
+     *        ChannelMessageGpadlBody messages of a GPADL, pulling PFNs from
+     *        any source without allocating.
+     */
+    class VmbusGpadlEncoder
+    {
+    private:
+
+        const VmbusGpadlRange* m_Ranges = nullptr;
+        HV_UINT16 m_RangeCount = 0;
+        HV_UINT16 m_RangeIndex = 0;
+        HV_UINT32 m_ChildRelId = 0;
+        HV_UINT32 m_Gpadl = 0;
+        HV_UINT64 m_TotalWords = 0;
+        // The PFNs left in the current range.
+        HV_UINT32 m_PfnsLeft = 0;
+        HV_UINT32 m_MessageNumber = 0;
+        bool m_HeaderSent = false;
+
+        bool IsWordStreamComplete() const
+        {
+            return !m_PfnsLeft && m_RangeIndex == m_RangeCount;
+        }
+
+        template<typename PfnSource>
+        NTSTATUS FillWords(
+            PfnSource&& Source,
+            HV_UINT8* Words,
+            HV_UINT32 MaximumWords,
+            HV_UINT32* WordCount)
+        {
+            HV_UINT32 Count = 0;
+            while (Count < MaximumWords && !this->IsWordStreamComplete())
+            {
+                HV_UINT64 Word = 0;
+                if (m_PfnsLeft)
+                {
+                    if (!Source(Word))
+                    {
+                        return STATUS_INVALID_PARAMETER;
+                    }
+                    --m_PfnsLeft;
+                }
+                else
+                {
+                    VmbusGpadlRange const& Range = m_Ranges[m_RangeIndex++];
+                    GPA_RANGE Header;
+                    Header.ByteCount = Range.ByteCount;
+                    Header.ByteOffset = Range.ByteOffset;
+                    std::memcpy(&Word, &Header, VmbusGpadlWordSize);
+                    m_PfnsLeft = static_cast<HV_UINT32>(
+                        ::Mile::HyperV::VmbusGpadlRangePfnCount(Range));
+                }
+                std::memcpy(
+                    Words + Count * VmbusGpadlWordSize,
+                    &Word,
+                    VmbusGpadlWordSize);
+                ++Count;
+            }
+            *WordCount = Count;
+            return STATUS_SUCCESS;
+        }
+
+    public:
+
+        /**
+         * @brief Starts encoding a GPADL.
+         * @param ChildRelId The channel the GPADL belongs to.
+         * @param Gpadl The GPADL handle chosen by the guest.
+         * @param Ranges The ranges, which must outlive the encoding.
+         * @param RangeCount The number of ranges.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER, or
+         *         STATUS_INTEGER_OVERFLOW if a range needs more than
+         *         GPA_RANGE_MAX_PFN_COUNT PFNs.
+         */
+        NTSTATUS Initialize(
+            HV_UINT32 ChildRelId,
+            HV_UINT32 Gpadl,
+            const VmbusGpadlRange* Ranges,
+            HV_UINT16 RangeCount)
+        {
+            *this = VmbusGpadlEncoder();
+            if (!Ranges || !RangeCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            HV_UINT64 TotalWords = 0;
+            for (HV_UINT16 i = 0; i < RangeCount; ++i)
+            {
+                NTSTATUS Status =
+                    ::Mile::HyperV::VmbusGpadlValidateRange(Ranges[i]);
+                if (!NT_SUCCESS(Status))
+                {
+                    return Status;
+                }
+                TotalWords +=
+                    1 + ::Mile::HyperV::VmbusGpadlRangePfnCount(Ranges[i]);
+            }
+
+            m_Ranges = Ranges;
+            m_RangeCount = RangeCount;
+            m_ChildRelId = ChildRelId;
+            m_Gpadl = Gpadl;
+            m_TotalWords = TotalWords;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Gets the number of range buffer words of the GPADL.
+         * @return The number of words, range headers included.
+         */
+        HV_UINT64 TotalWords() const
+        {
+            return m_TotalWords;
+        }
+
+        /**
+         * @brief Gets the number of messages the GPADL needs.
+         * @return The number of messages, the header included.
+         */
+        HV_UINT64 MessageCount() const
+        {
+            return ::Mile::HyperV::VmbusGpadlMessageCount(m_TotalWords);
+        }
+
+        bool IsComplete() const
+        {
+            return m_HeaderSent && this->IsWordStreamComplete();
+        }
+
+        /**
+         * @brief Produces the next message.
+         * @param Source The callback invoked as bool Source(HV_UINT64& Pfn)
+         *               for every PFN in range order. It returns false when
+         *               it runs out of PFNs.
+         * @param Message The buffer which receives the message, at least
+         *                MAXIMUM_SYNIC_MESSAGE_BYTES bytes.
+         * @param MessageSize Receives the size of the message in bytes.
+         * @return STATUS_SUCCESS, STATUS_NO_MORE_ENTRIES once all messages
+         *         were produced, or STATUS_INVALID_PARAMETER if the source
+         *         runs out of PFNs or the encoder was not initialized.
+         */
+        template<typename PfnSource>
+        NTSTATUS Next(
+            PfnSource&& Source,
+            void* Message,
+            HV_UINT32* MessageSize)
+        {
+            if (!m_Ranges || !Message || !MessageSize)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            if (this->IsComplete())
+            {
+                return STATUS_NO_MORE_ENTRIES;
+            }
+
+            HV_UINT8* Bytes = reinterpret_cast<HV_UINT8*>(Message);
+            HV_UINT32 WordCount = 0;
+            NTSTATUS Status = STATUS_SUCCESS;
+            if (!m_HeaderSent)
+            {
+                VMBUS_CHANNEL_GPADL_HEADER Header = {};
+                Header.Header.MessageType = ChannelMessageGpadlHeader;
+                Header.ChildRelId = m_ChildRelId;
+                Header.Gpadl = m_Gpadl;
+                // The field is 16 bits wide, so it wraps for GPADLs larger
+                // than 32 MiB, which is what existing guests send as well.
+                Header.RangeBufLen = static_cast<HV_UINT16>(
+                    m_TotalWords * VmbusGpadlWordSize);
+                Header.RangeCount = m_RangeCount;
+                const HV_UINT32 FixedSize =
+                    offsetof(VMBUS_CHANNEL_GPADL_HEADER, Range);
+                std::memcpy(Bytes, &Header, FixedSize);
+                Status = this->FillWords(
+                    Source,
+                    Bytes + FixedSize,
+                    VmbusGpadlHeaderMaximumWords,
+                    &WordCount);
+                *MessageSize = FixedSize + WordCount * VmbusGpadlWordSize;
+            }
+            else
+            {
+                VMBUS_CHANNEL_GPADL_BODY Body = {};
+                Body.Header.MessageType = ChannelMessageGpadlBody;
+                Body.MessageNumber = m_MessageNumber;
+                Body.Gpadl = m_Gpadl;
+                const HV_UINT32 FixedSize =
+                    offsetof(VMBUS_CHANNEL_GPADL_BODY, Pfn);
+                std::memcpy(Bytes, &Body, FixedSize);
+                Status = this->FillWords(
+                    Source,
+                    Bytes + FixedSize,
+                    VmbusGpadlBodyMaximumWords,
+                    &WordCount);
+                *MessageSize = FixedSize + WordCount * VmbusGpadlWordSize;
+            }
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+
+            m_HeaderSent = true;
+            ++m_MessageNumber;
+            return STATUS_SUCCESS;
+        }
+    };
+
+    /**
+     * @brief Reassembles a GPADL from its ChannelMessageGpadlHeader and
+     *        ChannelMessageGpadlBody messages, streaming the ranges and PFNs
+     *        to callbacks without allocating.
+     */
+    class VmbusGpadlDecoder
+    {
+    private:
+
+        HV_UINT32 m_ChildRelId = 0;
+        HV_UINT32 m_Gpadl = 0;
+        HV_UINT16 m_RangeBufferLength = 0;
+        HV_UINT16 m_RangeCount = 0;
+        HV_UINT16 m_RangeIndex = 0;
+        HV_UINT32 m_PfnsLeft = 0;
+        HV_UINT64 m_TotalWords = 0;
+        // The MessageNumber the next body carries, as the header is message
+        // zero.
+        HV_UINT32 m_MessageNumber = 0;
+        bool m_HeaderReceived = false;
+
+        bool IsWordStreamComplete() const
+        {
+            return !m_PfnsLeft && m_RangeIndex == m_RangeCount;
+        }
+
+        template<typename RangeCallback, typename PfnCallback>
+        NTSTATUS ConsumeWords(
+            const HV_UINT8* Words,
+            HV_UINT32 WordCount,
+            RangeCallback&& OnRange,
+            PfnCallback&& OnPfn)
+        {
+            for (HV_UINT32 i = 0; i < WordCount; ++i)
+            {
+                if (this->IsWordStreamComplete())
+                {
+                    // More words than the ranges describe.
+                    return STATUS_BAD_DATA;
+                }
+
+                if (m_PfnsLeft)
+                {
+                    HV_UINT64 Pfn;
+                    std::memcpy(
+                        &Pfn,
+                        Words + i * VmbusGpadlWordSize,
+                        VmbusGpadlWordSize);
+                    OnPfn(Pfn);
+                    --m_PfnsLeft;
+                }
+                else
+                {
+                    GPA_RANGE Header;
+                    std::memcpy(
+                        &Header,
+                        Words + i * VmbusGpadlWordSize,
+                        VmbusGpadlWordSize);
+                    VmbusGpadlRange Range;
+                    Range.ByteCount = Header.ByteCount;
+                    Range.ByteOffset = Header.ByteOffset;
+                    NTSTATUS Status =
+                        ::Mile::HyperV::VmbusGpadlValidateRange(Range);
+                    if (!NT_SUCCESS(Status))
+                    {
+                        return (Status == STATUS_INTEGER_OVERFLOW)
+                            ? Status
+                            : STATUS_BAD_DATA;
+                    }
+                    OnRange(m_RangeIndex++, Range);
+                    m_PfnsLeft = static_cast<HV_UINT32>(
+                        ::Mile::HyperV::VmbusGpadlRangePfnCount(Range));
+                }
+                ++m_TotalWords;
+            }
+
+            if (!this->IsWordStreamComplete())
+            {
+                return STATUS_MORE_ENTRIES;
+            }
+            if (static_cast<HV_UINT16>(m_TotalWords * VmbusGpadlWordSize)
+                != m_RangeBufferLength)
+            {
+                return STATUS_BAD_DATA;
+            }
+            return STATUS_SUCCESS;
+        }
+
+    public:
+
+        HV_UINT32 ChildRelId() const
+        {
+            return m_ChildRelId;
+        }
+
+        HV_UINT32 Gpadl() const
+        {
+            return m_Gpadl;
+        }
+
+        bool IsComplete() const
+        {
+            return m_HeaderReceived && this->IsWordStreamComplete();
+        }
+
+        /**
+         * @brief Decodes a ChannelMessageGpadlHeader message and starts a
+         *        new GPADL.
+         * @param Message The message.
+         * @param MessageSize The size of the message in bytes.
+         * @param OnRange The callback invoked as OnRange(HV_UINT16 Index,
+         *                VmbusGpadlRange const& Range) for every range.
+         * @param OnPfn The callback invoked as OnPfn(HV_UINT64 Pfn) for every
+         *              PFN, in range order.
+         * @return STATUS_SUCCESS if the GPADL is complete, STATUS_MORE_ENTRIES
+         *         if body messages must follow, STATUS_INTEGER_OVERFLOW if a
+         *         range exceeds GPA_RANGE_MAX_PFN_COUNT, or STATUS_BAD_DATA.
+         */
+        template<typename RangeCallback, typename PfnCallback>
+        NTSTATUS DecodeHeader(
+            const void* Message,
+            HV_UINT32 MessageSize,
+            RangeCallback&& OnRange,
+            PfnCallback&& OnPfn)
+        {
+            *this = VmbusGpadlDecoder();
+
+            const HV_UINT32 FixedSize =
+                offsetof(VMBUS_CHANNEL_GPADL_HEADER, Range);
+            if (!Message ||
+                MessageSize < FixedSize ||
+                MessageSize > MAXIMUM_SYNIC_MESSAGE_BYTES)
+            {
+                return STATUS_BAD_DATA;
+            }
+            VMBUS_CHANNEL_GPADL_HEADER Header;
+            std::memcpy(&Header, Message, FixedSize);
+            if (Header.Header.MessageType != ChannelMessageGpadlHeader ||
+                !Header.RangeCount)
+            {
+                return STATUS_BAD_DATA;
+            }
+
+            m_ChildRelId = Header.ChildRelId;
+            m_Gpadl = Header.Gpadl;
+            m_RangeBufferLength = Header.RangeBufLen;
+            m_RangeCount = Header.RangeCount;
+            m_MessageNumber = 1;
+            m_HeaderReceived = true;
+            return this->ConsumeWords(
+                reinterpret_cast<const HV_UINT8*>(Message) + FixedSize,
+                (MessageSize - FixedSize) / VmbusGpadlWordSize,
+                OnRange,
+                OnPfn);
+        }
+
+        /**
+         * @brief Decodes a ChannelMessageGpadlBody message of the GPADL
+         *        started by DecodeHeader.
+         * @param Message The message.
+         * @param MessageSize The size of the message in bytes.
+         * @param OnRange See DecodeHeader.
+         * @param OnPfn See DecodeHeader.
+         * @return See DecodeHeader, STATUS_INVALID_DEVICE_STATE if no GPADL
+         *         is in progress, or STATUS_INVALID_PARAMETER if the
+         *         MessageNumber is not the next in sequence, in which case
+         *         the message is dropped and the GPADL stays in progress.
+         * @remark Bodies are numbered from one in the order they are sent,
+         *         as VmbusGpadlEncoder numbers them.
+         */
+        template<typename RangeCallback, typename PfnCallback>
+        NTSTATUS DecodeBody(
+            const void* Message,
+            HV_UINT32 MessageSize,
+            RangeCallback&& OnRange,
+            PfnCallback&& OnPfn)
+        {
+            if (!m_HeaderReceived || this->IsWordStreamComplete())
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+
+            const HV_UINT32 FixedSize =
+                offsetof(VMBUS_CHANNEL_GPADL_BODY, Pfn);
+            if (!Message ||
+                MessageSize < FixedSize + VmbusGpadlWordSize ||
+                MessageSize > MAXIMUM_SYNIC_MESSAGE_BYTES)
+            {
+                return STATUS_BAD_DATA;
+            }
+            VMBUS_CHANNEL_GPADL_BODY Body;
+            std::memcpy(&Body, Message, FixedSize);
+            if (Body.Header.MessageType != ChannelMessageGpadlBody ||
+                Body.Gpadl != m_Gpadl)
+            {
+                return STATUS_BAD_DATA;
+            }
+            if (Body.MessageNumber != m_MessageNumber)
+            {
+                // A reordered or repeated body would land its PFNs in the
+                // wrong positions.
+                return STATUS_INVALID_PARAMETER;
+            }
+            ++m_MessageNumber;
+
+            return this->ConsumeWords(
+                reinterpret_cast<const HV_UINT8*>(Message) + FixedSize,
+                (MessageSize - FixedSize) / VmbusGpadlWordSize,
+                OnRange,
+                OnPfn);
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_GPADL
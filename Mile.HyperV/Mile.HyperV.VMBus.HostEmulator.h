@@ -0,0 +1,1418 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.HostEmulator.h
+ * PURPOSE:    Definition for Hyper-V VMBus In-Process Host Emulator
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+// References
+// - OpenVMM
+//   - vm\devices\vmbus\vmbus_server\src\channels.rs
+//   - vm\devices\vmbus\vmbus_core\src\protocol.rs
+
+#ifndef MILE_HYPERV_VMBUS_HOSTEMULATOR
+#define MILE_HYPERV_VMBUS_HOSTEMULATOR
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus host emulator requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.Gpadl.h"
+#include "Mile.HyperV.VMBus.Ring.h"
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_NOT_FOUND
+// The object was not found.
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#endif // !STATUS_NOT_FOUND
+
+namespace Mile::HyperV
+{
+    // The versions the emulator accepts in ChannelMessageInitiateContact,
+    // newest first.
+    const HV_UINT32 VmbusHostEmulatorVersions[] =
+    {
+        VMBUS_VERSION_COPPER,
+        VMBUS_VERSION_IRON,
+        VMBUS_VERSION_WIN10RS5,
+        VMBUS_VERSION_WIN10RS4,
+        VMBUS_VERSION_WIN10RS3_1,
+        VMBUS_VERSION_WIN10RS3_0,
+        VMBUS_VERSION_WIN10,
+        VMBUS_VERSION_WIN8_1,
+        VMBUS_VERSION_WIN8,
+        VMBUS_VERSION_WIN7,
+        VMBUS_VERSION_V1,
+    };
+
+    // The features the emulator offers to guests which negotiate
+    // VMBUS_VERSION_COPPER.
+    const HV_UINT32 VmbusHostEmulatorFeatureFlags =
+        VMBUS_FEATURE_FLAG_GUEST_SPECIFIED_SIGNAL_PARAMETERS |
+        VMBUS_FEATURE_FLAG_CLIENT_ID |
+        VMBUS_FEATURE_FLAG_PAUSE_RESUME;
+
+    // The connection IDs of the channels follow this value, so they never
+    // collide with VMBUS_MESSAGE_CONNECTION_ID.
+    const HV_UINT32 VmbusHostEmulatorConnectionIdBase = 0x10000;
+
+    /**
+     * @brief A single producer, single consumer queue of SynIC messages,
+     *        standing in for the message slot of a SINT between the guest and
+     *        the host.
+     * @remark Unlike a real message slot, the queue holds several messages,
+     *         so the sender only fails when all of them are in use, which is
+     *         when the hypervisor returns HV_STATUS_INSUFFICIENT_BUFFERS. The
+     *         receiver uses messages in place and completes them, which is the
+     *         counterpart of writing HV_X64_MSR_EOM.
+     */
+    class VmbusSynicMessageQueue
+    {
+    private:
+
+        HV_MESSAGE* m_Slots = nullptr;
+        HV_UINT32 m_Mask = 0;
+        // Written by the sender only.
+        alignas(64) HV_UINT32 volatile m_Tail = 0;
+        // Written by the receiver only.
+        alignas(64) HV_UINT32 volatile m_Head = 0;
+
+    public:
+
+        /**
+         * @brief Initializes the queue over caller-owned slots.
+         * @param Slots The slots, which must outlive the queue.
+         * @param SlotCount The number of slots, a power of two.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            HV_MESSAGE* Slots,
+            HV_UINT32 SlotCount)
+        {
+            m_Slots = nullptr;
+            m_Mask = 0;
+            m_Tail = 0;
+            m_Head = 0;
+            if (!Slots || !SlotCount || (SlotCount & (SlotCount - 1)))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            m_Slots = Slots;
+            m_Mask = SlotCount - 1;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Gets the number of messages the sender can post right now.
+         * @return The number of free slots.
+         */
+        HV_UINT32 FreeCount() const
+        {
+            HV_UINT32 Tail = ::Mile::HyperV::VmbusRingLoadRelaxed(m_Tail);
+            HV_UINT32 Head = ::Mile::HyperV::VmbusRingLoadAcquire(m_Head);
+            return (m_Slots ? m_Mask + 1 : 0) - (Tail - Head);
+        }
+
+        bool IsEmpty() const
+        {
+            return ::Mile::HyperV::VmbusRingLoadRelaxed(m_Head)
+                == ::Mile::HyperV::VmbusRingLoadAcquire(m_Tail);
+        }
+
+        /**
+         * @brief Posts a message, as HvCallPostMessage does.
+         * @param MessageType The SynIC message type.
+         * @param Payload The payload.
+         * @param PayloadSize The size of the payload in bytes, at most
+         *                    HV_MESSAGE_PAYLOAD_BYTE_COUNT.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER, or
+         *         STATUS_INSUFFICIENT_RESOURCES if every slot is in use.
+         */
+        NTSTATUS Post(
+            HV_MESSAGE_TYPE MessageType,
+            const void* Payload,
+            HV_UINT32 PayloadSize)
+        {
+            if (!m_Slots ||
+                (!Payload && PayloadSize) ||
+                PayloadSize > HV_MESSAGE_PAYLOAD_BYTE_COUNT)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            HV_UINT32 Tail = ::Mile::HyperV::VmbusRingLoadRelaxed(m_Tail);
+            if (Tail - ::Mile::HyperV::VmbusRingLoadAcquire(m_Head)
+                > m_Mask)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            HV_MESSAGE& Slot = m_Slots[Tail & m_Mask];
+            Slot.Header.MessageType = MessageType;
+            Slot.Header.PayloadSize = static_cast<HV_UINT8>(PayloadSize);
+            Slot.Header.MessageFlags.AsUINT8 = 0;
+            Slot.Header.Sender = 0;
+            Slot.Header.Port.AsUINT32 = VMBUS_MESSAGE_CONNECTION_ID;
+            if (PayloadSize)
+            {
+                std::memcpy(Slot.Payload, Payload, PayloadSize);
+            }
+            ::Mile::HyperV::VmbusRingStoreRelease(m_Tail, Tail + 1);
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Gets the oldest message without removing it.
+         * @return The message, or nullptr if the queue is empty. The
+         *         MessagePending flag tells whether more messages follow.
+         */
+        const HV_MESSAGE* Peek()
+        {
+            if (!m_Slots)
+            {
+                return nullptr;
+            }
+            HV_UINT32 Head = ::Mile::HyperV::VmbusRingLoadRelaxed(m_Head);
+            HV_UINT32 Tail = ::Mile::HyperV::VmbusRingLoadAcquire(m_Tail);
+            if (Head == Tail)
+            {
+                return nullptr;
+            }
+            HV_MESSAGE& Slot = m_Slots[Head & m_Mask];
+            Slot.Header.MessageFlags.MessagePending = (Tail - Head > 1);
+            return &Slot;
+        }
+
+        /**
+         * @brief Removes the message returned by Peek and frees its slot.
+         */
+        void Complete()
+        {
+            HV_UINT32 Head = ::Mile::HyperV::VmbusRingLoadRelaxed(m_Head);
+            if (Head != ::Mile::HyperV::VmbusRingLoadAcquire(m_Tail))
+            {
+                ::Mile::HyperV::VmbusRingStoreRelease(m_Head, Head + 1);
+            }
+        }
+
+        /**
+         * @brief Removes the oldest message and copies it out.
+         * @param Message Receives the message.
+         * @return STATUS_SUCCESS, or STATUS_NO_MORE_ENTRIES if the queue is
+         *         empty.
+         */
+        NTSTATUS Receive(
+            HV_MESSAGE& Message)
+        {
+            const HV_MESSAGE* Slot = this->Peek();
+            if (!Slot)
+            {
+                return STATUS_NO_MORE_ENTRIES;
+            }
+            Message = *Slot;
+            this->Complete();
+            return STATUS_SUCCESS;
+        }
+    };
+
+    enum class VmbusHostChannelState : HV_UINT8
+    {
+        Free,
+        Offered,
+        Open,
+        // Rescinded, until the guest sends ChannelMessageRelIdReleased.
+        Rescinded,
+    };
+
+    enum class VmbusHostEvent : HV_UINT8
+    {
+        // The guest opened the channel. The status the callback returns is
+        // sent in ChannelMessageOpenChannelResult.
+        Open,
+        // The guest closed the channel, or it was closed by a rescind or an
+        // unload.
+        Close,
+        // The guest retargeted the interrupts of the channel. The channel
+        // already has the new TargetVp, and the status the callback returns
+        // is sent in ChannelMessageModifyChannelResponse since
+        // VMBUS_VERSION_IRON.
+        Modify,
+    };
+
+    /**
+     * @brief A channel of the host emulator.
+     */
+    struct VmbusHostChannel
+    {
+        VmbusHostChannelState State;
+        HV_UINT16 Flags;
+        HV_UINT16 SubChannelIndex;
+        HV_GUID InterfaceType;
+        HV_GUID InterfaceInstance;
+        HV_UINT8 UserDefined[MAX_USER_DEFINED_BYTES];
+        HV_UINT32 ChildRelId;
+        HV_CONNECTION_ID ConnectionId;
+
+        // Valid while the channel is open.
+
+        HV_UINT32 OpenId;
+        HV_UINT32 RingBufferGpadlHandle;
+        HV_UINT32 DownstreamRingBufferPageOffset;
+        HV_VP_INDEX TargetVp;
+        HV_UINT16 EventFlag;
+        HV_UINT16 OpenFlags;
+        HV_CONNECTION_ID GuestConnectionId;
+        HV_UINT8 UserData[MAX_USER_DEFINED_BYTES];
+
+        // Reserved for the device behind the channel.
+        void* Context;
+    };
+
+    /**
+     * @brief A GPADL the guest created, with its range buffer words.
+     */
+    struct VmbusHostGpadl
+    {
+        VmbusGpadlDecoder Decoder;
+        HV_UINT64* Words;
+        HV_UINT32 WordCount;
+        HV_UINT32 PageCount;
+        HV_UINT32 ChildRelId;
+        HV_UINT32 Handle;
+        bool InUse;
+        bool IsComplete;
+        bool IsTeardownPending;
+        // Set when the range buffer did not fit into the words of the slot.
+        bool IsTruncated;
+    };
+
+    /**
+     * @brief An in-process stand-in for the VMBus host, which answers the
+     *        channel messages of a guest over a pair of
+     *        VmbusSynicMessageQueue and keeps the offers, channels and GPADLs
+     *        in caller-owned tables.
+     * @remark Every message the guest sends is answered with at most one
+     *         message, so Process only consumes a message once a slot is free
+     *         in the outbound queue, and ChannelMessageRequestOffers is
+     *         answered incrementally. Messages which violate the protocol are
+     *         dropped and counted, as a real host would ignore them.
+     */
+    class VmbusHostEmulator
+    {
+    private:
+
+        VmbusSynicMessageQueue* m_Inbound = nullptr;
+        VmbusSynicMessageQueue* m_Outbound = nullptr;
+        VmbusHostChannel* m_Channels = nullptr;
+        HV_UINT32 m_ChannelCount = 0;
+        VmbusHostGpadl* m_Gpadls = nullptr;
+        HV_UINT32 m_GpadlCount = 0;
+        HV_UINT32 m_WordsPerGpadl = 0;
+        HV_UINT32 m_Version = 0;
+        HV_UINT32 m_FeatureFlags = 0;
+        HV_GUID m_ClientId = {};
+        // The next channel to offer while offers are being delivered, or
+        // m_ChannelCount once ChannelMessageAllOffersDelivered was sent.
+        HV_UINT32 m_NextOffer = 0;
+        bool m_IsConnected = false;
+        bool m_IsDelivering = false;
+        // Set from ChannelMessagePause to ChannelMessageResume, while no
+        // offer or rescind is sent.
+        bool m_IsPaused = false;
+        HV_UINT64 m_ProtocolErrors = 0;
+
+        NTSTATUS Send(
+            const void* Message,
+            HV_UINT32 MessageSize)
+        {
+            return m_Outbound->Post(
+                static_cast<HV_MESSAGE_TYPE>(VMBUS_MESSAGE_TYPE),
+                Message,
+                MessageSize);
+        }
+
+        NTSTATUS SendOffer(
+            VmbusHostChannel const& Channel)
+        {
+            VMBUS_CHANNEL_OFFER_CHANNEL Offer = {};
+            Offer.Header.MessageType = ChannelMessageOfferChannel;
+            Offer.InterfaceType = Channel.InterfaceType;
+            Offer.InterfaceInstance = Channel.InterfaceInstance;
+            Offer.Flags = Channel.Flags;
+            std::memcpy(
+                Offer.UserDefined,
+                Channel.UserDefined,
+                sizeof(Offer.UserDefined));
+            Offer.SubChannelIndex = Channel.SubChannelIndex;
+            Offer.ChildRelId = Channel.ChildRelId;
+            HV_UINT32 Size = VMBUS_CHANNEL_OFFER_CHANNEL_SIZE_PRE_WIN7;
+            if (m_Version >= VMBUS_VERSION_WIN7)
+            {
+                Offer.ConnectionId = Channel.ConnectionId;
+                Size = sizeof(Offer);
+            }
+            return this->Send(&Offer, Size);
+        }
+
+        /**
+         * @brief Sends the offers which are left from the last
+         *        ChannelMessageRequestOffers.
+         * @return STATUS_SUCCESS once ChannelMessageAllOffersDelivered was
+         *         sent or the guest paused the host, or STATUS_DEVICE_BUSY if
+         *         the outbound queue is full.
+         */
+        NTSTATUS DeliverOffers()
+        {
+            while (m_IsDelivering && !m_IsPaused)
+            {
+                if (!m_Outbound->FreeCount())
+                {
+                    return STATUS_DEVICE_BUSY;
+                }
+                if (m_NextOffer == m_ChannelCount)
+                {
+                    VMBUS_CHANNEL_ALL_OFFERS_DELIVERED Message = {};
+                    Message.MessageType = ChannelMessageAllOffersDelivered;
+                    this->Send(&Message, sizeof(Message));
+                    m_IsDelivering = false;
+                    break;
+                }
+                VmbusHostChannel const& Channel = m_Channels[m_NextOffer++];
+                if (Channel.State == VmbusHostChannelState::Offered)
+                {
+                    this->SendOffer(Channel);
+                }
+            }
+            return STATUS_SUCCESS;
+        }
+
+        VmbusHostChannel* LookupChannel(
+            HV_UINT32 ChildRelId)
+        {
+            if (!ChildRelId || ChildRelId > m_ChannelCount)
+            {
+                return nullptr;
+            }
+            VmbusHostChannel& Channel = m_Channels[ChildRelId - 1];
+            return (Channel.State == VmbusHostChannelState::Free)
+                ? nullptr
+                : &Channel;
+        }
+
+        VmbusHostGpadl* LookupGpadl(
+            HV_UINT32 Handle)
+        {
+            for (HV_UINT32 i = 0; i < m_GpadlCount; ++i)
+            {
+                if (m_Gpadls[i].InUse && m_Gpadls[i].Handle == Handle)
+                {
+                    return &m_Gpadls[i];
+                }
+            }
+            return nullptr;
+        }
+
+        void ReleaseGpadl(
+            VmbusHostGpadl& Gpadl)
+        {
+            Gpadl.InUse = false;
+            Gpadl.IsComplete = false;
+            Gpadl.IsTeardownPending = false;
+        }
+
+        void SendGpadlTorndown(
+            HV_UINT32 Handle)
+        {
+            VMBUS_CHANNEL_GPADL_TORNDOWN Torndown = {};
+            Torndown.Header.MessageType = ChannelMessageGpadlTorndown;
+            Torndown.Gpadl = Handle;
+            this->Send(&Torndown, sizeof(Torndown));
+        }
+
+        template<typename EventCallback>
+        void CloseChannel(
+            VmbusHostChannel& Channel,
+            EventCallback&& OnEvent,
+            bool SendTorndown)
+        {
+            Channel.State = VmbusHostChannelState::Offered;
+            OnEvent(VmbusHostEvent::Close, Channel);
+            VmbusHostGpadl* Gpadl =
+                this->LookupGpadl(Channel.RingBufferGpadlHandle);
+            if (Gpadl && Gpadl->IsTeardownPending)
+            {
+                HV_UINT32 Handle = Gpadl->Handle;
+                this->ReleaseGpadl(*Gpadl);
+                if (SendTorndown)
+                {
+                    this->SendGpadlTorndown(Handle);
+                }
+            }
+        }
+
+        template<typename EventCallback>
+        void Disconnect(
+            EventCallback&& OnEvent)
+        {
+            for (HV_UINT32 i = 0; i < m_ChannelCount; ++i)
+            {
+                VmbusHostChannel& Channel = m_Channels[i];
+                if (Channel.State == VmbusHostChannelState::Open)
+                {
+                    this->CloseChannel(Channel, OnEvent, false);
+                }
+                else if (Channel.State == VmbusHostChannelState::Rescinded)
+                {
+                    Channel.State = VmbusHostChannelState::Free;
+                }
+            }
+            for (HV_UINT32 i = 0; i < m_GpadlCount; ++i)
+            {
+                this->ReleaseGpadl(m_Gpadls[i]);
+            }
+            m_IsConnected = false;
+            m_IsDelivering = false;
+            m_IsPaused = false;
+            m_NextOffer = 0;
+            m_Version = 0;
+            m_FeatureFlags = 0;
+        }
+
+        NTSTATUS OnInitiateContact(
+            const HV_UINT8* Message,
+            HV_UINT32 MessageSize)
+        {
+            if (m_IsConnected ||
+                MessageSize < VMBUS_CHANNEL_INITIATE_CONTACT_MIN_SIZE)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            VMBUS_CHANNEL_INITIATE_CONTACT Contact = {};
+            std::memcpy(
+                &Contact,
+                Message,
+                (MessageSize < sizeof(Contact))
+                    ? MessageSize
+                    : sizeof(Contact));
+
+            VMBUS_CHANNEL_VERSION_RESPONSE Response = {};
+            Response.Header.MessageType = ChannelMessageVersionResponse;
+            HV_UINT32 ResponseSize = VMBUS_CHANNEL_VERSION_RESPONSE_MIN_SIZE;
+            for (HV_UINT32 Version : VmbusHostEmulatorVersions)
+            {
+                if (Version != Contact.VMBusVersionRequested)
+                {
+                    continue;
+                }
+                m_Version = Version;
+                m_IsConnected = true;
+                Response.VersionSupported = 1;
+                Response.ConnectionState = VmbusChannelConnectionSuccessful;
+                if (Version >= VMBUS_VERSION_MULTICLIENT)
+                {
+                    Response.ConnectionId.AsUINT32 =
+                        VMBUS_MESSAGE_CONNECTION_ID;
+                }
+                else
+                {
+                    Response.SelectedVersion = Version;
+                }
+                if (Version >= VMBUS_VERSION_COPPER)
+                {
+                    m_FeatureFlags =
+                        Contact.FeatureFlags & VmbusHostEmulatorFeatureFlags;
+                    Response.SupportedFeatures = m_FeatureFlags;
+                    ResponseSize = sizeof(Response);
+                    if ((m_FeatureFlags & VMBUS_FEATURE_FLAG_CLIENT_ID) &&
+                        MessageSize >= sizeof(Contact))
+                    {
+                        m_ClientId = Contact.ClientId;
+                    }
+                }
+                break;
+            }
+            return this->Send(&Response, ResponseSize);
+        }
+
+        NTSTATUS OnRequestOffers()
+        {
+            if (!m_IsConnected || m_IsDelivering)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            m_IsDelivering = true;
+            m_NextOffer = 0;
+            // The offers which do not fit now are sent by Process later.
+            this->DeliverOffers();
+            return STATUS_SUCCESS;
+        }
+
+        void SendGpadlCreated(
+            VmbusHostGpadl const& Gpadl,
+            NTSTATUS Status)
+        {
+            VMBUS_CHANNEL_GPADL_CREATED Created = {};
+            Created.Header.MessageType = ChannelMessageGpadlCreated;
+            Created.ChildRelId = Gpadl.ChildRelId;
+            Created.Gpadl = Gpadl.Handle;
+            Created.CreationStatus = static_cast<HV_UINT32>(Status);
+            this->Send(&Created, sizeof(Created));
+        }
+
+        void FinishGpadl(
+            VmbusHostGpadl& Gpadl,
+            NTSTATUS Status)
+        {
+            if (Status == STATUS_MORE_ENTRIES)
+            {
+                return;
+            }
+            if (NT_SUCCESS(Status) && Gpadl.IsTruncated)
+            {
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+            }
+            this->SendGpadlCreated(Gpadl, Status);
+            if (NT_SUCCESS(Status))
+            {
+                Gpadl.IsComplete = true;
+            }
+            else
+            {
+                this->ReleaseGpadl(Gpadl);
+            }
+        }
+
+        NTSTATUS DecodeGpadl(
+            VmbusHostGpadl& Gpadl,
+            const HV_UINT8* Message,
+            HV_UINT32 MessageSize,
+            bool IsHeader)
+        {
+            auto Store = [&Gpadl, this](HV_UINT64 Word)
+            {
+                if (Gpadl.WordCount < m_WordsPerGpadl)
+                {
+                    Gpadl.Words[Gpadl.WordCount++] = Word;
+                }
+                else
+                {
+                    Gpadl.IsTruncated = true;
+                }
+            };
+            auto OnRange = [&Store](HV_UINT16, VmbusGpadlRange const& Range)
+            {
+                GPA_RANGE Header;
+                Header.ByteCount = Range.ByteCount;
+                Header.ByteOffset = Range.ByteOffset;
+                HV_UINT64 Word = 0;
+                std::memcpy(&Word, &Header, VmbusGpadlWordSize);
+                Store(Word);
+            };
+            auto OnPfn = [&Gpadl, &Store](HV_UINT64 Pfn)
+            {
+                ++Gpadl.PageCount;
+                Store(Pfn);
+            };
+            return IsHeader
+                ? Gpadl.Decoder.DecodeHeader(
+                    Message,
+                    MessageSize,
+                    OnRange,
+                    OnPfn)
+                : Gpadl.Decoder.DecodeBody(
+                    Message,
+                    MessageSize,
+                    OnRange,
+                    OnPfn);
+        }
+
+        NTSTATUS OnGpadlHeader(
+            const HV_UINT8* Message,
+            HV_UINT32 MessageSize)
+        {
+            if (MessageSize < offsetof(VMBUS_CHANNEL_GPADL_HEADER, Range))
+            {
+                return STATUS_BAD_DATA;
+            }
+            VMBUS_CHANNEL_GPADL_HEADER Header;
+            std::memcpy(
+                &Header,
+                Message,
+                offsetof(VMBUS_CHANNEL_GPADL_HEADER, Range));
+            if (!this->LookupChannel(Header.ChildRelId) ||
+                this->LookupGpadl(Header.Gpadl))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            VmbusHostGpadl* Gpadl = nullptr;
+            for (HV_UINT32 i = 0; i < m_GpadlCount && !Gpadl; ++i)
+            {
+                if (!m_Gpadls[i].InUse)
+                {
+                    Gpadl = &m_Gpadls[i];
+                }
+            }
+            if (!Gpadl)
+            {
+                VmbusHostGpadl Rejected = {};
+                Rejected.ChildRelId = Header.ChildRelId;
+                Rejected.Handle = Header.Gpadl;
+                this->SendGpadlCreated(
+                    Rejected,
+                    STATUS_INSUFFICIENT_RESOURCES);
+                return STATUS_SUCCESS;
+            }
+
+            Gpadl->InUse = true;
+            Gpadl->IsComplete = false;
+            Gpadl->IsTeardownPending = false;
+            Gpadl->IsTruncated = false;
+            Gpadl->WordCount = 0;
+            Gpadl->PageCount = 0;
+            Gpadl->ChildRelId = Header.ChildRelId;
+            Gpadl->Handle = Header.Gpadl;
+            this->FinishGpadl(
+                *Gpadl,
+                this->DecodeGpadl(*Gpadl, Message, MessageSize, true));
+            return STATUS_SUCCESS;
+        }
+
+        NTSTATUS OnGpadlBody(
+            const HV_UINT8* Message,
+            HV_UINT32 MessageSize)
+        {
+            if (MessageSize < offsetof(VMBUS_CHANNEL_GPADL_BODY, Pfn))
+            {
+                return STATUS_BAD_DATA;
+            }
+            VMBUS_CHANNEL_GPADL_BODY Body;
+            std::memcpy(
+                &Body,
+                Message,
+                offsetof(VMBUS_CHANNEL_GPADL_BODY, Pfn));
+            VmbusHostGpadl* Gpadl = this->LookupGpadl(Body.Gpadl);
+            if (!Gpadl || Gpadl->IsComplete)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            this->FinishGpadl(
+                *Gpadl,
+                this->DecodeGpadl(*Gpadl, Message, MessageSize, false));
+            return STATUS_SUCCESS;
+        }
+
+        NTSTATUS OnGpadlTeardown(
+            const HV_UINT8* Message,
+            HV_UINT32 MessageSize)
+        {
+            VMBUS_CHANNEL_GPADL_TEARDOWN Teardown;
+            if (MessageSize < sizeof(Teardown))
+            {
+                return STATUS_BAD_DATA;
+            }
+            std::memcpy(&Teardown, Message, sizeof(Teardown));
+            VmbusHostGpadl* Gpadl = this->LookupGpadl(Teardown.Gpadl);
+            if (!Gpadl ||
+                !Gpadl->IsComplete ||
+                Gpadl->IsTeardownPending ||
+                Gpadl->ChildRelId != Teardown.ChildRelId)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            // The ring buffer of an open channel stays mapped until the
+            // channel is closed, and ChannelMessageGpadlTorndown follows the
+            // close.
+            VmbusHostChannel* Channel = this->LookupChannel(Gpadl->ChildRelId);
+            if (Channel &&
+                Channel->State == VmbusHostChannelState::Open &&
+                Channel->RingBufferGpadlHandle == Gpadl->Handle)
+            {
+                Gpadl->IsTeardownPending = true;
+                return STATUS_SUCCESS;
+            }
+            this->ReleaseGpadl(*Gpadl);
+            this->SendGpadlTorndown(Teardown.Gpadl);
+            return STATUS_SUCCESS;
+        }
+
+        template<typename EventCallback>
+        NTSTATUS OnOpenChannel(
+            const HV_UINT8* Message,
+            HV_UINT32 MessageSize,
+            EventCallback&& OnEvent)
+        {
+            if (MessageSize < VMBUS_CHANNEL_OPEN_CHANNEL_MIN_SIZE)
+            {
+                return STATUS_BAD_DATA;
+            }
+            VMBUS_CHANNEL_OPEN_CHANNEL Open = {};
+            std::memcpy(
+                &Open,
+                Message,
+                (MessageSize < sizeof(Open)) ? MessageSize : sizeof(Open));
+            VmbusHostChannel* Channel = this->LookupChannel(Open.ChildRelId);
+            if (!Channel || Channel->State == VmbusHostChannelState::Open)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+
+            NTSTATUS Status = STATUS_SUCCESS;
+            VmbusHostGpadl* Gpadl =
+                this->LookupGpadl(Open.RingBufferGpadlHandle);
+            if (Channel->State != VmbusHostChannelState::Offered)
+            {
+                Status = STATUS_DEVICE_DOES_NOT_EXIST;
+            }
+            else if (!Gpadl ||
+                !Gpadl->IsComplete ||
+                Gpadl->IsTeardownPending ||
+                Gpadl->ChildRelId != Open.ChildRelId ||
+                !Open.DownstreamRingBufferPageOffset ||
+                Open.DownstreamRingBufferPageOffset >= Gpadl->PageCount)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+            }
+            else
+            {
+                Channel->OpenId = Open.OpenId;
+                Channel->RingBufferGpadlHandle = Open.RingBufferGpadlHandle;
+                Channel->DownstreamRingBufferPageOffset =
+                    Open.DownstreamRingBufferPageOffset;
+                Channel->TargetVp = Open.TargetVp;
+                std::memcpy(
+                    Channel->UserData,
+                    Open.UserData,
+                    sizeof(Channel->UserData));
+                Channel->GuestConnectionId.AsUINT32 = 0;
+                Channel->EventFlag = static_cast<HV_UINT16>(
+                    Channel->ChildRelId);
+                Channel->OpenFlags = 0;
+                if ((m_FeatureFlags &
+                    VMBUS_FEATURE_FLAG_GUEST_SPECIFIED_SIGNAL_PARAMETERS) &&
+                    MessageSize >= sizeof(Open))
+                {
+                    Channel->GuestConnectionId = Open.ConnectionId;
+                    Channel->EventFlag = Open.EventFlag;
+                    Channel->OpenFlags = Open.Flags;
+                }
+                Status = OnEvent(VmbusHostEvent::Open, *Channel);
+                if (NT_SUCCESS(Status))
+                {
+                    Channel->State = VmbusHostChannelState::Open;
+                }
+            }
+
+            VMBUS_CHANNEL_OPEN_RESULT Result = {};
+            Result.Header.MessageType = ChannelMessageOpenChannelResult;
+            Result.ChildRelId = Open.ChildRelId;
+            Result.OpenId = Open.OpenId;
+            Result.Status = static_cast<HV_UINT32>(Status);
+            return this->Send(&Result, sizeof(Result));
+        }
+
+        template<typename EventCallback>
+        NTSTATUS OnCloseChannel(
+            const HV_UINT8* Message,
+            HV_UINT32 MessageSize,
+            EventCallback&& OnEvent)
+        {
+            VMBUS_CHANNEL_CLOSE_CHANNEL Close;
+            if (MessageSize < sizeof(Close))
+            {
+                return STATUS_BAD_DATA;
+            }
+            std::memcpy(&Close, Message, sizeof(Close));
+            VmbusHostChannel* Channel = this->LookupChannel(Close.ChildRelId);
+            if (!Channel || Channel->State != VmbusHostChannelState::Open)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            this->CloseChannel(*Channel, OnEvent, true);
+            return STATUS_SUCCESS;
+        }
+
+        template<typename EventCallback>
+        NTSTATUS OnModifyChannel(
+            const HV_UINT8* Message,
+            HV_UINT32 MessageSize,
+            EventCallback&& OnEvent)
+        {
+            VMBUS_CHANNEL_MODIFY_CHANNEL Modify;
+            if (MessageSize < sizeof(Modify))
+            {
+                return STATUS_BAD_DATA;
+            }
+            std::memcpy(&Modify, Message, sizeof(Modify));
+            VmbusHostChannel* Channel =
+                this->LookupChannel(Modify.ChildRelId);
+            if (!Channel || Channel->State != VmbusHostChannelState::Open)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            HV_VP_INDEX PreviousVp = Channel->TargetVp;
+            Channel->TargetVp = Modify.TargetVp;
+            NTSTATUS Status = OnEvent(VmbusHostEvent::Modify, *Channel);
+            if (!NT_SUCCESS(Status))
+            {
+                Channel->TargetVp = PreviousVp;
+            }
+            if (m_Version < VMBUS_VERSION_IRON)
+            {
+                return STATUS_SUCCESS;
+            }
+            VMBUS_CHANNEL_MODIFY_CHANNEL_RESPONSE Response = {};
+            Response.Header.MessageType = ChannelMessageModifyChannelResponse;
+            Response.ChildRelId = Modify.ChildRelId;
+            Response.Status = Status;
+            return this->Send(&Response, sizeof(Response));
+        }
+
+        NTSTATUS OnPause()
+        {
+            if (!(m_FeatureFlags & VMBUS_FEATURE_FLAG_PAUSE_RESUME))
+            {
+                return STATUS_NOT_SUPPORTED;
+            }
+            if (m_IsPaused)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            m_IsPaused = true;
+            VMBUS_CHANNEL_PAUSE_RESPONSE Response = {};
+            Response.MessageType = ChannelMessagePauseResponse;
+            return this->Send(&Response, sizeof(Response));
+        }
+
+        NTSTATUS OnResume()
+        {
+            if (!m_IsPaused)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            // The offers held back meanwhile are sent by Process.
+            m_IsPaused = false;
+            return STATUS_SUCCESS;
+        }
+
+        NTSTATUS OnRelIdReleased(
+            const HV_UINT8* Message,
+            HV_UINT32 MessageSize)
+        {
+            VMBUS_CHANNEL_RELID_RELEASED Released;
+            if (MessageSize < sizeof(Released))
+            {
+                return STATUS_BAD_DATA;
+            }
+            std::memcpy(&Released, Message, sizeof(Released));
+            VmbusHostChannel* Channel =
+                this->LookupChannel(Released.ChildRelId);
+            if (!Channel || Channel->State != VmbusHostChannelState::Rescinded)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            for (HV_UINT32 i = 0; i < m_GpadlCount; ++i)
+            {
+                if (m_Gpadls[i].InUse &&
+                    m_Gpadls[i].ChildRelId == Released.ChildRelId)
+                {
+                    this->ReleaseGpadl(m_Gpadls[i]);
+                }
+            }
+            Channel->State = VmbusHostChannelState::Free;
+            return STATUS_SUCCESS;
+        }
+
+        template<typename EventCallback>
+        NTSTATUS OnUnload(
+            EventCallback&& OnEvent)
+        {
+            this->Disconnect(OnEvent);
+            VMBUS_CHANNEL_UNLOAD_COMPLETE Complete = {};
+            Complete.MessageType = ChannelMessageUnloadComplete;
+            return this->Send(&Complete, sizeof(Complete));
+        }
+
+    public:
+
+        /**
+         * @brief Initializes the emulator over caller-owned queues and tables.
+         * @param Inbound The queue the guest posts its messages to.
+         * @param Outbound The queue the emulator posts its messages to.
+         * @param Channels The channel table. The ChildRelId of a channel is
+         *                 its index plus one.
+         * @param ChannelCount The number of channels, at most
+         *                     VMBUS_MAX_CHANNELS.
+         * @param Gpadls The GPADL table.
+         * @param GpadlCount The number of GPADLs.
+         * @param Words The range buffer words of the GPADLs, WordsPerGpadl
+         *              words for each of them.
+         * @param WordsPerGpadl The number of range buffer words a GPADL can
+         *                      use. A GPADL which needs more fails with
+         *                      STATUS_INSUFFICIENT_RESOURCES.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            VmbusSynicMessageQueue* Inbound,
+            VmbusSynicMessageQueue* Outbound,
+            VmbusHostChannel* Channels,
+            HV_UINT32 ChannelCount,
+            VmbusHostGpadl* Gpadls,
+            HV_UINT32 GpadlCount,
+            HV_UINT64* Words,
+            HV_UINT32 WordsPerGpadl)
+        {
+            *this = VmbusHostEmulator();
+            if (!Inbound ||
+                !Outbound ||
+                !Channels ||
+                !ChannelCount ||
+                ChannelCount > VMBUS_MAX_CHANNELS ||
+                !Gpadls ||
+                !GpadlCount ||
+                !Words ||
+                !WordsPerGpadl)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+            {
+                Channels[i] = VmbusHostChannel();
+                Channels[i].ChildRelId = i + 1;
+            }
+            for (HV_UINT32 i = 0; i < GpadlCount; ++i)
+            {
+                Gpadls[i] = VmbusHostGpadl();
+                Gpadls[i].Words = Words + static_cast<std::size_t>(i)
+                    * WordsPerGpadl;
+            }
+            m_Inbound = Inbound;
+            m_Outbound = Outbound;
+            m_Channels = Channels;
+            m_ChannelCount = ChannelCount;
+            m_Gpadls = Gpadls;
+            m_GpadlCount = GpadlCount;
+            m_WordsPerGpadl = WordsPerGpadl;
+            return STATUS_SUCCESS;
+        }
+
+        bool IsConnected() const
+        {
+            return m_IsConnected;
+        }
+
+        /**
+         * @brief Gets the version the guest negotiated.
+         * @return The VMBUS_VERSION_* value, or zero if not connected.
+         */
+        HV_UINT32 Version() const
+        {
+            return m_Version;
+        }
+
+        HV_UINT32 FeatureFlags() const
+        {
+            return m_FeatureFlags;
+        }
+
+        HV_GUID const& ClientId() const
+        {
+            return m_ClientId;
+        }
+
+        /**
+         * @brief Gets whether the guest paused the messages of the host with
+         *        ChannelMessagePause.
+         */
+        bool IsPaused() const
+        {
+            return m_IsPaused;
+        }
+
+        /**
+         * @brief Gets the number of guest messages which were dropped because
+         *        they violate the protocol.
+         */
+        HV_UINT64 ProtocolErrors() const
+        {
+            return m_ProtocolErrors;
+        }
+
+        /**
+         * @brief Gets a channel by its ChildRelId.
+         * @param ChildRelId The ChildRelId.
+         * @return The channel, or nullptr if it is not offered.
+         */
+        VmbusHostChannel* Channel(
+            HV_UINT32 ChildRelId)
+        {
+            return this->LookupChannel(ChildRelId);
+        }
+
+        /**
+         * @brief Gets a GPADL by its handle.
+         * @param Handle The GPADL handle chosen by the guest.
+         * @return The GPADL, or nullptr if it does not exist or is still
+         *         being created.
+         */
+        const VmbusHostGpadl* Gpadl(
+            HV_UINT32 Handle)
+        {
+            VmbusHostGpadl* Entry = this->LookupGpadl(Handle);
+            return (Entry && Entry->IsComplete) ? Entry : nullptr;
+        }
+
+        /**
+         * @brief Adds a channel offer. It is sent right away if the guest
+         *        already requested the offers, and otherwise with the next
+         *        ChannelMessageRequestOffers.
+         * @param InterfaceType The class ID of the device.
+         * @param InterfaceInstance The instance ID of the device.
+         * @param SubChannelIndex The subchannel index, zero for the primary
+         *                        channel.
+         * @param Flags The VMBUS_OFFER_FLAG_* flags.
+         * @param UserDefined Optional. MAX_USER_DEFINED_BYTES bytes passed to
+         *                    the guest.
+         * @param ChildRelId Receives the ChildRelId of the channel.
+         * @return STATUS_SUCCESS, STATUS_INSUFFICIENT_RESOURCES if the table
+         *         is full, or STATUS_DEVICE_BUSY if the outbound queue is full
+         *         or the guest paused the host, in which case the offer is not
+         *         added.
+         */
+        NTSTATUS Offer(
+            HV_GUID const& InterfaceType,
+            HV_GUID const& InterfaceInstance,
+            HV_UINT16 SubChannelIndex,
+            HV_UINT16 Flags,
+            const HV_UINT8* UserDefined,
+            HV_UINT32* ChildRelId)
+        {
+            if (!m_Channels || !ChildRelId)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            VmbusHostChannel* Channel = nullptr;
+            for (HV_UINT32 i = 0; i < m_ChannelCount && !Channel; ++i)
+            {
+                if (m_Channels[i].State == VmbusHostChannelState::Free)
+                {
+                    Channel = &m_Channels[i];
+                }
+            }
+            if (!Channel)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            // Offers the delivery has already passed, which includes all of
+            // them after ChannelMessageAllOffersDelivered, are hot added. The
+            // others are picked up by the delivery once it reaches them.
+            bool SendNow = m_IsConnected &&
+                m_NextOffer > Channel->ChildRelId - 1;
+            if (SendNow && (m_IsPaused || !m_Outbound->FreeCount()))
+            {
+                return STATUS_DEVICE_BUSY;
+            }
+
+            HV_UINT32 Index = Channel->ChildRelId - 1;
+            *Channel = VmbusHostChannel();
+            Channel->State = VmbusHostChannelState::Offered;
+            Channel->Flags = Flags;
+            Channel->SubChannelIndex = SubChannelIndex;
+            Channel->InterfaceType = InterfaceType;
+            Channel->InterfaceInstance = InterfaceInstance;
+            if (UserDefined)
+            {
+                std::memcpy(
+                    Channel->UserDefined,
+                    UserDefined,
+                    sizeof(Channel->UserDefined));
+            }
+            Channel->ChildRelId = Index + 1;
+            Channel->ConnectionId.AsUINT32 =
+                VmbusHostEmulatorConnectionIdBase + Index + 1;
+            *ChildRelId = Channel->ChildRelId;
+            if (SendNow)
+            {
+                this->SendOffer(*Channel);
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Rescinds a channel offer. An open channel is closed first.
+         *        The ChildRelId stays in use until the guest sends
+         *        ChannelMessageRelIdReleased.
+         * @param ChildRelId The ChildRelId.
+         * @param OnEvent The callback invoked as
+         *                NTSTATUS OnEvent(VmbusHostEvent, VmbusHostChannel&).
+         * @return STATUS_SUCCESS, STATUS_NOT_FOUND, or STATUS_DEVICE_BUSY if
+         *         the outbound queue is full or the guest paused the host.
+         */
+        template<typename EventCallback>
+        NTSTATUS Rescind(
+            HV_UINT32 ChildRelId,
+            EventCallback&& OnEvent)
+        {
+            VmbusHostChannel* Channel = this->LookupChannel(ChildRelId);
+            if (!Channel || Channel->State == VmbusHostChannelState::Rescinded)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            if (!m_IsConnected)
+            {
+                Channel->State = VmbusHostChannelState::Free;
+                return STATUS_SUCCESS;
+            }
+            if (m_IsPaused || !m_Outbound->FreeCount())
+            {
+                return STATUS_DEVICE_BUSY;
+            }
+            if (Channel->State == VmbusHostChannelState::Open)
+            {
+                this->CloseChannel(*Channel, OnEvent, false);
+            }
+            Channel->State = VmbusHostChannelState::Rescinded;
+            VMBUS_CHANNEL_RESCIND_OFFER Rescind = {};
+            Rescind.Header.MessageType = ChannelMessageRescindChannelOffer;
+            Rescind.ChildRelId = ChildRelId;
+            return this->Send(&Rescind, sizeof(Rescind));
+        }
+
+        /**
+         * @brief Handles one channel message of the guest.
+         * @param Message The message.
+         * @param MessageSize The size of the message in bytes.
+         * @param OnEvent The callback invoked as
+         *                NTSTATUS OnEvent(VmbusHostEvent, VmbusHostChannel&)
+         *                when a channel is opened, closed or retargeted.
+         * @return STATUS_SUCCESS, or the reason the message was dropped.
+         * @remark The outbound queue must have a free slot.
+         */
+        template<typename EventCallback>
+        NTSTATUS HandleMessage(
+            const void* Message,
+            HV_UINT32 MessageSize,
+            EventCallback&& OnEvent)
+        {
+            VMBUS_CHANNEL_MESSAGE_HEADER Header;
+            if (!Message ||
+                MessageSize < sizeof(Header) ||
+                MessageSize > MAXIMUM_SYNIC_MESSAGE_BYTES)
+            {
+                return STATUS_BAD_DATA;
+            }
+            std::memcpy(&Header, Message, sizeof(Header));
+            const HV_UINT8* Bytes = reinterpret_cast<const HV_UINT8*>(Message);
+            if (Header.MessageType == ChannelMessageInitiateContact)
+            {
+                return this->OnInitiateContact(Bytes, MessageSize);
+            }
+            if (!m_IsConnected)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            switch (Header.MessageType)
+            {
+            case ChannelMessageRequestOffers:
+                return this->OnRequestOffers();
+            case ChannelMessageOpenChannel:
+                return this->OnOpenChannel(Bytes, MessageSize, OnEvent);
+            case ChannelMessageCloseChannel:
+                return this->OnCloseChannel(Bytes, MessageSize, OnEvent);
+            case ChannelMessageModifyChannel:
+                return this->OnModifyChannel(Bytes, MessageSize, OnEvent);
+            case ChannelMessageGpadlHeader:
+                return this->OnGpadlHeader(Bytes, MessageSize);
+            case ChannelMessageGpadlBody:
+                return this->OnGpadlBody(Bytes, MessageSize);
+            case ChannelMessageGpadlTeardown:
+                return this->OnGpadlTeardown(Bytes, MessageSize);
+            case ChannelMessageRelIdReleased:
+                return this->OnRelIdReleased(Bytes, MessageSize);
+            case ChannelMessageUnload:
+                return this->OnUnload(OnEvent);
+            case ChannelMessagePause:
+                return this->OnPause();
+            case ChannelMessageResume:
+                return this->OnResume();
+            default:
+                return STATUS_NOT_SUPPORTED;
+            }
+        }
+
+        /**
+         * @brief Handles the messages waiting in the inbound queue.
+         * @param OnEvent See HandleMessage.
+         * @param MaximumMessages The maximum number of messages to handle.
+         * @param Processed Optional. Receives the number of messages handled.
+         * @return STATUS_SUCCESS once the inbound queue is empty or
+         *         MaximumMessages were handled, or STATUS_DEVICE_BUSY if the
+         *         outbound queue is full, in which case the guest has to
+         *         receive messages before Process is called again.
+         */
+        template<typename EventCallback>
+        NTSTATUS Process(
+            EventCallback&& OnEvent,
+            HV_UINT32 MaximumMessages = 0xFFFFFFFF,
+            HV_UINT32* Processed = nullptr)
+        {
+            if (!m_Inbound)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            HV_UINT32 Count = 0;
+            NTSTATUS Status = this->DeliverOffers();
+            while (NT_SUCCESS(Status) && Count < MaximumMessages)
+            {
+                const HV_MESSAGE* Message = m_Inbound->Peek();
+                if (!Message)
+                {
+                    break;
+                }
+                if (!m_Outbound->FreeCount())
+                {
+                    Status = STATUS_DEVICE_BUSY;
+                    break;
+                }
+                if (!NT_SUCCESS(this->HandleMessage(
+                    Message->Payload,
+                    Message->Header.PayloadSize,
+                    OnEvent)))
+                {
+                    ++m_ProtocolErrors;
+                }
+                m_Inbound->Complete();
+                ++Count;
+                Status = this->DeliverOffers();
+            }
+            if (Processed)
+            {
+                *Processed = Count;
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Maps a GPADL which describes one run of pages that is
+         *        contiguous in the local address space, such as a ring
+         *        buffer.
+         * @param Handle The GPADL handle.
+         * @param MapPage The callback invoked as PHV_UINT8 MapPage(HV_UINT64
+         *                Pfn), which returns nullptr for unknown pages.
+         * @param Base Receives the local address of the first byte.
+         * @param Size Receives the size of the GPADL in bytes.
+         * @return STATUS_SUCCESS, STATUS_NOT_FOUND, or STATUS_NOT_SUPPORTED
+         *         if the GPADL has several ranges or its pages are not
+         *         contiguous.
+         */
+        template<typename PageMapper>
+        NTSTATUS MapGpadl(
+            HV_UINT32 Handle,
+            PageMapper&& MapPage,
+            PHV_UINT8* Base,
+            HV_UINT32* Size)
+        {
+            const VmbusHostGpadl* Entry = this->Gpadl(Handle);
+            if (!Base || !Size)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            if (!Entry)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            if (Entry->WordCount != 1 + Entry->PageCount)
+            {
+                return STATUS_NOT_SUPPORTED;
+            }
+            GPA_RANGE Range;
+            std::memcpy(&Range, &Entry->Words[0], VmbusGpadlWordSize);
+            PHV_UINT8 First = MapPage(Entry->Words[1]);
+            if (!First)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            for (HV_UINT32 i = 1; i < Entry->PageCount; ++i)
+            {
+                if (MapPage(Entry->Words[1 + i])
+                    != First + static_cast<std::size_t>(i)
+                        * VmbusGpadlPageSize)
+                {
+                    return STATUS_NOT_SUPPORTED;
+                }
+            }
+            *Base = First + Range.ByteOffset;
+            *Size = Range.ByteCount;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Maps the ring buffers of an open channel, so the host side
+         *        of the device can use them.
+         * @param ChildRelId The ChildRelId.
+         * @param MapPage See MapGpadl.
+         * @param Inbound Receives the ring the guest writes to.
+         * @param Outbound Receives the ring the guest reads from.
+         * @return STATUS_SUCCESS, STATUS_INVALID_DEVICE_STATE if the channel
+         *         is not open, or see MapGpadl.
+         */
+        template<typename PageMapper>
+        NTSTATUS MapRings(
+            HV_UINT32 ChildRelId,
+            PageMapper&& MapPage,
+            VmbusRing& Inbound,
+            VmbusRing& Outbound)
+        {
+            VmbusHostChannel* Channel = this->LookupChannel(ChildRelId);
+            if (!Channel || Channel->State != VmbusHostChannelState::Open)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            PHV_UINT8 Base = nullptr;
+            HV_UINT32 Size = 0;
+            NTSTATUS Status = this->MapGpadl(
+                Channel->RingBufferGpadlHandle,
+                MapPage,
+                &Base,
+                &Size);
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+            std::size_t Split = static_cast<std::size_t>(
+                Channel->DownstreamRingBufferPageOffset) * VmbusGpadlPageSize;
+            if (Split >= Size)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            // The upstream ring, which the guest writes, comes first.
+            Status = Inbound.Initialize(Base, Split);
+            if (NT_SUCCESS(Status))
+            {
+                Status = Outbound.Initialize(Base + Split, Size - Split);
+            }
+            return Status;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_HOSTEMULATOR
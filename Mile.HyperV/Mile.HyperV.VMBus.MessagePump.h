@@ -0,0 +1,482 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.MessagePump.h
+ * PURPOSE:    Definition for Hyper-V SynIC Message Slot Pump
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_MESSAGEPUMP
+#define MILE_HYPERV_VMBUS_MESSAGEPUMP
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The SynIC message pump requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.Guest.Protocols.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_MORE_ENTRIES
+// Returned by enumeration APIs to indicate more information is available to
+// successive calls.
+#define STATUS_MORE_ENTRIES ((NTSTATUS)0x00000105L)
+#endif // !STATUS_MORE_ENTRIES
+
+#ifndef STATUS_OBJECT_NAME_COLLISION
+// Object Name already exists.
+#define STATUS_OBJECT_NAME_COLLISION ((NTSTATUS)0xC0000035L)
+#endif // !STATUS_OBJECT_NAME_COLLISION
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief The number of entries of the jump table of a message pump.
+     */
+    const HV_UINT32 VmbusMessagePumpTableSize = 256;
+
+    /**
+     * @brief Gets the jump table entry of a SynIC message type.
+     * @param MessageType The message type.
+     * @return The index of the entry.
+     * @remark Types below 0x80 map to themselves. Every hypervisor message
+     *         type HV_MESSAGE_TYPE defines gets an entry of its own, so
+     *         collisions only happen for types defined later.
+     */
+    constexpr HV_UINT32 VmbusMessagePumpKey(
+        HV_UINT32 MessageType)
+    {
+        return ((MessageType & 0xFF) +
+            ((MessageType >> 8) & 0xFF) * 7 +
+            ((MessageType >> 16) & 0xFF) * 9 +
+            (MessageType >> 31) * 0x80) & (VmbusMessagePumpTableSize - 1);
+    }
+
+    static_assert(
+        VmbusMessagePumpKey(VMBUS_MESSAGE_TYPE) == VMBUS_MESSAGE_TYPE);
+    static_assert(
+        VmbusMessagePumpKey(HvMessageTypeUnmappedGpa) !=
+        VmbusMessagePumpKey(HvMessageTypeSchedulerVpSignalBitset));
+
+    /**
+     * @brief The routine a SynIC message is dispatched to.
+     * @param Context The context the routine was registered with.
+     * @param Message The message, copied out of the slot, which is free again
+     *                by the time the routine runs.
+     */
+    typedef void (*VmbusMessageRoutine)(
+        void* Context,
+        HV_MESSAGE const& Message);
+
+    /**
+     * @brief Drains the message slot of a SINT and dispatches every message
+     *        by its type through a jump table.
+     * @remark The slot is released by clearing MessageType, and EOM is only
+     *         written when the hypervisor set MessagePending, which tells it
+     *         to deliver the next queued message. Routines are registered
+     *         before the SINT is unmasked, not while a pump runs.
+     */
+    class VmbusMessagePump
+    {
+    private:
+
+        struct Entry
+        {
+            HV_UINT32 MessageType;
+            VmbusMessageRoutine Routine;
+            void* Context;
+        };
+
+        Entry m_Table[VmbusMessagePumpTableSize] = {};
+        VmbusMessageRoutine m_DefaultRoutine = nullptr;
+        void* m_DefaultContext = nullptr;
+        HV_UINT64 m_Messages = 0;
+        HV_UINT64 m_Eoms = 0;
+        HV_UINT64 m_Unhandled = 0;
+
+    public:
+
+        /**
+         * @brief Routes a message type to a routine.
+         * @param MessageType The message type, other than HvMessageTypeNone.
+         * @param Routine The routine.
+         * @param Context The context passed to the routine.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER, or
+         *         STATUS_OBJECT_NAME_COLLISION if another type uses the
+         *         entry, in which case the default routine can handle it.
+         */
+        NTSTATUS Register(
+            HV_UINT32 MessageType,
+            VmbusMessageRoutine Routine,
+            void* Context)
+        {
+            if (MessageType == HvMessageTypeNone || !Routine)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            Entry& Current = m_Table[
+                ::Mile::HyperV::VmbusMessagePumpKey(MessageType)];
+            if (Current.Routine && Current.MessageType != MessageType)
+            {
+                return STATUS_OBJECT_NAME_COLLISION;
+            }
+            Current.MessageType = MessageType;
+            Current.Routine = Routine;
+            Current.Context = Context;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Stops routing a message type.
+         * @param MessageType The message type.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER if it was not
+         *         routed.
+         */
+        NTSTATUS Unregister(
+            HV_UINT32 MessageType)
+        {
+            Entry& Current = m_Table[
+                ::Mile::HyperV::VmbusMessagePumpKey(MessageType)];
+            if (!Current.Routine || Current.MessageType != MessageType)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            Current = Entry();
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Sets the routine for the message types without one.
+         * @param Routine The routine, or nullptr to count them as unhandled.
+         * @param Context The context passed to the routine.
+         */
+        void SetDefault(
+            VmbusMessageRoutine Routine,
+            void* Context)
+        {
+            m_DefaultRoutine = Routine;
+            m_DefaultContext = Context;
+        }
+
+        HV_UINT64 Messages() const
+        {
+            return m_Messages;
+        }
+
+        HV_UINT64 Eoms() const
+        {
+            return m_Eoms;
+        }
+
+        HV_UINT64 Unhandled() const
+        {
+            return m_Unhandled;
+        }
+
+        /**
+         * @brief Dispatches a message which is no longer in its slot.
+         * @param Message The message.
+         */
+        void Dispatch(
+            HV_MESSAGE const& Message)
+        {
+            HV_UINT32 MessageType = Message.Header.MessageType;
+            Entry const& Current = m_Table[
+                ::Mile::HyperV::VmbusMessagePumpKey(MessageType)];
+            if (Current.Routine && Current.MessageType == MessageType)
+            {
+                Current.Routine(Current.Context, Message);
+            }
+            else if (m_DefaultRoutine)
+            {
+                m_DefaultRoutine(m_DefaultContext, Message);
+            }
+            else
+            {
+                ++m_Unhandled;
+            }
+        }
+
+        /**
+         * @brief Drains the message slot of a SINT.
+         * @param Slot The slot, such as the VMBUS_MESSAGE_SINT entry of the
+         *             SynIC message page.
+         * @param WriteEom The callback invoked as void WriteEom() to write
+         *                 HV_X64_MSR_EOM, or HvRegisterEom on ARM64.
+         * @param MaximumMessages The maximum number of messages to drain.
+         * @param Processed Optional. Receives the number of messages drained.
+         * @return STATUS_SUCCESS once the slot is empty, or
+         *         STATUS_MORE_ENTRIES if MaximumMessages were drained and the
+         *         slot still holds one.
+         */
+        template<typename EomWriter>
+        NTSTATUS Pump(
+            volatile HV_MESSAGE& Slot,
+            EomWriter&& WriteEom,
+            HV_UINT32 MaximumMessages = 0xFFFFFFFF,
+            HV_UINT32* Processed = nullptr)
+        {
+            HV_MESSAGE& Plain = const_cast<HV_MESSAGE&>(Slot);
+            std::atomic_ref<HV_MESSAGE_TYPE> MessageType(
+                Plain.Header.MessageType);
+            HV_UINT32 Count = 0;
+            NTSTATUS Status = STATUS_SUCCESS;
+            for (;;)
+            {
+                if (HvMessageTypeNone ==
+                    MessageType.load(std::memory_order_acquire))
+                {
+                    break;
+                }
+                if (Count == MaximumMessages)
+                {
+                    Status = STATUS_MORE_ENTRIES;
+                    break;
+                }
+
+                // Copy the message out, so the slot can be released before
+                // the routine runs. The whole slot is copied, which takes a
+                // few vector moves, instead of a copy sized by PayloadSize.
+                HV_MESSAGE Message;
+                std::memcpy(&Message, &Plain, sizeof(Message));
+
+                // The slot must be seen free before EOM is written, or the
+                // hypervisor finds it busy and keeps the next message queued.
+                // MessagePending is read from the slot again, as it can be
+                // set while the message is copied.
+                MessageType.store(HvMessageTypeNone, std::memory_order_release);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                HV_MESSAGE_FLAGS Flags;
+                Flags.AsUINT8 = std::atomic_ref<HV_UINT8>(
+                    Plain.Header.MessageFlags.AsUINT8).load(
+                        std::memory_order_relaxed);
+                if (Flags.MessagePending)
+                {
+                    WriteEom();
+                    ++m_Eoms;
+                }
+
+                this->Dispatch(Message);
+                ++m_Messages;
+                ++Count;
+            }
+            if (Processed)
+            {
+                *Processed = Count;
+            }
+            return Status;
+        }
+    };
+
+    /**
+     * @brief Stands in for the hypervisor side of the message slot of a
+     *        SINT, so a message pump can run without a partition.
+     * @remark Messages which find the slot in use wait in a backlog and set
+     *         MessagePending, and EOM delivers the oldest of them, as the
+     *         hypervisor does. The simulator is driven from one thread:
+     *         Post, Eom and the pump which writes EOM must not run
+     *         concurrently. The flags are still updated atomically, with
+     *         the ordering the pump reads them with.
+     */
+    class VmbusSynicMessageSlotSimulator
+    {
+    private:
+
+        volatile HV_MESSAGE* m_Slot = nullptr;
+        HV_MESSAGE* m_Backlog = nullptr;
+        HV_UINT32 m_Mask = 0;
+        HV_UINT32 m_Head = 0;
+        HV_UINT32 m_Tail = 0;
+        HV_UINT64 m_Interrupts = 0;
+        HV_UINT64 m_Eoms = 0;
+
+        void Deliver(
+            HV_MESSAGE const& Message,
+            bool Pending)
+        {
+            HV_MESSAGE& Plain = const_cast<HV_MESSAGE&>(*m_Slot);
+            Plain.Header.PayloadSize = Message.Header.PayloadSize;
+            std::memcpy(
+                Plain.Header.Reserved,
+                Message.Header.Reserved,
+                offsetof(HV_MESSAGE, Payload)
+                    - offsetof(HV_MESSAGE_HEADER, Reserved)
+                    + Message.Header.PayloadSize);
+            HV_MESSAGE_FLAGS Flags;
+            Flags.AsUINT8 = 0;
+            Flags.MessagePending = Pending;
+            std::atomic_ref<HV_UINT8>(Plain.Header.MessageFlags.AsUINT8).store(
+                Flags.AsUINT8,
+                std::memory_order_relaxed);
+            std::atomic_ref<HV_MESSAGE_TYPE>(Plain.Header.MessageType).store(
+                Message.Header.MessageType,
+                std::memory_order_release);
+            ++m_Interrupts;
+        }
+
+        bool IsSlotFree() const
+        {
+            HV_MESSAGE& Plain = const_cast<HV_MESSAGE&>(*m_Slot);
+            return HvMessageTypeNone == std::atomic_ref<HV_MESSAGE_TYPE>(
+                Plain.Header.MessageType).load(std::memory_order_acquire);
+        }
+
+    public:
+
+        /**
+         * @brief Initializes the simulator.
+         * @param Slot The slot the pump drains, which must outlive the
+         *             simulator.
+         * @param Backlog The storage of the messages waiting for the slot.
+         * @param BacklogCount The number of backlog entries, a power of two.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            volatile HV_MESSAGE* Slot,
+            HV_MESSAGE* Backlog,
+            HV_UINT32 BacklogCount)
+        {
+            *this = VmbusSynicMessageSlotSimulator();
+            if (!Slot ||
+                !Backlog ||
+                !BacklogCount ||
+                (BacklogCount & (BacklogCount - 1)))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            std::memset(
+                const_cast<HV_MESSAGE*>(Slot),
+                0,
+                sizeof(HV_MESSAGE));
+            m_Slot = Slot;
+            m_Backlog = Backlog;
+            m_Mask = BacklogCount - 1;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Gets the number of times the slot went from free to full,
+         *        each of which raises the SINT.
+         */
+        HV_UINT64 Interrupts() const
+        {
+            return m_Interrupts;
+        }
+
+        HV_UINT64 Eoms() const
+        {
+            return m_Eoms;
+        }
+
+        HV_UINT32 BacklogCount() const
+        {
+            return m_Tail - m_Head;
+        }
+
+        /**
+         * @brief Posts a message, as HvCallPostMessage does.
+         * @param MessageType The message type, other than HvMessageTypeNone.
+         * @param Payload The payload.
+         * @param PayloadSize The size of the payload in bytes, at most
+         *                    HV_MESSAGE_PAYLOAD_BYTE_COUNT.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER, or
+         *         STATUS_INSUFFICIENT_RESOURCES if the backlog is full, which
+         *         is HV_STATUS_INSUFFICIENT_BUFFERS for a real partition.
+         */
+        NTSTATUS Post(
+            HV_UINT32 MessageType,
+            const void* Payload,
+            HV_UINT32 PayloadSize)
+        {
+            if (!m_Slot ||
+                MessageType == HvMessageTypeNone ||
+                (!Payload && PayloadSize) ||
+                PayloadSize > HV_MESSAGE_PAYLOAD_BYTE_COUNT)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            HV_MESSAGE* Message = nullptr;
+            HV_MESSAGE Local;
+            bool SlotFree = (m_Tail == m_Head) && this->IsSlotFree();
+            if (SlotFree)
+            {
+                Message = &Local;
+            }
+            else if (m_Tail - m_Head > m_Mask)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            else
+            {
+                Message = &m_Backlog[m_Tail++ & m_Mask];
+            }
+            Message->Header.MessageType =
+                static_cast<HV_MESSAGE_TYPE>(MessageType);
+            Message->Header.PayloadSize = static_cast<HV_UINT8>(PayloadSize);
+            Message->Header.MessageFlags.AsUINT8 = 0;
+            Message->Header.Reserved[0] = 0;
+            Message->Header.Reserved[1] = 0;
+            Message->Header.Sender = 0;
+            Message->Header.Port.AsUINT32 = VMBUS_MESSAGE_CONNECTION_ID;
+            if (PayloadSize)
+            {
+                std::memcpy(Message->Payload, Payload, PayloadSize);
+            }
+            if (SlotFree)
+            {
+                this->Deliver(Local, false);
+            }
+            else
+            {
+                // The guest sees the flag at the latest when it takes the
+                // message out of the slot. The exchange is sequentially
+                // consistent, as the pump reads the flag after a fence.
+                HV_MESSAGE_FLAGS Flags;
+                Flags.AsUINT8 = 0;
+                Flags.MessagePending = 1;
+                std::atomic_ref<HV_UINT8>(const_cast<HV_MESSAGE&>(
+                    *m_Slot).Header.MessageFlags.AsUINT8).fetch_or(
+                        Flags.AsUINT8,
+                        std::memory_order_seq_cst);
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Handles a write to the EOM register.
+         */
+        void Eom()
+        {
+            ++m_Eoms;
+            if (m_Tail != m_Head && this->IsSlotFree())
+            {
+                HV_MESSAGE const& Next = m_Backlog[m_Head++ & m_Mask];
+                this->Deliver(Next, m_Tail != m_Head);
+            }
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_MESSAGEPUMP
@@ -0,0 +1,441 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.Monitor.h
+ * PURPOSE:    Definition for Hyper-V VMBus Monitored Notification Facility
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_MONITOR
+#define MILE_HYPERV_VMBUS_MONITOR
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus monitor page requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.Guest.Protocols.h"
+
+#include <atomic>
+#include <bit>
+#include <cstring>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief The number of trigger groups of a monitor page.
+     */
+    const HV_UINT32 VmbusMonitorGroupCount = 4;
+
+    /**
+     * @brief The number of monitor IDs in a trigger group.
+     */
+    const HV_UINT32 VmbusMonitorIdsPerGroup = 32;
+
+    /**
+     * @brief The number of monitor IDs of a monitor page.
+     */
+    const HV_UINT32 VmbusMonitorIdCount =
+        VmbusMonitorGroupCount * VmbusMonitorIdsPerGroup;
+
+    /**
+     * @brief Gets the monitor ID the host assigned to an offer.
+     * @param Offer The offer.
+     * @param MonitorId Receives the monitor ID.
+     * @return true if the channel is signaled through the monitor page, or
+     *         false if it is signaled with HvSignalEvent.
+     */
+    inline bool VmbusGetOfferMonitorId(
+        VMBUS_CHANNEL_OFFER_CHANNEL const& Offer,
+        HV_UINT8* MonitorId)
+    {
+        if (!Offer.MonitorAllocated || Offer.MonitorId >= VmbusMonitorIdCount)
+        {
+            return false;
+        }
+        if (MonitorId)
+        {
+            *MonitorId = Offer.MonitorId;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Hands out the monitor IDs of a monitor page.
+     * @remark Allocate and Release can be called concurrently.
+     */
+    class VmbusMonitorAllocator
+    {
+    private:
+
+        std::atomic<HV_UINT32> m_Allocated[VmbusMonitorGroupCount] = {};
+
+    public:
+
+        /**
+         * @brief Allocates the lowest free monitor ID.
+         * @param MonitorId Receives the monitor ID.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER, or
+         *         STATUS_INSUFFICIENT_RESOURCES if every ID is in use, in
+         *         which case the channel is signaled with HvSignalEvent.
+         */
+        NTSTATUS Allocate(
+            HV_UINT8* MonitorId)
+        {
+            if (!MonitorId)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            for (HV_UINT32 Group = 0; Group < VmbusMonitorGroupCount; ++Group)
+            {
+                HV_UINT32 Allocated =
+                    m_Allocated[Group].load(std::memory_order_relaxed);
+                while (Allocated != 0xFFFFFFFF)
+                {
+                    HV_UINT32 Bit = std::countr_one(Allocated);
+                    if (m_Allocated[Group].compare_exchange_weak(
+                        Allocated,
+                        Allocated | (1u << Bit),
+                        std::memory_order_acquire,
+                        std::memory_order_relaxed))
+                    {
+                        *MonitorId = static_cast<HV_UINT8>(
+                            Group * VmbusMonitorIdsPerGroup + Bit);
+                        return STATUS_SUCCESS;
+                    }
+                }
+            }
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        /**
+         * @brief Releases a monitor ID.
+         * @param MonitorId The monitor ID.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER if the ID is not
+         *         allocated.
+         */
+        NTSTATUS Release(
+            HV_UINT8 MonitorId)
+        {
+            if (MonitorId >= VmbusMonitorIdCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            HV_UINT32 Mask = 1u << (MonitorId % VmbusMonitorIdsPerGroup);
+            HV_UINT32 Previous = m_Allocated[
+                MonitorId / VmbusMonitorIdsPerGroup].fetch_and(
+                    ~Mask,
+                    std::memory_order_release);
+            return (Previous & Mask)
+                ? STATUS_SUCCESS
+                : STATUS_INVALID_PARAMETER;
+        }
+
+        bool IsAllocated(
+            HV_UINT8 MonitorId) const
+        {
+            if (MonitorId >= VmbusMonitorIdCount)
+            {
+                return false;
+            }
+            return 0 != (m_Allocated[
+                MonitorId / VmbusMonitorIdsPerGroup].load(
+                    std::memory_order_relaxed) &
+                (1u << (MonitorId % VmbusMonitorIdsPerGroup)));
+        }
+    };
+
+    /**
+     * @brief A view of a monitor page shared by the guest, which sets the
+     *        pending bits of its channels instead of calling HvSignalEvent,
+     *        and the hypervisor, which scans them and signals every channel
+     *        at most once per its latency.
+     * @remark The page is not owned, so it works over the monitor pages of a
+     *         real partition or plain shared memory alike. Times are in 100ns
+     *         units and wrap around, as NextCheckTime is 32 bits wide. A
+     *         signal is held back only while NextCheckTime lies at most the
+     *         largest latency ahead, so it is due after any wrap or idle
+     *         period.
+     */
+    class VmbusMonitorPage
+    {
+    private:
+
+        PHV_MONITOR_PAGE m_Page = nullptr;
+
+        HV_UINT32& Pending(
+            HV_UINT32 Group) const
+        {
+            return m_Page->TriggerGroup[Group].Pending;
+        }
+
+        HV_UINT32& Armed(
+            HV_UINT32 Group) const
+        {
+            return m_Page->TriggerGroup[Group].Armed;
+        }
+
+    public:
+
+        /**
+         * @brief Initializes the view.
+         * @param Page The monitor page, which must outlive the view.
+         * @param Reset Whether to clear the page, which only the side which
+         *              allocates the monitor IDs does.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            PHV_MONITOR_PAGE Page,
+            bool Reset)
+        {
+            m_Page = nullptr;
+            if (!Page)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            if (Reset)
+            {
+                std::memset(Page, 0, sizeof(HV_MONITOR_PAGE));
+            }
+            m_Page = Page;
+            return STATUS_SUCCESS;
+        }
+
+        PHV_MONITOR_PAGE Page() const
+        {
+            return m_Page;
+        }
+
+        /**
+         * @brief Arms a monitor ID for a channel.
+         * @param MonitorId The monitor ID.
+         * @param ConnectionId The connection the hypervisor signals.
+         * @param FlagNumber The event flag the hypervisor sets.
+         * @param Latency The minimum time between two signals, in 100ns
+         *                units.
+         * @param Now The current time in 100ns units, from which the first
+         *            signal is due.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         * @remark The trigger group of the ID is enabled as well.
+         */
+        NTSTATUS Arm(
+            HV_UINT8 MonitorId,
+            HV_CONNECTION_ID ConnectionId,
+            HV_UINT16 FlagNumber,
+            HV_UINT16 Latency,
+            HV_UINT32 Now)
+        {
+            if (!m_Page || MonitorId >= VmbusMonitorIdCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            HV_UINT32 Group = MonitorId / VmbusMonitorIdsPerGroup;
+            HV_UINT32 Bit = MonitorId % VmbusMonitorIdsPerGroup;
+            HV_MONITOR_PARAMETER& Parameter = m_Page->Parameter[Group][Bit];
+            Parameter.ConnectionId = ConnectionId;
+            Parameter.FlagNumber = FlagNumber;
+            Parameter.ReservedZ = 0;
+            m_Page->Latency[Group][Bit] = Latency;
+            m_Page->NextCheckTime[Group][Bit] = static_cast<HV_INT32>(Now);
+            std::atomic_ref<HV_UINT32>(this->Armed(Group)).fetch_or(
+                1u << Bit,
+                std::memory_order_release);
+            std::atomic_ref<HV_UINT32>(m_Page->TriggerState.AsUINT32).fetch_or(
+                1u << Group,
+                std::memory_order_release);
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Disarms a monitor ID and drops its pending signal.
+         * @param MonitorId The monitor ID.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         * @remark The trigger group is disabled with its last ID.
+         */
+        NTSTATUS Disarm(
+            HV_UINT8 MonitorId)
+        {
+            if (!m_Page || MonitorId >= VmbusMonitorIdCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            HV_UINT32 Group = MonitorId / VmbusMonitorIdsPerGroup;
+            HV_UINT32 Mask = 1u << (MonitorId % VmbusMonitorIdsPerGroup);
+            HV_UINT32 Armed = std::atomic_ref<HV_UINT32>(
+                this->Armed(Group)).fetch_and(
+                    ~Mask,
+                    std::memory_order_acq_rel) & ~Mask;
+            std::atomic_ref<HV_UINT32>(this->Pending(Group)).fetch_and(
+                ~Mask,
+                std::memory_order_relaxed);
+            if (!Armed)
+            {
+                std::atomic_ref<HV_UINT32>(
+                    m_Page->TriggerState.AsUINT32).fetch_and(
+                        ~(1u << Group),
+                        std::memory_order_release);
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Sets the latency of an armed monitor ID.
+         * @param MonitorId The monitor ID.
+         * @param Latency The minimum time between two signals, in 100ns
+         *                units.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS SetLatency(
+            HV_UINT8 MonitorId,
+            HV_UINT16 Latency)
+        {
+            if (!m_Page || MonitorId >= VmbusMonitorIdCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            std::atomic_ref<HV_UINT16>(m_Page->Latency[
+                MonitorId / VmbusMonitorIdsPerGroup][
+                    MonitorId % VmbusMonitorIdsPerGroup]).store(
+                        Latency,
+                        std::memory_order_relaxed);
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Signals a channel, as the guest does instead of calling
+         *        HvSignalEvent.
+         * @param MonitorId The monitor ID of the channel.
+         * @return true if the signal was not pending yet, false if it was
+         *         merged with a pending one or the ID is invalid.
+         */
+        bool Signal(
+            HV_UINT8 MonitorId)
+        {
+            if (!m_Page || MonitorId >= VmbusMonitorIdCount)
+            {
+                return false;
+            }
+            HV_UINT32 Group = MonitorId / VmbusMonitorIdsPerGroup;
+            HV_UINT32 Mask = 1u << (MonitorId % VmbusMonitorIdsPerGroup);
+            std::atomic_ref<HV_UINT32> Pending(this->Pending(Group));
+            // Skip the locked operation while the bit is already set, so
+            // channels signaled in bursts keep the line shared.
+            if (Pending.load(std::memory_order_relaxed) & Mask)
+            {
+                return false;
+            }
+            return 0 == (Pending.fetch_or(
+                Mask,
+                std::memory_order_release) & Mask);
+        }
+
+        bool IsPending(
+            HV_UINT8 MonitorId) const
+        {
+            if (!m_Page || MonitorId >= VmbusMonitorIdCount)
+            {
+                return false;
+            }
+            return 0 != (std::atomic_ref<HV_UINT32>(
+                this->Pending(MonitorId / VmbusMonitorIdsPerGroup)).load(
+                    std::memory_order_relaxed) &
+                (1u << (MonitorId % VmbusMonitorIdsPerGroup)));
+        }
+
+        /**
+         * @brief Scans the enabled trigger groups, as the hypervisor does,
+         *        and delivers every pending signal whose latency elapsed.
+         * @param Now The current time in 100ns units.
+         * @param OnTrigger The callback invoked as void OnTrigger(HV_UINT8
+         *                  MonitorId, HV_MONITOR_PARAMETER const& Parameter)
+         *                  for every delivered signal.
+         * @return The number of signals delivered.
+         * @remark Signals still within their latency stay pending and are
+         *         delivered by a later scan, merged with the ones set
+         *         meanwhile. Only one thread may scan a page at a time.
+         */
+        template<typename TriggerCallback>
+        HV_UINT32 Scan(
+            HV_UINT32 Now,
+            TriggerCallback&& OnTrigger)
+        {
+            if (!m_Page)
+            {
+                return 0;
+            }
+            HV_UINT32 Delivered = 0;
+            HV_UINT32 Enabled = std::atomic_ref<HV_UINT32>(
+                m_Page->TriggerState.AsUINT32).load(
+                    std::memory_order_acquire) &
+                ((1u << VmbusMonitorGroupCount) - 1);
+            while (Enabled)
+            {
+                HV_UINT32 Group = std::countr_zero(Enabled);
+                Enabled &= Enabled - 1;
+                std::atomic_ref<HV_UINT32> Pending(this->Pending(Group));
+                HV_UINT32 Candidates =
+                    Pending.load(std::memory_order_acquire) &
+                    std::atomic_ref<HV_UINT32>(this->Armed(Group)).load(
+                        std::memory_order_relaxed);
+                HV_UINT32 Due = 0;
+                for (HV_UINT32 Bits = Candidates; Bits; Bits &= Bits - 1)
+                {
+                    HV_UINT32 Bit = std::countr_zero(Bits);
+                    HV_INT32& NextCheckTime =
+                        m_Page->NextCheckTime[Group][Bit];
+                    // A check time up to the largest latency ahead is still
+                    // waited for, anything else is due, even if the page was
+                    // idle for more than half the range of the clock.
+                    HV_UINT32 Remaining =
+                        static_cast<HV_UINT32>(NextCheckTime) - Now;
+                    if (Remaining - 1 >= 0xFFFF)
+                    {
+                        Due |= 1u << Bit;
+                        NextCheckTime = static_cast<HV_INT32>(
+                            Now + std::atomic_ref<HV_UINT16>(
+                                m_Page->Latency[Group][Bit]).load(
+                                    std::memory_order_relaxed));
+                    }
+                }
+                if (!Due)
+                {
+                    continue;
+                }
+                // Clear the bits before delivering, so signals set while the
+                // consumer runs are delivered by a later scan.
+                Pending.fetch_and(~Due, std::memory_order_acq_rel);
+                for (; Due; Due &= Due - 1)
+                {
+                    HV_UINT32 Bit = std::countr_zero(Due);
+                    OnTrigger(
+                        static_cast<HV_UINT8>(
+                            Group * VmbusMonitorIdsPerGroup + Bit),
+                        m_Page->Parameter[Group][Bit]);
+                    ++Delivered;
+                }
+            }
+            return Delivered;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_MONITOR
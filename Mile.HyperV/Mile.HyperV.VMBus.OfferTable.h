@@ -0,0 +1,577 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.OfferTable.h
+ * PURPOSE:    Definition for Hyper-V VMBus Class ID Hash and Offer Registry
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_OFFERTABLE
+#define MILE_HYPERV_VMBUS_OFFERTABLE
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus offer table requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.h"
+
+#include <bit>
+#include <cstddef>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_NOT_FOUND
+// The object was not found.
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#endif // !STATUS_NOT_FOUND
+
+#ifndef STATUS_OBJECT_NAME_COLLISION
+// Object Name already exists.
+#define STATUS_OBJECT_NAME_COLLISION ((NTSTATUS)0xC0000035L)
+#endif // !STATUS_OBJECT_NAME_COLLISION
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief The 16 bytes of a GUID as two words, which makes comparing and
+     *        hashing GUIDs cheap, also at compile time.
+     */
+    struct VmbusGuidWords
+    {
+        HV_UINT64 Low;
+        HV_UINT64 High;
+    };
+
+    static_assert(sizeof(HV_GUID) == sizeof(VmbusGuidWords));
+
+    constexpr VmbusGuidWords VmbusGuidToWords(
+        HV_GUID const& Guid)
+    {
+        return std::bit_cast<VmbusGuidWords>(Guid);
+    }
+
+    constexpr bool VmbusGuidEquals(
+        HV_GUID const& Left,
+        HV_GUID const& Right)
+    {
+        VmbusGuidWords LeftWords = ::Mile::HyperV::VmbusGuidToWords(Left);
+        VmbusGuidWords RightWords = ::Mile::HyperV::VmbusGuidToWords(Right);
+        return ((LeftWords.Low ^ RightWords.Low)
+            | (LeftWords.High ^ RightWords.High)) == 0;
+    }
+
+    /**
+     * @brief Mixes a word into a running hash.
+     * @param Hash The running hash.
+     * @param Word The word.
+     * @return The new running hash.
+     */
+    constexpr HV_UINT64 VmbusHashMix(
+        HV_UINT64 Hash,
+        HV_UINT64 Word)
+    {
+        Hash = (Hash ^ Word) * 0xBF58476D1CE4E5B9ULL;
+        return Hash ^ (Hash >> 31);
+    }
+
+    /**
+     * @brief Hashes a GUID.
+     * @param Guid The GUID.
+     * @param Seed The seed, which selects one of many unrelated hash
+     *             functions.
+     * @return The hash, whose high bits are as well mixed as its low bits.
+     */
+    constexpr HV_UINT64 VmbusGuidHash(
+        HV_GUID const& Guid,
+        HV_UINT64 Seed = 0)
+    {
+        VmbusGuidWords Words = ::Mile::HyperV::VmbusGuidToWords(Guid);
+        HV_UINT64 Hash = ::Mile::HyperV::VmbusHashMix(
+            Seed + 0x9E3779B97F4A7C15ULL,
+            Words.Low);
+        return ::Mile::HyperV::VmbusHashMix(Hash, Words.High)
+            * 0x94D049BB133111EBULL;
+    }
+
+    /**
+     * @brief A collision-free hash over a fixed set of GUIDs, built at compile
+     *        time, so a lookup costs one hash and one comparison.
+     * @tparam Count The number of GUIDs, at most 254.
+     * @remark The slot table has 256 entries, which keeps the expected number
+     *         of seeds the build tries small for a few dozen GUIDs.
+     */
+    template<std::size_t Count>
+    class VmbusGuidPerfectHash
+    {
+    private:
+
+        static_assert(Count && Count < 0xFF);
+
+        static const HV_UINT8 EmptySlot = 0xFF;
+
+        HV_GUID m_Keys[Count] = {};
+        HV_UINT8 m_Slots[256] = {};
+        HV_UINT64 m_Seed = 0;
+        bool m_IsValid = false;
+
+        static constexpr HV_UINT8 SlotOf(
+            HV_GUID const& Guid,
+            HV_UINT64 Seed)
+        {
+            return static_cast<HV_UINT8>(
+                ::Mile::HyperV::VmbusGuidHash(Guid, Seed) >> 56);
+        }
+
+    public:
+
+        /**
+         * @brief Searches a seed which maps every GUID to its own slot.
+         * @param Keys The GUIDs, which must be distinct.
+         * @remark IsValid returns false if the GUIDs are not distinct or no
+         *         seed was found.
+         */
+        consteval VmbusGuidPerfectHash(
+            const HV_GUID (&Keys)[Count])
+        {
+            for (std::size_t i = 0; i < Count; ++i)
+            {
+                m_Keys[i] = Keys[i];
+            }
+            for (HV_UINT64 Seed = 0; Seed < 0x10000 && !m_IsValid; ++Seed)
+            {
+                for (HV_UINT8& Slot : m_Slots)
+                {
+                    Slot = EmptySlot;
+                }
+                bool Collided = false;
+                for (std::size_t i = 0; i < Count && !Collided; ++i)
+                {
+                    HV_UINT8& Slot = m_Slots[SlotOf(Keys[i], Seed)];
+                    Collided = (Slot != EmptySlot);
+                    Slot = static_cast<HV_UINT8>(i);
+                }
+                if (!Collided)
+                {
+                    m_Seed = Seed;
+                    m_IsValid = true;
+                }
+            }
+        }
+
+        constexpr bool IsValid() const
+        {
+            return m_IsValid;
+        }
+
+        constexpr HV_UINT64 Seed() const
+        {
+            return m_Seed;
+        }
+
+        /**
+         * @brief Looks a GUID up.
+         * @param Guid The GUID.
+         * @return The index of the GUID in the set, or -1 if it is not in it.
+         */
+        constexpr int Find(
+            HV_GUID const& Guid) const
+        {
+            HV_UINT8 Index = m_Slots[SlotOf(Guid, m_Seed)];
+            if (Index == EmptySlot ||
+                !::Mile::HyperV::VmbusGuidEquals(m_Keys[Index], Guid))
+            {
+                return -1;
+            }
+            return Index;
+        }
+    };
+
+    /**
+     * @brief A GUID constant this library defines.
+     */
+    struct VmbusWellKnownGuid
+    {
+        const char* Name;
+        HV_GUID Guid;
+    };
+
+    constexpr VmbusWellKnownGuid VmbusWellKnownGuids[] =
+    {
+        { "SYNTHVID_CLASS_ID", SYNTHVID_CLASS_ID },
+        { "HK_CLASS_ID", HK_CLASS_ID },
+        { "HK_INSTANCE_ID", HK_INSTANCE_ID },
+        { "SYNTHHID_CLASS_ID", SYNTHHID_CLASS_ID },
+        { "SYNTHHID_INSTANCE_ID", SYNTHHID_INSTANCE_ID },
+        { "VMSCSI_CLASS_ID", VMSCSI_CLASS_ID },
+        { "VMIDE_ACCELERATOR_CLASS_ID", VMIDE_ACCELERATOR_CLASS_ID },
+        { "NVSP_CLASS_ID", NVSP_CLASS_ID },
+        { "VPCI_CLASS_ID", VPCI_CLASS_ID },
+        { "VMBFS_CLASS_ID", VMBFS_CLASS_ID },
+        { "VMBFS_IMC_INSTANCE_ID", VMBFS_IMC_INSTANCE_ID },
+        { "VMBFS_BOOT_INSTANCE_ID", VMBFS_BOOT_INSTANCE_ID },
+        { "IC_HEARTBEAT_CLASS_ID", IC_HEARTBEAT_CLASS_ID },
+        { "IC_KVP_EXCHANGE_CLASS_ID", IC_KVP_EXCHANGE_CLASS_ID },
+        { "IC_KVP_EXCHANGE_INSTANCE_ID", IC_KVP_EXCHANGE_INSTANCE_ID },
+        { "IC_SHUTDOWN_CLASS_ID", IC_SHUTDOWN_CLASS_ID },
+        { "IC_SHUTDOWN_INSTANCE_ID", IC_SHUTDOWN_INSTANCE_ID },
+        { "IC_TIMESYNC_CLASS_ID", IC_TIMESYNC_CLASS_ID },
+        { "IC_TIMESYNC_INSTANCE_ID", IC_TIMESYNC_INSTANCE_ID },
+        { "IC_VSS_CLASS_ID", IC_VSS_CLASS_ID },
+        { "IC_RDV_CLASS_ID", IC_RDV_CLASS_ID },
+        { "INHERITED_ACTIVATION_CLASS_ID", INHERITED_ACTIVATION_CLASS_ID },
+        { "BOOT_EVENT_CHANNEL_GUID", BOOT_EVENT_CHANNEL_GUID },
+        { "VMFC_CLASS_ID", VMFC_CLASS_ID },
+        { "IC_NEGOTIATE_CLASS_ID", IC_NEGOTIATE_CLASS_ID },
+        { "IC_NEGOTIATE_INSTANCE_ID", IC_NEGOTIATE_INSTANCE_ID },
+        { "IC_HEARTBEAT_INSTANCE_ID", IC_HEARTBEAT_INSTANCE_ID },
+        { "IC_VSS_INSTANCE_ID", IC_VSS_INSTANCE_ID },
+        { "IC_RDV_INSTANCE_ID", IC_RDV_INSTANCE_ID },
+        { "IC_GUESTSVC_CLASS_ID", IC_GUESTSVC_CLASS_ID },
+        { "IC_GUESTSVC_INSTANCE_ID", IC_GUESTSVC_INSTANCE_ID },
+        { "SYNTHRDP_CONTROL_CLASS_ID", SYNTHRDP_CONTROL_CLASS_ID },
+        { "SYNTHRDP_CONTROL_INSTANCE_ID", SYNTHRDP_CONTROL_INSTANCE_ID },
+        { "SYNTHRDP_DATA_CLASS_ID", SYNTHRDP_DATA_CLASS_ID },
+        { "SYNTHRDP_DATA_INSTANCE_ID_1", SYNTHRDP_DATA_INSTANCE_ID_1 },
+        { "SYNTHRDP_DATA_INSTANCE_ID_2", SYNTHRDP_DATA_INSTANCE_ID_2 },
+        { "SYNTHRDP_DATA_INSTANCE_ID_3", SYNTHRDP_DATA_INSTANCE_ID_3 },
+        { "SYNTHRDP_DATA_INSTANCE_ID_4", SYNTHRDP_DATA_INSTANCE_ID_4 },
+        { "SYNTHRDP_DATA_INSTANCE_ID_5", SYNTHRDP_DATA_INSTANCE_ID_5 },
+        { "VSMB_CLASS_ID", VSMB_CLASS_ID },
+        { "VSMB_INSTANCE_ID", VSMB_INSTANCE_ID },
+    };
+
+    constexpr std::size_t VmbusWellKnownGuidCount =
+        sizeof(VmbusWellKnownGuids) / sizeof(VmbusWellKnownGuids[0]);
+
+    namespace Details
+    {
+        struct VmbusWellKnownGuidKeys
+        {
+            HV_GUID Keys[VmbusWellKnownGuidCount];
+
+            consteval VmbusWellKnownGuidKeys()
+                : Keys()
+            {
+                for (std::size_t i = 0; i < VmbusWellKnownGuidCount; ++i)
+                {
+                    Keys[i] = VmbusWellKnownGuids[i].Guid;
+                }
+            }
+        };
+    }
+
+    constexpr VmbusGuidPerfectHash<VmbusWellKnownGuidCount>
+        VmbusWellKnownGuidHash(Details::VmbusWellKnownGuidKeys().Keys);
+
+    static_assert(
+        VmbusWellKnownGuidHash.IsValid(),
+        "The well-known GUIDs must be distinct.");
+
+    /**
+     * @brief Looks up a GUID this library defines, such as the class ID of an
+     *        offer.
+     * @param Guid The GUID.
+     * @return The entry in VmbusWellKnownGuids, or nullptr if the GUID is not
+     *         one of them.
+     */
+    constexpr const VmbusWellKnownGuid* VmbusFindWellKnownGuid(
+        HV_GUID const& Guid)
+    {
+        int Index = VmbusWellKnownGuidHash.Find(Guid);
+        return (Index < 0) ? nullptr : &VmbusWellKnownGuids[Index];
+    }
+
+    /**
+     * @brief Identifies an offer, which stays the same when the guest
+     *        reconnects while the ChildRelId may change.
+     */
+    struct VmbusOfferKey
+    {
+        HV_GUID InterfaceType;
+        HV_GUID InterfaceInstance;
+        HV_UINT16 SubChannelIndex;
+    };
+
+    constexpr HV_UINT64 VmbusOfferKeyHash(
+        VmbusOfferKey const& Key)
+    {
+        VmbusGuidWords Type =
+            ::Mile::HyperV::VmbusGuidToWords(Key.InterfaceType);
+        VmbusGuidWords Instance =
+            ::Mile::HyperV::VmbusGuidToWords(Key.InterfaceInstance);
+        HV_UINT64 Hash = ::Mile::HyperV::VmbusHashMix(
+            0x9E3779B97F4A7C15ULL + Key.SubChannelIndex,
+            Type.Low);
+        Hash = ::Mile::HyperV::VmbusHashMix(Hash, Type.High);
+        Hash = ::Mile::HyperV::VmbusHashMix(Hash, Instance.Low);
+        return ::Mile::HyperV::VmbusHashMix(Hash, Instance.High)
+            * 0x94D049BB133111EBULL;
+    }
+
+    constexpr bool VmbusOfferKeyEquals(
+        VmbusOfferKey const& Left,
+        VmbusOfferKey const& Right)
+    {
+        return Left.SubChannelIndex == Right.SubChannelIndex &&
+            ::Mile::HyperV::VmbusGuidEquals(
+                Left.InterfaceInstance,
+                Right.InterfaceInstance) &&
+            ::Mile::HyperV::VmbusGuidEquals(
+                Left.InterfaceType,
+                Right.InterfaceType);
+    }
+
+    /**
+     * @brief An offer in VmbusOfferRegistry.
+     */
+    struct VmbusOfferEntry
+    {
+        VmbusOfferKey Key;
+        HV_UINT64 Hash;
+        HV_UINT32 ChildRelId;
+        bool InUse;
+        // The entry of InterfaceType in VmbusWellKnownGuids, or nullptr.
+        const VmbusWellKnownGuid* Class;
+        void* Context;
+    };
+
+    /**
+     * @brief Open addressing hash table of the offers of a connection, keyed
+     *        by InterfaceType, InterfaceInstance and SubChannelIndex, over
+     *        caller-owned entries.
+     * @remark Linear probing with backward shift deletion keeps probe
+     *         sequences short without tombstones, and the table refuses
+     *         inserts beyond three quarters of its capacity.
+     */
+    class VmbusOfferRegistry
+    {
+    private:
+
+        VmbusOfferEntry* m_Entries = nullptr;
+        HV_UINT32 m_Mask = 0;
+        HV_UINT32 m_Count = 0;
+
+        HV_UINT32 HomeOf(
+            HV_UINT64 Hash) const
+        {
+            return static_cast<HV_UINT32>(Hash >> 32) & m_Mask;
+        }
+
+        HV_UINT32 Probe(
+            VmbusOfferKey const& Key,
+            HV_UINT64 Hash) const
+        {
+            HV_UINT32 Index = this->HomeOf(Hash);
+            while (m_Entries[Index].InUse)
+            {
+                VmbusOfferEntry const& Entry = m_Entries[Index];
+                if (Entry.Hash == Hash &&
+                    ::Mile::HyperV::VmbusOfferKeyEquals(Entry.Key, Key))
+                {
+                    break;
+                }
+                Index = (Index + 1) & m_Mask;
+            }
+            return Index;
+        }
+
+    public:
+
+        /**
+         * @brief Initializes the registry over caller-owned entries.
+         * @param Entries The entries, which must outlive the registry.
+         * @param Capacity The number of entries, a power of two.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            VmbusOfferEntry* Entries,
+            HV_UINT32 Capacity)
+        {
+            *this = VmbusOfferRegistry();
+            if (!Entries || Capacity < 4 || (Capacity & (Capacity - 1)))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            for (HV_UINT32 i = 0; i < Capacity; ++i)
+            {
+                Entries[i] = VmbusOfferEntry();
+            }
+            m_Entries = Entries;
+            m_Mask = Capacity - 1;
+            return STATUS_SUCCESS;
+        }
+
+        HV_UINT32 Count() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * @brief Adds an offer.
+         * @param Key The key of the offer.
+         * @param ChildRelId The ChildRelId of the offer.
+         * @param Context The context of the caller.
+         * @param Entry Optional. Receives the entry, which stays valid until
+         *              an offer is removed.
+         * @return STATUS_SUCCESS, STATUS_OBJECT_NAME_COLLISION if the key is
+         *         already registered, or STATUS_INSUFFICIENT_RESOURCES if the
+         *         table is three quarters full.
+         */
+        NTSTATUS Insert(
+            VmbusOfferKey const& Key,
+            HV_UINT32 ChildRelId,
+            void* Context,
+            VmbusOfferEntry** Entry = nullptr)
+        {
+            if (!m_Entries)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            HV_UINT64 Hash = ::Mile::HyperV::VmbusOfferKeyHash(Key);
+            HV_UINT32 Index = this->Probe(Key, Hash);
+            VmbusOfferEntry& Slot = m_Entries[Index];
+            if (Slot.InUse)
+            {
+                return STATUS_OBJECT_NAME_COLLISION;
+            }
+            if (m_Count + 1 > (m_Mask + 1) / 4 * 3)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            Slot.Key = Key;
+            Slot.Hash = Hash;
+            Slot.ChildRelId = ChildRelId;
+            Slot.InUse = true;
+            Slot.Class =
+                ::Mile::HyperV::VmbusFindWellKnownGuid(Key.InterfaceType);
+            Slot.Context = Context;
+            ++m_Count;
+            if (Entry)
+            {
+                *Entry = &Slot;
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Adds the offer of a ChannelMessageOfferChannel message.
+         * @param Offer The message.
+         * @param Context See Insert.
+         * @param Entry See Insert.
+         * @return See Insert.
+         */
+        NTSTATUS Insert(
+            VMBUS_CHANNEL_OFFER_CHANNEL const& Offer,
+            void* Context,
+            VmbusOfferEntry** Entry = nullptr)
+        {
+            VmbusOfferKey Key;
+            Key.InterfaceType = Offer.InterfaceType;
+            Key.InterfaceInstance = Offer.InterfaceInstance;
+            Key.SubChannelIndex = Offer.SubChannelIndex;
+            return this->Insert(Key, Offer.ChildRelId, Context, Entry);
+        }
+
+        /**
+         * @brief Looks an offer up.
+         * @param Key The key of the offer.
+         * @return The entry, or nullptr if the offer is not registered.
+         */
+        VmbusOfferEntry* Find(
+            VmbusOfferKey const& Key) const
+        {
+            if (!m_Entries)
+            {
+                return nullptr;
+            }
+            VmbusOfferEntry& Slot = m_Entries[
+                this->Probe(Key, ::Mile::HyperV::VmbusOfferKeyHash(Key))];
+            return Slot.InUse ? &Slot : nullptr;
+        }
+
+        VmbusOfferEntry* Find(
+            HV_GUID const& InterfaceType,
+            HV_GUID const& InterfaceInstance,
+            HV_UINT16 SubChannelIndex) const
+        {
+            VmbusOfferKey Key;
+            Key.InterfaceType = InterfaceType;
+            Key.InterfaceInstance = InterfaceInstance;
+            Key.SubChannelIndex = SubChannelIndex;
+            return this->Find(Key);
+        }
+
+        /**
+         * @brief Removes an offer, such as on a rescind.
+         * @param Key The key of the offer.
+         * @return STATUS_SUCCESS or STATUS_NOT_FOUND.
+         * @remark Entries behind the removed one may move, so pointers to
+         *         entries are invalidated.
+         */
+        NTSTATUS Remove(
+            VmbusOfferKey const& Key)
+        {
+            if (!m_Entries)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            HV_UINT32 Hole = this->Probe(
+                Key,
+                ::Mile::HyperV::VmbusOfferKeyHash(Key));
+            if (!m_Entries[Hole].InUse)
+            {
+                return STATUS_NOT_FOUND;
+            }
+
+            // Move back every following entry of the cluster which may sit in
+            // the hole, which is when the hole lies between its home slot and
+            // its current slot.
+            for (HV_UINT32 Index = (Hole + 1) & m_Mask;
+                m_Entries[Index].InUse;
+                Index = (Index + 1) & m_Mask)
+            {
+                HV_UINT32 Home = this->HomeOf(m_Entries[Index].Hash);
+                if (((Index - Home) & m_Mask) >= ((Index - Hole) & m_Mask))
+                {
+                    m_Entries[Hole] = m_Entries[Index];
+                    Hole = Index;
+                }
+            }
+            m_Entries[Hole] = VmbusOfferEntry();
+            --m_Count;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Removes every offer, such as on ChannelMessageUnload.
+         */
+        void Clear()
+        {
+            for (HV_UINT32 i = 0; m_Entries && i <= m_Mask; ++i)
+            {
+                m_Entries[i] = VmbusOfferEntry();
+            }
+            m_Count = 0;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_OFFERTABLE
@@ -0,0 +1,470 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.PipeArrival.h
+ * PURPOSE:    Definition for Hyper-V VMBus Pipe Channel Arrival Adapter
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_PIPEARRIVAL
+#define MILE_HYPERV_VMBUS_PIPEARRIVAL
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus pipe arrival adapter requires C++20 or later.
+#endif // !__cplusplus
+
+#ifdef _WIN32
+#include "Mile.HyperV.Windows.VMBusPipe.h"
+#else
+#include "Mile.HyperV.Linux.VMBusPipe.h"
+#endif // _WIN32
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+namespace Mile::HyperV
+{
+#ifdef _WIN32
+    // An event handle on Windows, which can be waited for together with the
+    // other handles of an event loop.
+    typedef HANDLE VmbusPipeWaitableObject;
+#else
+    // An eventfd on Linux, which can be added to the epoll set or the poll
+    // array of an event loop.
+    typedef int VmbusPipeWaitableObject;
+#endif // _WIN32
+
+    /**
+     * @brief A channel which arrived, as posted to a VmbusPipeArrivalQueue.
+     * @remark The consumer which pops an arrival owns it and deletes it.
+     *         The pipe handle is closed with the arrival unless the consumer
+     *         takes it by setting PipeHandle to INVALID_HANDLE_VALUE.
+     */
+    struct VmbusPipeArrival
+    {
+        std::atomic<VmbusPipeArrival*> Next;
+        VMBUS_PIPE_CHANNEL_INFO ChannelInfo;
+        // The context given when registering, which tells the adapters
+        // sharing a queue apart.
+        void* Context;
+        // The pre-opened client handle, or INVALID_HANDLE_VALUE when the
+        // channel was not pre-opened or the open failed.
+        HANDLE PipeHandle;
+        // ERROR_SUCCESS, or the Win32 error of the pre-open.
+        DWORD OpenError;
+
+        VmbusPipeArrival() :
+            Next(nullptr),
+            ChannelInfo(),
+            Context(nullptr),
+            PipeHandle(INVALID_HANDLE_VALUE),
+            OpenError(ERROR_SUCCESS)
+        {
+        }
+
+        ~VmbusPipeArrival()
+        {
+            if (this->PipeHandle != INVALID_HANDLE_VALUE)
+            {
+                ::CloseHandle(this->PipeHandle);
+            }
+        }
+
+        VmbusPipeArrival(VmbusPipeArrival const&) = delete;
+        VmbusPipeArrival& operator=(VmbusPipeArrival const&) = delete;
+    };
+
+    /**
+     * @brief The intrusive lock-free queue which carries arrivals from the
+     *        notification threads to one event loop thread, with a waitable
+     *        object which is signaled when the queue turns non-empty.
+     * @remark Any number of threads may push, and only the event loop thread
+     *         may pop. Pushing never blocks, so the notification callbacks
+     *         never wait for the event loop.
+     */
+    class VmbusPipeArrivalQueue
+    {
+    private:
+
+        alignas(64) std::atomic<VmbusPipeArrival*> m_Head;
+        // Set while the waitable object is signaled, so a burst of arrivals
+        // signals it once.
+        alignas(64) std::atomic<bool> m_IsSignaled = false;
+        alignas(64) VmbusPipeArrival* m_Tail;
+        VmbusPipeArrival m_Stub;
+#ifdef _WIN32
+        HANDLE m_Event = nullptr;
+#else
+        VmbusPipeLinuxEvent m_Event;
+#endif // _WIN32
+
+        void Link(
+            VmbusPipeArrival* Arrival)
+        {
+            Arrival->Next.store(nullptr, std::memory_order_relaxed);
+            VmbusPipeArrival* Previous =
+                m_Head.exchange(Arrival, std::memory_order_acq_rel);
+            // Until this store the arrival is not reachable from the tail,
+            // and Pop reports the queue as empty.
+            Previous->Next.store(Arrival, std::memory_order_release);
+        }
+
+    public:
+
+        VmbusPipeArrivalQueue() :
+            m_Head(&m_Stub),
+            m_Tail(&m_Stub)
+        {
+        }
+
+        ~VmbusPipeArrivalQueue()
+        {
+            while (VmbusPipeArrival* Arrival = this->Pop())
+            {
+                delete Arrival;
+            }
+#ifdef _WIN32
+            if (m_Event)
+            {
+                ::CloseHandle(m_Event);
+            }
+#endif // _WIN32
+        }
+
+        VmbusPipeArrivalQueue(VmbusPipeArrivalQueue const&) = delete;
+        VmbusPipeArrivalQueue& operator=(
+            VmbusPipeArrivalQueue const&) = delete;
+
+        /**
+         * @brief Creates the waitable object.
+         * @return ERROR_SUCCESS or the Win32 error.
+         */
+        DWORD Initialize()
+        {
+#ifdef _WIN32
+            if (!m_Event)
+            {
+                m_Event = ::CreateEventW(nullptr, FALSE, FALSE, nullptr);
+                if (!m_Event)
+                {
+                    return ::GetLastError();
+                }
+            }
+            return ERROR_SUCCESS;
+#else
+            return NT_SUCCESS(m_Event.Create())
+                ? ERROR_SUCCESS
+                : ERROR_NOT_ENOUGH_MEMORY;
+#endif // _WIN32
+        }
+
+        /**
+         * @brief Gets the object which is signaled when arrivals are posted.
+         * @return The auto-reset event on Windows, or the eventfd on Linux.
+         */
+        VmbusPipeWaitableObject WaitableObject() const
+        {
+#ifdef _WIN32
+            return m_Event;
+#else
+            return m_Event.FileDescriptor();
+#endif // _WIN32
+        }
+
+        /**
+         * @brief Posts an arrival, and signals the waitable object if it is
+         *        not signaled yet.
+         * @param Arrival The arrival, which the queue owns until it is
+         *                popped.
+         */
+        void Push(
+            VmbusPipeArrival* Arrival)
+        {
+            this->Link(Arrival);
+            if (!m_IsSignaled.exchange(true, std::memory_order_seq_cst))
+            {
+#ifdef _WIN32
+                ::SetEvent(m_Event);
+#else
+                m_Event.Set();
+#endif // _WIN32
+            }
+        }
+
+        /**
+         * @brief Resets the waitable object. The event loop calls it after
+         *        the object is signaled and before it pops the arrivals, so
+         *        arrivals posted meanwhile signal the object again.
+         */
+        void Acknowledge()
+        {
+            m_IsSignaled.store(false, std::memory_order_seq_cst);
+#ifndef _WIN32
+            // The eventfd is non-blocking, so this only drains its counter.
+            HV_UINT64 Value = 0;
+            while (::read(m_Event.FileDescriptor(), &Value, sizeof(Value)) < 0
+                && errno == EINTR)
+            {
+            }
+#endif // !_WIN32
+        }
+
+        /**
+         * @brief Waits until the waitable object is signaled and
+         *        acknowledges it, for event loops which only wait for
+         *        arrivals.
+         * @param Timeout The maximum time to wait in milliseconds, or
+         *                INFINITE.
+         * @return true if the object was signaled, false on timeout.
+         */
+        bool Wait(
+            DWORD Timeout)
+        {
+#ifdef _WIN32
+            if (::WaitForSingleObject(m_Event, Timeout) != WAIT_OBJECT_0)
+            {
+                return false;
+            }
+#else
+            pollfd Descriptor = {};
+            Descriptor.fd = m_Event.FileDescriptor();
+            Descriptor.events = POLLIN;
+            if (::poll(
+                &Descriptor,
+                1,
+                Timeout == INFINITE ? -1 : static_cast<int>(Timeout)) <= 0)
+            {
+                return false;
+            }
+#endif // _WIN32
+            this->Acknowledge();
+            return true;
+        }
+
+        /**
+         * @brief Takes the oldest arrival. Only the event loop thread may
+         *        call it.
+         * @return The arrival, or nullptr if the queue is empty or the
+         *         oldest arrival is still being linked, in which case its
+         *         producer signals the waitable object once it is linked.
+         */
+        VmbusPipeArrival* Pop()
+        {
+            VmbusPipeArrival* Tail = m_Tail;
+            VmbusPipeArrival* Next =
+                Tail->Next.load(std::memory_order_acquire);
+            if (Tail == &m_Stub)
+            {
+                if (!Next)
+                {
+                    return nullptr;
+                }
+                m_Tail = Next;
+                Tail = Next;
+                Next = Next->Next.load(std::memory_order_acquire);
+            }
+            if (Next)
+            {
+                m_Tail = Next;
+                return Tail;
+            }
+            if (Tail != m_Head.load(std::memory_order_acquire))
+            {
+                return nullptr;
+            }
+            // The tail is the last arrival, so put the stub behind it
+            // before handing it out.
+            this->Link(&m_Stub);
+            Next = Tail->Next.load(std::memory_order_acquire);
+            if (Next)
+            {
+                m_Tail = Next;
+                return Tail;
+            }
+            return nullptr;
+        }
+    };
+
+    /**
+     * @brief Registers for channel arrival notifications, and posts every
+     *        arrival to a VmbusPipeArrivalQueue instead of handling it on
+     *        the notification thread.
+     * @remark With pre-opening, the channel is opened as a client right in
+     *         the callback, so the event loop gets a handle it can use at
+     *         once, and the time until a service can talk to a new channel
+     *         does not depend on when the event loop thread gets scheduled.
+     */
+    class VmbusPipeArrivalAdapter
+    {
+    private:
+
+        VmbusPipeArrivalQueue* m_Queue = nullptr;
+        HVMBUS_PIPE_NOTIFICATION m_Notification = nullptr;
+        void* m_Context = nullptr;
+        bool m_IsPreOpening = false;
+        DWORD m_OpenMode = 0;
+        VMBUS_PIPE_CLIENT_CHANNEL_SETTINGS m_Settings = {};
+        std::atomic<HV_UINT64> m_ArrivalCount = 0;
+        std::atomic<HV_UINT64> m_DroppedCount = 0;
+
+        static VOID CALLBACK OnNotification(
+            _In_opt_ LPVOID ClientContext,
+            _In_ PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+            _In_ VMBUS_PIPE_CHANNEL_NOTIFICATION_TYPE NotificationType)
+        {
+            VmbusPipeArrivalAdapter* Adapter =
+                static_cast<VmbusPipeArrivalAdapter*>(ClientContext);
+            if (NotificationType != ChannelNotificationArrival)
+            {
+                return;
+            }
+
+            VmbusPipeArrival* Arrival =
+                new (std::nothrow) VmbusPipeArrival();
+            if (!Arrival)
+            {
+                Adapter->m_DroppedCount.fetch_add(
+                    1,
+                    std::memory_order_relaxed);
+                return;
+            }
+            Arrival->ChannelInfo = *ChannelInfo;
+            Arrival->Context = Adapter->m_Context;
+            if (Adapter->m_IsPreOpening)
+            {
+                HANDLE PipeHandle = ::VmbusPipeClientOpenChannelEx(
+                    &Arrival->ChannelInfo,
+                    Adapter->m_OpenMode,
+                    Adapter->m_Settings.IncomingSize
+                        ? &Adapter->m_Settings
+                        : nullptr);
+                if (PipeHandle && PipeHandle != INVALID_HANDLE_VALUE)
+                {
+                    Arrival->PipeHandle = PipeHandle;
+                }
+                else
+                {
+                    Arrival->OpenError = ::GetLastError();
+                }
+            }
+            Adapter->m_ArrivalCount.fetch_add(1, std::memory_order_relaxed);
+            Adapter->m_Queue->Push(Arrival);
+        }
+
+    public:
+
+        VmbusPipeArrivalAdapter() = default;
+
+        ~VmbusPipeArrivalAdapter()
+        {
+            this->Unregister();
+        }
+
+        VmbusPipeArrivalAdapter(VmbusPipeArrivalAdapter const&) = delete;
+        VmbusPipeArrivalAdapter& operator=(
+            VmbusPipeArrivalAdapter const&) = delete;
+
+        /**
+         * @brief Registers for the arrivals of channels of an interface.
+         * @param Queue The initialized queue which receives the arrivals,
+         *              which must outlive the registration.
+         * @param InterfaceType The interface type of the channels.
+         * @param InterfaceInstance Optional. The interface instance of the
+         *                          channels, or nullptr for every instance.
+         * @param Context Stored in every arrival.
+         * @param IsPreOpening Whether to open the channels in the callback.
+         * @param OpenMode The open mode of pre-opened channels, which is
+         *                 FILE_FLAG_OVERLAPPED for channels which will be
+         *                 attached to a VmbusPipeIoEngine on Windows.
+         * @param RingSize The size of both rings of pre-opened channels, or
+         *                 zero for the default size.
+         * @param ReportExistingChannels Whether to post the channels which
+         *                               are already offered.
+         * @return ERROR_SUCCESS or the Win32 error.
+         */
+        DWORD Register(
+            VmbusPipeArrivalQueue& Queue,
+            LPCGUID InterfaceType,
+            LPCGUID InterfaceInstance,
+            void* Context,
+            bool IsPreOpening,
+            DWORD OpenMode,
+            DWORD RingSize,
+            bool ReportExistingChannels)
+        {
+            this->Unregister();
+
+            m_Queue = &Queue;
+            m_Context = Context;
+            m_IsPreOpening = IsPreOpening;
+            m_OpenMode = OpenMode;
+            m_Settings.Version = VMBUS_PIPE_CLIENT_CHANNEL_CURRENT_VERSION;
+            m_Settings.Size = sizeof(m_Settings);
+            m_Settings.IncomingSize = RingSize;
+            m_Settings.OutgoingSize = RingSize;
+            m_Notification = ::VmbusPipeClientRegisterChannelNotification(
+                InterfaceType,
+                InterfaceInstance,
+                0,
+                &VmbusPipeArrivalAdapter::OnNotification,
+                this);
+            if (!m_Notification)
+            {
+                return ::GetLastError();
+            }
+            ::VmbusPipeClientReadyForChannelNotification(
+                m_Notification,
+                ReportExistingChannels ? TRUE : FALSE);
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Unregisters, and waits for the callbacks in progress. The
+         *        arrivals already posted stay in the queue.
+         */
+        void Unregister()
+        {
+            if (m_Notification)
+            {
+                ::VmbusPipeClientUnregisterChannelNotification(
+                    m_Notification,
+                    TRUE);
+                m_Notification = nullptr;
+            }
+        }
+
+        HV_UINT64 ArrivalCount() const
+        {
+            return m_ArrivalCount.load(std::memory_order_relaxed);
+        }
+
+        // The arrivals which could not be posted for lack of memory.
+        HV_UINT64 DroppedCount() const
+        {
+            return m_DroppedCount.load(std::memory_order_relaxed);
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_PIPEARRIVAL
@@ -0,0 +1,995 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.PipeAsync.h
+ * PURPOSE:    Definition for Hyper-V VMBus Pipe Asynchronous Channel
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_PIPEASYNC
+#define MILE_HYPERV_VMBUS_PIPEASYNC
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus pipe async channel requires C++20 or later.
+#endif // !__cplusplus
+
+#ifdef _WIN32
+#include "Mile.HyperV.Windows.VMBusPipe.h"
+#else
+#include "Mile.HyperV.Linux.VMBusPipe.h"
+#include <sys/epoll.h>
+#endif // _WIN32
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief A coroutine which starts right away and can be waited for from
+     *        a thread which is not a coroutine.
+     */
+    class VmbusPipeAsyncTask
+    {
+    public:
+
+        struct promise_type
+        {
+            std::mutex Mutex;
+            std::condition_variable Completed;
+            bool IsCompleted = false;
+
+            VmbusPipeAsyncTask get_return_object()
+            {
+                return VmbusPipeAsyncTask(
+                    std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_never initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            struct FinalAwaiter
+            {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                // Notify while the mutex is still held: once it is released
+                // the waiter may return from Wait() and destroy the frame,
+                // so the promise must not be touched after that point.
+                void await_suspend(
+                    std::coroutine_handle<promise_type> Handle) noexcept
+                {
+                    promise_type& Promise = Handle.promise();
+                    std::lock_guard<std::mutex> Guard(Promise.Mutex);
+                    Promise.IsCompleted = true;
+                    Promise.Completed.notify_all();
+                }
+
+                void await_resume() noexcept
+                {
+                }
+            };
+
+            FinalAwaiter final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void return_void()
+            {
+            }
+
+            void unhandled_exception()
+            {
+                std::terminate();
+            }
+        };
+
+    private:
+
+        std::coroutine_handle<promise_type> m_Handle;
+
+        explicit VmbusPipeAsyncTask(
+            std::coroutine_handle<promise_type> Handle) :
+            m_Handle(Handle)
+        {
+        }
+
+    public:
+
+        VmbusPipeAsyncTask(VmbusPipeAsyncTask const&) = delete;
+        VmbusPipeAsyncTask& operator=(VmbusPipeAsyncTask const&) = delete;
+
+        VmbusPipeAsyncTask(
+            VmbusPipeAsyncTask&& Other) noexcept :
+            m_Handle(Other.m_Handle)
+        {
+            Other.m_Handle = nullptr;
+        }
+
+        ~VmbusPipeAsyncTask()
+        {
+            if (m_Handle)
+            {
+                this->Wait();
+                m_Handle.destroy();
+            }
+        }
+
+        /**
+         * @brief Blocks until the coroutine returns.
+         */
+        void Wait()
+        {
+            promise_type& Promise = m_Handle.promise();
+            std::unique_lock<std::mutex> Lock(Promise.Mutex);
+            Promise.Completed.wait(Lock, [&]()
+            {
+                return Promise.IsCompleted;
+            });
+        }
+    };
+
+    /**
+     * @brief The outcome of an asynchronous pipe operation.
+     */
+    struct VmbusPipeIoResult
+    {
+        // ERROR_SUCCESS or the Win32 error of the operation.
+        DWORD Error;
+        DWORD BytesTransferred;
+    };
+
+    /**
+     * @brief Gets the page size the pipe backend sizes its rings in.
+     * @return The page size of the system on Windows, or the ring mapping
+     *         granularity of the Linux backend.
+     */
+    inline HV_UINT32 VmbusPipeRingPageSize()
+    {
+#ifdef _WIN32
+        static const HV_UINT32 PageSize = []() -> HV_UINT32
+        {
+            SYSTEM_INFO SystemInfo;
+            ::GetSystemInfo(&SystemInfo);
+            return SystemInfo.dwPageSize;
+        }();
+        return PageSize;
+#else
+        return static_cast<HV_UINT32>(
+            ::Mile::HyperV::VmbusRingMappingGranularity());
+#endif // _WIN32
+    }
+
+    /**
+     * @brief Picks the ring size of a channel from the throughput observed
+     *        with the sizes tried before. Every channel session reports its
+     *        throughput when it is closed, and the tuner doubles the ring
+     *        size while that keeps improving the throughput, then settles on
+     *        the best size.
+     * @remark The tuner is shared by the channels of one kind of service, and
+     *         sessions which moved fewer bytes than a few rings are ignored,
+     *         because their throughput says little about the ring size.
+     */
+    class VmbusPipeRingTuner
+    {
+    private:
+
+        std::mutex m_Mutex;
+        HV_UINT32 m_MaximumSize = 0;
+        HV_UINT32 m_CurrentSize = 0;
+        HV_UINT32 m_BestSize = 0;
+        double m_BestThroughput = 0.0;
+        bool m_IsSettled = false;
+
+    public:
+
+        // A larger ring has to beat the best throughput by 1/16 to be kept.
+        static constexpr double MinimumGain = 1.0 / 16.0;
+
+        // The number of rings a session has to move to count.
+        static constexpr HV_UINT32 MinimumRingsPerSession = 4;
+
+        /**
+         * @brief Starts tuning.
+         * @param MinimumSize The ring size to start with, which is a power of
+         *                    two and at least VmbusPipeRingPageSize.
+         * @param MaximumSize The largest ring size to try.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            HV_UINT32 MinimumSize,
+            HV_UINT32 MaximumSize)
+        {
+            if (MinimumSize < ::Mile::HyperV::VmbusPipeRingPageSize() ||
+                (MinimumSize & (MinimumSize - 1)) ||
+                MaximumSize < MinimumSize)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            m_MaximumSize = MaximumSize;
+            m_CurrentSize = MinimumSize;
+            m_BestSize = MinimumSize;
+            m_BestThroughput = 0.0;
+            m_IsSettled = false;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Gets the ring size the next channel should be opened with.
+         * @return The ring size in bytes.
+         */
+        HV_UINT32 RingSize()
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            return m_CurrentSize;
+        }
+
+        bool IsSettled()
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            return m_IsSettled;
+        }
+
+        /**
+         * @brief Reports a finished channel session.
+         * @param RingSize The ring size the channel was opened with.
+         * @param Bytes The number of bytes the session moved.
+         * @param Nanoseconds How long the session was open.
+         */
+        void Report(
+            HV_UINT32 RingSize,
+            HV_UINT64 Bytes,
+            HV_UINT64 Nanoseconds)
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            if (m_IsSettled ||
+                RingSize != m_CurrentSize ||
+                !Nanoseconds ||
+                Bytes < static_cast<HV_UINT64>(RingSize) *
+                    MinimumRingsPerSession)
+            {
+                return;
+            }
+
+            double Throughput = static_cast<double>(Bytes) / Nanoseconds;
+            if (Throughput > m_BestThroughput * (1.0 + MinimumGain))
+            {
+                m_BestThroughput = Throughput;
+                m_BestSize = m_CurrentSize;
+                if (m_CurrentSize <= m_MaximumSize / 2)
+                {
+                    m_CurrentSize *= 2;
+                    return;
+                }
+            }
+            m_CurrentSize = m_BestSize;
+            m_IsSettled = true;
+        }
+    };
+
+    class VmbusPipeAsyncChannel;
+
+#ifdef _WIN32
+
+    /**
+     * @brief An I/O completion port with the threads which resume the
+     *        coroutines waiting for the pipe operations.
+     */
+    class VmbusPipeIoEngine
+    {
+    private:
+
+        HANDLE m_Port = nullptr;
+        std::vector<std::thread> m_Workers;
+
+        static const ULONG_PTR StopKey = 1;
+
+    public:
+
+        /**
+         * @brief The state of one overlapped operation. The OVERLAPPED
+         *        structure comes first, so the completion packet leads back
+         *        to the operation.
+         */
+        struct Operation
+        {
+            OVERLAPPED Overlapped;
+            std::coroutine_handle<> Continuation;
+            VmbusPipeIoResult Result;
+        };
+
+        VmbusPipeIoEngine() = default;
+
+        ~VmbusPipeIoEngine()
+        {
+            this->Stop();
+        }
+
+        VmbusPipeIoEngine(VmbusPipeIoEngine const&) = delete;
+        VmbusPipeIoEngine& operator=(VmbusPipeIoEngine const&) = delete;
+
+        /**
+         * @brief Creates the completion port and its threads.
+         * @param ThreadCount The number of threads.
+         * @return ERROR_SUCCESS or the Win32 error.
+         */
+        DWORD Start(
+            DWORD ThreadCount)
+        {
+            m_Port = ::CreateIoCompletionPort(
+                INVALID_HANDLE_VALUE,
+                nullptr,
+                0,
+                ThreadCount);
+            if (!m_Port)
+            {
+                return ::GetLastError();
+            }
+            for (DWORD i = 0; i < ThreadCount; ++i)
+            {
+                m_Workers.emplace_back([this]()
+                {
+                    for (;;)
+                    {
+                        DWORD BytesTransferred = 0;
+                        ULONG_PTR Key = 0;
+                        LPOVERLAPPED Overlapped = nullptr;
+                        BOOL Succeeded = ::GetQueuedCompletionStatus(
+                            m_Port,
+                            &BytesTransferred,
+                            &Key,
+                            &Overlapped,
+                            INFINITE);
+                        if (!Overlapped)
+                        {
+                            if (Key == StopKey)
+                            {
+                                break;
+                            }
+                            continue;
+                        }
+                        Operation* Current =
+                            reinterpret_cast<Operation*>(Overlapped);
+                        Current->Result.Error =
+                            Succeeded ? ERROR_SUCCESS : ::GetLastError();
+                        Current->Result.BytesTransferred = BytesTransferred;
+                        Current->Continuation.resume();
+                    }
+                });
+            }
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Stops the threads once they are idle and closes the port.
+         */
+        void Stop()
+        {
+            for (std::size_t i = 0; i < m_Workers.size(); ++i)
+            {
+                ::PostQueuedCompletionStatus(m_Port, 0, StopKey, nullptr);
+            }
+            for (std::thread& Worker : m_Workers)
+            {
+                Worker.join();
+            }
+            m_Workers.clear();
+            if (m_Port)
+            {
+                ::CloseHandle(m_Port);
+                m_Port = nullptr;
+            }
+        }
+
+        /**
+         * @brief Routes the completions of a pipe handle opened with
+         *        FILE_FLAG_OVERLAPPED to the engine.
+         * @return ERROR_SUCCESS or the Win32 error.
+         */
+        DWORD Attach(
+            HANDLE PipeHandle)
+        {
+            if (!::CreateIoCompletionPort(PipeHandle, m_Port, 0, 0))
+            {
+                return ::GetLastError();
+            }
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Issues an overlapped read or write.
+         * @return true if the completion will resume the coroutine, false if
+         *         the operation failed right away with Result.Error set.
+         * @remark The completion may resume the coroutine on a worker before
+         *         this returns, so the operation must not be touched after a
+         *         successful issue.
+         */
+        static bool Issue(
+            HANDLE PipeHandle,
+            bool IsWrite,
+            void* Buffer,
+            DWORD Size,
+            Operation& Current)
+        {
+            std::memset(&Current.Overlapped, 0, sizeof(OVERLAPPED));
+            BOOL Succeeded = IsWrite
+                ? ::WriteFile(
+                    PipeHandle,
+                    Buffer,
+                    Size,
+                    nullptr,
+                    &Current.Overlapped)
+                : ::ReadFile(
+                    PipeHandle,
+                    Buffer,
+                    Size,
+                    nullptr,
+                    &Current.Overlapped);
+            if (!Succeeded)
+            {
+                DWORD Error = ::GetLastError();
+                if (Error != ERROR_IO_PENDING)
+                {
+                    Current.Result.Error = Error;
+                    Current.Result.BytesTransferred = 0;
+                    return false;
+                }
+            }
+            // Completions are queued even when the operation finishes right
+            // away, because the handle does not skip the port on success.
+            return true;
+        }
+    };
+
+#else
+
+    /**
+     * @brief An epoll instance with the threads which resume the coroutines
+     *        waiting for the pipe operations, standing in for an I/O
+     *        completion port on top of the Linux pipe backend.
+     * @remark Operations are retried without waiting first. Only the ones
+     *         which would block wait for the eventfd of their direction,
+     *         registered with EPOLLONESHOT so exactly one worker retries
+     *         them.
+     */
+    class VmbusPipeIoEngine
+    {
+    private:
+
+        int m_Epoll = -1;
+        int m_StopEvent = -1;
+        std::vector<std::thread> m_Workers;
+
+    public:
+
+        /**
+         * @brief The state of one operation which waits for an eventfd.
+         */
+        struct Operation
+        {
+            std::coroutine_handle<> Continuation;
+            VmbusPipeIoResult Result;
+            HANDLE PipeHandle;
+            bool IsWrite;
+            HV_UINT8* Buffer;
+            DWORD Size;
+            int EventDescriptor;
+
+            /**
+             * @brief Makes as much progress as possible without waiting.
+             * @return true if the operation finished.
+             */
+            bool TryComplete()
+            {
+                for (;;)
+                {
+                    DWORD Bytes = 0;
+                    DWORD Error = this->IsWrite
+                        ? ::Mile::HyperV::VmbusPipeLinuxTryWrite(
+                            this->PipeHandle,
+                            this->Buffer + this->Result.BytesTransferred,
+                            this->Size - this->Result.BytesTransferred,
+                            &Bytes)
+                        : ::Mile::HyperV::VmbusPipeLinuxTryRead(
+                            this->PipeHandle,
+                            this->Buffer,
+                            this->Size,
+                            &Bytes);
+                    if (Error == ERROR_IO_PENDING)
+                    {
+                        return false;
+                    }
+                    this->Result.Error = Error;
+                    this->Result.BytesTransferred += Bytes;
+                    // Writes finish once every byte is in the ring, like an
+                    // overlapped write, reads once any byte arrived.
+                    if (Error != ERROR_SUCCESS ||
+                        !this->IsWrite ||
+                        this->Result.BytesTransferred == this->Size)
+                    {
+                        return true;
+                    }
+                }
+            }
+        };
+
+        VmbusPipeIoEngine() = default;
+
+        ~VmbusPipeIoEngine()
+        {
+            this->Stop();
+        }
+
+        VmbusPipeIoEngine(VmbusPipeIoEngine const&) = delete;
+        VmbusPipeIoEngine& operator=(VmbusPipeIoEngine const&) = delete;
+
+        /**
+         * @brief Creates the epoll instance and its threads.
+         * @param ThreadCount The number of threads.
+         * @return ERROR_SUCCESS or ERROR_NOT_ENOUGH_MEMORY.
+         */
+        DWORD Start(
+            DWORD ThreadCount)
+        {
+            m_Epoll = ::epoll_create1(EPOLL_CLOEXEC);
+            m_StopEvent = ::eventfd(0, EFD_CLOEXEC);
+            epoll_event Stop = {};
+            Stop.events = EPOLLIN;
+            Stop.data.ptr = nullptr;
+            if (m_Epoll < 0 ||
+                m_StopEvent < 0 ||
+                ::epoll_ctl(m_Epoll, EPOLL_CTL_ADD, m_StopEvent, &Stop))
+            {
+                this->Stop();
+                return ERROR_NOT_ENOUGH_MEMORY;
+            }
+            for (DWORD i = 0; i < ThreadCount; ++i)
+            {
+                m_Workers.emplace_back([this]()
+                {
+                    for (;;)
+                    {
+                        epoll_event Event;
+                        int Count = ::epoll_wait(m_Epoll, &Event, 1, -1);
+                        if (Count <= 0)
+                        {
+                            continue;
+                        }
+                        Operation* Current =
+                            static_cast<Operation*>(Event.data.ptr);
+                        if (!Current)
+                        {
+                            break;
+                        }
+
+                        // Reset the event before retrying, so a signal which
+                        // arrives after the retry is not lost.
+                        HV_UINT64 Value = 0;
+                        if (::read(
+                            Current->EventDescriptor,
+                            &Value,
+                            sizeof(Value)) < 0)
+                        {
+                            Value = 0;
+                        }
+                        if (Current->TryComplete() || !this->Arm(*Current))
+                        {
+                            Current->Continuation.resume();
+                        }
+                    }
+                });
+            }
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Stops the threads once they are idle.
+         */
+        void Stop()
+        {
+            if (m_StopEvent >= 0)
+            {
+                // The stop event stays set, so every worker sees it.
+                HV_UINT64 Value = 1;
+                if (::write(m_StopEvent, &Value, sizeof(Value)) < 0)
+                {
+                    Value = 0;
+                }
+            }
+            for (std::thread& Worker : m_Workers)
+            {
+                Worker.join();
+            }
+            m_Workers.clear();
+            if (m_StopEvent >= 0)
+            {
+                ::close(m_StopEvent);
+                m_StopEvent = -1;
+            }
+            if (m_Epoll >= 0)
+            {
+                ::close(m_Epoll);
+                m_Epoll = -1;
+            }
+        }
+
+        /**
+         * @brief Registers the eventfds of a connected pipe handle.
+         * @return ERROR_SUCCESS or ERROR_INVALID_HANDLE.
+         */
+        DWORD Attach(
+            HANDLE PipeHandle)
+        {
+            for (bool IsWrite : { false, true })
+            {
+                int Descriptor = ::Mile::HyperV::VmbusPipeLinuxEventDescriptor(
+                    PipeHandle,
+                    IsWrite);
+                // Registered disarmed, Arm enables it for one operation.
+                epoll_event Event = {};
+                Event.events = EPOLLONESHOT;
+                if (Descriptor < 0 ||
+                    ::epoll_ctl(m_Epoll, EPOLL_CTL_ADD, Descriptor, &Event))
+                {
+                    this->Detach(PipeHandle);
+                    return ERROR_INVALID_HANDLE;
+                }
+            }
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Unregisters the eventfds of a pipe handle, which must not
+         *        have operations in progress.
+         */
+        void Detach(
+            HANDLE PipeHandle)
+        {
+            for (bool IsWrite : { false, true })
+            {
+                int Descriptor = ::Mile::HyperV::VmbusPipeLinuxEventDescriptor(
+                    PipeHandle,
+                    IsWrite);
+                if (Descriptor >= 0)
+                {
+                    ::epoll_ctl(m_Epoll, EPOLL_CTL_DEL, Descriptor, nullptr);
+                }
+            }
+        }
+
+        /**
+         * @brief Waits for the eventfd of an operation once.
+         * @return true if a worker will retry the operation.
+         */
+        bool Arm(
+            Operation& Current)
+        {
+            epoll_event Event = {};
+            Event.events = EPOLLIN | EPOLLONESHOT;
+            Event.data.ptr = &Current;
+            if (::epoll_ctl(
+                m_Epoll,
+                EPOLL_CTL_MOD,
+                Current.EventDescriptor,
+                &Event))
+            {
+                Current.Result.Error = ERROR_INVALID_HANDLE;
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * @brief Starts an operation.
+         * @return true if a worker will resume the coroutine, false if the
+         *         operation finished right away.
+         * @remark The eventfd is level triggered, so a signal which arrived
+         *         between the attempt and arming it wakes a worker at once.
+         */
+        bool Issue(
+            HANDLE PipeHandle,
+            bool IsWrite,
+            void* Buffer,
+            DWORD Size,
+            Operation& Current)
+        {
+            Current.Result.Error = ERROR_SUCCESS;
+            Current.Result.BytesTransferred = 0;
+            Current.PipeHandle = PipeHandle;
+            Current.IsWrite = IsWrite;
+            Current.Buffer = static_cast<HV_UINT8*>(Buffer);
+            Current.Size = Size;
+            Current.EventDescriptor =
+                ::Mile::HyperV::VmbusPipeLinuxEventDescriptor(
+                    PipeHandle,
+                    IsWrite);
+            if (Current.TryComplete())
+            {
+                return false;
+            }
+            return this->Arm(Current);
+        }
+    };
+
+#endif // _WIN32
+
+    /**
+     * @brief Awaits one read or write of a VmbusPipeAsyncChannel.
+     */
+    class VmbusPipeIoAwaiter
+    {
+    private:
+
+        VmbusPipeIoEngine* m_Engine;
+        HANDLE m_PipeHandle;
+        bool m_IsWrite;
+        void* m_Buffer;
+        DWORD m_Size;
+        std::atomic<HV_UINT64>* m_Counter;
+        VmbusPipeIoEngine::Operation m_Operation;
+
+    public:
+
+        VmbusPipeIoAwaiter(
+            VmbusPipeIoEngine* Engine,
+            HANDLE PipeHandle,
+            bool IsWrite,
+            void* Buffer,
+            DWORD Size,
+            std::atomic<HV_UINT64>* Counter) :
+            m_Engine(Engine),
+            m_PipeHandle(PipeHandle),
+            m_IsWrite(IsWrite),
+            m_Buffer(Buffer),
+            m_Size(Size),
+            m_Counter(Counter),
+            m_Operation()
+        {
+        }
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(
+            std::coroutine_handle<> Continuation)
+        {
+            m_Operation.Continuation = Continuation;
+            return m_Engine->Issue(
+                m_PipeHandle,
+                m_IsWrite,
+                m_Buffer,
+                m_Size,
+                m_Operation);
+        }
+
+        VmbusPipeIoResult await_resume() noexcept
+        {
+            m_Counter->fetch_add(
+                m_Operation.Result.BytesTransferred,
+                std::memory_order_relaxed);
+            return m_Operation.Result;
+        }
+    };
+
+    /**
+     * @brief A VMBus pipe channel which owns its handle, serves reads and
+     *        writes as coroutines through a VmbusPipeIoEngine, and feeds
+     *        the throughput of every session to a VmbusPipeRingTuner.
+     * @remark At most one read and one write may be in progress at a time,
+     *         and none when the channel is closed.
+     */
+    class VmbusPipeAsyncChannel
+    {
+    private:
+
+        VmbusPipeIoEngine* m_Engine = nullptr;
+        HANDLE m_PipeHandle = INVALID_HANDLE_VALUE;
+        VmbusPipeRingTuner* m_Tuner = nullptr;
+        HV_UINT32 m_RingSize = 0;
+        std::chrono::steady_clock::time_point m_OpenTime;
+        std::atomic<HV_UINT64> m_BytesTransferred = 0;
+
+    public:
+
+        VmbusPipeAsyncChannel() = default;
+
+        ~VmbusPipeAsyncChannel()
+        {
+            this->Close();
+        }
+
+        VmbusPipeAsyncChannel(VmbusPipeAsyncChannel const&) = delete;
+        VmbusPipeAsyncChannel& operator=(
+            VmbusPipeAsyncChannel const&) = delete;
+
+        /**
+         * @brief Opens an offered channel as a client.
+         * @param Engine The engine which completes the operations.
+         * @param ChannelInfo The channel from an offer.
+         * @param Tuner Optional. Picks the ring sizes, and receives the
+         *              throughput of the session when the channel closes.
+         * @param RingSize The size of both rings when Tuner is not given, or
+         *                 zero for the default size.
+         * @return ERROR_SUCCESS or the Win32 error.
+         */
+        DWORD Open(
+            VmbusPipeIoEngine& Engine,
+            PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+            VmbusPipeRingTuner* Tuner,
+            DWORD RingSize = 0)
+        {
+            this->Close();
+
+            if (Tuner)
+            {
+                RingSize = Tuner->RingSize();
+            }
+            VMBUS_PIPE_CLIENT_CHANNEL_SETTINGS Settings = {};
+            Settings.Version = VMBUS_PIPE_CLIENT_CHANNEL_CURRENT_VERSION;
+            Settings.Size = sizeof(Settings);
+            Settings.IncomingSize = RingSize;
+            Settings.OutgoingSize = RingSize;
+#ifdef _WIN32
+            DWORD OpenMode = FILE_FLAG_OVERLAPPED;
+#else
+            DWORD OpenMode = 0;
+#endif // _WIN32
+            HANDLE PipeHandle = ::VmbusPipeClientOpenChannelEx(
+                ChannelInfo,
+                OpenMode,
+                &Settings);
+            if (!PipeHandle || PipeHandle == INVALID_HANDLE_VALUE)
+            {
+                return ::GetLastError();
+            }
+
+            DWORD Error = this->Attach(Engine, PipeHandle);
+            if (Error == ERROR_SUCCESS)
+            {
+                m_Tuner = Tuner;
+                m_RingSize = RingSize;
+            }
+            return Error;
+        }
+
+        /**
+         * @brief Takes over a connected pipe handle, such as a server handle
+         *        after VmbusPipeServerConnectPipe.
+         * @param Engine The engine which completes the operations.
+         * @param PipeHandle The pipe handle, which is closed on failure. On
+         *                   Windows it must have been opened or offered with
+         *                   FILE_FLAG_OVERLAPPED.
+         * @return ERROR_SUCCESS or the Win32 error.
+         */
+        DWORD Attach(
+            VmbusPipeIoEngine& Engine,
+            HANDLE PipeHandle)
+        {
+            this->Close();
+
+            DWORD Error = Engine.Attach(PipeHandle);
+            if (Error != ERROR_SUCCESS)
+            {
+                ::CloseHandle(PipeHandle);
+                return Error;
+            }
+            m_Engine = &Engine;
+            m_PipeHandle = PipeHandle;
+            m_OpenTime = std::chrono::steady_clock::now();
+            m_BytesTransferred.store(0, std::memory_order_relaxed);
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Closes the handle and reports the session to the tuner.
+         */
+        void Close()
+        {
+            if (m_PipeHandle == INVALID_HANDLE_VALUE)
+            {
+                return;
+            }
+#ifndef _WIN32
+            m_Engine->Detach(m_PipeHandle);
+#endif // !_WIN32
+            ::CloseHandle(m_PipeHandle);
+            m_PipeHandle = INVALID_HANDLE_VALUE;
+            m_Engine = nullptr;
+
+            if (m_Tuner)
+            {
+                m_Tuner->Report(
+                    m_RingSize,
+                    m_BytesTransferred.load(std::memory_order_relaxed),
+                    static_cast<HV_UINT64>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() -
+                            m_OpenTime).count()));
+                m_Tuner = nullptr;
+            }
+        }
+
+        HANDLE Handle() const
+        {
+            return m_PipeHandle;
+        }
+
+        /**
+         * @brief Reads the bytes available, waiting until there are some.
+         * @param Buffer The buffer which receives the bytes, which must stay
+         *               valid until the operation completes.
+         * @param Size The size of the buffer in bytes.
+         * @return An awaiter which yields a VmbusPipeIoResult.
+         */
+        VmbusPipeIoAwaiter AsyncRead(
+            void* Buffer,
+            DWORD Size)
+        {
+            return VmbusPipeIoAwaiter(
+                m_Engine,
+                m_PipeHandle,
+                false,
+                Buffer,
+                Size,
+                &m_BytesTransferred);
+        }
+
+        /**
+         * @brief Writes all the bytes, waiting while the ring is full.
+         * @param Buffer The bytes, which must stay valid until the operation
+         *               completes.
+         * @param Size The number of bytes.
+         * @return An awaiter which yields a VmbusPipeIoResult.
+         */
+        VmbusPipeIoAwaiter AsyncWrite(
+            const void* Buffer,
+            DWORD Size)
+        {
+            return VmbusPipeIoAwaiter(
+                m_Engine,
+                m_PipeHandle,
+                true,
+                const_cast<void*>(Buffer),
+                Size,
+                &m_BytesTransferred);
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_PIPEASYNC
@@ -0,0 +1,842 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.PipeDirectory.h
+ * PURPOSE:    Definition for Hyper-V VMBus Pipe Channel Directory
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_PIPEDIRECTORY
+#define MILE_HYPERV_VMBUS_PIPEDIRECTORY
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus pipe directory requires C++20 or later.
+#endif // !__cplusplus
+
+#ifdef _WIN32
+#include "Mile.HyperV.Windows.VMBusPipe.h"
+#else
+#include "Mile.HyperV.Linux.VMBusPipe.h"
+#endif // _WIN32
+
+#include "Mile.HyperV.VMBus.OfferTable.h"
+
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief Parses a braced GUID, such as {01234567-89ab-cdef-0123-
+     *        456789abcdef}, in either case.
+     * @param Text The text, which starts with the opening brace.
+     * @param Guid Receives the GUID.
+     * @return The number of characters parsed, or zero if the text does not
+     *         start with a braced GUID.
+     */
+    inline std::size_t VmbusPipeParseBracedGuid(
+        const WCHAR* Text,
+        GUID& Guid)
+    {
+        // The digit count of every group, separated by dashes.
+        const HV_UINT8 Groups[] = { 8, 4, 4, 4, 12 };
+        HV_UINT8 Bytes[16] = {};
+        std::size_t Position = 0;
+        std::size_t Nibble = 0;
+        if (Text[Position++] != L'{')
+        {
+            return 0;
+        }
+        for (std::size_t Group = 0; Group < 5; ++Group)
+        {
+            if (Group && Text[Position++] != L'-')
+            {
+                return 0;
+            }
+            for (HV_UINT8 i = 0; i < Groups[Group]; ++i)
+            {
+                WCHAR Character = Text[Position++];
+                HV_UINT8 Value = 0;
+                if (Character >= L'0' && Character <= L'9')
+                {
+                    Value = static_cast<HV_UINT8>(Character - L'0');
+                }
+                else if (Character >= L'a' && Character <= L'f')
+                {
+                    Value = static_cast<HV_UINT8>(Character - L'a' + 10);
+                }
+                else if (Character >= L'A' && Character <= L'F')
+                {
+                    Value = static_cast<HV_UINT8>(Character - L'A' + 10);
+                }
+                else
+                {
+                    return 0;
+                }
+                Bytes[Nibble / 2] |= (Nibble & 1) ? Value : (Value << 4);
+                ++Nibble;
+            }
+        }
+        if (Text[Position++] != L'}')
+        {
+            return 0;
+        }
+
+        // The text is in the byte order of the fields, not of the memory.
+        Guid.Data1 = (static_cast<HV_UINT32>(Bytes[0]) << 24)
+            | (static_cast<HV_UINT32>(Bytes[1]) << 16)
+            | (static_cast<HV_UINT32>(Bytes[2]) << 8)
+            | Bytes[3];
+        Guid.Data2 = static_cast<HV_UINT16>((Bytes[4] << 8) | Bytes[5]);
+        Guid.Data3 = static_cast<HV_UINT16>((Bytes[6] << 8) | Bytes[7]);
+        std::memcpy(Guid.Data4, &Bytes[8], sizeof(Guid.Data4));
+        return Position;
+    }
+
+    /**
+     * @brief Gets the interface instance of a channel from its device path,
+     *        which holds the braced interface type followed by the braced
+     *        interface instance.
+     * @param ChannelInfo The channel.
+     * @param InterfaceType The interface type of the channel.
+     * @param InterfaceInstance Receives the interface instance.
+     * @return true if the path holds the interface type followed by a GUID.
+     */
+    inline bool VmbusPipeParseDevicePath(
+        VMBUS_PIPE_CHANNEL_INFO const& ChannelInfo,
+        GUID const& InterfaceType,
+        GUID& InterfaceInstance)
+    {
+        const std::size_t Length = sizeof(ChannelInfo.DevicePath)
+            / sizeof(ChannelInfo.DevicePath[0]);
+        // A braced GUID is 38 characters long.
+        const std::size_t GuidLength = 38;
+        const WCHAR* Path = ChannelInfo.DevicePath;
+        bool IsTypeFound = false;
+        for (std::size_t i = 0; i + GuidLength < Length && Path[i]; ++i)
+        {
+            GUID Guid;
+            std::size_t Parsed =
+                ::Mile::HyperV::VmbusPipeParseBracedGuid(&Path[i], Guid);
+            if (!Parsed)
+            {
+                continue;
+            }
+            if (IsTypeFound)
+            {
+                InterfaceInstance = Guid;
+                return true;
+            }
+            IsTypeFound =
+                ::Mile::HyperV::VmbusGuidEquals(Guid, InterfaceType);
+            i += Parsed - 1;
+        }
+        return false;
+    }
+
+    /**
+     * @brief A channel in a VmbusPipeChannelDirectory.
+     */
+    struct VmbusPipeDirectoryChannel
+    {
+        GUID InterfaceType;
+        GUID InterfaceInstance;
+        VMBUS_PIPE_CHANNEL_INFO ChannelInfo;
+        BYTE UserDefined[112];
+        // Whether UserDefined is known. Channels learned from arrival
+        // notifications have it once the next Refresh enumerates them.
+        bool IsUserDefinedValid;
+        // The generation of the directory when the channel was added or
+        // last changed.
+        HV_UINT64 Generation;
+    };
+
+    /**
+     * @brief The channels of the interface types a process watches, kept
+     *        current through arrival notifications and looked up in
+     *        constant time by InterfaceType and InterfaceInstance.
+     * @remark VmbusPipeClientEnumeratePipes walks every offer of a type on
+     *         every call. The directory enumerates a type once when it starts
+     *         watching it and then applies the arrivals one at a time, so
+     *         discovery loops over hundreds of channels cost a lookup each.
+     *         The directory generation and the generation of every watched
+     *         type change whenever their channels change, so callers can
+     *         keep derived state until the generation they saw moves.
+     *
+     *         The pipe API reports arrivals only. Callers which find a
+     *         channel gone, such as when opening it fails with
+     *         ERROR_FILE_NOT_FOUND, call Remove, and Refresh reconciles a
+     *         type with a new enumeration.
+     */
+    class VmbusPipeChannelDirectory
+    {
+    private:
+
+        struct Slot
+        {
+            VmbusPipeDirectoryChannel Channel;
+            // The refresh which saw the channel last.
+            HV_UINT64 RefreshStamp;
+            bool IsInUse;
+        };
+
+        struct Watch
+        {
+            VmbusPipeChannelDirectory* Directory;
+            GUID InterfaceType;
+            HVMBUS_PIPE_NOTIFICATION Notification;
+            std::atomic<HV_UINT64> Generation;
+            // The stamp of the latest refresh applied to the type, under the
+            // lock.
+            HV_UINT64 RefreshStamp;
+        };
+
+        /**
+         * @brief A channel reported by an enumeration.
+         */
+        struct Offer
+        {
+            GUID InterfaceInstance;
+            VMBUS_PIPE_CHANNEL_INFO ChannelInfo;
+            BYTE UserDefined[112];
+        };
+
+        mutable std::mutex m_Mutex;
+        std::vector<VmbusOfferEntry> m_Entries;
+        VmbusOfferRegistry m_Registry;
+        std::vector<Slot> m_Slots;
+        std::vector<Slot*> m_FreeSlots;
+        std::vector<std::unique_ptr<Watch>> m_Watches;
+        // The refreshes which use watches outside the lock, which Close
+        // waits for before freeing the watches.
+        HV_UINT32 m_ActiveRefreshes = 0;
+        std::condition_variable m_RefreshCompleted;
+        HV_UINT64 m_RefreshStamp = 0;
+        std::atomic<HV_UINT64> m_Generation = 0;
+        std::atomic<HV_UINT64> m_OverflowCount = 0;
+
+        Watch* FindWatch(
+            GUID const& InterfaceType) const
+        {
+            for (auto const& Current : m_Watches)
+            {
+                if (::Mile::HyperV::VmbusGuidEquals(
+                    Current->InterfaceType,
+                    InterfaceType))
+                {
+                    return Current.get();
+                }
+            }
+            return nullptr;
+        }
+
+        Slot* FindSlot(
+            GUID const& InterfaceType,
+            GUID const& InterfaceInstance) const
+        {
+            VmbusOfferEntry* Entry = m_Registry.Find(
+                InterfaceType,
+                InterfaceInstance,
+                0);
+            return Entry ? static_cast<Slot*>(Entry->Context) : nullptr;
+        }
+
+        /**
+         * @brief Adds a channel, or updates it if its device path or user
+         *        defined bytes changed. The caller holds the lock.
+         * @param UserDefined The user defined bytes, or nullptr if they are
+         *                    not known.
+         * @return true if the directory changed.
+         */
+        bool Upsert(
+            Watch& Owner,
+            GUID const& InterfaceInstance,
+            VMBUS_PIPE_CHANNEL_INFO const& ChannelInfo,
+            const BYTE* UserDefined)
+        {
+            Slot* Current = this->FindSlot(
+                Owner.InterfaceType,
+                InterfaceInstance);
+            if (Current)
+            {
+                Current->RefreshStamp = m_RefreshStamp;
+                VmbusPipeDirectoryChannel& Channel = Current->Channel;
+                bool IsPathChanged = 0 != std::memcmp(
+                    &Channel.ChannelInfo,
+                    &ChannelInfo,
+                    sizeof(ChannelInfo));
+                bool IsUserDefinedChanged = UserDefined &&
+                    (!Channel.IsUserDefinedValid || 0 != std::memcmp(
+                        Channel.UserDefined,
+                        UserDefined,
+                        sizeof(Channel.UserDefined)));
+                if (!IsPathChanged && !IsUserDefinedChanged)
+                {
+                    return false;
+                }
+                if (IsPathChanged && !UserDefined)
+                {
+                    // The channel was offered again, so the old bytes may be
+                    // stale.
+                    Channel.IsUserDefinedValid = false;
+                }
+                Channel.ChannelInfo = ChannelInfo;
+                if (UserDefined)
+                {
+                    std::memcpy(
+                        Channel.UserDefined,
+                        UserDefined,
+                        sizeof(Channel.UserDefined));
+                    Channel.IsUserDefinedValid = true;
+                }
+                Channel.Generation = this->Changed(Owner);
+                return true;
+            }
+
+            if (m_FreeSlots.empty())
+            {
+                m_OverflowCount.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            Current = m_FreeSlots.back();
+            VmbusOfferKey Key;
+            Key.InterfaceType = Owner.InterfaceType;
+            Key.InterfaceInstance = InterfaceInstance;
+            Key.SubChannelIndex = 0;
+            if (!NT_SUCCESS(m_Registry.Insert(Key, 0, Current)))
+            {
+                m_OverflowCount.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            m_FreeSlots.pop_back();
+            Current->IsInUse = true;
+            Current->RefreshStamp = m_RefreshStamp;
+            VmbusPipeDirectoryChannel& Channel = Current->Channel;
+            Channel.InterfaceType = Owner.InterfaceType;
+            Channel.InterfaceInstance = InterfaceInstance;
+            Channel.ChannelInfo = ChannelInfo;
+            Channel.IsUserDefinedValid = (UserDefined != nullptr);
+            if (UserDefined)
+            {
+                std::memcpy(
+                    Channel.UserDefined,
+                    UserDefined,
+                    sizeof(Channel.UserDefined));
+            }
+            else
+            {
+                std::memset(
+                    Channel.UserDefined,
+                    0,
+                    sizeof(Channel.UserDefined));
+            }
+            Channel.Generation = this->Changed(Owner);
+            return true;
+        }
+
+        /**
+         * @brief Removes a channel. The caller holds the lock.
+         */
+        void Erase(
+            Watch& Owner,
+            Slot* Current)
+        {
+            VmbusOfferKey Key;
+            Key.InterfaceType = Current->Channel.InterfaceType;
+            Key.InterfaceInstance = Current->Channel.InterfaceInstance;
+            Key.SubChannelIndex = 0;
+            m_Registry.Remove(Key);
+            Current->IsInUse = false;
+            m_FreeSlots.push_back(Current);
+            this->Changed(Owner);
+        }
+
+        /**
+         * @brief Moves the generations on. The caller holds the lock.
+         * @return The new directory generation.
+         */
+        HV_UINT64 Changed(
+            Watch& Owner)
+        {
+            Owner.Generation.fetch_add(1, std::memory_order_release);
+            return m_Generation.fetch_add(1, std::memory_order_release) + 1;
+        }
+
+        static VOID CALLBACK OnOffer(
+            _In_opt_ LPVOID HostContext,
+            _In_ LPBYTE UserDefined,
+            _In_ PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+            _In_ LPCGUID InstanceGuid)
+        {
+            std::vector<Offer>* Offers =
+                static_cast<std::vector<Offer>*>(HostContext);
+            Offer Current;
+            Current.InterfaceInstance = *InstanceGuid;
+            Current.ChannelInfo = *ChannelInfo;
+            std::memcpy(
+                Current.UserDefined,
+                UserDefined,
+                sizeof(Current.UserDefined));
+            Offers->push_back(Current);
+        }
+
+        static VOID CALLBACK OnArrival(
+            _In_opt_ LPVOID ClientContext,
+            _In_ PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
+            _In_ VMBUS_PIPE_CHANNEL_NOTIFICATION_TYPE NotificationType)
+        {
+            Watch* Owner = static_cast<Watch*>(ClientContext);
+            if (NotificationType != ChannelNotificationArrival)
+            {
+                return;
+            }
+            VmbusPipeChannelDirectory* Directory = Owner->Directory;
+            GUID InterfaceInstance;
+            if (!::Mile::HyperV::VmbusPipeParseDevicePath(
+                *ChannelInfo,
+                Owner->InterfaceType,
+                InterfaceInstance))
+            {
+                // Fall back to reading the whole type once more.
+                Directory->RefreshWatch(*Owner);
+                return;
+            }
+            std::lock_guard<std::mutex> Guard(Directory->m_Mutex);
+            Directory->Upsert(
+                *Owner,
+                InterfaceInstance,
+                *ChannelInfo,
+                nullptr);
+        }
+
+        DWORD RefreshWatch(
+            Watch& Owner)
+        {
+            // The stamp is taken before enumerating, so a channel arriving
+            // while the enumeration runs carries this stamp or a later one
+            // and survives the sweep below. The enumeration itself runs
+            // outside the lock, as its callbacks may be delivered while
+            // arrivals for the same type are.
+            HV_UINT64 Stamp = 0;
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                Stamp = ++m_RefreshStamp;
+            }
+            std::vector<Offer> Offers;
+            if (!::VmbusPipeClientEnumeratePipes(
+                &Owner.InterfaceType,
+                &Offers,
+                &VmbusPipeChannelDirectory::OnOffer))
+            {
+                return ::GetLastError();
+            }
+
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            if (Owner.RefreshStamp > Stamp)
+            {
+                // A later refresh of the type completed first, and its
+                // enumeration is newer than this one.
+                return ERROR_SUCCESS;
+            }
+            Owner.RefreshStamp = Stamp;
+            for (Offer const& Current : Offers)
+            {
+                this->Upsert(
+                    Owner,
+                    Current.InterfaceInstance,
+                    Current.ChannelInfo,
+                    Current.UserDefined);
+            }
+            for (Slot& Current : m_Slots)
+            {
+                // A refresh of another type may have raised the stamp
+                // meanwhile, so only channels older than this one go.
+                if (Current.IsInUse &&
+                    Current.RefreshStamp < Stamp &&
+                    ::Mile::HyperV::VmbusGuidEquals(
+                        Current.Channel.InterfaceType,
+                        Owner.InterfaceType))
+                {
+                    this->Erase(Owner, &Current);
+                }
+            }
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Ends a refresh counted in m_ActiveRefreshes.
+         */
+        void EndRefresh()
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            if (!--m_ActiveRefreshes)
+            {
+                m_RefreshCompleted.notify_all();
+            }
+        }
+
+    public:
+
+        VmbusPipeChannelDirectory() = default;
+
+        ~VmbusPipeChannelDirectory()
+        {
+            this->Close();
+        }
+
+        VmbusPipeChannelDirectory(VmbusPipeChannelDirectory const&) = delete;
+        VmbusPipeChannelDirectory& operator=(
+            VmbusPipeChannelDirectory const&) = delete;
+
+        /**
+         * @brief Allocates room for a number of channels.
+         * @param Capacity The number of channels the directory can hold.
+         * @return ERROR_SUCCESS or ERROR_INVALID_PARAMETER.
+         */
+        DWORD Initialize(
+            HV_UINT32 Capacity)
+        {
+            this->Close();
+
+            if (!Capacity || Capacity > 0x10000000)
+            {
+                return ERROR_INVALID_PARAMETER;
+            }
+            // The table refuses inserts beyond three quarters of its size.
+            HV_UINT32 TableSize = std::bit_ceil(Capacity + Capacity / 3 + 1);
+            if (TableSize < 4)
+            {
+                TableSize = 4;
+            }
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            m_Entries.resize(TableSize);
+            m_Slots.resize(Capacity);
+            m_FreeSlots.clear();
+            m_FreeSlots.reserve(Capacity);
+            m_Registry.Initialize(m_Entries.data(), TableSize);
+            for (HV_UINT32 i = Capacity; i > 0; --i)
+            {
+                m_Slots[i - 1].IsInUse = false;
+                m_FreeSlots.push_back(&m_Slots[i - 1]);
+            }
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Starts watching the channels of an interface type, and adds
+         *        the channels which are offered already.
+         * @param InterfaceType The interface type.
+         * @return ERROR_SUCCESS, ERROR_ALREADY_EXISTS if the type is watched
+         *         already, or the Win32 error.
+         */
+        DWORD StartWatching(
+            GUID const& InterfaceType)
+        {
+            std::unique_ptr<Watch> Current(new (std::nothrow) Watch());
+            if (!Current)
+            {
+                return ERROR_NOT_ENOUGH_MEMORY;
+            }
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                if (m_Slots.empty())
+                {
+                    return ERROR_INVALID_HANDLE;
+                }
+                if (this->FindWatch(InterfaceType))
+                {
+                    return ERROR_ALREADY_EXISTS;
+                }
+            }
+            Current->Directory = this;
+            Current->InterfaceType = InterfaceType;
+            Current->Notification = nullptr;
+            Current->Generation.store(0, std::memory_order_relaxed);
+            Current->RefreshStamp = 0;
+
+            // Arrivals are delivered before the enumeration starts, so a
+            // channel offered meanwhile is seen by one or both of them.
+            Current->Notification =
+                ::VmbusPipeClientRegisterChannelNotification(
+                    &Current->InterfaceType,
+                    nullptr,
+                    0,
+                    &VmbusPipeChannelDirectory::OnArrival,
+                    Current.get());
+            if (!Current->Notification)
+            {
+                return ::GetLastError();
+            }
+            ::VmbusPipeClientReadyForChannelNotification(
+                Current->Notification,
+                FALSE);
+            Watch* Added = Current.get();
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                // Another caller may have started watching the same type
+                // while the notification was being registered.
+                if (!this->FindWatch(InterfaceType))
+                {
+                    m_Watches.push_back(std::move(Current));
+                    ++m_ActiveRefreshes;
+                }
+            }
+            if (Current)
+            {
+                ::VmbusPipeClientUnregisterChannelNotification(
+                    Current->Notification,
+                    TRUE);
+                return ERROR_ALREADY_EXISTS;
+            }
+            DWORD Error = this->RefreshWatch(*Added);
+            this->EndRefresh();
+            return Error;
+        }
+
+        /**
+         * @brief Stops watching every interface type, and removes every
+         *        channel.
+         * @remark Refreshes already running are waited for. Must not be
+         *         called from an arrival or enumeration callback.
+         */
+        void Close()
+        {
+            std::vector<std::unique_ptr<Watch>> Watches;
+            {
+                std::unique_lock<std::mutex> Guard(m_Mutex);
+                Watches.swap(m_Watches);
+                m_RefreshCompleted.wait(Guard, [this]()
+                {
+                    return !m_ActiveRefreshes;
+                });
+            }
+            for (auto& Current : Watches)
+            {
+                ::VmbusPipeClientUnregisterChannelNotification(
+                    Current->Notification,
+                    TRUE);
+            }
+
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            m_Registry.Clear();
+            m_FreeSlots.clear();
+            for (HV_UINT32 i = static_cast<HV_UINT32>(m_Slots.size());
+                i > 0;
+                --i)
+            {
+                m_Slots[i - 1].IsInUse = false;
+                m_FreeSlots.push_back(&m_Slots[i - 1]);
+            }
+            if (!Watches.empty())
+            {
+                m_Generation.fetch_add(1, std::memory_order_release);
+            }
+        }
+
+        /**
+         * @brief Enumerates watched types again, adds and updates the
+         *        channels found, and removes the channels which are gone.
+         * @param InterfaceType Optional. The type to refresh, or nullptr for
+         *                      every watched type.
+         * @return ERROR_SUCCESS, ERROR_FILE_NOT_FOUND if the type is not
+         *         watched, or the Win32 error of the enumeration.
+         */
+        DWORD Refresh(
+            LPCGUID InterfaceType = nullptr)
+        {
+            std::vector<Watch*> Watches;
+            {
+                std::lock_guard<std::mutex> Guard(m_Mutex);
+                for (auto const& Current : m_Watches)
+                {
+                    if (!InterfaceType || ::Mile::HyperV::VmbusGuidEquals(
+                        Current->InterfaceType,
+                        *InterfaceType))
+                    {
+                        Watches.push_back(Current.get());
+                    }
+                }
+                if (Watches.empty())
+                {
+                    return InterfaceType
+                        ? ERROR_FILE_NOT_FOUND
+                        : ERROR_SUCCESS;
+                }
+                // Close frees the watches only after this refresh ends.
+                ++m_ActiveRefreshes;
+            }
+            DWORD Error = ERROR_SUCCESS;
+            for (Watch* Current : Watches)
+            {
+                Error = this->RefreshWatch(*Current);
+                if (Error != ERROR_SUCCESS)
+                {
+                    break;
+                }
+            }
+            this->EndRefresh();
+            return Error;
+        }
+
+        /**
+         * @brief Looks a channel up.
+         * @param InterfaceType The interface type of the channel.
+         * @param InterfaceInstance The interface instance of the channel.
+         * @param Channel Optional. Receives a copy of the channel.
+         * @return true if the channel is in the directory.
+         */
+        bool Find(
+            GUID const& InterfaceType,
+            GUID const& InterfaceInstance,
+            VmbusPipeDirectoryChannel* Channel) const
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            Slot* Current = this->FindSlot(InterfaceType, InterfaceInstance);
+            if (!Current)
+            {
+                return false;
+            }
+            if (Channel)
+            {
+                *Channel = Current->Channel;
+            }
+            return true;
+        }
+
+        /**
+         * @brief Copies the channels of an interface type.
+         * @param InterfaceType The interface type.
+         * @param Channels Receives the channels, in no particular order.
+         * @param Capacity The number of elements of Channels.
+         * @param Generation Optional. Receives the generation of the type
+         *                   the copy belongs to.
+         * @return The number of channels of the type, which is more than
+         *         Capacity if not all of them were copied.
+         * @remark This walks the whole directory. Callers which keep the
+         *         list compare TypeGeneration first, and only list again
+         *         when it moved.
+         */
+        HV_UINT32 List(
+            GUID const& InterfaceType,
+            VmbusPipeDirectoryChannel* Channels,
+            HV_UINT32 Capacity,
+            HV_UINT64* Generation = nullptr) const
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            HV_UINT32 Count = 0;
+            for (Slot const& Current : m_Slots)
+            {
+                if (!Current.IsInUse ||
+                    !::Mile::HyperV::VmbusGuidEquals(
+                        Current.Channel.InterfaceType,
+                        InterfaceType))
+                {
+                    continue;
+                }
+                if (Count < Capacity)
+                {
+                    Channels[Count] = Current.Channel;
+                }
+                ++Count;
+            }
+            if (Generation)
+            {
+                Watch* Owner = this->FindWatch(InterfaceType);
+                *Generation = Owner
+                    ? Owner->Generation.load(std::memory_order_acquire)
+                    : 0;
+            }
+            return Count;
+        }
+
+        /**
+         * @brief Removes a channel the caller found gone, such as when
+         *        opening it failed with ERROR_FILE_NOT_FOUND.
+         * @param InterfaceType The interface type of the channel.
+         * @param InterfaceInstance The interface instance of the channel.
+         * @return ERROR_SUCCESS or ERROR_FILE_NOT_FOUND.
+         */
+        DWORD Remove(
+            GUID const& InterfaceType,
+            GUID const& InterfaceInstance)
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            Watch* Owner = this->FindWatch(InterfaceType);
+            Slot* Current = this->FindSlot(InterfaceType, InterfaceInstance);
+            if (!Owner || !Current)
+            {
+                return ERROR_FILE_NOT_FOUND;
+            }
+            this->Erase(*Owner, Current);
+            return ERROR_SUCCESS;
+        }
+
+        /**
+         * @brief Gets the generation of the directory, which moves whenever
+         *        a channel of any watched type is added, changed or removed.
+         */
+        HV_UINT64 Generation() const
+        {
+            return m_Generation.load(std::memory_order_acquire);
+        }
+
+        /**
+         * @brief Gets the generation of an interface type, which moves
+         *        whenever a channel of the type is added, changed or
+         *        removed.
+         * @return The generation, or zero if the type is not watched.
+         * @remark This takes the lock to find the type, unlike Generation,
+         *         which is a single load.
+         */
+        HV_UINT64 TypeGeneration(
+            GUID const& InterfaceType) const
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            Watch* Owner = this->FindWatch(InterfaceType);
+            return Owner
+                ? Owner->Generation.load(std::memory_order_acquire)
+                : 0;
+        }
+
+        HV_UINT32 Count() const
+        {
+            std::lock_guard<std::mutex> Guard(m_Mutex);
+            return m_Registry.Count();
+        }
+
+        // The channels which were not added because the directory was full.
+        HV_UINT64 OverflowCount() const
+        {
+            return m_OverflowCount.load(std::memory_order_relaxed);
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_PIPEDIRECTORY
@@ -0,0 +1,949 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.PipeGpaDirect.h
+ * PURPOSE:    Definition for Hyper-V VMBus Pipe GPA Direct Buffers
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_PIPEGPADIRECT
+#define MILE_HYPERV_VMBUS_PIPEGPADIRECT
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus pipe GPA direct mode requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.GpaDirect.h"
+#include "Mile.HyperV.VMBus.PipeStream.h"
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_ACCESS_DENIED
+// A process has requested access to an object but has not been granted those
+// access rights.
+#define STATUS_ACCESS_DENIED ((NTSTATUS)0xC0000022L)
+#endif // !STATUS_ACCESS_DENIED
+
+#ifndef STATUS_NOT_FOUND
+// The object was not found.
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#endif // !STATUS_NOT_FOUND
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief The body of the VmPipeMessageIndicationComplete messages of a
+     *        GPA direct buffer.
+     * @remark The protocol does not document this body. This library sends
+     *         it from the registering endpoint to announce bytes of the
+     *         buffer, and back from the opposite endpoint once it is done
+     *         with them.
+     */
+    struct VmbusPipeGpaDirectIndication
+    {
+        HV_UINT32 Handle;
+        HV_UINT32 ByteCount;
+        HV_UINT64 ByteOffset;
+    };
+
+    /**
+     * @brief The number of indications a VmbusPipeGpaDirectBuffer keeps
+     *        outstanding at most.
+     */
+    const HV_UINT32 VmbusPipeGpaDirectMaximumOutstanding = 16;
+
+    /**
+     * @brief Reads the VMPIPE_PROTOCOL_HEADER of a pipe packet.
+     * @param Packet The packet.
+     * @param Header Receives the header.
+     * @param BodyOffset Receives the offset of the message body inside the
+     *                   packet.
+     * @return STATUS_SUCCESS, or STATUS_BAD_DATA if the packet is no pipe
+     *         packet or its body does not fit.
+     */
+    inline NTSTATUS VmbusPipeReadHeader(
+        VmbusRingPacket const& Packet,
+        VMPIPE_PROTOCOL_HEADER& Header,
+        HV_UINT32* BodyOffset)
+    {
+        HV_UINT32 Offset =
+            Packet.Descriptor().DataOffset8 * VmbusRingPacketAlignment;
+        if (Packet.Descriptor().Type != VmbusPacketTypeDataInBand ||
+            Packet.Copy(Offset, &Header, sizeof(Header)) != sizeof(Header))
+        {
+            return STATUS_BAD_DATA;
+        }
+        Offset += sizeof(Header);
+        HV_UINT32 DataSize = (Header.PacketType == VmPipeMessagePartial)
+            ? Header.Partial.DataSize
+            : Header.DataSize;
+        if (DataSize > Packet.Size() - Offset)
+        {
+            return STATUS_BAD_DATA;
+        }
+        *BodyOffset = Offset;
+        return STATUS_SUCCESS;
+    }
+
+    /**
+     * @brief Writes a pipe control message.
+     * @param Writer The VmbusRingWriter or VmbusRingMultiWriter.
+     * @param Type The message type.
+     * @param Body The body pieces.
+     * @param BodyCount The number of body pieces, at most 2.
+     * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+     * @return See VmbusRingWriter::WritePacket.
+     */
+    template<typename RingWriter>
+    NTSTATUS VmbusPipeWriteMessage(
+        RingWriter& Writer,
+        VMPIPE_PROTOCOL_MESSAGE_TYPE Type,
+        const VmbusRingSegment* Body,
+        std::size_t BodyCount,
+        bool* SignalRequired = nullptr)
+    {
+        if (BodyCount > 2)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        VMPIPE_PROTOCOL_HEADER Header;
+        Header.PacketType = Type;
+        Header.DataSize = 0;
+        VmbusRingSegment Segments[3] = { { &Header, sizeof(Header) } };
+        for (std::size_t i = 0; i < BodyCount; ++i)
+        {
+            Header.DataSize += Body[i].Size;
+            Segments[1 + i] = Body[i];
+        }
+        return Writer.WritePacket(
+            VmbusRingWriter::InBandDescriptor(VmbusPacketTypeDataInBand, 0, 0),
+            Segments,
+            1 + BodyCount,
+            SignalRequired);
+    }
+
+    /**
+     * @brief Writes a VmPipeMessageIndicationComplete message.
+     * @param Writer The VmbusRingWriter or VmbusRingMultiWriter.
+     * @param Indication The body.
+     * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+     * @return See VmbusRingWriter::WritePacket.
+     */
+    template<typename RingWriter>
+    NTSTATUS VmbusPipeWriteIndication(
+        RingWriter& Writer,
+        VmbusPipeGpaDirectIndication const& Indication,
+        bool* SignalRequired = nullptr)
+    {
+        VmbusRingSegment Segment = { &Indication, sizeof(Indication) };
+        return ::Mile::HyperV::VmbusPipeWriteMessage(
+            Writer,
+            VmPipeMessageIndicationComplete,
+            &Segment,
+            1,
+            SignalRequired);
+    }
+
+    /**
+     * @brief Reads the body of a VmPipeMessageIndicationComplete message.
+     * @param Packet The packet.
+     * @param Indication Receives the body.
+     * @return STATUS_SUCCESS, or STATUS_BAD_DATA if the packet is no such
+     *         message.
+     */
+    inline NTSTATUS VmbusPipeReadIndication(
+        VmbusRingPacket const& Packet,
+        VmbusPipeGpaDirectIndication& Indication)
+    {
+        VMPIPE_PROTOCOL_HEADER Header;
+        HV_UINT32 BodyOffset = 0;
+        NTSTATUS Status = ::Mile::HyperV::VmbusPipeReadHeader(
+            Packet,
+            Header,
+            &BodyOffset);
+        if (!NT_SUCCESS(Status))
+        {
+            return Status;
+        }
+        if (Header.PacketType != VmPipeMessageIndicationComplete ||
+            Header.DataSize < sizeof(Indication))
+        {
+            return STATUS_BAD_DATA;
+        }
+        Packet.Copy(BodyOffset, &Indication, sizeof(Indication));
+        return STATUS_SUCCESS;
+    }
+
+    /**
+     * @brief The registering side of a GPA direct buffer: a long-lived buffer
+     *        which the opposite endpoint accesses by reference, so bulk bytes
+     *        do not travel through the ring.
+     * @remark The buffer memory is owned by the caller. It must stay valid
+     *         and untouched by anything but the transfers the caller tracks
+     *         until Teardown succeeds.
+     */
+    class VmbusPipeGpaDirectBuffer
+    {
+    private:
+
+        HV_UINT32 m_Handle = 0;
+        HV_UINT64 m_Size = 0;
+        // The indications the opposite endpoint has not completed yet, in
+        // no particular order.
+        VmbusPipeGpaDirectIndication m_Pending[
+            VmbusPipeGpaDirectMaximumOutstanding] = {};
+        HV_UINT32 m_Outstanding = 0;
+        bool m_Registered = false;
+
+        /**
+         * @brief Gets the number of bytes a range list describes.
+         * @param Ranges The range list.
+         * @return The sum of the range sizes in bytes.
+         */
+        static HV_UINT64 DescribedSize(
+            VmbusGpaDirectBuilder const& Ranges)
+        {
+            HV_UINT64 ByteCount = 0;
+            HV_UINT32 Word = 0;
+            for (HV_UINT32 i = 0;
+                i < Ranges.RangeCount() && Word < Ranges.WordCount();
+                ++i)
+            {
+                GPA_RANGE Range;
+                std::memcpy(
+                    &Range,
+                    &Ranges.Words()[Word],
+                    VmbusGpadlWordSize);
+                VmbusGpadlRange Described =
+                {
+                    Range.ByteCount,
+                    Range.ByteOffset
+                };
+                Word += 1 + static_cast<HV_UINT32>(
+                    ::Mile::HyperV::VmbusGpadlRangePfnCount(Described));
+                ByteCount += Range.ByteCount;
+            }
+            return ByteCount;
+        }
+
+    public:
+
+        HV_UINT32 Handle() const
+        {
+            return m_Handle;
+        }
+
+        HV_UINT64 Size() const
+        {
+            return m_Size;
+        }
+
+        bool IsRegistered() const
+        {
+            return m_Registered;
+        }
+
+        /**
+         * @brief Gets the number of indications the opposite endpoint has not
+         *        completed yet.
+         * @return The number of outstanding indications.
+         */
+        HV_UINT32 Outstanding() const
+        {
+            return m_Outstanding;
+        }
+
+        /**
+         * @brief Registers the buffer with a VmPipeMessageSetupGpaDirect
+         *        message.
+         * @param Writer The VmbusRingWriter or VmbusRingMultiWriter.
+         * @param Handle The handle, chosen by the caller and unique among the
+         *               buffers registered on the pipe.
+         * @param IsWritable Whether the opposite endpoint may write to the
+         *                   buffer.
+         * @param Ranges The GPA ranges of the buffer, in buffer order.
+         * @param Size The size of the buffer in bytes, at most the bytes the
+         *             ranges describe.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         * @return See VmbusRingWriter::WritePacket,
+         *         STATUS_INVALID_DEVICE_STATE if the buffer is registered,
+         *         STATUS_INVALID_PARAMETER if Size exceeds the ranges, or
+         *         STATUS_BUFFER_OVERFLOW if the message body would exceed
+         *         VMPIPE_MAXIMUM_PIPE_PACKET_SIZE, in which case the buffer
+         *         is split into several registrations.
+         */
+        template<typename RingWriter>
+        NTSTATUS Register(
+            RingWriter& Writer,
+            HV_UINT32 Handle,
+            bool IsWritable,
+            VmbusGpaDirectBuilder const& Ranges,
+            HV_UINT64 Size,
+            bool* SignalRequired = nullptr)
+        {
+            if (m_Registered)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            if (!Ranges.RangeCount() ||
+                !Size ||
+                Size > VmbusPipeGpaDirectBuffer::DescribedSize(Ranges))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            if (offsetof(VMPIPE_SETUP_GPA_DIRECT_BODY, Range)
+                + static_cast<HV_UINT64>(Ranges.WordCount())
+                    * VmbusGpadlWordSize > VMPIPE_MAXIMUM_PIPE_PACKET_SIZE)
+            {
+                return STATUS_BUFFER_OVERFLOW;
+            }
+
+            // The fields in front of the flexible range array.
+            HV_UINT8 Fixed[offsetof(VMPIPE_SETUP_GPA_DIRECT_BODY, Range)] = {};
+            HV_UINT8 Writable = IsWritable ? 1 : 0;
+            HV_UINT32 RangeCount = Ranges.RangeCount();
+            std::memcpy(
+                Fixed + offsetof(VMPIPE_SETUP_GPA_DIRECT_BODY, Handle),
+                &Handle,
+                sizeof(Handle));
+            std::memcpy(
+                Fixed + offsetof(VMPIPE_SETUP_GPA_DIRECT_BODY, IsWritable),
+                &Writable,
+                sizeof(Writable));
+            std::memcpy(
+                Fixed + offsetof(VMPIPE_SETUP_GPA_DIRECT_BODY, RangeCount),
+                &RangeCount,
+                sizeof(RangeCount));
+            VmbusRingSegment Segments[2] =
+            {
+                { Fixed, sizeof(Fixed) },
+                { Ranges.Words(), Ranges.WordCount() * VmbusGpadlWordSize },
+            };
+            NTSTATUS Status = ::Mile::HyperV::VmbusPipeWriteMessage(
+                Writer,
+                VmPipeMessageSetupGpaDirect,
+                Segments,
+                2,
+                SignalRequired);
+            if (NT_SUCCESS(Status))
+            {
+                m_Handle = Handle;
+                m_Size = Size;
+                m_Outstanding = 0;
+                m_Registered = true;
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Hands bytes of the buffer to the opposite endpoint.
+         * @param Writer The VmbusRingWriter or VmbusRingMultiWriter.
+         * @param ByteOffset The offset of the bytes in the buffer.
+         * @param ByteCount The number of bytes.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         * @return See VmbusRingWriter::WritePacket, STATUS_INVALID_PARAMETER
+         *         if the bytes are outside the buffer, STATUS_DEVICE_BUSY if
+         *         VmbusPipeGpaDirectMaximumOutstanding indications are
+         *         outstanding, or STATUS_INVALID_DEVICE_STATE if it is not
+         *         registered.
+         * @remark The bytes must not be touched until the matching Complete.
+         */
+        template<typename RingWriter>
+        NTSTATUS Indicate(
+            RingWriter& Writer,
+            HV_UINT64 ByteOffset,
+            HV_UINT32 ByteCount,
+            bool* SignalRequired = nullptr)
+        {
+            if (!m_Registered)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            if (!ByteCount ||
+                ByteOffset > m_Size ||
+                ByteCount > m_Size - ByteOffset)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            if (m_Outstanding == VmbusPipeGpaDirectMaximumOutstanding)
+            {
+                return STATUS_DEVICE_BUSY;
+            }
+
+            VmbusPipeGpaDirectIndication Indication;
+            Indication.Handle = m_Handle;
+            Indication.ByteCount = ByteCount;
+            Indication.ByteOffset = ByteOffset;
+            NTSTATUS Status = ::Mile::HyperV::VmbusPipeWriteIndication(
+                Writer,
+                Indication,
+                SignalRequired);
+            if (NT_SUCCESS(Status))
+            {
+                m_Pending[m_Outstanding++] = Indication;
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Accounts for an indication the opposite endpoint completed.
+         * @param Indication The body of the completion, which echoes the
+         *                   indication it acknowledges.
+         * @return STATUS_SUCCESS, STATUS_NOT_FOUND if it belongs to another
+         *         buffer, or STATUS_INVALID_DEVICE_STATE if it matches no
+         *         outstanding indication, such as a duplicate completion.
+         */
+        NTSTATUS Complete(
+            VmbusPipeGpaDirectIndication const& Indication)
+        {
+            if (!m_Registered || Indication.Handle != m_Handle)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            for (HV_UINT32 i = 0; i < m_Outstanding; ++i)
+            {
+                if (m_Pending[i].ByteOffset == Indication.ByteOffset &&
+                    m_Pending[i].ByteCount == Indication.ByteCount)
+                {
+                    m_Pending[i] = m_Pending[--m_Outstanding];
+                    return STATUS_SUCCESS;
+                }
+            }
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+
+        /**
+         * @brief Revokes the registration with a
+         *        VmPipeMessageTeardownGpaDirect message.
+         * @param Writer The VmbusRingWriter or VmbusRingMultiWriter.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         * @return See VmbusRingWriter::WritePacket, STATUS_DEVICE_BUSY if
+         *         indications are outstanding, or STATUS_INVALID_DEVICE_STATE
+         *         if the buffer is not registered.
+         * @remark Once this succeeds the opposite endpoint no longer accepts
+         *         the handle, and the memory belongs to the caller again.
+         */
+        template<typename RingWriter>
+        NTSTATUS Teardown(
+            RingWriter& Writer,
+            bool* SignalRequired = nullptr)
+        {
+            if (!m_Registered)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            if (m_Outstanding)
+            {
+                return STATUS_DEVICE_BUSY;
+            }
+
+            VMPIPE_TEARDOWN_GPA_DIRECT_BODY Body;
+            Body.Handle = m_Handle;
+            VmbusRingSegment Segment = { &Body, sizeof(Body) };
+            NTSTATUS Status = ::Mile::HyperV::VmbusPipeWriteMessage(
+                Writer,
+                VmPipeMessageTeardownGpaDirect,
+                &Segment,
+                1,
+                SignalRequired);
+            if (NT_SUCCESS(Status))
+            {
+                m_Registered = false;
+            }
+            return Status;
+        }
+    };
+
+    /**
+     * @brief The accessing side of a GPA direct buffer, which keeps the range
+     *        list of a VmPipeMessageSetupGpaDirect message in caller storage
+     *        and copies bytes by buffer offset.
+     */
+    class VmbusPipeGpaDirectRegion
+    {
+    private:
+
+        HV_UINT64* m_Words = nullptr;
+        HV_UINT32 m_WordCapacity = 0;
+        HV_UINT32 m_RangeCount = 0;
+        HV_UINT32 m_Handle = 0;
+        bool m_IsWritable = false;
+        bool m_Loaded = false;
+        HV_UINT64 m_ByteCount = 0;
+
+    public:
+
+        /**
+         * @brief Initializes the region.
+         * @param Words The buffer which holds the range list.
+         * @param WordCapacity The number of 64-bit words in the buffer, which
+         *                     limits the buffers the region can describe.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            HV_UINT64* Words,
+            HV_UINT32 WordCapacity)
+        {
+            *this = VmbusPipeGpaDirectRegion();
+            if (!Words || !WordCapacity)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            m_Words = Words;
+            m_WordCapacity = WordCapacity;
+            return STATUS_SUCCESS;
+        }
+
+        HV_UINT32 Handle() const
+        {
+            return m_Handle;
+        }
+
+        bool IsWritable() const
+        {
+            return m_IsWritable;
+        }
+
+        bool IsLoaded() const
+        {
+            return m_Loaded;
+        }
+
+        /**
+         * @brief Gets the size of the buffer.
+         * @return The sum of the range sizes in bytes.
+         */
+        HV_UINT64 ByteCount() const
+        {
+            return m_ByteCount;
+        }
+
+        /**
+         * @brief Loads the buffer described by a VmPipeMessageSetupGpaDirect
+         *        message.
+         * @param Packet The packet.
+         * @return STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL if the range list
+         *         does not fit, STATUS_INVALID_DEVICE_STATE if a buffer is
+         *         loaded, or STATUS_BAD_DATA.
+         */
+        NTSTATUS Load(
+            VmbusRingPacket const& Packet)
+        {
+            if (!m_Words || m_Loaded)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+
+            VMPIPE_PROTOCOL_HEADER Header;
+            HV_UINT32 BodyOffset = 0;
+            NTSTATUS Status = ::Mile::HyperV::VmbusPipeReadHeader(
+                Packet,
+                Header,
+                &BodyOffset);
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+            const HV_UINT32 FixedSize =
+                offsetof(VMPIPE_SETUP_GPA_DIRECT_BODY, Range);
+            if (Header.PacketType != VmPipeMessageSetupGpaDirect ||
+                Header.DataSize < FixedSize ||
+                (Header.DataSize - FixedSize) % VmbusGpadlWordSize)
+            {
+                return STATUS_BAD_DATA;
+            }
+            HV_UINT32 WordCount =
+                (Header.DataSize - FixedSize) / VmbusGpadlWordSize;
+            if (WordCount > m_WordCapacity)
+            {
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+
+            // Work on private copies, the opposite endpoint can still write
+            // to the ring.
+            HV_UINT32 Handle = 0;
+            HV_UINT8 IsWritable = 0;
+            HV_UINT32 RangeCount = 0;
+            Packet.Copy(
+                BodyOffset + offsetof(VMPIPE_SETUP_GPA_DIRECT_BODY, Handle),
+                &Handle,
+                sizeof(Handle));
+            Packet.Copy(
+                BodyOffset
+                    + offsetof(VMPIPE_SETUP_GPA_DIRECT_BODY, IsWritable),
+                &IsWritable,
+                sizeof(IsWritable));
+            Packet.Copy(
+                BodyOffset
+                    + offsetof(VMPIPE_SETUP_GPA_DIRECT_BODY, RangeCount),
+                &RangeCount,
+                sizeof(RangeCount));
+            Packet.Copy(
+                BodyOffset + FixedSize,
+                m_Words,
+                WordCount * VmbusGpadlWordSize);
+
+            HV_UINT64 ByteCount = 0;
+            HV_UINT32 Word = 0;
+            for (HV_UINT32 i = 0; i < RangeCount; ++i)
+            {
+                if (Word == WordCount)
+                {
+                    return STATUS_BAD_DATA;
+                }
+                GPA_RANGE Range;
+                std::memcpy(&Range, &m_Words[Word], VmbusGpadlWordSize);
+                VmbusGpadlRange Checked = { Range.ByteCount, Range.ByteOffset };
+                if (!Range.ByteCount ||
+                    !NT_SUCCESS(::Mile::HyperV::VmbusGpadlValidateRange(
+                        Checked)))
+                {
+                    return STATUS_BAD_DATA;
+                }
+                HV_UINT64 PfnCount =
+                    ::Mile::HyperV::VmbusGpadlRangePfnCount(Checked);
+                if (PfnCount > WordCount - Word - 1)
+                {
+                    return STATUS_BAD_DATA;
+                }
+                Word += 1 + static_cast<HV_UINT32>(PfnCount);
+                ByteCount += Range.ByteCount;
+            }
+            if (!RangeCount || Word != WordCount)
+            {
+                return STATUS_BAD_DATA;
+            }
+
+            m_RangeCount = RangeCount;
+            m_Handle = Handle;
+            m_IsWritable = IsWritable != 0;
+            m_ByteCount = ByteCount;
+            m_Loaded = true;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Forgets the buffer, after a VmPipeMessageTeardownGpaDirect
+         *        message.
+         */
+        void Unload()
+        {
+            m_RangeCount = 0;
+            m_Handle = 0;
+            m_IsWritable = false;
+            m_Loaded = false;
+            m_ByteCount = 0;
+        }
+
+        /**
+         * @brief Walks bytes of the buffer in place.
+         * @param ByteOffset The offset of the bytes in the buffer.
+         * @param ByteCount The number of bytes.
+         * @param MapPage The callback which gets the local address of a page
+         *                as HV_UINT8* MapPage(HV_UINT64 Pfn), or nullptr if
+         *                the page is not accessible.
+         * @param OnSpan The callback which receives each run of bytes as
+         *               void OnSpan(HV_UINT8* Data, HV_UINT32 Size). Pages
+         *               which are adjacent in local memory are reported as
+         *               one run.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER if the bytes are
+         *         outside the buffer, STATUS_INVALID_DEVICE_STATE if nothing
+         *         is loaded, or STATUS_BAD_DATA if a page is not accessible,
+         *         in which case the runs before it were reported.
+         */
+        template<typename PageMapper, typename SpanCallback>
+        NTSTATUS ForEachSpan(
+            HV_UINT64 ByteOffset,
+            HV_UINT32 ByteCount,
+            PageMapper&& MapPage,
+            SpanCallback&& OnSpan) const
+        {
+            if (!m_Loaded)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            if (ByteOffset > m_ByteCount ||
+                ByteCount > m_ByteCount - ByteOffset)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            HV_UINT8* SpanData = nullptr;
+            HV_UINT32 SpanSize = 0;
+            HV_UINT32 Word = 0;
+            for (HV_UINT32 i = 0; i < m_RangeCount && ByteCount; ++i)
+            {
+                GPA_RANGE Range;
+                std::memcpy(&Range, &m_Words[Word], VmbusGpadlWordSize);
+                const HV_UINT64* Pfns = &m_Words[Word + 1];
+                Word += 1 + static_cast<HV_UINT32>(
+                    ::Mile::HyperV::VmbusGpadlRangePfnCount(
+                        { Range.ByteCount, Range.ByteOffset }));
+                if (ByteOffset >= Range.ByteCount)
+                {
+                    ByteOffset -= Range.ByteCount;
+                    continue;
+                }
+
+                HV_UINT64 Position = Range.ByteOffset + ByteOffset;
+                HV_UINT64 End =
+                    static_cast<HV_UINT64>(Range.ByteOffset) + Range.ByteCount;
+                ByteOffset = 0;
+                while (ByteCount && Position < End)
+                {
+                    HV_UINT32 InPage =
+                        static_cast<HV_UINT32>(Position % VmbusGpadlPageSize);
+                    HV_UINT64 Chunk = VmbusGpadlPageSize - InPage;
+                    if (Chunk > End - Position)
+                    {
+                        Chunk = End - Position;
+                    }
+                    if (Chunk > ByteCount)
+                    {
+                        Chunk = ByteCount;
+                    }
+                    HV_UINT8* Page = MapPage(
+                        Pfns[Position / VmbusGpadlPageSize]);
+                    if (!Page)
+                    {
+                        if (SpanSize)
+                        {
+                            OnSpan(SpanData, SpanSize);
+                        }
+                        return STATUS_BAD_DATA;
+                    }
+                    if (SpanSize && SpanData + SpanSize == Page + InPage)
+                    {
+                        SpanSize += static_cast<HV_UINT32>(Chunk);
+                    }
+                    else
+                    {
+                        if (SpanSize)
+                        {
+                            OnSpan(SpanData, SpanSize);
+                        }
+                        SpanData = Page + InPage;
+                        SpanSize = static_cast<HV_UINT32>(Chunk);
+                    }
+                    Position += Chunk;
+                    ByteCount -= static_cast<HV_UINT32>(Chunk);
+                }
+            }
+            if (SpanSize)
+            {
+                OnSpan(SpanData, SpanSize);
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Copies bytes out of the buffer.
+         * @param ByteOffset The offset of the bytes in the buffer.
+         * @param Destination The buffer which receives the bytes.
+         * @param ByteCount The number of bytes.
+         * @param MapPage See ForEachSpan.
+         * @return See ForEachSpan.
+         */
+        template<typename PageMapper>
+        NTSTATUS Read(
+            HV_UINT64 ByteOffset,
+            void* Destination,
+            HV_UINT32 ByteCount,
+            PageMapper&& MapPage) const
+        {
+            HV_UINT8* Cursor = reinterpret_cast<HV_UINT8*>(Destination);
+            return this->ForEachSpan(
+                ByteOffset,
+                ByteCount,
+                MapPage,
+                [&](HV_UINT8* Data, HV_UINT32 Size)
+            {
+                std::memcpy(Cursor, Data, Size);
+                Cursor += Size;
+            });
+        }
+
+        /**
+         * @brief Copies bytes into the buffer.
+         * @param ByteOffset The offset of the bytes in the buffer.
+         * @param Source The bytes.
+         * @param ByteCount The number of bytes.
+         * @param MapPage See ForEachSpan.
+         * @return See ForEachSpan, or STATUS_ACCESS_DENIED if the buffer was
+         *         registered read-only.
+         */
+        template<typename PageMapper>
+        NTSTATUS Write(
+            HV_UINT64 ByteOffset,
+            const void* Source,
+            HV_UINT32 ByteCount,
+            PageMapper&& MapPage) const
+        {
+            if (m_Loaded && !m_IsWritable)
+            {
+                return STATUS_ACCESS_DENIED;
+            }
+            const HV_UINT8* Cursor = reinterpret_cast<const HV_UINT8*>(Source);
+            return this->ForEachSpan(
+                ByteOffset,
+                ByteCount,
+                MapPage,
+                [&](HV_UINT8* Data, HV_UINT32 Size)
+            {
+                std::memcpy(Data, Cursor, Size);
+                Cursor += Size;
+            });
+        }
+    };
+
+    /**
+     * @brief The GPA direct buffers registered on one pipe, looked up by
+     *        handle.
+     * @remark Pipes register few long-lived buffers, so the regions are
+     *         searched linearly.
+     */
+    class VmbusPipeGpaDirectTable
+    {
+    private:
+
+        VmbusPipeGpaDirectRegion* m_Regions = nullptr;
+        HV_UINT32 m_RegionCount = 0;
+
+    public:
+
+        /**
+         * @brief Initializes the table.
+         * @param Regions The regions, each initialized with its own range list
+         *                storage.
+         * @param RegionCount The number of regions, which limits the buffers
+         *                    registered at the same time.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            VmbusPipeGpaDirectRegion* Regions,
+            HV_UINT32 RegionCount)
+        {
+            *this = VmbusPipeGpaDirectTable();
+            if (!Regions || !RegionCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            m_Regions = Regions;
+            m_RegionCount = RegionCount;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Looks a registered buffer up.
+         * @param Handle The handle.
+         * @return The region, or nullptr if the handle is not registered.
+         */
+        VmbusPipeGpaDirectRegion* Find(
+            HV_UINT32 Handle) const
+        {
+            for (HV_UINT32 i = 0; i < m_RegionCount; ++i)
+            {
+                if (m_Regions[i].IsLoaded() &&
+                    m_Regions[i].Handle() == Handle)
+                {
+                    return &m_Regions[i];
+                }
+            }
+            return nullptr;
+        }
+
+        /**
+         * @brief Registers the buffer of a VmPipeMessageSetupGpaDirect
+         *        message.
+         * @param Packet The packet.
+         * @return See VmbusPipeGpaDirectRegion::Load, or
+         *         STATUS_INSUFFICIENT_RESOURCES if every region is in use, or
+         *         STATUS_INVALID_PARAMETER if the handle is registered.
+         */
+        NTSTATUS Setup(
+            VmbusRingPacket const& Packet)
+        {
+            for (HV_UINT32 i = 0; i < m_RegionCount; ++i)
+            {
+                VmbusPipeGpaDirectRegion& Region = m_Regions[i];
+                if (Region.IsLoaded())
+                {
+                    continue;
+                }
+                NTSTATUS Status = Region.Load(Packet);
+                if (!NT_SUCCESS(Status))
+                {
+                    return Status;
+                }
+                for (HV_UINT32 j = 0; j < m_RegionCount; ++j)
+                {
+                    if (j != i &&
+                        m_Regions[j].IsLoaded() &&
+                        m_Regions[j].Handle() == Region.Handle())
+                    {
+                        Region.Unload();
+                        return STATUS_INVALID_PARAMETER;
+                    }
+                }
+                return STATUS_SUCCESS;
+            }
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        /**
+         * @brief Unregisters the buffer of a VmPipeMessageTeardownGpaDirect
+         *        message.
+         * @param Packet The packet.
+         * @return STATUS_SUCCESS, STATUS_NOT_FOUND if the handle is not
+         *         registered, or STATUS_BAD_DATA.
+         */
+        NTSTATUS Teardown(
+            VmbusRingPacket const& Packet)
+        {
+            VMPIPE_PROTOCOL_HEADER Header;
+            HV_UINT32 BodyOffset = 0;
+            NTSTATUS Status = ::Mile::HyperV::VmbusPipeReadHeader(
+                Packet,
+                Header,
+                &BodyOffset);
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+            VMPIPE_TEARDOWN_GPA_DIRECT_BODY Body;
+            if (Header.PacketType != VmPipeMessageTeardownGpaDirect ||
+                Header.DataSize < sizeof(Body))
+            {
+                return STATUS_BAD_DATA;
+            }
+            Packet.Copy(BodyOffset, &Body, sizeof(Body));
+            VmbusPipeGpaDirectRegion* Region = this->Find(Body.Handle);
+            if (!Region)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            Region->Unload();
+            return STATUS_SUCCESS;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_PIPEGPADIRECT
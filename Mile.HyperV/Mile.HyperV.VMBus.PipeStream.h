@@ -0,0 +1,494 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.PipeStream.h
+ * PURPOSE:    Definition for Hyper-V VMBus Pipe Byte Stream Reader and Writer
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+// References
+// - OpenVMM
+//   - vm\devices\vmbus\vmbus_async\src\pipe.rs
+
+#ifndef MILE_HYPERV_VMBUS_PIPESTREAM
+#define MILE_HYPERV_VMBUS_PIPESTREAM
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus pipe stream requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.Ring.h"
+
+#include <cstddef>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_END_OF_FILE
+// The end-of-file marker has been reached. There is no valid data in the file
+// beyond this marker.
+#define STATUS_END_OF_FILE ((NTSTATUS)0xC0000011L)
+#endif // !STATUS_END_OF_FILE
+
+namespace Mile::HyperV
+{
+    // The bytes in front of the data of every pipe packet.
+    const HV_UINT32 VmbusPipePacketOverhead =
+        sizeof(VMPACKET_DESCRIPTOR) + sizeof(VMPIPE_PROTOCOL_HEADER);
+
+    // The largest data size a partially consumed packet can describe.
+    const HV_UINT32 VmbusPipeMaximumPartialDataSize = 0xFFFF;
+
+    // The number of buffer pieces gathered into one pipe packet.
+    const HV_UINT32 VmbusPipeMaximumSegments = 16;
+
+    /**
+     * @brief A piece of caller memory which receives stream bytes.
+     */
+    struct VmbusPipeBuffer
+    {
+        void* Buffer;
+        HV_UINT32 Size;
+    };
+
+    /**
+     * @brief Writes a byte stream into a pipe ring, splitting it into
+     *        VmPipeMessageData packets of up to VMPIPE_MAXIMUM_PIPE_PACKET_SIZE
+     *        bytes.
+     */
+    class VmbusPipeStreamWriter : public VmbusRingWriter
+    {
+    private:
+
+        HV_UINT32 m_MaximumPacketDataSize = VMPIPE_MAXIMUM_PIPE_PACKET_SIZE;
+
+    public:
+
+        VmbusPipeStreamWriter() = default;
+
+        explicit VmbusPipeStreamWriter(
+            VmbusRing const& Ring) :
+            VmbusRingWriter(Ring)
+        {
+        }
+
+        /**
+         * @brief Writes as many bytes as the ring has room for, gathering them
+         *        from several buffers.
+         * @param Buffers The buffers, written in order.
+         * @param BufferCount The number of buffers.
+         * @param BytesWritten Receives the number of bytes written.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket. It
+         *                       is set if any packet needs a signal.
+         * @return STATUS_SUCCESS if at least one byte or every byte was
+         *         written, STATUS_INSUFFICIENT_RESOURCES if the ring is full,
+         *         or STATUS_BAD_DATA.
+         * @remark When the ring can not hold a whole packet, a shorter packet
+         *         is written to fill it, as a stream has no message
+         *         boundaries to keep.
+         */
+        NTSTATUS Writev(
+            const VmbusRingSegment* Buffers,
+            std::size_t BufferCount,
+            HV_UINT32* BytesWritten,
+            bool* SignalRequired = nullptr)
+        {
+            *BytesWritten = 0;
+            if (SignalRequired)
+            {
+                *SignalRequired = false;
+            }
+
+            std::size_t Index = 0;
+            HV_UINT32 Offset = 0;
+            NTSTATUS Status = STATUS_SUCCESS;
+            for (;;)
+            {
+                while (Index < BufferCount && Offset == Buffers[Index].Size)
+                {
+                    ++Index;
+                    Offset = 0;
+                }
+                if (Index == BufferCount)
+                {
+                    break;
+                }
+
+                // Keep the free space strictly larger than the packet.
+                HV_UINT32 Available = this->BytesAvailable();
+                HV_UINT32 Overhead =
+                    VmbusPipePacketOverhead + VmbusRingTrailerSize;
+                if (Available <= Overhead + VmbusRingPacketAlignment)
+                {
+                    Status = STATUS_INSUFFICIENT_RESOURCES;
+                    break;
+                }
+                HV_UINT32 Limit = (Available - 1 - Overhead)
+                    & ~(VmbusRingPacketAlignment - 1);
+                if (Limit > m_MaximumPacketDataSize)
+                {
+                    Limit = m_MaximumPacketDataSize;
+                }
+
+                VMPIPE_PROTOCOL_HEADER Header;
+                Header.PacketType = VmPipeMessageData;
+                Header.DataSize = 0;
+                VmbusRingSegment Segments[1 + VmbusPipeMaximumSegments];
+                Segments[0] = { &Header, sizeof(Header) };
+                std::size_t SegmentCount = 1;
+                std::size_t NextIndex = Index;
+                HV_UINT32 NextOffset = Offset;
+                while (Header.DataSize < Limit &&
+                    NextIndex < BufferCount &&
+                    SegmentCount < 1 + VmbusPipeMaximumSegments)
+                {
+                    HV_UINT32 Size = Buffers[NextIndex].Size - NextOffset;
+                    if (Size > Limit - Header.DataSize)
+                    {
+                        Size = Limit - Header.DataSize;
+                    }
+                    if (Size)
+                    {
+                        Segments[SegmentCount].Buffer =
+                            reinterpret_cast<const HV_UINT8*>(
+                                Buffers[NextIndex].Buffer) + NextOffset;
+                        Segments[SegmentCount].Size = Size;
+                        ++SegmentCount;
+                        Header.DataSize += Size;
+                        NextOffset += Size;
+                    }
+                    if (NextOffset == Buffers[NextIndex].Size)
+                    {
+                        ++NextIndex;
+                        NextOffset = 0;
+                    }
+                }
+
+                bool Signal = false;
+                Status = this->WritePacket(
+                    VmbusRingWriter::InBandDescriptor(
+                        VmbusPacketTypeDataInBand,
+                        0,
+                        0),
+                    Segments,
+                    SegmentCount,
+                    &Signal);
+                if (!NT_SUCCESS(Status))
+                {
+                    break;
+                }
+                if (SignalRequired && Signal)
+                {
+                    *SignalRequired = true;
+                }
+                *BytesWritten += Header.DataSize;
+                Index = NextIndex;
+                Offset = NextOffset;
+            }
+
+            if (Status == STATUS_INSUFFICIENT_RESOURCES && *BytesWritten)
+            {
+                return STATUS_SUCCESS;
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Writes as many bytes as the ring has room for.
+         * @param Buffer The bytes.
+         * @param Size The number of bytes.
+         * @param BytesWritten See Writev.
+         * @param SignalRequired Optional. See Writev.
+         * @return See Writev.
+         */
+        NTSTATUS Write(
+            const void* Buffer,
+            HV_UINT32 Size,
+            HV_UINT32* BytesWritten,
+            bool* SignalRequired = nullptr)
+        {
+            VmbusRingSegment Segment = { Buffer, Size };
+            return this->Writev(&Segment, 1, BytesWritten, SignalRequired);
+        }
+
+        /**
+         * @brief Writes an empty VmPipeMessageData packet, which tells the
+         *        reader no more bytes follow.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         * @return See VmbusRingWriter::WritePacket.
+         */
+        NTSTATUS Shutdown(
+            bool* SignalRequired = nullptr)
+        {
+            VMPIPE_PROTOCOL_HEADER Header;
+            Header.PacketType = VmPipeMessageData;
+            Header.DataSize = 0;
+            VmbusRingSegment Segment = { &Header, sizeof(Header) };
+            return this->WritePacket(
+                VmbusRingWriter::InBandDescriptor(
+                    VmbusPacketTypeDataInBand,
+                    0,
+                    0),
+                &Segment,
+                1,
+                SignalRequired);
+        }
+    };
+
+    /**
+     * @brief Reads a byte stream from a pipe ring, copying across packet
+     *        boundaries and leaving partially read packets in the ring as
+     *        VmPipeMessagePartial, with Partial.Offset recording the bytes
+     *        already read.
+     * @remark Keeping the read position in the ring instead of in the reader
+     *         means any reader of the ring resumes at the right byte.
+     */
+    class VmbusPipeStreamReader : public VmbusRingReader
+    {
+    private:
+
+        bool m_EndOfStream = false;
+
+    public:
+
+        VmbusPipeStreamReader() = default;
+
+        explicit VmbusPipeStreamReader(
+            VmbusRing const& Ring) :
+            VmbusRingReader(Ring)
+        {
+        }
+
+        /**
+         * @brief Checks whether the writer has shut down the stream and every
+         *        byte before that was read.
+         * @return true if the end of the stream was reached.
+         */
+        bool IsEndOfStream() const
+        {
+            return m_EndOfStream;
+        }
+
+        /**
+         * @brief Reads the bytes available, scattering them over several
+         *        buffers, and consumes the packets fully read with a single
+         *        Out update.
+         * @param Buffers The buffers, filled in order.
+         * @param BufferCount The number of buffers.
+         * @param BytesRead Receives the number of bytes read.
+         * @param SignalRequired Optional. See VmbusRingReader::Read.
+         * @return STATUS_SUCCESS if at least one byte was read or all the
+         *         buffers are empty, STATUS_NO_MORE_ENTRIES if the ring is
+         *         empty, STATUS_END_OF_FILE if the stream ended, or
+         *         STATUS_BAD_DATA if the ring holds something other than pipe
+         *         data.
+         */
+        NTSTATUS Readv(
+            const VmbusPipeBuffer* Buffers,
+            std::size_t BufferCount,
+            HV_UINT32* BytesRead,
+            bool* SignalRequired = nullptr)
+        {
+            *BytesRead = 0;
+            if (SignalRequired)
+            {
+                *SignalRequired = false;
+            }
+            if (m_EndOfStream)
+            {
+                return STATUS_END_OF_FILE;
+            }
+
+            VmbusRing const& Ring = this->Ring();
+            PVMRCB Control = Ring.Control();
+            HV_UINT32 In = ::Mile::HyperV::VmbusRingLoadAcquire(Control->In);
+            HV_UINT32 OldOut =
+                ::Mile::HyperV::VmbusRingLoadRelaxed(Control->Out);
+            HV_UINT32 Out = OldOut;
+
+            std::size_t Index = 0;
+            HV_UINT32 Offset = 0;
+            NTSTATUS Status = STATUS_SUCCESS;
+            for (;;)
+            {
+                while (Index < BufferCount && Offset == Buffers[Index].Size)
+                {
+                    ++Index;
+                    Offset = 0;
+                }
+                if (Index == BufferCount)
+                {
+                    break;
+                }
+
+                VMPACKET_DESCRIPTOR Descriptor;
+                HV_UINT32 Size = 0;
+                Status = this->PeekAt(In, Out, Descriptor, Size);
+                if (Status == STATUS_NO_MORE_ENTRIES)
+                {
+                    HV_UINT32 LatestIn = ::Mile::HyperV::VmbusRingLoadAcquire(
+                        Control->In);
+                    if (LatestIn == In)
+                    {
+                        break;
+                    }
+                    In = LatestIn;
+                    continue;
+                }
+                if (!NT_SUCCESS(Status))
+                {
+                    break;
+                }
+
+                // Read the pipe header once, the writer can still scribble
+                // over it.
+                HV_UINT32 HeaderOffset =
+                    Descriptor.DataOffset8 * VmbusRingPacketAlignment;
+                VMPIPE_PROTOCOL_HEADER Header;
+                if (Descriptor.Type != VmbusPacketTypeDataInBand ||
+                    Size - HeaderOffset < sizeof(Header))
+                {
+                    Status = STATUS_BAD_DATA;
+                    break;
+                }
+                Ring.CopyFromRing(
+                    Ring.Advance(Out, HeaderOffset),
+                    &Header,
+                    sizeof(Header));
+                HV_UINT32 DataSize = 0;
+                HV_UINT32 Consumed = 0;
+                if (Header.PacketType == VmPipeMessageData)
+                {
+                    DataSize = Header.DataSize;
+                }
+                else if (Header.PacketType == VmPipeMessagePartial)
+                {
+                    DataSize = Header.Partial.DataSize;
+                    Consumed = Header.Partial.Offset;
+                }
+                else
+                {
+                    Status = STATUS_BAD_DATA;
+                    break;
+                }
+                HV_UINT32 DataOffset = HeaderOffset + sizeof(Header);
+                if (DataSize > Size - DataOffset ||
+                    DataSize > VmbusPipeMaximumPartialDataSize ||
+                    Consumed > DataSize ||
+                    (Consumed && !DataSize))
+                {
+                    Status = STATUS_BAD_DATA;
+                    break;
+                }
+                if (!DataSize)
+                {
+                    // The writer shut the stream down.
+                    m_EndOfStream = true;
+                    Out = Ring.Advance(Out, Size + VmbusRingTrailerSize);
+                    break;
+                }
+
+                HV_UINT32 DataCursor = Ring.Advance(
+                    Out,
+                    DataOffset + Consumed);
+                while (Consumed < DataSize && Index < BufferCount)
+                {
+                    HV_UINT32 Chunk = Buffers[Index].Size - Offset;
+                    if (Chunk > DataSize - Consumed)
+                    {
+                        Chunk = DataSize - Consumed;
+                    }
+                    DataCursor = Ring.CopyFromRing(
+                        DataCursor,
+                        reinterpret_cast<HV_UINT8*>(
+                            Buffers[Index].Buffer) + Offset,
+                        Chunk);
+                    Consumed += Chunk;
+                    Offset += Chunk;
+                    *BytesRead += Chunk;
+                    while (Index < BufferCount &&
+                        Offset == Buffers[Index].Size)
+                    {
+                        ++Index;
+                        Offset = 0;
+                    }
+                }
+
+                if (Consumed < DataSize)
+                {
+                    // The packet still belongs to the reader, so the read
+                    // position is stored in place.
+                    VMPIPE_PROTOCOL_HEADER Partial;
+                    Partial.PacketType = VmPipeMessagePartial;
+                    Partial.Partial.DataSize = static_cast<HV_UINT16>(DataSize);
+                    Partial.Partial.Offset = static_cast<HV_UINT16>(Consumed);
+                    Ring.CopyToRing(
+                        Ring.Advance(Out, HeaderOffset),
+                        &Partial,
+                        sizeof(Partial));
+                    break;
+                }
+                Out = Ring.Advance(Out, Size + VmbusRingTrailerSize);
+            }
+
+            bool Signal = false;
+            if (Out != OldOut)
+            {
+                Signal = this->PublishOut(OldOut, Out);
+            }
+            if (SignalRequired)
+            {
+                *SignalRequired = Signal;
+            }
+
+            if (Status == STATUS_BAD_DATA)
+            {
+                // Hand out the good bytes first, the broken packet stays in
+                // the ring and is reported by the next call.
+                return *BytesRead ? STATUS_SUCCESS : STATUS_BAD_DATA;
+            }
+            if (*BytesRead || Index == BufferCount)
+            {
+                return STATUS_SUCCESS;
+            }
+            return m_EndOfStream ? STATUS_END_OF_FILE : STATUS_NO_MORE_ENTRIES;
+        }
+
+        /**
+         * @brief Reads the bytes available.
+         * @param Buffer The buffer which receives the bytes.
+         * @param Size The size of the buffer in bytes.
+         * @param BytesRead See Readv.
+         * @param SignalRequired Optional. See Readv.
+         * @return See Readv.
+         */
+        NTSTATUS Read(
+            void* Buffer,
+            HV_UINT32 Size,
+            HV_UINT32* BytesRead,
+            bool* SignalRequired = nullptr)
+        {
+            VmbusPipeBuffer Piece = { Buffer, Size };
+            return this->Readv(&Piece, 1, BytesRead, SignalRequired);
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_PIPESTREAM
@@ -0,0 +1,243 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.Polling.h
+ * PURPOSE:    Definition for Hyper-V VMBus Ring Buffer Hybrid Polling Receiver
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_POLLING
+#define MILE_HYPERV_VMBUS_POLLING
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus polling receiver requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.Ring.h"
+
+#include <chrono>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief The counters of a VmbusRingPoller.
+     */
+    struct VmbusRingPollCounters
+    {
+        // The number of times the In index was checked while busy polling.
+        HV_UINT64 Polls;
+        // The number of times packets arrived inside the polling window, so
+        // the writer saw InterruptMask set and did not have to signal.
+        HV_UINT64 InterruptsAvoided;
+        // The number of times the receiver blocked and was woken up.
+        HV_UINT64 Wakeups;
+    };
+
+    /**
+     * @brief Receives from a ring by busy polling the In index for a window
+     *        after each packet, and only re-arming the interrupt and
+     *        blocking once the window expires.
+     * @remark In adaptive mode the window follows the halt polling policy:
+     *         it grows when a wakeup arrives shortly after blocking, which
+     *         polling longer would have caught, and shrinks when blocking
+     *         lasts longer than the maximum window.
+     */
+    class VmbusRingPoller
+    {
+    private:
+
+        // The first non-zero window used when growing from zero.
+        static constexpr std::chrono::nanoseconds GrowStart =
+            std::chrono::microseconds(2);
+
+        VmbusRingReader& m_Reader;
+        std::chrono::nanoseconds m_PollWindow;
+        std::chrono::nanoseconds m_MaximumPollWindow;
+        bool m_Adaptive;
+        VmbusRingPollCounters m_Counters = {};
+
+        /**
+         * @brief Spins on the In index until data arrives or the window
+         *        expires.
+         * @return true if data arrived.
+         */
+        bool Spin()
+        {
+            if (m_PollWindow.count() <= 0)
+            {
+                return false;
+            }
+            std::chrono::steady_clock::time_point Deadline =
+                std::chrono::steady_clock::now() + m_PollWindow;
+            do
+            {
+                ++m_Counters.Polls;
+                if (m_Reader.BytesAvailable())
+                {
+                    ++m_Counters.InterruptsAvoided;
+                    return true;
+                }
+                ::Mile::HyperV::VmbusRingCpuRelax();
+            } while (std::chrono::steady_clock::now() < Deadline);
+            return false;
+        }
+
+        void Adapt(
+            std::chrono::nanoseconds Blocked)
+        {
+            if (!m_Adaptive)
+            {
+                return;
+            }
+            if (Blocked <= m_MaximumPollWindow)
+            {
+                // A slightly longer window would have caught this packet.
+                m_PollWindow = (m_PollWindow < GrowStart)
+                    ? GrowStart
+                    : m_PollWindow * 2;
+                if (m_PollWindow > m_MaximumPollWindow)
+                {
+                    m_PollWindow = m_MaximumPollWindow;
+                }
+            }
+            else
+            {
+                // The channel is idle, polling is only burning processor.
+                m_PollWindow /= 2;
+                if (m_PollWindow < GrowStart)
+                {
+                    m_PollWindow = std::chrono::nanoseconds::zero();
+                }
+            }
+        }
+
+    public:
+
+        /**
+         * @brief Creates a poller over a ring reader.
+         * @param Reader The reader, which must outlive the poller and must
+         *               only be used through the poller.
+         * @param PollWindow The time to poll after the ring runs empty. Zero
+         *                   means pure interrupt driven receiving.
+         * @param MaximumPollWindow Optional. If non-zero, the window is
+         *                          auto-tuned between zero and this value,
+         *                          starting at PollWindow.
+         */
+        VmbusRingPoller(
+            VmbusRingReader& Reader,
+            std::chrono::nanoseconds PollWindow,
+            std::chrono::nanoseconds MaximumPollWindow =
+                std::chrono::nanoseconds::zero()) :
+            m_Reader(Reader),
+            m_PollWindow(PollWindow),
+            m_MaximumPollWindow(MaximumPollWindow),
+            m_Adaptive(MaximumPollWindow.count() > 0)
+        {
+            if (m_Adaptive && m_PollWindow > m_MaximumPollWindow)
+            {
+                m_PollWindow = m_MaximumPollWindow;
+            }
+        }
+
+        /**
+         * @brief Gets the current polling window, which changes over time in
+         *        adaptive mode.
+         * @return The polling window.
+         */
+        std::chrono::nanoseconds PollWindow() const
+        {
+            return m_PollWindow;
+        }
+
+        VmbusRingPollCounters const& Counters() const
+        {
+            return m_Counters;
+        }
+
+        void ResetCounters()
+        {
+            m_Counters = {};
+        }
+
+        /**
+         * @brief Waits until at least one packet is available and consumes a
+         *        batch of packets with interrupts masked.
+         * @param OnPacket See VmbusRingReader::ReadBatch.
+         * @param Wait The callback invoked as bool Wait() to block until the
+         *             writer signals. Returning false aborts the receive.
+         * @param MaximumPackets The maximum number of packets to consume.
+         * @param PacketCount Optional. Receives the number of packets
+         *                    consumed.
+         * @param SignalRequired Optional. See VmbusRingReader::Read.
+         * @return STATUS_SUCCESS, STATUS_MORE_ENTRIES, STATUS_BAD_DATA, or
+         *         STATUS_CANCELLED if Wait returned false.
+         * @remark Interrupts stay masked between calls while the channel is
+         *         busy, so the writer does not signal for those packets.
+         */
+        template<typename PacketCallback, typename WaitCallback>
+        NTSTATUS Receive(
+            PacketCallback&& OnPacket,
+            WaitCallback&& Wait,
+            HV_UINT32 MaximumPackets,
+            HV_UINT32* PacketCount = nullptr,
+            bool* SignalRequired = nullptr)
+        {
+            if (PacketCount)
+            {
+                *PacketCount = 0;
+            }
+
+            for (;;)
+            {
+                m_Reader.DisableInterrupts();
+                if (m_Reader.BytesAvailable() || this->Spin())
+                {
+                    return m_Reader.ReadBatch(
+                        OnPacket,
+                        MaximumPackets,
+                        0xFFFFFFFF,
+                        PacketCount,
+                        SignalRequired);
+                }
+
+                // Unmask, then re-check, so a packet published before the
+                // unmask is not left waiting for a signal that never comes.
+                if (m_Reader.EnableInterrupts())
+                {
+                    continue;
+                }
+
+                std::chrono::steady_clock::time_point Start =
+                    std::chrono::steady_clock::now();
+                if (!Wait())
+                {
+                    return STATUS_CANCELLED;
+                }
+                ++m_Counters.Wakeups;
+                this->Adapt(std::chrono::steady_clock::now() - Start);
+            }
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_POLLING
@@ -0,0 +1,1759 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.Ring.h
+ * PURPOSE:    Definition for Hyper-V VMBus Ring Buffer Engine
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+// References
+// - OpenVMM
+//   - vm\devices\vmbus\vmbus_ring\src\lib.rs
+
+#ifndef MILE_HYPERV_VMBUS_RING
+#define MILE_HYPERV_VMBUS_RING
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus ring engine requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.Guest.Protocols.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <span>
+
+#if defined(_M_AMD64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_NO_MORE_ENTRIES
+// No more entries are available from an enumeration operation.
+#define STATUS_NO_MORE_ENTRIES ((NTSTATUS)0x8000001AL)
+#endif // !STATUS_NO_MORE_ENTRIES
+
+#ifndef STATUS_MORE_ENTRIES
+// Returned by enumeration APIs to indicate more information is available to
+// successive calls.
+#define STATUS_MORE_ENTRIES ((NTSTATUS)0x00000105L)
+#endif // !STATUS_MORE_ENTRIES
+
+namespace Mile::HyperV
+{
+    // The VMRCB lives in a dedicated page in front of the ring data pages.
+    const HV_UINT32 VmbusRingControlPageSize = 0x1000;
+
+    // Every packet and its trailer start on an 8-byte boundary in the ring.
+    const HV_UINT32 VmbusRingPacketAlignment = 8;
+
+    // Every packet is followed by a PREVIOUS_PACKET_OFFSET trailer.
+    const HV_UINT32 VmbusRingTrailerSize = sizeof(PREVIOUS_PACKET_OFFSET);
+
+    // The largest packet VMPACKET_DESCRIPTOR::Length8 is able to describe.
+    const HV_UINT32 VmbusRingMaximumPacketSize = 0xFFFF * 8;
+
+    // The largest packet, trailer included, which WriteBatch lays out once on
+    // the stack instead of filling every copy piece by piece.
+    const HV_UINT32 VmbusRingBatchImageSize = 256;
+
+    /**
+     * @brief Rounds a packet size up to the ring packet alignment.
+     * @param Size The unaligned size in bytes.
+     * @return The aligned size in bytes.
+     */
+    constexpr HV_UINT32 VmbusRingAlignSize(
+        HV_UINT32 Size)
+    {
+        return (Size + (VmbusRingPacketAlignment - 1))
+            & ~(VmbusRingPacketAlignment - 1);
+    }
+
+    /**
+     * @brief Reads a ring index published by the opposite endpoint with
+     *        acquire semantics, so the bytes it covers are visible.
+     * @param Value The ring index in the VMRCB.
+     * @return The current value of the ring index.
+     */
+    inline HV_UINT32 VmbusRingLoadAcquire(
+        HV_UINT32 volatile const& Value)
+    {
+        return std::atomic_ref<HV_UINT32>(
+            const_cast<HV_UINT32&>(Value)).load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Reads a ring field without ordering constraints.
+     * @param Value The field in the VMRCB.
+     * @return The current value of the field.
+     */
+    inline HV_UINT32 VmbusRingLoadRelaxed(
+        HV_UINT32 volatile const& Value)
+    {
+        return std::atomic_ref<HV_UINT32>(
+            const_cast<HV_UINT32&>(Value)).load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Publishes a ring index with release semantics, so the bytes it
+     *        covers are visible before the index itself.
+     * @param Value The ring index in the VMRCB.
+     * @param NewValue The new value of the ring index.
+     */
+    inline void VmbusRingStoreRelease(
+        HV_UINT32 volatile& Value,
+        HV_UINT32 NewValue)
+    {
+        std::atomic_ref<HV_UINT32>(
+            const_cast<HV_UINT32&>(Value)).store(
+                NewValue,
+                std::memory_order_release);
+    }
+
+    /**
+     * @brief Writes a ring field without ordering constraints.
+     * @param Value The field in the VMRCB.
+     * @param NewValue The new value of the field.
+     */
+    inline void VmbusRingStoreRelaxed(
+        HV_UINT32 volatile& Value,
+        HV_UINT32 NewValue)
+    {
+        std::atomic_ref<HV_UINT32>(
+            const_cast<HV_UINT32&>(Value)).store(
+                NewValue,
+                std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Tells the processor the caller is spinning on a ring index.
+     */
+    inline void VmbusRingCpuRelax()
+    {
+#if defined(_M_AMD64) || defined(_M_IX86)
+        ::_mm_pause();
+#elif defined(_M_ARM64) && defined(_MSC_VER)
+        ::__yield();
+#elif defined(_M_ARM64)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    /**
+     * @brief A contiguous piece of packet payload used for gather writes.
+     */
+    struct VmbusRingSegment
+    {
+        const void* Buffer;
+        HV_UINT32 Size;
+    };
+
+    /**
+     * @brief A view of one direction of a VMBus channel, which is a VMRCB
+     *        followed by the ring data area. It does not own the memory, so
+     *        it works over guest pages, GPADL mappings or a plain shared
+     *        memory region alike.
+     */
+    class VmbusRing
+    {
+    private:
+
+        PVMRCB m_Control = nullptr;
+        PHV_UINT8 m_Data = nullptr;
+        HV_UINT32 m_DataSize = 0;
+        bool m_Mirrored = false;
+
+    public:
+
+        VmbusRing() = default;
+
+        /**
+         * @brief Creates a view over a separately located control block and
+         *        data area.
+         * @param Control The ring control block.
+         * @param Data The ring data area.
+         * @param DataSize The size of the ring data area in bytes, which must
+         *                 be a non-zero multiple of the packet alignment.
+         * @param Mirrored Whether the data pages are mapped a second time
+         *                 right after the data area, which makes every packet
+         *                 contiguous in memory.
+         */
+        VmbusRing(
+            PVMRCB Control,
+            PHV_UINT8 Data,
+            HV_UINT32 DataSize,
+            bool Mirrored = false) :
+            m_Control(Control),
+            m_Data(Data),
+            m_DataSize(DataSize),
+            m_Mirrored(Mirrored)
+        {
+        }
+
+        /**
+         * @brief Attaches the view to a memory region laid out like a VMBus
+         *        ring buffer, a control page followed by the data pages.
+         * @param Buffer The beginning of the memory region.
+         * @param BufferSize The size of the memory region in bytes, without
+         *                   the mirror mapping.
+         * @param Mirrored Whether the data pages are mapped a second time
+         *                 right after the memory region.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            void* Buffer,
+            std::size_t BufferSize,
+            bool Mirrored = false)
+        {
+            if (!Buffer || BufferSize <= VmbusRingControlPageSize)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            std::size_t DataSize = BufferSize - VmbusRingControlPageSize;
+            if (DataSize % VmbusRingPacketAlignment ||
+                DataSize > 0x80000000)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            m_Control = reinterpret_cast<PVMRCB>(Buffer);
+            m_Data = reinterpret_cast<PHV_UINT8>(Buffer)
+                + VmbusRingControlPageSize;
+            m_DataSize = static_cast<HV_UINT32>(DataSize);
+            m_Mirrored = Mirrored;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Resets the control block to the empty ring state. Only the
+         *        endpoint which allocates the ring should do this, before the
+         *        ring is shared with the opposite endpoint.
+         * @param SupportsPendingSendSize Whether this endpoint honors the
+         *                                PendingSendSize protocol.
+         */
+        void Reset(
+            bool SupportsPendingSendSize = false)
+        {
+            std::memset(m_Control, 0, sizeof(VMRCB));
+            m_Control->FeatureBits.SupportsPendingSendSize =
+                SupportsPendingSendSize ? 1 : 0;
+        }
+
+        bool IsValid() const
+        {
+            return m_Control && m_Data && m_DataSize;
+        }
+
+        PVMRCB Control() const
+        {
+            return m_Control;
+        }
+
+        PHV_UINT8 Data() const
+        {
+            return m_Data;
+        }
+
+        HV_UINT32 DataSize() const
+        {
+            return m_DataSize;
+        }
+
+        bool IsMirrored() const
+        {
+            return m_Mirrored;
+        }
+
+        /**
+         * @brief Gets direct access to bytes in the ring.
+         * @param Offset The index of the bytes.
+         * @param Size The number of bytes.
+         * @return The bytes, or nullptr if they wrap around the end of a ring
+         *         which is not mirrored.
+         */
+        PHV_UINT8 Contiguous(
+            HV_UINT32 Offset,
+            HV_UINT32 Size) const
+        {
+            if (m_Mirrored || Size <= m_DataSize - Offset)
+            {
+                return m_Data + Offset;
+            }
+            return nullptr;
+        }
+
+        /**
+         * @brief Checks whether an index read from the control block is
+         *        usable. The opposite endpoint is not trusted.
+         * @param Offset The index to check.
+         * @return true if the index is inside the ring and aligned.
+         */
+        bool IsValidOffset(
+            HV_UINT32 Offset) const
+        {
+            return Offset < m_DataSize
+                && !(Offset % VmbusRingPacketAlignment);
+        }
+
+        /**
+         * @brief Moves an index forward with wrap-around.
+         * @param Offset The index to move, which must be inside the ring.
+         * @param Bytes The distance in bytes, which must not exceed the size
+         *              of the ring data area.
+         * @return The new index.
+         */
+        HV_UINT32 Advance(
+            HV_UINT32 Offset,
+            HV_UINT32 Bytes) const
+        {
+            Offset += Bytes;
+            if (Offset >= m_DataSize)
+            {
+                Offset -= m_DataSize;
+            }
+            return Offset;
+        }
+
+        /**
+         * @brief Gets the number of bytes between the Out and In indexes.
+         * @param In The In index.
+         * @param Out The Out index.
+         * @return The number of bytes written but not consumed yet.
+         */
+        HV_UINT32 BytesToRead(
+            HV_UINT32 In,
+            HV_UINT32 Out) const
+        {
+            return (In >= Out) ? (In - Out) : (m_DataSize - Out + In);
+        }
+
+        /**
+         * @brief Gets the number of free bytes. A writer needs strictly more
+         *        free bytes than it writes, since In equal to Out means the
+         *        ring is empty.
+         * @param In The In index.
+         * @param Out The Out index.
+         * @return The number of free bytes.
+         */
+        HV_UINT32 BytesToWrite(
+            HV_UINT32 In,
+            HV_UINT32 Out) const
+        {
+            return m_DataSize - this->BytesToRead(In, Out);
+        }
+
+        /**
+         * @brief Copies bytes into the ring with wrap-around.
+         * @param Offset The index to copy to.
+         * @param Source The bytes to copy.
+         * @param Size The number of bytes to copy.
+         * @return The index after the copied bytes.
+         */
+        HV_UINT32 CopyToRing(
+            HV_UINT32 Offset,
+            const void* Source,
+            HV_UINT32 Size) const
+        {
+            HV_UINT32 Tail = m_DataSize - Offset;
+            if (m_Mirrored || Size <= Tail)
+            {
+                std::memcpy(m_Data + Offset, Source, Size);
+            }
+            else
+            {
+                std::memcpy(m_Data + Offset, Source, Tail);
+                std::memcpy(
+                    m_Data,
+                    reinterpret_cast<const HV_UINT8*>(Source) + Tail,
+                    Size - Tail);
+            }
+            return this->Advance(Offset, Size);
+        }
+
+        /**
+         * @brief Copies bytes out of the ring with wrap-around.
+         * @param Offset The index to copy from.
+         * @param Destination The buffer which receives the bytes.
+         * @param Size The number of bytes to copy.
+         * @return The index after the copied bytes.
+         */
+        HV_UINT32 CopyFromRing(
+            HV_UINT32 Offset,
+            void* Destination,
+            HV_UINT32 Size) const
+        {
+            HV_UINT32 Tail = m_DataSize - Offset;
+            if (m_Mirrored || Size <= Tail)
+            {
+                std::memcpy(Destination, m_Data + Offset, Size);
+            }
+            else
+            {
+                std::memcpy(Destination, m_Data + Offset, Tail);
+                std::memcpy(
+                    reinterpret_cast<HV_UINT8*>(Destination) + Tail,
+                    m_Data,
+                    Size - Tail);
+            }
+            return this->Advance(Offset, Size);
+        }
+    };
+
+    /**
+     * @brief The single producer of one VMBus ring direction. It owns the In
+     *        index and must not be used from more than one thread at a time.
+     */
+    class VmbusRingWriter
+    {
+    private:
+
+        VmbusRing m_Ring;
+        bool m_PendingSendArmed = false;
+
+    public:
+
+        VmbusRingWriter() = default;
+
+        explicit VmbusRingWriter(
+            VmbusRing const& Ring) :
+            m_Ring(Ring)
+        {
+        }
+
+        VmbusRing const& Ring() const
+        {
+            return m_Ring;
+        }
+
+        /**
+         * @brief Gets the number of free bytes as seen by the writer.
+         * @return The number of free bytes.
+         */
+        HV_UINT32 BytesAvailable() const
+        {
+            PVMRCB Control = m_Ring.Control();
+            return m_Ring.BytesToWrite(
+                ::Mile::HyperV::VmbusRingLoadRelaxed(Control->In),
+                ::Mile::HyperV::VmbusRingLoadAcquire(Control->Out));
+        }
+
+        /**
+         * @brief Writes a packet and publishes it to the reader.
+         * @param Descriptor The packet descriptor. The Length8 field is
+         *                   computed from the segments and ignored here. The
+         *                   DataOffset8 field must account for any extended
+         *                   header the caller places in the first segments.
+         * @param Segments The bytes which follow the descriptor.
+         * @param SegmentCount The number of segments.
+         * @param SignalRequired Optional. Receives whether the reader is
+         *                       waiting for an interrupt, which happens when
+         *                       the ring was empty and InterruptMask is zero.
+         * @return STATUS_SUCCESS, STATUS_INSUFFICIENT_RESOURCES if the ring is
+         *         full, STATUS_INVALID_PARAMETER if the packet can never fit,
+         *         or STATUS_BAD_DATA if the reader corrupted the Out index.
+         */
+        NTSTATUS WritePacket(
+            VMPACKET_DESCRIPTOR const& Descriptor,
+            const VmbusRingSegment* Segments,
+            std::size_t SegmentCount,
+            bool* SignalRequired = nullptr)
+        {
+            if (SignalRequired)
+            {
+                *SignalRequired = false;
+            }
+
+            HV_UINT32 PacketSize = 0;
+            NTSTATUS Status = VmbusRingWriter::MeasurePacket(
+                m_Ring,
+                Descriptor,
+                Segments,
+                SegmentCount,
+                &PacketSize);
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+            HV_UINT32 TotalSize = PacketSize + VmbusRingTrailerSize;
+
+            PVMRCB Control = m_Ring.Control();
+            HV_UINT32 In = ::Mile::HyperV::VmbusRingLoadRelaxed(Control->In);
+            HV_UINT32 Out = ::Mile::HyperV::VmbusRingLoadAcquire(Control->Out);
+            if (!m_Ring.IsValidOffset(In) || !m_Ring.IsValidOffset(Out))
+            {
+                return STATUS_BAD_DATA;
+            }
+            if (m_Ring.BytesToWrite(In, Out) <= TotalSize)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            HV_UINT32 Offset = VmbusRingWriter::FillPacket(
+                m_Ring,
+                In,
+                Descriptor,
+                Segments,
+                SegmentCount,
+                PacketSize);
+
+            ::Mile::HyperV::VmbusRingStoreRelease(Control->In, Offset);
+
+            if (SignalRequired)
+            {
+                *SignalRequired = VmbusRingWriter::IsSignalRequired(
+                    Control,
+                    In);
+            }
+
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Validates a packet and computes its size in the ring.
+         * @param Ring The ring the packet is written to.
+         * @param Descriptor See WritePacket.
+         * @param Segments See WritePacket.
+         * @param SegmentCount See WritePacket.
+         * @param PacketSize Receives the aligned packet size, descriptor
+         *                   included and trailer excluded.
+         * @return STATUS_SUCCESS, or STATUS_INVALID_PARAMETER if the packet
+         *         can never fit.
+         */
+        static NTSTATUS MeasurePacket(
+            VmbusRing const& Ring,
+            VMPACKET_DESCRIPTOR const& Descriptor,
+            const VmbusRingSegment* Segments,
+            std::size_t SegmentCount,
+            HV_UINT32* PacketSize)
+        {
+            HV_UINT64 RawSize = sizeof(VMPACKET_DESCRIPTOR);
+            for (std::size_t i = 0; i < SegmentCount; ++i)
+            {
+                RawSize += Segments[i].Size;
+            }
+            if (RawSize > VmbusRingMaximumPacketSize)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            HV_UINT32 AlignedSize = ::Mile::HyperV::VmbusRingAlignSize(
+                static_cast<HV_UINT32>(RawSize));
+            if (Descriptor.DataOffset8 * VmbusRingPacketAlignment
+                > AlignedSize)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            if (AlignedSize + VmbusRingTrailerSize >= Ring.DataSize())
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            *PacketSize = AlignedSize;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Writes the descriptor, payload, padding and trailer of a
+         *        packet without publishing it.
+         * @param Ring The ring the packet is written to.
+         * @param Offset The index the packet starts at.
+         * @param Descriptor See WritePacket.
+         * @param Segments See WritePacket.
+         * @param SegmentCount See WritePacket.
+         * @param PacketSize The size returned by MeasurePacket.
+         * @return The index after the trailer.
+         */
+        static HV_UINT32 FillPacket(
+            VmbusRing const& Ring,
+            HV_UINT32 Offset,
+            VMPACKET_DESCRIPTOR const& Descriptor,
+            const VmbusRingSegment* Segments,
+            std::size_t SegmentCount,
+            HV_UINT32 PacketSize)
+        {
+            static const HV_UINT8 Padding[VmbusRingPacketAlignment] = {};
+
+            VMPACKET_DESCRIPTOR Header = Descriptor;
+            Header.Length8 = static_cast<HV_UINT16>(
+                PacketSize / VmbusRingPacketAlignment);
+            HV_UINT32 Start = Offset;
+            HV_UINT32 RawSize = sizeof(Header);
+            Offset = Ring.CopyToRing(Offset, &Header, sizeof(Header));
+            for (std::size_t i = 0; i < SegmentCount; ++i)
+            {
+                if (Segments[i].Size)
+                {
+                    Offset = Ring.CopyToRing(
+                        Offset,
+                        Segments[i].Buffer,
+                        Segments[i].Size);
+                    RawSize += Segments[i].Size;
+                }
+            }
+            HV_UINT32 PaddingSize = PacketSize - RawSize;
+            if (PaddingSize)
+            {
+                Offset = Ring.CopyToRing(Offset, Padding, PaddingSize);
+            }
+            PREVIOUS_PACKET_OFFSET Trailer;
+            Trailer.Reserved = 0;
+            Trailer.Offset = Start;
+            return Ring.CopyToRing(Offset, &Trailer, sizeof(Trailer));
+        }
+
+        /**
+         * @brief Checks whether the reader must be signaled after publishing
+         *        the In index.
+         * @param Control The VMRCB of the ring.
+         * @param OldIn The In index before the publication.
+         * @return true if the ring was empty and InterruptMask is zero.
+         */
+        static bool IsSignalRequired(
+            PVMRCB Control,
+            HV_UINT32 OldIn)
+        {
+            // The In publication must be ordered before the InterruptMask
+            // and Out reads, otherwise a reader which is about to sleep can
+            // be missed.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return !::Mile::HyperV::VmbusRingLoadRelaxed(
+                Control->InterruptMask) &&
+                OldIn == ::Mile::HyperV::VmbusRingLoadRelaxed(Control->Out);
+        }
+
+        /**
+         * @brief Writes an in-band data packet.
+         * @param Type The packet type, usually VmbusPacketTypeDataInBand or
+         *             VmbusPacketTypeCompletion.
+         * @param Flags The packet flags.
+         * @param TransactionId The transaction ID.
+         * @param Buffer The payload.
+         * @param Size The size of the payload in bytes.
+         * @param SignalRequired Optional. See WritePacket.
+         * @return See WritePacket.
+         */
+        NTSTATUS Write(
+            HV_UINT16 Type,
+            HV_UINT16 Flags,
+            HV_UINT64 TransactionId,
+            const void* Buffer,
+            HV_UINT32 Size,
+            bool* SignalRequired = nullptr)
+        {
+            VmbusRingSegment Segment = { Buffer, Size };
+            return this->WritePacket(
+                VmbusRingWriter::InBandDescriptor(Type, Flags, TransactionId),
+                &Segment,
+                1,
+                SignalRequired);
+        }
+
+        /**
+         * @brief Writes packets which only differ in their transaction IDs
+         *        back to back, and publishes them with a single In update.
+         * @param Descriptor The descriptor shared by the packets. The
+         *                   TransactionId field is ignored.
+         * @param GetTransactionId The callback invoked as
+         *                         HV_UINT64 GetTransactionId(HV_UINT32 Index)
+         *                         for every packet written.
+         * @param Segments The bytes which follow every descriptor.
+         * @param SegmentCount The number of segments.
+         * @param PacketCount The number of packets to write.
+         * @param WrittenCount Receives the number of packets written, which
+         *                     is less than PacketCount if the ring fills up.
+         * @param SignalRequired Optional. See WritePacket. It is set at most
+         *                       once for the whole batch.
+         * @return See WritePacket. STATUS_INSUFFICIENT_RESOURCES is only
+         *         returned if no packet fits.
+         */
+        template<typename TransactionIdCallback>
+        NTSTATUS WriteBatch(
+            VMPACKET_DESCRIPTOR const& Descriptor,
+            TransactionIdCallback&& GetTransactionId,
+            const VmbusRingSegment* Segments,
+            std::size_t SegmentCount,
+            HV_UINT32 PacketCount,
+            HV_UINT32* WrittenCount,
+            bool* SignalRequired = nullptr)
+        {
+            *WrittenCount = 0;
+            if (SignalRequired)
+            {
+                *SignalRequired = false;
+            }
+            if (!PacketCount)
+            {
+                return STATUS_SUCCESS;
+            }
+
+            HV_UINT32 PacketSize = 0;
+            NTSTATUS Status = VmbusRingWriter::MeasurePacket(
+                m_Ring,
+                Descriptor,
+                Segments,
+                SegmentCount,
+                &PacketSize);
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+            HV_UINT32 TotalSize = PacketSize + VmbusRingTrailerSize;
+
+            PVMRCB Control = m_Ring.Control();
+            HV_UINT32 In = ::Mile::HyperV::VmbusRingLoadRelaxed(Control->In);
+            HV_UINT32 Out = ::Mile::HyperV::VmbusRingLoadAcquire(Control->Out);
+            if (!m_Ring.IsValidOffset(In) || !m_Ring.IsValidOffset(Out))
+            {
+                return STATUS_BAD_DATA;
+            }
+            // The free space must stay strictly larger than what is written,
+            // as in WritePacket.
+            HV_UINT32 Available = m_Ring.BytesToWrite(In, Out);
+            HV_UINT32 Count = Available ? (Available - 1) / TotalSize : 0;
+            if (!Count)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            if (Count > PacketCount)
+            {
+                Count = PacketCount;
+            }
+
+            VMPACKET_DESCRIPTOR Header = Descriptor;
+            HV_UINT32 Offset = In;
+            HV_UINT8 Image[VmbusRingBatchImageSize];
+            if (TotalSize <= sizeof(Image))
+            {
+                // Small packets, such as completions, are laid out once and
+                // copied with a single copy each, patching only the
+                // transaction ID and the trailer.
+                VmbusRing ImageRing(nullptr, Image, sizeof(Image));
+                VmbusRingWriter::FillPacket(
+                    ImageRing,
+                    0,
+                    Header,
+                    Segments,
+                    SegmentCount,
+                    PacketSize);
+                for (HV_UINT32 i = 0; i < Count; ++i)
+                {
+                    HV_UINT64 TransactionId = GetTransactionId(i);
+                    std::memcpy(
+                        Image + offsetof(VMPACKET_DESCRIPTOR, TransactionId),
+                        &TransactionId,
+                        sizeof(TransactionId));
+                    PREVIOUS_PACKET_OFFSET Trailer;
+                    Trailer.Reserved = 0;
+                    Trailer.Offset = Offset;
+                    std::memcpy(Image + PacketSize, &Trailer, sizeof(Trailer));
+                    Offset = m_Ring.CopyToRing(Offset, Image, TotalSize);
+                }
+            }
+            else
+            {
+                for (HV_UINT32 i = 0; i < Count; ++i)
+                {
+                    Header.TransactionId = GetTransactionId(i);
+                    Offset = VmbusRingWriter::FillPacket(
+                        m_Ring,
+                        Offset,
+                        Header,
+                        Segments,
+                        SegmentCount,
+                        PacketSize);
+                }
+            }
+
+            ::Mile::HyperV::VmbusRingStoreRelease(Control->In, Offset);
+
+            if (SignalRequired)
+            {
+                *SignalRequired = VmbusRingWriter::IsSignalRequired(
+                    Control,
+                    In);
+            }
+
+            *WrittenCount = Count;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Builds the descriptor of an in-band packet.
+         * @param Type The packet type.
+         * @param Flags The packet flags.
+         * @param TransactionId The transaction ID.
+         * @return The descriptor, whose Length8 is filled by WritePacket.
+         */
+        static VMPACKET_DESCRIPTOR InBandDescriptor(
+            HV_UINT16 Type,
+            HV_UINT16 Flags,
+            HV_UINT64 TransactionId)
+        {
+            VMPACKET_DESCRIPTOR Descriptor;
+            Descriptor.Type = Type;
+            Descriptor.DataOffset8 = static_cast<HV_UINT16>(
+                sizeof(VMPACKET_DESCRIPTOR) / VmbusRingPacketAlignment);
+            Descriptor.Length8 = 0;
+            Descriptor.Flags = Flags;
+            Descriptor.TransactionId = TransactionId;
+            return Descriptor;
+        }
+
+        /**
+         * @brief Writes a packet, or records the space it needs in
+         *        PendingSendSize when the ring is full, so the reader signals
+         *        once enough space is free and the caller does not need to
+         *        spin.
+         * @param Descriptor See WritePacket.
+         * @param Segments See WritePacket.
+         * @param SegmentCount See WritePacket.
+         * @param SignalRequired Optional. See WritePacket.
+         * @return See WritePacket. STATUS_PENDING means the ring is full and
+         *         the reader has been asked to signal, after which the caller
+         *         should try again. STATUS_INSUFFICIENT_RESOURCES is still
+         *         returned if the reader does not support PendingSendSize.
+         */
+        NTSTATUS WritePacketOrArm(
+            VMPACKET_DESCRIPTOR const& Descriptor,
+            const VmbusRingSegment* Segments,
+            std::size_t SegmentCount,
+            bool* SignalRequired = nullptr)
+        {
+            PVMRCB Control = m_Ring.Control();
+
+            for (;;)
+            {
+                NTSTATUS Status = this->WritePacket(
+                    Descriptor,
+                    Segments,
+                    SegmentCount,
+                    SignalRequired);
+                if (Status != STATUS_INSUFFICIENT_RESOURCES)
+                {
+                    if (m_PendingSendArmed)
+                    {
+                        this->CancelPendingSend();
+                    }
+                    return Status;
+                }
+                if (!Control->FeatureBits.SupportsPendingSendSize)
+                {
+                    return Status;
+                }
+
+                HV_UINT32 TotalSize = VmbusRingTrailerSize;
+                TotalSize += ::Mile::HyperV::VmbusRingAlignSize(
+                    sizeof(VMPACKET_DESCRIPTOR));
+                for (std::size_t i = 0; i < SegmentCount; ++i)
+                {
+                    TotalSize += Segments[i].Size;
+                }
+                TotalSize = ::Mile::HyperV::VmbusRingAlignSize(TotalSize);
+
+                // Readers compare with either > or >=, so ask for one byte
+                // more than the packet needs to make both sufficient.
+                ::Mile::HyperV::VmbusRingStoreRelaxed(
+                    Control->PendingSendSize,
+                    TotalSize + 1);
+                m_PendingSendArmed = true;
+
+                // The PendingSendSize store must be ordered before the Out
+                // load, which pairs with the fence after the Out store in the
+                // reader. Space freed before the reader saw PendingSendSize
+                // is caught by this re-check instead of a signal.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (this->BytesAvailable() <= TotalSize)
+                {
+                    return STATUS_PENDING;
+                }
+            }
+        }
+
+        /**
+         * @brief Writes a packet and sleeps while the ring is full, using the
+         *        PendingSendSize protocol.
+         * @param Descriptor See WritePacket.
+         * @param Segments See WritePacket.
+         * @param SegmentCount See WritePacket.
+         * @param Wait The callback invoked as bool Wait() to sleep until the
+         *             reader signals. It returns false to give up.
+         * @param SignalRequired Optional. See WritePacket.
+         * @return See WritePacketOrArm, or STATUS_IO_TIMEOUT if Wait gave up.
+         */
+        template<typename WaitCallback>
+        NTSTATUS WritePacketWait(
+            VMPACKET_DESCRIPTOR const& Descriptor,
+            const VmbusRingSegment* Segments,
+            std::size_t SegmentCount,
+            WaitCallback&& Wait,
+            bool* SignalRequired = nullptr)
+        {
+            for (;;)
+            {
+                NTSTATUS Status = this->WritePacketOrArm(
+                    Descriptor,
+                    Segments,
+                    SegmentCount,
+                    SignalRequired);
+                if (Status != STATUS_PENDING)
+                {
+                    return Status;
+                }
+                if (!Wait())
+                {
+                    this->CancelPendingSend();
+                    return STATUS_IO_TIMEOUT;
+                }
+            }
+        }
+
+        /**
+         * @brief Withdraws the request made by WritePacketOrArm.
+         */
+        void CancelPendingSend()
+        {
+            ::Mile::HyperV::VmbusRingStoreRelaxed(
+                m_Ring.Control()->PendingSendSize,
+                0);
+            m_PendingSendArmed = false;
+        }
+    };
+
+    /**
+     * @brief A producer of one VMBus ring direction which is safe to use from
+     *        many threads at once. Producers reserve space with an atomic
+     *        ticket, fill their packets in parallel and publish the In index
+     *        in reservation order, so the ring contents are laid out exactly
+     *        as VmbusRingWriter lays them out.
+     * @remark A producer which is preempted between its reservation and its
+     *         publication delays the publication of later packets, but not
+     *         their copies, so producers should not outnumber the processors
+     *         they run on. The multi-producer writer owns the In index, so it
+     *         must not be mixed with a VmbusRingWriter on the same ring.
+     */
+    class VmbusRingMultiWriter
+    {
+    private:
+
+        VmbusRing m_Ring;
+        // The end of the last reservation, as an absolute byte position.
+        std::atomic<HV_UINT64> m_Reserved = 0;
+        // The position up to which the In index is published.
+        std::atomic<HV_UINT64> m_Published = 0;
+
+        HV_UINT32 PositionToOffset(
+            HV_UINT64 Position) const
+        {
+            return static_cast<HV_UINT32>(Position % m_Ring.DataSize());
+        }
+
+    public:
+
+        VmbusRingMultiWriter() = default;
+
+        explicit VmbusRingMultiWriter(
+            VmbusRing const& Ring) :
+            m_Ring(Ring)
+        {
+            HV_UINT32 In = ::Mile::HyperV::VmbusRingLoadRelaxed(
+                Ring.Control()->In);
+            m_Reserved.store(In, std::memory_order_relaxed);
+            m_Published.store(In, std::memory_order_relaxed);
+        }
+
+        VmbusRingMultiWriter(VmbusRingMultiWriter const&) = delete;
+        VmbusRingMultiWriter& operator=(VmbusRingMultiWriter const&) = delete;
+
+        VmbusRing const& Ring() const
+        {
+            return m_Ring;
+        }
+
+        /**
+         * @brief Writes a packet and publishes it to the reader once every
+         *        earlier reservation is published.
+         * @param Descriptor See VmbusRingWriter::WritePacket.
+         * @param Segments See VmbusRingWriter::WritePacket.
+         * @param SegmentCount See VmbusRingWriter::WritePacket.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         * @return See VmbusRingWriter::WritePacket.
+         */
+        NTSTATUS WritePacket(
+            VMPACKET_DESCRIPTOR const& Descriptor,
+            const VmbusRingSegment* Segments,
+            std::size_t SegmentCount,
+            bool* SignalRequired = nullptr)
+        {
+            if (SignalRequired)
+            {
+                *SignalRequired = false;
+            }
+
+            HV_UINT32 PacketSize = 0;
+            NTSTATUS Status = VmbusRingWriter::MeasurePacket(
+                m_Ring,
+                Descriptor,
+                Segments,
+                SegmentCount,
+                &PacketSize);
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+            HV_UINT32 TotalSize = PacketSize + VmbusRingTrailerSize;
+
+            // Reserve the space. Everything between Out and the reservation
+            // end counts as used, published or not.
+            PVMRCB Control = m_Ring.Control();
+            HV_UINT64 Start = m_Reserved.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                HV_UINT32 Out = ::Mile::HyperV::VmbusRingLoadAcquire(
+                    Control->Out);
+                if (!m_Ring.IsValidOffset(Out))
+                {
+                    return STATUS_BAD_DATA;
+                }
+                if (m_Ring.BytesToWrite(this->PositionToOffset(Start), Out)
+                    > TotalSize)
+                {
+                    if (m_Reserved.compare_exchange_weak(
+                        Start,
+                        Start + TotalSize,
+                        std::memory_order_relaxed,
+                        std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                    continue;
+                }
+                // The reservation end may be stale, in which case Out can
+                // already be past it and the free space looks wrong.
+                HV_UINT64 Current = m_Reserved.load(std::memory_order_relaxed);
+                if (Current == Start)
+                {
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+                Start = Current;
+            }
+
+            HV_UINT32 In = this->PositionToOffset(Start);
+            HV_UINT32 NewIn = VmbusRingWriter::FillPacket(
+                m_Ring,
+                In,
+                Descriptor,
+                Segments,
+                SegmentCount,
+                PacketSize);
+
+            // Wait for the earlier reservations, whose packets this
+            // publication makes visible as well. Sleep after a short spin,
+            // so a preempted producer gets the processor back.
+            HV_UINT32 Spins = 0;
+            for (;;)
+            {
+                HV_UINT64 Published = m_Published.load(
+                    std::memory_order_acquire);
+                if (Published == Start)
+                {
+                    break;
+                }
+                if (++Spins < 64)
+                {
+                    ::Mile::HyperV::VmbusRingCpuRelax();
+                }
+                else
+                {
+                    m_Published.wait(Published, std::memory_order_acquire);
+                }
+            }
+            ::Mile::HyperV::VmbusRingStoreRelease(Control->In, NewIn);
+            m_Published.store(Start + TotalSize, std::memory_order_release);
+            m_Published.notify_all();
+
+            if (SignalRequired)
+            {
+                *SignalRequired = VmbusRingWriter::IsSignalRequired(
+                    Control,
+                    In);
+            }
+
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Writes an in-band data packet.
+         * @param Type See VmbusRingWriter::Write.
+         * @param Flags See VmbusRingWriter::Write.
+         * @param TransactionId See VmbusRingWriter::Write.
+         * @param Buffer See VmbusRingWriter::Write.
+         * @param Size See VmbusRingWriter::Write.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         * @return See VmbusRingWriter::WritePacket.
+         */
+        NTSTATUS Write(
+            HV_UINT16 Type,
+            HV_UINT16 Flags,
+            HV_UINT64 TransactionId,
+            const void* Buffer,
+            HV_UINT32 Size,
+            bool* SignalRequired = nullptr)
+        {
+            VmbusRingSegment Segment = { Buffer, Size };
+            return this->WritePacket(
+                VmbusRingWriter::InBandDescriptor(Type, Flags, TransactionId),
+                &Segment,
+                1,
+                SignalRequired);
+        }
+    };
+
+    /**
+     * @brief A packet handed out by a batched drain. It refers to the ring
+     *        memory directly and is only valid inside the drain callback.
+     */
+    class VmbusRingPacket
+    {
+    private:
+
+        VmbusRing const* m_Ring = nullptr;
+        HV_UINT32 m_Offset = 0;
+        HV_UINT32 m_Size = 0;
+        VMPACKET_DESCRIPTOR m_Descriptor = {};
+
+    public:
+
+        VmbusRingPacket() = default;
+
+        VmbusRingPacket(
+            VmbusRing const& Ring,
+            HV_UINT32 Offset,
+            HV_UINT32 Size,
+            VMPACKET_DESCRIPTOR const& Descriptor) :
+            m_Ring(&Ring),
+            m_Offset(Offset),
+            m_Size(Size),
+            m_Descriptor(Descriptor)
+        {
+        }
+
+        VMPACKET_DESCRIPTOR const& Descriptor() const
+        {
+            return m_Descriptor;
+        }
+
+        /**
+         * @brief Gets the index of the packet in the ring data area.
+         * @return The index of the packet descriptor.
+         */
+        HV_UINT32 Offset() const
+        {
+            return m_Offset;
+        }
+
+        /**
+         * @brief Gets the packet size without the trailer.
+         * @return The packet size in bytes, descriptor included.
+         */
+        HV_UINT32 Size() const
+        {
+            return m_Size;
+        }
+
+        /**
+         * @brief Gets the payload size, which is the packet size after
+         *        DataOffset8.
+         * @return The payload size in bytes.
+         */
+        HV_UINT32 PayloadSize() const
+        {
+            return m_Size
+                - m_Descriptor.DataOffset8 * VmbusRingPacketAlignment;
+        }
+
+        /**
+         * @brief Copies part of the packet with wrap-around.
+         * @param PacketOffset The offset inside the packet to copy from.
+         * @param Buffer The buffer which receives the bytes.
+         * @param Size The number of bytes to copy.
+         * @return The number of bytes copied, which is clipped to the end of
+         *         the packet.
+         */
+        HV_UINT32 Copy(
+            HV_UINT32 PacketOffset,
+            void* Buffer,
+            HV_UINT32 Size) const
+        {
+            if (PacketOffset >= m_Size)
+            {
+                return 0;
+            }
+            if (Size > m_Size - PacketOffset)
+            {
+                Size = m_Size - PacketOffset;
+            }
+            m_Ring->CopyFromRing(
+                m_Ring->Advance(m_Offset, PacketOffset),
+                Buffer,
+                Size);
+            return Size;
+        }
+
+        /**
+         * @brief Copies the payload which follows DataOffset8.
+         * @param Buffer The buffer which receives the payload.
+         * @param BufferSize The size of the buffer in bytes.
+         * @return The number of bytes copied.
+         */
+        HV_UINT32 CopyPayload(
+            void* Buffer,
+            HV_UINT32 BufferSize) const
+        {
+            return this->Copy(
+                m_Descriptor.DataOffset8 * VmbusRingPacketAlignment,
+                Buffer,
+                BufferSize);
+        }
+
+        /**
+         * @brief Gets the whole packet in place, descriptor included.
+         * @return The packet bytes, or an empty span if the packet wraps
+         *         around the end of a ring which is not mirrored.
+         * @remark The opposite endpoint can still write to the ring, so
+         *         fields other than the validated descriptor copy must be
+         *         read once and checked before use.
+         */
+        std::span<const HV_UINT8> Bytes() const
+        {
+            const HV_UINT8* Data = m_Ring->Contiguous(m_Offset, m_Size);
+            if (!Data)
+            {
+                return {};
+            }
+            return std::span<const HV_UINT8>(Data, m_Size);
+        }
+
+        /**
+         * @brief Gets the payload which follows DataOffset8 in place.
+         * @return The payload bytes, or an empty span, see Bytes.
+         */
+        std::span<const HV_UINT8> Payload() const
+        {
+            std::span<const HV_UINT8> Packet = this->Bytes();
+            if (Packet.empty())
+            {
+                return {};
+            }
+            return Packet.subspan(
+                m_Descriptor.DataOffset8 * VmbusRingPacketAlignment);
+        }
+
+        /**
+         * @brief Gets the transfer page header in place.
+         * @return The header, or nullptr if this is not a transfer page packet,
+         *         the header does not fit, or the packet is not contiguous.
+         */
+        const VMTRANSFER_PAGE_PACKET_HEADER* TransferPageHeader() const
+        {
+            if (m_Descriptor.Type != VmbusPacketTypeDataUsingTransferPages ||
+                m_Size < HV_FIELD_OFFSET(VMTRANSFER_PAGE_PACKET_HEADER, Ranges))
+            {
+                return nullptr;
+            }
+            return reinterpret_cast<const VMTRANSFER_PAGE_PACKET_HEADER*>(
+                this->Bytes().data());
+        }
+
+        /**
+         * @brief Gets the transfer page ranges in place.
+         * @return The ranges, clipped to the bytes the packet really has, or
+         *         an empty span, see TransferPageHeader.
+         */
+        std::span<const VMTRANSFER_PAGE_RANGE> TransferPageRanges() const
+        {
+            const VMTRANSFER_PAGE_PACKET_HEADER* Header =
+                this->TransferPageHeader();
+            if (!Header)
+            {
+                return {};
+            }
+            HV_UINT32 RangeCount = ::Mile::HyperV::VmbusRingLoadRelaxed(
+                Header->RangeCount);
+            HV_UINT32 Capacity = static_cast<HV_UINT32>(
+                (m_Size - HV_FIELD_OFFSET(
+                    VMTRANSFER_PAGE_PACKET_HEADER,
+                    Ranges)) / sizeof(VMTRANSFER_PAGE_RANGE));
+            if (RangeCount > Capacity)
+            {
+                RangeCount = Capacity;
+            }
+            return std::span<const VMTRANSFER_PAGE_RANGE>(
+                Header->Ranges,
+                RangeCount);
+        }
+
+        /**
+         * @brief Gets the GPA direct header in place.
+         * @return The header, or nullptr if this is not a GPA direct packet,
+         *         the header does not fit, or the packet is not contiguous.
+         */
+        const VMDATA_GPA_DIRECT* GpaDirectHeader() const
+        {
+            if (m_Descriptor.Type != VmbusPacketTypeDataUsingGpaDirect ||
+                m_Size < HV_FIELD_OFFSET(VMDATA_GPA_DIRECT, Range))
+            {
+                return nullptr;
+            }
+            return reinterpret_cast<const VMDATA_GPA_DIRECT*>(
+                this->Bytes().data());
+        }
+
+        /**
+         * @brief Gets the variable sized GPA_RANGE array of a GPA direct
+         *        packet in place.
+         * @return The range bytes between the header and DataOffset8, or an
+         *         empty span, see GpaDirectHeader.
+         */
+        std::span<const HV_UINT8> GpaDirectRanges() const
+        {
+            if (!this->GpaDirectHeader())
+            {
+                return {};
+            }
+            HV_UINT32 Begin = HV_FIELD_OFFSET(VMDATA_GPA_DIRECT, Range);
+            HV_UINT32 End = m_Descriptor.DataOffset8 * VmbusRingPacketAlignment;
+            if (End < Begin)
+            {
+                return {};
+            }
+            return this->Bytes().subspan(Begin, End - Begin);
+        }
+    };
+
+    /**
+     * @brief The single consumer of one VMBus ring direction. It owns the Out
+     *        index and must not be used from more than one thread at a time.
+     */
+    class VmbusRingReader
+    {
+    private:
+
+        VmbusRing m_Ring;
+
+    protected:
+
+        /**
+         * @brief Validates the packet which starts at the given index.
+         * @param In The In index read with acquire semantics.
+         * @param Out The index of the packet.
+         * @param Descriptor Receives the packet descriptor.
+         * @param PacketSize Receives the packet size without the trailer.
+         * @return STATUS_SUCCESS, STATUS_NO_MORE_ENTRIES if the ring is empty,
+         *         or STATUS_BAD_DATA if the writer produced a broken packet.
+         */
+        NTSTATUS PeekAt(
+            HV_UINT32 In,
+            HV_UINT32 Out,
+            VMPACKET_DESCRIPTOR& Descriptor,
+            HV_UINT32& PacketSize) const
+        {
+            if (!m_Ring.IsValidOffset(In) || !m_Ring.IsValidOffset(Out))
+            {
+                return STATUS_BAD_DATA;
+            }
+
+            HV_UINT32 Available = m_Ring.BytesToRead(In, Out);
+            if (!Available)
+            {
+                return STATUS_NO_MORE_ENTRIES;
+            }
+            if (Available < sizeof(VMPACKET_DESCRIPTOR) + VmbusRingTrailerSize)
+            {
+                return STATUS_BAD_DATA;
+            }
+
+            m_Ring.CopyFromRing(Out, &Descriptor, sizeof(Descriptor));
+            PacketSize = Descriptor.Length8 * VmbusRingPacketAlignment;
+            if (PacketSize < sizeof(VMPACKET_DESCRIPTOR) ||
+                Descriptor.DataOffset8 * VmbusRingPacketAlignment
+                > PacketSize ||
+                PacketSize + VmbusRingTrailerSize > Available)
+            {
+                return STATUS_BAD_DATA;
+            }
+
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Publishes a new Out index and decides whether the writer is
+         *        waiting for the free space this crosses.
+         * @param OldOut The Out index before the packets were consumed.
+         * @param NewOut The Out index after the packets were consumed.
+         * @return true if the writer must be signaled, which only happens when
+         *         the free space crosses PendingSendSize.
+         */
+        bool PublishOut(
+            HV_UINT32 OldOut,
+            HV_UINT32 NewOut)
+        {
+            PVMRCB Control = m_Ring.Control();
+            ::Mile::HyperV::VmbusRingStoreRelease(Control->Out, NewOut);
+
+            // The Out store must be ordered before the PendingSendSize load,
+            // which pairs with the fence after the PendingSendSize store in
+            // the writer.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            HV_UINT32 PendingSendSize = ::Mile::HyperV::VmbusRingLoadRelaxed(
+                Control->PendingSendSize);
+            if (!PendingSendSize)
+            {
+                return false;
+            }
+
+            HV_UINT32 In = ::Mile::HyperV::VmbusRingLoadRelaxed(Control->In);
+            return m_Ring.BytesToWrite(In, OldOut) <= PendingSendSize
+                && m_Ring.BytesToWrite(In, NewOut) > PendingSendSize;
+        }
+
+    public:
+
+        VmbusRingReader() = default;
+
+        explicit VmbusRingReader(
+            VmbusRing const& Ring) :
+            m_Ring(Ring)
+        {
+        }
+
+        VmbusRing const& Ring() const
+        {
+            return m_Ring;
+        }
+
+        /**
+         * @brief Gets the number of bytes waiting to be consumed.
+         * @return The number of readable bytes.
+         */
+        HV_UINT32 BytesAvailable() const
+        {
+            PVMRCB Control = m_Ring.Control();
+            return m_Ring.BytesToRead(
+                ::Mile::HyperV::VmbusRingLoadAcquire(Control->In),
+                ::Mile::HyperV::VmbusRingLoadRelaxed(Control->Out));
+        }
+
+        /**
+         * @brief Gets the descriptor of the next packet without consuming it.
+         * @param Descriptor Receives the packet descriptor.
+         * @return See PeekAt.
+         */
+        NTSTATUS Peek(
+            VMPACKET_DESCRIPTOR& Descriptor) const
+        {
+            PVMRCB Control = m_Ring.Control();
+            HV_UINT32 PacketSize = 0;
+            return this->PeekAt(
+                ::Mile::HyperV::VmbusRingLoadAcquire(Control->In),
+                ::Mile::HyperV::VmbusRingLoadRelaxed(Control->Out),
+                Descriptor,
+                PacketSize);
+        }
+
+        /**
+         * @brief Copies the next packet, descriptor included, and consumes it.
+         * @param Buffer The buffer which receives the packet.
+         * @param BufferSize The size of the buffer in bytes.
+         * @param PacketSize Optional. Receives the packet size, which is the
+         *                   required buffer size on STATUS_BUFFER_OVERFLOW.
+         * @param SignalRequired Optional. Receives whether the writer waits
+         *                       for the space this frees, see PublishOut.
+         * @return See PeekAt, or STATUS_BUFFER_OVERFLOW if the buffer is too
+         *         small, in which case the packet is left in the ring.
+         */
+        NTSTATUS Read(
+            void* Buffer,
+            HV_UINT32 BufferSize,
+            HV_UINT32* PacketSize = nullptr,
+            bool* SignalRequired = nullptr)
+        {
+            if (SignalRequired)
+            {
+                *SignalRequired = false;
+            }
+
+            PVMRCB Control = m_Ring.Control();
+            HV_UINT32 In = ::Mile::HyperV::VmbusRingLoadAcquire(Control->In);
+            HV_UINT32 Out = ::Mile::HyperV::VmbusRingLoadRelaxed(Control->Out);
+
+            VMPACKET_DESCRIPTOR Descriptor;
+            HV_UINT32 Size = 0;
+            NTSTATUS Status = this->PeekAt(In, Out, Descriptor, Size);
+            if (PacketSize)
+            {
+                *PacketSize = Size;
+            }
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+            if (Size > BufferSize)
+            {
+                return STATUS_BUFFER_OVERFLOW;
+            }
+
+            m_Ring.CopyFromRing(Out, Buffer, Size);
+            bool Signal = this->PublishOut(
+                Out,
+                m_Ring.Advance(Out, Size + VmbusRingTrailerSize));
+            if (SignalRequired)
+            {
+                *SignalRequired = Signal;
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Consumes the next packet without copying it.
+         * @param SignalRequired Optional. See Read.
+         * @return See PeekAt.
+         */
+        NTSTATUS Skip(
+            bool* SignalRequired = nullptr)
+        {
+            PVMRCB Control = m_Ring.Control();
+            HV_UINT32 In = ::Mile::HyperV::VmbusRingLoadAcquire(Control->In);
+            HV_UINT32 Out = ::Mile::HyperV::VmbusRingLoadRelaxed(Control->Out);
+
+            VMPACKET_DESCRIPTOR Descriptor;
+            HV_UINT32 Size = 0;
+            NTSTATUS Status = this->PeekAt(In, Out, Descriptor, Size);
+            bool Signal = false;
+            if (NT_SUCCESS(Status))
+            {
+                Signal = this->PublishOut(
+                    Out,
+                    m_Ring.Advance(Out, Size + VmbusRingTrailerSize));
+            }
+            if (SignalRequired)
+            {
+                *SignalRequired = Signal;
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Asks the writer not to signal, because the reader is going
+         *        to poll the ring anyway.
+         */
+        void DisableInterrupts()
+        {
+            ::Mile::HyperV::VmbusRingStoreRelaxed(
+                m_Ring.Control()->InterruptMask,
+                1);
+        }
+
+        /**
+         * @brief Asks the writer to signal again, then re-checks the ring to
+         *        close the race with a writer which published a packet while
+         *        interrupts were still masked.
+         * @return true if the ring is not empty, in which case no signal can
+         *         be expected for the pending packets and the caller must
+         *         drain again.
+         */
+        bool EnableInterrupts()
+        {
+            PVMRCB Control = m_Ring.Control();
+            ::Mile::HyperV::VmbusRingStoreRelaxed(Control->InterruptMask, 0);
+            // The InterruptMask store must be ordered before the In load,
+            // which pairs with the fence after the In store in the writer.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return ::Mile::HyperV::VmbusRingLoadAcquire(Control->In)
+                != ::Mile::HyperV::VmbusRingLoadRelaxed(Control->Out);
+        }
+
+        /**
+         * @brief Consumes up to a packet count or byte budget and publishes
+         *        the Out index once at the end instead of once per packet.
+         * @param OnPacket The callback invoked as OnPacket(VmbusRingPacket
+         *                 const&) for every packet, in ring order. The packet
+         *                 memory is released to the writer after the batch.
+         * @param MaximumPackets The maximum number of packets to consume.
+         * @param MaximumBytes The maximum number of ring bytes to consume. At
+         *                     least one packet is consumed if available.
+         * @param PacketCount Optional. Receives the number of packets
+         *                    consumed.
+         * @param SignalRequired Optional. See Read.
+         * @return STATUS_SUCCESS if the ring was drained, STATUS_MORE_ENTRIES
+         *         if a budget was exhausted first, or STATUS_BAD_DATA. Packets
+         *         consumed before a STATUS_BAD_DATA are still released.
+         */
+        template<typename PacketCallback>
+        NTSTATUS ReadBatch(
+            PacketCallback&& OnPacket,
+            HV_UINT32 MaximumPackets,
+            HV_UINT32 MaximumBytes = 0xFFFFFFFF,
+            HV_UINT32* PacketCount = nullptr,
+            bool* SignalRequired = nullptr)
+        {
+            PVMRCB Control = m_Ring.Control();
+            HV_UINT32 In = ::Mile::HyperV::VmbusRingLoadAcquire(Control->In);
+            HV_UINT32 OldOut = ::Mile::HyperV::VmbusRingLoadRelaxed(
+                Control->Out);
+            HV_UINT32 Out = OldOut;
+            HV_UINT32 Count = 0;
+            HV_UINT32 Bytes = 0;
+
+            NTSTATUS Status = STATUS_SUCCESS;
+            while (Count < MaximumPackets)
+            {
+                VMPACKET_DESCRIPTOR Descriptor;
+                HV_UINT32 Size = 0;
+                Status = this->PeekAt(In, Out, Descriptor, Size);
+                if (Status == STATUS_NO_MORE_ENTRIES)
+                {
+                    // Pick up packets published during this batch.
+                    HV_UINT32 LatestIn = ::Mile::HyperV::VmbusRingLoadAcquire(
+                        Control->In);
+                    if (LatestIn == In)
+                    {
+                        Status = STATUS_SUCCESS;
+                        break;
+                    }
+                    In = LatestIn;
+                    continue;
+                }
+                if (!NT_SUCCESS(Status))
+                {
+                    break;
+                }
+
+                HV_UINT32 TotalSize = Size + VmbusRingTrailerSize;
+                if (Count && TotalSize > MaximumBytes - Bytes)
+                {
+                    Status = STATUS_MORE_ENTRIES;
+                    break;
+                }
+
+                OnPacket(VmbusRingPacket(m_Ring, Out, Size, Descriptor));
+                Out = m_Ring.Advance(Out, TotalSize);
+                Bytes += TotalSize;
+                ++Count;
+
+                if (Bytes >= MaximumBytes)
+                {
+                    break;
+                }
+            }
+            if (NT_SUCCESS(Status) && Out != In)
+            {
+                Status = STATUS_MORE_ENTRIES;
+            }
+
+            bool Signal = false;
+            if (Out != OldOut)
+            {
+                Signal = this->PublishOut(OldOut, Out);
+            }
+            if (SignalRequired)
+            {
+                *SignalRequired = Signal;
+            }
+            if (PacketCount)
+            {
+                *PacketCount = Count;
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Drains the ring with interrupts masked and re-arms them with
+         *        the unmask then re-check pattern once the ring is empty.
+         * @param OnPacket See ReadBatch.
+         * @param MaximumPackets The maximum number of packets to consume
+         *                       across all batches.
+         * @param MaximumBytes The byte budget of each batch, see ReadBatch.
+         * @param PacketCount Optional. Receives the number of packets
+         *                    consumed.
+         * @param SignalRequired Optional. Receives whether any batch crossed
+         *                       the writer's PendingSendSize, see Read.
+         * @return STATUS_SUCCESS if the ring is empty and interrupts are
+         *         armed, STATUS_MORE_ENTRIES if a budget was exhausted and
+         *         interrupts are still masked, so the caller must drain again
+         *         later, or STATUS_BAD_DATA.
+         */
+        template<typename PacketCallback>
+        NTSTATUS Drain(
+            PacketCallback&& OnPacket,
+            HV_UINT32 MaximumPackets,
+            HV_UINT32 MaximumBytes = 0xFFFFFFFF,
+            HV_UINT32* PacketCount = nullptr,
+            bool* SignalRequired = nullptr)
+        {
+            HV_UINT32 Total = 0;
+            bool Signal = false;
+            NTSTATUS Status = STATUS_SUCCESS;
+
+            this->DisableInterrupts();
+            for (;;)
+            {
+                HV_UINT32 Count = 0;
+                bool BatchSignal = false;
+                Status = this->ReadBatch(
+                    OnPacket,
+                    MaximumPackets - Total,
+                    MaximumBytes,
+                    &Count,
+                    &BatchSignal);
+                Total += Count;
+                Signal = Signal || BatchSignal;
+                if (Status != STATUS_SUCCESS)
+                {
+                    break;
+                }
+                if (!this->EnableInterrupts())
+                {
+                    break;
+                }
+                if (Total >= MaximumPackets)
+                {
+                    this->DisableInterrupts();
+                    Status = STATUS_MORE_ENTRIES;
+                    break;
+                }
+                this->DisableInterrupts();
+            }
+
+            if (PacketCount)
+            {
+                *PacketCount = Total;
+            }
+            if (SignalRequired)
+            {
+                *SignalRequired = Signal;
+            }
+            return Status;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_RING
@@ -0,0 +1,440 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.Servicing.h
+ * PURPOSE:    Definition for Hyper-V VMBus Pause and Resume Control Plane
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+// References
+// - OpenVMM
+//   - vm\devices\vmbus\vmbus_core\src\protocol.rs
+
+#ifndef MILE_HYPERV_VMBUS_SERVICING
+#define MILE_HYPERV_VMBUS_SERVICING
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus servicing control plane requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.Transaction.h"
+
+#include <atomic>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief Lets submissions into a channel through until it is closed for
+     *        servicing, and tells when the last submission in flight left.
+     * @remark Submissions which find the gate closed are deferred, not
+     *         dropped: the submitter keeps the packet and retries after the
+     *         gate opens again.
+     */
+    class VmbusChannelGate
+    {
+    private:
+
+        static const HV_UINT32 ClosedBit = 0x80000000;
+
+        // ClosedBit and the number of submitters inside the gate.
+        std::atomic<HV_UINT32> m_State = 0;
+        std::atomic<HV_UINT64> m_Deferred = 0;
+
+    public:
+
+        /**
+         * @brief Enters the gate before writing to the channel.
+         * @return true if the gate is open, in which case Leave must be
+         *         called once the packet is written.
+         */
+        bool TryEnter()
+        {
+            HV_UINT32 State = m_State.fetch_add(1, std::memory_order_acquire);
+            if (State & ClosedBit)
+            {
+                m_State.fetch_sub(1, std::memory_order_release);
+                m_Deferred.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+
+        void Leave()
+        {
+            m_State.fetch_sub(1, std::memory_order_release);
+        }
+
+        void Close()
+        {
+            m_State.fetch_or(ClosedBit, std::memory_order_acq_rel);
+        }
+
+        void Open()
+        {
+            m_State.fetch_and(~ClosedBit, std::memory_order_release);
+        }
+
+        bool IsClosed() const
+        {
+            return m_State.load(std::memory_order_acquire) & ClosedBit;
+        }
+
+        /**
+         * @brief Checks whether the gate is closed and every submission
+         *        which entered before has left.
+         */
+        bool IsDrained() const
+        {
+            return m_State.load(std::memory_order_acquire) == ClosedBit;
+        }
+
+        /**
+         * @brief Gets the number of submissions which found the gate closed.
+         */
+        HV_UINT64 Deferred() const
+        {
+            return m_Deferred.load(std::memory_order_relaxed);
+        }
+    };
+
+    /**
+     * @brief A channel under the control of VmbusServicingController, whose
+     *        fields after Gate are owned by the controller once registered.
+     */
+    struct VmbusServicingChannel
+    {
+        VmbusChannelGate Gate;
+        // Optional. The ring the guest writes, whose write index must not
+        // move while the channel is paused.
+        const VmbusRing* Outbound;
+        // Optional. The transactions of the channel.
+        const VmbusTransactionTable* Transactions;
+        // Optional. Receives the IDs of the transactions in flight when the
+        // channel was paused.
+        HV_UINT64* InFlight;
+        HV_UINT32 InFlightCapacity;
+
+        // Captured when the channel is paused.
+
+        HV_UINT32 InFlightCount;
+        HV_UINT32 OutboundWriteIndex;
+    };
+
+    enum class VmbusServicingState : HV_UINT8
+    {
+        Running,
+        // ChannelMessagePause was sent, and the gates are closed.
+        Pausing,
+        // The host acknowledged the pause, and the channels are drained.
+        Paused,
+    };
+
+    /**
+     * @brief The latencies of the pause and resume cycles, in the units of
+     *        the clock passed to VmbusServicingController.
+     */
+    struct VmbusServicingMetrics
+    {
+        HV_UINT64 Pauses;
+        HV_UINT64 LastPauseLatency;
+        HV_UINT64 MaximumPauseLatency;
+        HV_UINT64 TotalPauseLatency;
+        HV_UINT64 LastResumeLatency;
+        HV_UINT64 MaximumResumeLatency;
+        HV_UINT64 TotalResumeLatency;
+        // The time from the pause completing to the resume starting, which
+        // is the window the host has for its servicing.
+        HV_UINT64 LastPausedTime;
+        // Channels whose outbound ring was written while paused.
+        HV_UINT64 Violations;
+    };
+
+    /**
+     * @brief Pauses the control messages of the host with ChannelMessagePause
+     *        and the traffic of a set of channels, so the host can be
+     *        serviced without tearing the channels down, then resumes both.
+     * @remark Requires VMBUS_FEATURE_FLAG_PAUSE_RESUME, which the host only
+     *         grants with VMBUS_VERSION_COPPER or later. The pause completes
+     *         once ChannelMessagePauseResponse arrived and every channel
+     *         drained, and the state of every channel is captured then. The
+     *         controller is driven from one thread, while submissions run
+     *         concurrently through the gates.
+     */
+    class VmbusServicingController
+    {
+    private:
+
+        VmbusServicingChannel* m_Channels = nullptr;
+        HV_UINT32 m_ChannelCount = 0;
+        HV_UINT32 m_FeatureFlags = 0;
+        VmbusServicingState m_State = VmbusServicingState::Running;
+        bool m_IsResponseReceived = false;
+        HV_UINT64 m_PauseStart = 0;
+        HV_UINT64 m_PausedAt = 0;
+        VmbusServicingMetrics m_Metrics = {};
+
+        bool IsDrained() const
+        {
+            for (HV_UINT32 i = 0; i < m_ChannelCount; ++i)
+            {
+                if (!m_Channels[i].Gate.IsDrained())
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void Capture(
+            VmbusServicingChannel& Channel)
+        {
+            Channel.InFlightCount = Channel.Transactions
+                ? Channel.Transactions->Snapshot(
+                    Channel.InFlight,
+                    Channel.InFlight ? Channel.InFlightCapacity : 0)
+                : 0;
+            Channel.OutboundWriteIndex = Channel.Outbound
+                ? ::Mile::HyperV::VmbusRingLoadAcquire(
+                    Channel.Outbound->Control()->In)
+                : 0;
+        }
+
+        void OpenGates()
+        {
+            for (HV_UINT32 i = 0; i < m_ChannelCount; ++i)
+            {
+                m_Channels[i].Gate.Open();
+            }
+        }
+
+    public:
+
+        /**
+         * @brief Initializes the controller over caller-owned channels.
+         * @param Channels The channels, which must outlive the controller.
+         *                 Their gates are opened.
+         * @param ChannelCount The number of channels.
+         * @param FeatureFlags The SupportedFeatures of the
+         *                     ChannelMessageVersionResponse of the host.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            VmbusServicingChannel* Channels,
+            HV_UINT32 ChannelCount,
+            HV_UINT32 FeatureFlags)
+        {
+            m_Channels = nullptr;
+            m_ChannelCount = 0;
+            m_FeatureFlags = 0;
+            m_State = VmbusServicingState::Running;
+            m_IsResponseReceived = false;
+            m_Metrics = VmbusServicingMetrics();
+            if (!Channels && ChannelCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            for (HV_UINT32 i = 0; i < ChannelCount; ++i)
+            {
+                Channels[i].Gate.Open();
+                Channels[i].InFlightCount = 0;
+                Channels[i].OutboundWriteIndex = 0;
+            }
+            m_Channels = Channels;
+            m_ChannelCount = ChannelCount;
+            m_FeatureFlags = FeatureFlags;
+            return STATUS_SUCCESS;
+        }
+
+        VmbusServicingState State() const
+        {
+            return m_State;
+        }
+
+        VmbusServicingMetrics const& Metrics() const
+        {
+            return m_Metrics;
+        }
+
+        /**
+         * @brief Starts a pause: closes every gate and sends
+         *        ChannelMessagePause.
+         * @param Send The callback invoked as
+         *             NTSTATUS Send(const void* Message, HV_UINT32 Size) to
+         *             post a channel message to the host.
+         * @param Now The callback invoked as HV_UINT64 Now() to read the
+         *            clock the metrics are measured with.
+         * @return STATUS_SUCCESS, STATUS_NOT_SUPPORTED if the host did not
+         *         grant VMBUS_FEATURE_FLAG_PAUSE_RESUME,
+         *         STATUS_INVALID_DEVICE_STATE if not running, or the status of
+         *         Send, in which case the gates are opened again.
+         * @remark Call Poll until the pause completes.
+         */
+        template<typename MessageSender, typename Clock>
+        NTSTATUS Pause(
+            MessageSender&& Send,
+            Clock&& Now)
+        {
+            if (!(m_FeatureFlags & VMBUS_FEATURE_FLAG_PAUSE_RESUME))
+            {
+                return STATUS_NOT_SUPPORTED;
+            }
+            if (m_State != VmbusServicingState::Running)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            m_PauseStart = Now();
+            for (HV_UINT32 i = 0; i < m_ChannelCount; ++i)
+            {
+                m_Channels[i].Gate.Close();
+            }
+            // The response may arrive before Send returns.
+            m_State = VmbusServicingState::Pausing;
+            m_IsResponseReceived = false;
+            VMBUS_CHANNEL_PAUSE Message = {};
+            Message.MessageType = ChannelMessagePause;
+            NTSTATUS Status = Send(
+                static_cast<const void*>(&Message),
+                static_cast<HV_UINT32>(sizeof(Message)));
+            if (!NT_SUCCESS(Status))
+            {
+                m_State = VmbusServicingState::Running;
+                this->OpenGates();
+            }
+            return Status;
+        }
+
+        /**
+         * @brief Handles ChannelMessagePauseResponse.
+         * @return STATUS_SUCCESS or STATUS_INVALID_DEVICE_STATE if no pause
+         *         was started.
+         */
+        NTSTATUS OnPauseResponse()
+        {
+            if (m_State != VmbusServicingState::Pausing ||
+                m_IsResponseReceived)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            m_IsResponseReceived = true;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Completes a pause once the host acknowledged it and every
+         *        channel drained, and captures the state of the channels.
+         * @param Now See Pause.
+         * @return STATUS_SUCCESS if paused, STATUS_PENDING if still pausing,
+         *         or STATUS_INVALID_DEVICE_STATE if running.
+         */
+        template<typename Clock>
+        NTSTATUS Poll(
+            Clock&& Now)
+        {
+            if (m_State == VmbusServicingState::Paused)
+            {
+                return STATUS_SUCCESS;
+            }
+            if (m_State != VmbusServicingState::Pausing)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            if (!m_IsResponseReceived || !this->IsDrained())
+            {
+                return STATUS_PENDING;
+            }
+            for (HV_UINT32 i = 0; i < m_ChannelCount; ++i)
+            {
+                this->Capture(m_Channels[i]);
+            }
+            m_State = VmbusServicingState::Paused;
+            m_PausedAt = Now();
+            HV_UINT64 Latency = m_PausedAt - m_PauseStart;
+            ++m_Metrics.Pauses;
+            m_Metrics.LastPauseLatency = Latency;
+            m_Metrics.TotalPauseLatency += Latency;
+            if (Latency > m_Metrics.MaximumPauseLatency)
+            {
+                m_Metrics.MaximumPauseLatency = Latency;
+            }
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Sends ChannelMessageResume and opens every gate.
+         * @param Send See Pause.
+         * @param Now See Pause.
+         * @return STATUS_SUCCESS, STATUS_INVALID_DEVICE_STATE if not paused,
+         *         or the status of Send, in which case the channels stay
+         *         paused.
+         * @remark A channel whose outbound ring moved while paused is
+         *         counted in VmbusServicingMetrics::Violations once the
+         *         resume completes, so a retried resume counts it once.
+         */
+        template<typename MessageSender, typename Clock>
+        NTSTATUS Resume(
+            MessageSender&& Send,
+            Clock&& Now)
+        {
+            if (m_State != VmbusServicingState::Paused)
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+            HV_UINT64 ResumeStart = Now();
+            HV_UINT64 Violations = 0;
+            for (HV_UINT32 i = 0; i < m_ChannelCount; ++i)
+            {
+                VmbusServicingChannel const& Channel = m_Channels[i];
+                if (Channel.Outbound &&
+                    Channel.OutboundWriteIndex !=
+                    ::Mile::HyperV::VmbusRingLoadAcquire(
+                        Channel.Outbound->Control()->In))
+                {
+                    ++Violations;
+                }
+            }
+            VMBUS_CHANNEL_RESUME Message = {};
+            Message.MessageType = ChannelMessageResume;
+            NTSTATUS Status = Send(
+                static_cast<const void*>(&Message),
+                static_cast<HV_UINT32>(sizeof(Message)));
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+            this->OpenGates();
+            m_State = VmbusServicingState::Running;
+            m_Metrics.Violations += Violations;
+            HV_UINT64 Latency = Now() - ResumeStart;
+            m_Metrics.LastPausedTime = ResumeStart - m_PausedAt;
+            m_Metrics.LastResumeLatency = Latency;
+            m_Metrics.TotalResumeLatency += Latency;
+            if (Latency > m_Metrics.MaximumResumeLatency)
+            {
+                m_Metrics.MaximumResumeLatency = Latency;
+            }
+            return STATUS_SUCCESS;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_SERVICING
@@ -0,0 +1,748 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.Transaction.h
+ * PURPOSE:    Definition for Hyper-V VMBus Transaction Completion Tracker
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_TRANSACTION
+#define MILE_HYPERV_VMBUS_TRANSACTION
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus transaction tracker requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.Ring.h"
+
+#include <atomic>
+#include <coroutine>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_NOT_FOUND
+// The object was not found.
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#endif // !STATUS_NOT_FOUND
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief The outcome of a transaction.
+     */
+    struct VmbusTransactionResult
+    {
+        // STATUS_SUCCESS, STATUS_BUFFER_OVERFLOW if the response was
+        // truncated, STATUS_CANCELLED or STATUS_NOT_FOUND.
+        NTSTATUS Status;
+        // The number of response bytes stored in the response buffer.
+        HV_UINT32 ResponseSize;
+    };
+
+    /**
+     * @brief The routine invoked when a transaction allocated with a
+     *        callback completes. The transaction ID is already released, so
+     *        the routine is free to issue a new request.
+     */
+    typedef void(*VmbusTransactionCallback)(
+        void* Context,
+        HV_UINT64 TransactionId,
+        VmbusTransactionResult const& Result);
+
+    /**
+     * @brief The storage of a transaction, which is owned by the
+     *        VmbusTransactionTable it is attached to.
+     */
+    struct VmbusTransactionSlot
+    {
+        // The generation in the high 32 bits and the slot state in the low
+        // 32 bits, which are updated together.
+        std::atomic<HV_UINT64> State;
+        // The index of the next free slot while the slot is free.
+        std::atomic<HV_UINT32> Next;
+        void* ResponseBuffer;
+        HV_UINT32 ResponseBufferSize;
+        VmbusTransactionResult Result;
+        VmbusTransactionCallback Callback;
+        void* Context;
+        std::coroutine_handle<> Waiter;
+    };
+
+    /**
+     * @brief A lock-free, fixed-capacity table which hands out transaction
+     *        IDs for VMPACKET_DESCRIPTOR::TransactionId and matches
+     *        VmbusPacketTypeCompletion packets back to their requests.
+     * @remark A transaction ID holds the slot index in the low 32 bits and
+     *         the slot generation in the high 32 bits. The generation is
+     *         bumped every time a slot is released, so duplicate or late
+     *         completions for a reused slot are rejected, and no transaction
+     *         ID is ever zero.
+     */
+    class VmbusTransactionTable
+    {
+    private:
+
+        static const HV_UINT32 SlotFree = 0;
+        static const HV_UINT32 SlotPending = 1;
+        // A coroutine is suspended on the slot.
+        static const HV_UINT32 SlotWaiting = 2;
+        // A completion is storing the response.
+        static const HV_UINT32 SlotCompleting = 3;
+        static const HV_UINT32 SlotCompleted = 4;
+
+        static const HV_UINT32 NoSlot = 0xFFFFFFFF;
+
+        VmbusTransactionSlot* m_Slots = nullptr;
+        HV_UINT32 m_Capacity = 0;
+        // The free list index in the low 32 bits and a tag in the high 32
+        // bits, which changes on every update to defeat ABA.
+        std::atomic<HV_UINT64> m_FreeHead = NoSlot;
+
+        static constexpr HV_UINT64 MakeState(
+            HV_UINT32 Generation,
+            HV_UINT32 State)
+        {
+            return (static_cast<HV_UINT64>(Generation) << 32) | State;
+        }
+
+        static constexpr HV_UINT32 StateGeneration(
+            HV_UINT64 Value)
+        {
+            return static_cast<HV_UINT32>(Value >> 32);
+        }
+
+        static constexpr HV_UINT32 StateValue(
+            HV_UINT64 Value)
+        {
+            return static_cast<HV_UINT32>(Value);
+        }
+
+        VmbusTransactionSlot* Lookup(
+            HV_UINT64 TransactionId,
+            HV_UINT32& Generation) const
+        {
+            HV_UINT32 Index = static_cast<HV_UINT32>(TransactionId);
+            if (Index >= m_Capacity)
+            {
+                return nullptr;
+            }
+            Generation = static_cast<HV_UINT32>(TransactionId >> 32);
+            return &m_Slots[Index];
+        }
+
+        void Push(
+            HV_UINT32 Index)
+        {
+            HV_UINT64 Head = m_FreeHead.load(std::memory_order_relaxed);
+            HV_UINT64 NewHead;
+            do
+            {
+                m_Slots[Index].Next.store(
+                    static_cast<HV_UINT32>(Head),
+                    std::memory_order_relaxed);
+                NewHead = ((Head + (1ULL << 32)) & ~0xFFFFFFFFULL) | Index;
+            } while (!m_FreeHead.compare_exchange_weak(
+                Head,
+                NewHead,
+                std::memory_order_release,
+                std::memory_order_relaxed));
+        }
+
+        HV_UINT32 Pop()
+        {
+            HV_UINT64 Head = m_FreeHead.load(std::memory_order_acquire);
+            HV_UINT64 NewHead;
+            do
+            {
+                HV_UINT32 Index = static_cast<HV_UINT32>(Head);
+                if (Index == NoSlot)
+                {
+                    return NoSlot;
+                }
+                // The slot may be popped concurrently, in which case the
+                // stale Next value is discarded because the tag changed.
+                HV_UINT32 Next = m_Slots[Index].Next.load(
+                    std::memory_order_relaxed);
+                NewHead = ((Head + (1ULL << 32)) & ~0xFFFFFFFFULL) | Next;
+            } while (!m_FreeHead.compare_exchange_weak(
+                Head,
+                NewHead,
+                std::memory_order_acquire,
+                std::memory_order_acquire));
+            return static_cast<HV_UINT32>(Head);
+        }
+
+        void Free(
+            VmbusTransactionSlot& Slot,
+            HV_UINT32 Generation)
+        {
+            HV_UINT32 NextGeneration = Generation + 1;
+            if (!NextGeneration)
+            {
+                NextGeneration = 1;
+            }
+            Slot.State.store(
+                MakeState(NextGeneration, SlotFree),
+                std::memory_order_release);
+            this->Push(static_cast<HV_UINT32>(&Slot - m_Slots));
+        }
+
+        NTSTATUS AllocateSlot(
+            void* ResponseBuffer,
+            HV_UINT32 ResponseBufferSize,
+            VmbusTransactionCallback Callback,
+            void* Context,
+            HV_UINT64* TransactionId)
+        {
+            if (!TransactionId || (!ResponseBuffer && ResponseBufferSize))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            HV_UINT32 Index = this->Pop();
+            if (Index == NoSlot)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            VmbusTransactionSlot& Slot = m_Slots[Index];
+            HV_UINT32 Generation = StateGeneration(
+                Slot.State.load(std::memory_order_relaxed));
+            Slot.ResponseBuffer = ResponseBuffer;
+            Slot.ResponseBufferSize = ResponseBufferSize;
+            Slot.Result = { STATUS_PENDING, 0 };
+            Slot.Callback = Callback;
+            Slot.Context = Context;
+            Slot.Waiter = nullptr;
+            Slot.State.store(
+                MakeState(Generation, SlotPending),
+                std::memory_order_release);
+
+            *TransactionId = (static_cast<HV_UINT64>(Generation) << 32) | Index;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Claims a pending transaction for completion.
+         * @param TransactionId The transaction ID.
+         * @param PreviousState Receives the state before the claim.
+         * @return The slot, or nullptr if the transaction is unknown, stale
+         *         or already completed.
+         */
+        VmbusTransactionSlot* Claim(
+            HV_UINT64 TransactionId,
+            HV_UINT32& PreviousState)
+        {
+            HV_UINT32 Generation = 0;
+            VmbusTransactionSlot* Slot = this->Lookup(
+                TransactionId,
+                Generation);
+            if (!Slot)
+            {
+                return nullptr;
+            }
+
+            HV_UINT64 Expected = Slot->State.load(std::memory_order_acquire);
+            do
+            {
+                PreviousState = StateValue(Expected);
+                if (StateGeneration(Expected) != Generation ||
+                    (PreviousState != SlotPending &&
+                        PreviousState != SlotWaiting))
+                {
+                    return nullptr;
+                }
+            } while (!Slot->State.compare_exchange_weak(
+                Expected,
+                MakeState(Generation, SlotCompleting),
+                std::memory_order_acquire,
+                std::memory_order_acquire));
+            return Slot;
+        }
+
+        /**
+         * @brief Publishes the result of a claimed transaction and wakes up
+         *        whoever is waiting for it.
+         */
+        void Finish(
+            VmbusTransactionSlot& Slot,
+            HV_UINT64 TransactionId,
+            HV_UINT32 PreviousState)
+        {
+            HV_UINT32 Generation = static_cast<HV_UINT32>(TransactionId >> 32);
+
+            if (Slot.Callback)
+            {
+                VmbusTransactionCallback Callback = Slot.Callback;
+                void* Context = Slot.Context;
+                VmbusTransactionResult Result = Slot.Result;
+                this->Free(Slot, Generation);
+                Callback(Context, TransactionId, Result);
+                return;
+            }
+
+            if (PreviousState == SlotWaiting)
+            {
+                // The handle was published by the exchange to the waiting
+                // state, which the claim acquired. Only then is it safe to
+                // read, as an awaiter may still be storing it otherwise. The
+                // waiter owns the slot once it observes the completed state,
+                // so the handle must be read before publishing it.
+                std::coroutine_handle<> Waiter = Slot.Waiter;
+                Slot.State.store(
+                    MakeState(Generation, SlotCompleted),
+                    std::memory_order_release);
+                Waiter.resume();
+                return;
+            }
+
+            Slot.State.store(
+                MakeState(Generation, SlotCompleted),
+                std::memory_order_release);
+            Slot.State.notify_all();
+        }
+
+    public:
+
+        /**
+         * @brief Awaits a transaction from a C++20 coroutine, see WaitAsync.
+         */
+        class Awaiter
+        {
+        private:
+
+            VmbusTransactionTable* m_Table;
+            HV_UINT64 m_TransactionId;
+
+        public:
+
+            Awaiter(
+                VmbusTransactionTable& Table,
+                HV_UINT64 TransactionId) :
+                m_Table(&Table),
+                m_TransactionId(TransactionId)
+            {
+            }
+
+            bool await_ready() const
+            {
+                HV_UINT32 Generation = 0;
+                VmbusTransactionSlot* Slot = m_Table->Lookup(
+                    m_TransactionId,
+                    Generation);
+                if (!Slot)
+                {
+                    return true;
+                }
+                HV_UINT64 State = Slot->State.load(std::memory_order_acquire);
+                return StateGeneration(State) != Generation
+                    || StateValue(State) == SlotCompleted;
+            }
+
+            bool await_suspend(
+                std::coroutine_handle<> Handle)
+            {
+                HV_UINT32 Generation = 0;
+                VmbusTransactionSlot* Slot = m_Table->Lookup(
+                    m_TransactionId,
+                    Generation);
+                Slot->Waiter = Handle;
+                // Suspend only if no completion has claimed the slot yet,
+                // otherwise the result is already available or about to be.
+                HV_UINT64 Expected = MakeState(Generation, SlotPending);
+                return Slot->State.compare_exchange_strong(
+                    Expected,
+                    MakeState(Generation, SlotWaiting),
+                    std::memory_order_acq_rel,
+                    std::memory_order_acquire);
+            }
+
+            VmbusTransactionResult await_resume()
+            {
+                return m_Table->Wait(m_TransactionId);
+            }
+        };
+
+        VmbusTransactionTable() = default;
+
+        VmbusTransactionTable(VmbusTransactionTable const&) = delete;
+        VmbusTransactionTable& operator=(
+            VmbusTransactionTable const&) = delete;
+
+        /**
+         * @brief Attaches the table to caller-owned slot storage.
+         * @param Slots The slots, which must outlive the table.
+         * @param Capacity The number of slots, which is the maximum number
+         *                 of outstanding transactions.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         * @remark Must not race with any other method.
+         */
+        NTSTATUS Initialize(
+            VmbusTransactionSlot* Slots,
+            HV_UINT32 Capacity)
+        {
+            if (!Slots || !Capacity || Capacity == NoSlot)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            m_Slots = Slots;
+            m_Capacity = Capacity;
+            m_FreeHead.store(NoSlot, std::memory_order_relaxed);
+            for (HV_UINT32 i = Capacity; i > 0; --i)
+            {
+                VmbusTransactionSlot& Slot = m_Slots[i - 1];
+                Slot.State.store(
+                    MakeState(1, SlotFree),
+                    std::memory_order_relaxed);
+                Slot.ResponseBuffer = nullptr;
+                Slot.ResponseBufferSize = 0;
+                Slot.Result = { STATUS_PENDING, 0 };
+                Slot.Callback = nullptr;
+                Slot.Context = nullptr;
+                Slot.Waiter = nullptr;
+                this->Push(i - 1);
+            }
+            return STATUS_SUCCESS;
+        }
+
+        HV_UINT32 Capacity() const
+        {
+            return m_Capacity;
+        }
+
+        /**
+         * @brief Allocates a transaction which is completed with Wait, Poll
+         *        or WaitAsync.
+         * @param ResponseBuffer Optional. The buffer which receives the
+         *                       completion payload.
+         * @param ResponseBufferSize The size of the response buffer.
+         * @param TransactionId Receives the transaction ID to send in the
+         *                      request packet.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER, or
+         *         STATUS_INSUFFICIENT_RESOURCES if all slots are in use.
+         * @remark Call Release if the request can not be sent.
+         */
+        NTSTATUS Allocate(
+            void* ResponseBuffer,
+            HV_UINT32 ResponseBufferSize,
+            HV_UINT64* TransactionId)
+        {
+            return this->AllocateSlot(
+                ResponseBuffer,
+                ResponseBufferSize,
+                nullptr,
+                nullptr,
+                TransactionId);
+        }
+
+        /**
+         * @brief Allocates a transaction which invokes a callback from the
+         *        completing thread and releases itself.
+         * @param ResponseBuffer See Allocate.
+         * @param ResponseBufferSize See Allocate.
+         * @param Callback The completion routine.
+         * @param Context The context passed to the completion routine.
+         * @param TransactionId See Allocate.
+         * @return See Allocate.
+         */
+        NTSTATUS Allocate(
+            void* ResponseBuffer,
+            HV_UINT32 ResponseBufferSize,
+            VmbusTransactionCallback Callback,
+            void* Context,
+            HV_UINT64* TransactionId)
+        {
+            if (!Callback)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            return this->AllocateSlot(
+                ResponseBuffer,
+                ResponseBufferSize,
+                Callback,
+                Context,
+                TransactionId);
+        }
+
+        /**
+         * @brief Releases a transaction which was never sent, or which
+         *        completed but is not going to be waited for.
+         * @param TransactionId The transaction ID.
+         * @return STATUS_SUCCESS or STATUS_NOT_FOUND.
+         * @remark Must not race with a completion of the same transaction.
+         */
+        NTSTATUS Release(
+            HV_UINT64 TransactionId)
+        {
+            HV_UINT32 Generation = 0;
+            VmbusTransactionSlot* Slot = this->Lookup(
+                TransactionId,
+                Generation);
+            if (!Slot)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            HV_UINT64 State = Slot->State.load(std::memory_order_acquire);
+            if (StateGeneration(State) != Generation ||
+                (StateValue(State) != SlotPending &&
+                    StateValue(State) != SlotCompleted))
+            {
+                return STATUS_NOT_FOUND;
+            }
+            this->Free(*Slot, Generation);
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Completes a transaction with a response.
+         * @param TransactionId The transaction ID echoed by the completion.
+         * @param Status The completion status.
+         * @param Response Optional. The response payload.
+         * @param ResponseSize The size of the response payload.
+         * @return STATUS_SUCCESS, or STATUS_NOT_FOUND if the transaction is
+         *         unknown, stale or already completed.
+         */
+        NTSTATUS Complete(
+            HV_UINT64 TransactionId,
+            NTSTATUS Status,
+            const void* Response,
+            HV_UINT32 ResponseSize)
+        {
+            HV_UINT32 PreviousState = SlotFree;
+            VmbusTransactionSlot* Slot = this->Claim(
+                TransactionId,
+                PreviousState);
+            if (!Slot)
+            {
+                return STATUS_NOT_FOUND;
+            }
+
+            if (ResponseSize > Slot->ResponseBufferSize)
+            {
+                ResponseSize = Slot->ResponseBufferSize;
+                if (NT_SUCCESS(Status))
+                {
+                    Status = STATUS_BUFFER_OVERFLOW;
+                }
+            }
+            if (ResponseSize)
+            {
+                std::memcpy(Slot->ResponseBuffer, Response, ResponseSize);
+            }
+            Slot->Result = { Status, ResponseSize };
+
+            this->Finish(*Slot, TransactionId, PreviousState);
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Completes the transaction a completion packet refers to,
+         *        copying its payload into the response buffer.
+         * @param Packet A VmbusPacketTypeCompletion packet.
+         * @return STATUS_SUCCESS, STATUS_INVALID_PARAMETER if the packet is
+         *         not a completion, or STATUS_NOT_FOUND.
+         */
+        NTSTATUS Complete(
+            VmbusRingPacket const& Packet)
+        {
+            if (Packet.Descriptor().Type != VmbusPacketTypeCompletion)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            HV_UINT64 TransactionId = Packet.Descriptor().TransactionId;
+            HV_UINT32 PreviousState = SlotFree;
+            VmbusTransactionSlot* Slot = this->Claim(
+                TransactionId,
+                PreviousState);
+            if (!Slot)
+            {
+                return STATUS_NOT_FOUND;
+            }
+
+            NTSTATUS Status = STATUS_SUCCESS;
+            HV_UINT32 ResponseSize = 0;
+            if (Slot->ResponseBufferSize)
+            {
+                ResponseSize = Packet.CopyPayload(
+                    Slot->ResponseBuffer,
+                    Slot->ResponseBufferSize);
+            }
+            if (ResponseSize < Packet.PayloadSize())
+            {
+                Status = STATUS_BUFFER_OVERFLOW;
+            }
+            Slot->Result = { Status, ResponseSize };
+
+            this->Finish(*Slot, TransactionId, PreviousState);
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Completes a transaction with STATUS_CANCELLED.
+         * @param TransactionId The transaction ID.
+         * @return See Complete.
+         */
+        NTSTATUS Cancel(
+            HV_UINT64 TransactionId)
+        {
+            return this->Complete(TransactionId, STATUS_CANCELLED, nullptr, 0);
+        }
+
+        /**
+         * @brief Cancels every outstanding transaction, for example when the
+         *        channel is closed or rescinded.
+         * @return The number of transactions cancelled.
+         */
+        HV_UINT32 CancelAll()
+        {
+            HV_UINT32 Count = 0;
+            for (HV_UINT32 i = 0; i < m_Capacity; ++i)
+            {
+                HV_UINT64 State = m_Slots[i].State.load(
+                    std::memory_order_acquire);
+                HV_UINT64 TransactionId = (State & ~0xFFFFFFFFULL) | i;
+                if (NT_SUCCESS(this->Cancel(TransactionId)))
+                {
+                    ++Count;
+                }
+            }
+            return Count;
+        }
+
+        /**
+         * @brief Lists the transactions which are still waiting for their
+         *        completions.
+         * @param TransactionIds Optional. Receives the transaction IDs.
+         * @param MaximumCount The number of IDs TransactionIds can hold.
+         * @return The number of outstanding transactions, which may exceed
+         *         MaximumCount.
+         * @remark The list is only stable while no request is sent, such as
+         *         when the channel is paused.
+         */
+        HV_UINT32 Snapshot(
+            HV_UINT64* TransactionIds,
+            HV_UINT32 MaximumCount) const
+        {
+            HV_UINT32 Count = 0;
+            for (HV_UINT32 i = 0; i < m_Capacity; ++i)
+            {
+                HV_UINT64 State = m_Slots[i].State.load(
+                    std::memory_order_acquire);
+                if (StateValue(State) != SlotPending &&
+                    StateValue(State) != SlotWaiting)
+                {
+                    continue;
+                }
+                if (TransactionIds && Count < MaximumCount)
+                {
+                    TransactionIds[Count] = (State & ~0xFFFFFFFFULL) | i;
+                }
+                ++Count;
+            }
+            return Count;
+        }
+
+        /**
+         * @brief Checks whether a transaction has completed, and releases it
+         *        if so.
+         * @param TransactionId The transaction ID.
+         * @param Result Receives the result if the transaction completed.
+         * @return STATUS_SUCCESS if completed, STATUS_PENDING, or
+         *         STATUS_NOT_FOUND.
+         */
+        NTSTATUS Poll(
+            HV_UINT64 TransactionId,
+            VmbusTransactionResult* Result)
+        {
+            HV_UINT32 Generation = 0;
+            VmbusTransactionSlot* Slot = this->Lookup(
+                TransactionId,
+                Generation);
+            if (!Slot || !Result)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            HV_UINT64 State = Slot->State.load(std::memory_order_acquire);
+            if (StateGeneration(State) != Generation ||
+                StateValue(State) == SlotFree)
+            {
+                return STATUS_NOT_FOUND;
+            }
+            if (StateValue(State) != SlotCompleted)
+            {
+                return STATUS_PENDING;
+            }
+            *Result = Slot->Result;
+            this->Free(*Slot, Generation);
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Blocks until a transaction completes, then releases it.
+         * @param TransactionId The transaction ID.
+         * @return The result, whose status is STATUS_NOT_FOUND if the
+         *         transaction is unknown or was released.
+         * @remark Use CancelAll to unblock waiters when the channel goes
+         *         away.
+         */
+        VmbusTransactionResult Wait(
+            HV_UINT64 TransactionId)
+        {
+            for (;;)
+            {
+                VmbusTransactionResult Result = { STATUS_NOT_FOUND, 0 };
+                NTSTATUS Status = this->Poll(TransactionId, &Result);
+                if (Status != STATUS_PENDING)
+                {
+                    return Result;
+                }
+
+                HV_UINT32 Generation = 0;
+                VmbusTransactionSlot* Slot = this->Lookup(
+                    TransactionId,
+                    Generation);
+                HV_UINT64 State = Slot->State.load(std::memory_order_acquire);
+                if (StateGeneration(State) == Generation &&
+                    StateValue(State) != SlotCompleted)
+                {
+                    Slot->State.wait(State, std::memory_order_acquire);
+                }
+            }
+        }
+
+        /**
+         * @brief Awaits a transaction from a C++20 coroutine. The coroutine
+         *        is resumed on the completing thread and the transaction is
+         *        released when the co_await expression returns.
+         * @param TransactionId The transaction ID.
+         * @return The awaitable, whose result is a VmbusTransactionResult.
+         */
+        Awaiter WaitAsync(
+            HV_UINT64 TransactionId)
+        {
+            return Awaiter(*this, TransactionId);
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_TRANSACTION
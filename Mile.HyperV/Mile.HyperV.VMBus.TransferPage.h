@@ -0,0 +1,435 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.HyperV.VMBus.TransferPage.h
+ * PURPOSE:    Definition for Hyper-V VMBus Transfer Page Packet Receive Path
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef MILE_HYPERV_VMBUS_TRANSFERPAGE
+#define MILE_HYPERV_VMBUS_TRANSFERPAGE
+
+#ifndef __cplusplus
+#error [Mile.HyperV] The VMBus transfer page iterator requires C++20 or later.
+#endif // !__cplusplus
+
+#include "Mile.HyperV.VMBus.Ring.h"
+
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <span>
+
+#ifdef _MSC_VER
+#if _MSC_VER > 1000
+#pragma once
+#endif
+#if (_MSC_VER >= 1200)
+#pragma warning(push)
+#endif
+#pragma warning(disable:4201) // nameless struct/union
+#endif
+
+#ifndef STATUS_NOT_FOUND
+// The object was not found.
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#endif // !STATUS_NOT_FOUND
+
+namespace Mile::HyperV
+{
+    /**
+     * @brief A transfer page set which is mapped by the receiver, such as the
+     *        NetVSC receive buffer.
+     */
+    struct VmbusTransferPageSet
+    {
+        HV_UINT16 Id;
+        std::span<const HV_UINT8> Buffer;
+    };
+
+    /**
+     * @brief One VMTRANSFER_PAGE_RANGE resolved into its transfer page set.
+     */
+    struct VmbusTransferPageRange
+    {
+        HV_UINT16 TransferPageSetId;
+        HV_UINT32 ByteOffset;
+        HV_UINT32 ByteCount;
+        // The bytes in the transfer page set, or an empty span if the range
+        // does not fit in the set, which the caller must treat as a protocol
+        // error.
+        std::span<const HV_UINT8> Data;
+    };
+
+    /**
+     * @brief Iterates the ranges of a transfer page packet in the ring,
+     *        reading each VMTRANSFER_PAGE_RANGE once and without allocating.
+     * @remark VMTRANSFER_PAGE_RANGES in Mile.HyperV.Guest.Protocols.h is the
+     *         other way to hand the ranges on: arrays of ranges copied out of
+     *         the ring and chained by Next. Nothing in this tree builds or
+     *         walks such a chain, and the iterator does not produce one. It
+     *         is meant for receivers which would copy the ranges only to
+     *         walk them once, and reads them in place instead.
+     */
+    class VmbusTransferPageRangeIterator
+    {
+    private:
+
+        const VmbusRingPacket* m_Packet = nullptr;
+        const VmbusTransferPageSet* m_Set = nullptr;
+        HV_UINT32 m_Index = 0;
+        HV_UINT32 m_RangeCount = 0;
+        VmbusTransferPageRange m_Range = {};
+
+        void Load()
+        {
+            if (m_Index >= m_RangeCount)
+            {
+                m_Range = {};
+                return;
+            }
+            VMTRANSFER_PAGE_RANGE Range = {};
+            m_Packet->Copy(
+                static_cast<HV_UINT32>(
+                    offsetof(VMTRANSFER_PAGE_PACKET_HEADER, Ranges)
+                    + m_Index * sizeof(VMTRANSFER_PAGE_RANGE)),
+                &Range,
+                sizeof(Range));
+            m_Range.TransferPageSetId = m_Set->Id;
+            m_Range.ByteOffset = Range.ByteOffset;
+            m_Range.ByteCount = Range.ByteCount;
+            m_Range.Data = {};
+            if (Range.ByteOffset <= m_Set->Buffer.size() &&
+                Range.ByteCount <= m_Set->Buffer.size() - Range.ByteOffset)
+            {
+                m_Range.Data = m_Set->Buffer.subspan(
+                    Range.ByteOffset,
+                    Range.ByteCount);
+            }
+        }
+
+    public:
+
+        using iterator_category = std::input_iterator_tag;
+        using value_type = VmbusTransferPageRange;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const VmbusTransferPageRange*;
+        using reference = VmbusTransferPageRange const&;
+
+        VmbusTransferPageRangeIterator() = default;
+
+        VmbusTransferPageRangeIterator(
+            VmbusRingPacket const& Packet,
+            VmbusTransferPageSet const& Set,
+            HV_UINT32 Index,
+            HV_UINT32 RangeCount) :
+            m_Packet(&Packet),
+            m_Set(&Set),
+            m_Index(Index),
+            m_RangeCount(RangeCount)
+        {
+            this->Load();
+        }
+
+        reference operator*() const
+        {
+            return m_Range;
+        }
+
+        pointer operator->() const
+        {
+            return &m_Range;
+        }
+
+        VmbusTransferPageRangeIterator& operator++()
+        {
+            ++m_Index;
+            this->Load();
+            return *this;
+        }
+
+        bool operator==(
+            VmbusTransferPageRangeIterator const& Other) const
+        {
+            return m_Index == Other.m_Index;
+        }
+    };
+
+    /**
+     * @brief A validated VmbusPacketTypeDataUsingTransferPages packet.
+     */
+    class VmbusTransferPagePacket
+    {
+    private:
+
+        const VmbusRingPacket* m_Packet = nullptr;
+        const VmbusTransferPageSet* m_Set = nullptr;
+        HV_UINT32 m_RangeCount = 0;
+        bool m_SenderOwnsSet = false;
+
+    public:
+
+        /**
+         * @brief Validates a transfer page packet and finds its set.
+         * @param Packet The packet, which must outlive this object.
+         * @param Sets The transfer page sets mapped by the receiver, which
+         *             must outlive this object.
+         * @param SetCount The number of sets.
+         * @return STATUS_SUCCESS, STATUS_BAD_DATA if the packet is malformed,
+         *         or STATUS_NOT_FOUND if the set is unknown.
+         */
+        NTSTATUS Initialize(
+            VmbusRingPacket const& Packet,
+            const VmbusTransferPageSet* Sets,
+            std::size_t SetCount)
+        {
+            *this = VmbusTransferPagePacket();
+
+            const HV_UINT32 FixedSize = static_cast<HV_UINT32>(
+                offsetof(VMTRANSFER_PAGE_PACKET_HEADER, Ranges));
+            HV_UINT32 DataOffset =
+                Packet.Descriptor().DataOffset8 * VmbusRingPacketAlignment;
+            if (Packet.Descriptor().Type !=
+                VmbusPacketTypeDataUsingTransferPages ||
+                DataOffset < FixedSize)
+            {
+                return STATUS_BAD_DATA;
+            }
+
+            // Read the header once, since the sender can still write to it.
+            VMTRANSFER_PAGE_PACKET_HEADER Header;
+            if (Packet.Copy(0, &Header, FixedSize) != FixedSize)
+            {
+                return STATUS_BAD_DATA;
+            }
+            if (Header.RangeCount >
+                (DataOffset - FixedSize) / sizeof(VMTRANSFER_PAGE_RANGE))
+            {
+                return STATUS_BAD_DATA;
+            }
+
+            for (std::size_t i = 0; i < SetCount; ++i)
+            {
+                if (Sets[i].Id == Header.TransferPageSetId)
+                {
+                    m_Set = &Sets[i];
+                    break;
+                }
+            }
+            if (!m_Set)
+            {
+                return STATUS_NOT_FOUND;
+            }
+
+            m_Packet = &Packet;
+            m_RangeCount = Header.RangeCount;
+            m_SenderOwnsSet = Header.SenderOwnsSet;
+            return STATUS_SUCCESS;
+        }
+
+        HV_UINT16 TransferPageSetId() const
+        {
+            return m_Set ? m_Set->Id : 0;
+        }
+
+        HV_UINT64 TransactionId() const
+        {
+            return m_Packet ? m_Packet->Descriptor().TransactionId : 0;
+        }
+
+        HV_UINT32 RangeCount() const
+        {
+            return m_RangeCount;
+        }
+
+        bool SenderOwnsSet() const
+        {
+            return m_SenderOwnsSet;
+        }
+
+        /**
+         * @brief Gets the first range. The ranges are read from the ring as
+         *        the iterator advances, so the packet must not be consumed
+         *        before the iteration ends.
+         * @return The iterator.
+         */
+        VmbusTransferPageRangeIterator begin() const
+        {
+            if (!m_Packet)
+            {
+                return VmbusTransferPageRangeIterator();
+            }
+            return VmbusTransferPageRangeIterator(
+                *m_Packet,
+                *m_Set,
+                0,
+                m_RangeCount);
+        }
+
+        VmbusTransferPageRangeIterator end() const
+        {
+            if (!m_Packet)
+            {
+                return VmbusTransferPageRangeIterator();
+            }
+            return VmbusTransferPageRangeIterator(
+                *m_Packet,
+                *m_Set,
+                m_RangeCount,
+                m_RangeCount);
+        }
+    };
+
+    /**
+     * @brief Collects the completions of transfer page packets and writes
+     *        them with VmbusRingWriter::WriteBatch, so a burst of receives
+     *        costs one In update and at most one signal.
+     * @remark Every completion carries the same payload, which for NetVSC is
+     *         an NVSP_MESSAGE_HEADER of NvspMessage1TypeSendRNDISPacketComplete
+     *         followed by its NVSP_STATUS. A failed receive can be completed
+     *         with VmbusRingWriter::Write after flushing.
+     */
+    class VmbusTransferPageCompletionBatch
+    {
+    private:
+
+        HV_UINT64* m_TransactionIds = nullptr;
+        HV_UINT32 m_Capacity = 0;
+        HV_UINT32 m_First = 0;
+        HV_UINT32 m_Count = 0;
+        const void* m_Payload = nullptr;
+        HV_UINT32 m_PayloadSize = 0;
+
+    public:
+
+        /**
+         * @brief Initializes the batch.
+         * @param TransactionIds The buffer which holds the pending transaction
+         *                       IDs.
+         * @param Capacity The number of entries in the buffer.
+         * @param Payload The payload of every completion packet, which must
+         *                outlive this object.
+         * @param PayloadSize The size of the payload in bytes.
+         * @return STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+         */
+        NTSTATUS Initialize(
+            HV_UINT64* TransactionIds,
+            HV_UINT32 Capacity,
+            const void* Payload,
+            HV_UINT32 PayloadSize)
+        {
+            *this = VmbusTransferPageCompletionBatch();
+            if (!TransactionIds || !Capacity || (!Payload && PayloadSize))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            m_TransactionIds = TransactionIds;
+            m_Capacity = Capacity;
+            m_Payload = Payload;
+            m_PayloadSize = PayloadSize;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Gets the number of completions not written yet.
+         * @return The number of pending completions.
+         */
+        HV_UINT32 Count() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * @brief Queues the completion of a transfer page packet.
+         * @param TransactionId The transaction ID of the packet.
+         * @return STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES if the
+         *         batch is full and must be flushed first.
+         */
+        NTSTATUS Add(
+            HV_UINT64 TransactionId)
+        {
+            if (m_Count == m_Capacity)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            if (m_First + m_Count == m_Capacity)
+            {
+                std::memmove(
+                    m_TransactionIds,
+                    m_TransactionIds + m_First,
+                    m_Count * sizeof(HV_UINT64));
+                m_First = 0;
+            }
+            m_TransactionIds[m_First + m_Count++] = TransactionId;
+            return STATUS_SUCCESS;
+        }
+
+        /**
+         * @brief Writes the queued completions as VmbusPacketTypeCompletion
+         *        packets.
+         * @param Writer The writer of the opposite ring direction.
+         * @param SignalRequired Optional. See VmbusRingWriter::WritePacket.
+         *                       It must be honored even if not every
+         *                       completion was written.
+         * @return STATUS_SUCCESS if the batch is empty afterwards,
+         *         STATUS_INSUFFICIENT_RESOURCES if the ring filled up first,
+         *         or see VmbusRingWriter::WriteBatch.
+         */
+        NTSTATUS Flush(
+            VmbusRingWriter& Writer,
+            bool* SignalRequired = nullptr)
+        {
+            if (SignalRequired)
+            {
+                *SignalRequired = false;
+            }
+            if (!m_Count)
+            {
+                return STATUS_SUCCESS;
+            }
+
+            VmbusRingSegment Segment = { m_Payload, m_PayloadSize };
+            const HV_UINT64* TransactionIds = m_TransactionIds + m_First;
+            HV_UINT32 Written = 0;
+            NTSTATUS Status = Writer.WriteBatch(
+                VmbusRingWriter::InBandDescriptor(
+                    VmbusPacketTypeCompletion,
+                    0,
+                    0),
+                [TransactionIds](HV_UINT32 Index) -> HV_UINT64
+                {
+                    return TransactionIds[Index];
+                },
+                &Segment,
+                m_PayloadSize ? 1 : 0,
+                m_Count,
+                &Written,
+                SignalRequired);
+            if (!NT_SUCCESS(Status))
+            {
+                return Status;
+            }
+
+            m_First += Written;
+            m_Count -= Written;
+            if (!m_Count)
+            {
+                m_First = 0;
+                return STATUS_SUCCESS;
+            }
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    };
+}
+
+#ifdef _MSC_VER
+#if (_MSC_VER >= 1200)
+#pragma warning(pop)
+#else
+#pragma warning(default:4201) // nameless struct/union
+#endif
+#endif
+
+#endif // !MILE_HYPERV_VMBUS_TRANSFERPAGE
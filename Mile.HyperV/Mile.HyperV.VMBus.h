@@ -85,7 +85,7 @@ typedef struct _SYNTHHID_MESSAGE
 //
 
 // {2F9BCC4A-0069-4AF3-B76B-6FD0BE528CDA}
-const HV_GUID VMFC_CLASS_ID =
+HV_CONSTEXPR HV_GUID VMFC_CLASS_ID =
 {
     0x2F9BCC4A,
     0x0069,
@@ -152,7 +152,7 @@ const HV_GUID VMFC_CLASS_ID =
 //
 
 // {9722C3E7-8F86-456D-8B6C-6009DA4CCD0B}
-const HV_GUID IC_NEGOTIATE_CLASS_ID =
+HV_CONSTEXPR HV_GUID IC_NEGOTIATE_CLASS_ID =
 {
     0x9722C3E7,
     0x8F86,
@@ -161,7 +161,7 @@ const HV_GUID IC_NEGOTIATE_CLASS_ID =
 };
 
 // {77B80A1A-C226-427B-B65B-DBA0DF85C812}
-const HV_GUID IC_NEGOTIATE_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID IC_NEGOTIATE_INSTANCE_ID =
 {
     0x77B80A1A,
     0xC226,
@@ -170,7 +170,7 @@ const HV_GUID IC_NEGOTIATE_INSTANCE_ID =
 };
 
 // {FD149E91-82E0-4A7D-AFA6-2A4166CBD7C0}
-const HV_GUID IC_HEARTBEAT_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID IC_HEARTBEAT_INSTANCE_ID =
 {
     0xFD149E91,
     0x82E0,
@@ -179,7 +179,7 @@ const HV_GUID IC_HEARTBEAT_INSTANCE_ID =
 };
 
 // {2450EE40-33BF-4FBD-892E-9FB06E9214CF}
-const HV_GUID IC_VSS_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID IC_VSS_INSTANCE_ID =
 {
     0x2450EE40,
     0x33BF,
@@ -188,7 +188,7 @@ const HV_GUID IC_VSS_INSTANCE_ID =
 };
 
 // {F5BEE29C-1741-4AAD-A4C2-8FDEDB46DCC2}
-const HV_GUID IC_RDV_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID IC_RDV_INSTANCE_ID =
 {
     0xF5BEE29C,
     0x1741,
@@ -197,7 +197,7 @@ const HV_GUID IC_RDV_INSTANCE_ID =
 };
 
 // {34D14BE3-DEE4-41C8-9AE7-6B174977C192}
-const HV_GUID IC_GUESTSVC_CLASS_ID =
+HV_CONSTEXPR HV_GUID IC_GUESTSVC_CLASS_ID =
 {
     0x34D14BE3,
     0xDEE4,
@@ -206,7 +206,7 @@ const HV_GUID IC_GUESTSVC_CLASS_ID =
 };
 
 // {EB765408-105F-49B6-B4AA-C123B64D17D4}
-const HV_GUID IC_GUESTSVC_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID IC_GUESTSVC_INSTANCE_ID =
 {
     0xEB765408,
     0x105F,
@@ -382,7 +382,7 @@ typedef struct _IC_GUESTIFACE_COPY_OPERATION_MESSAGE
 //
 
 // {F8E65716-3CB3-4A06-9A60-1889C5CCCAB5}
-const HV_GUID SYNTHRDP_CONTROL_CLASS_ID =
+HV_CONSTEXPR HV_GUID SYNTHRDP_CONTROL_CLASS_ID =
 {
     0xF8E65716,
     0x3CB3,
@@ -391,7 +391,7 @@ const HV_GUID SYNTHRDP_CONTROL_CLASS_ID =
 };
 
 // {99221FA0-24AD-11E2-BE98-001AA01BBF6E}
-const HV_GUID SYNTHRDP_CONTROL_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID SYNTHRDP_CONTROL_INSTANCE_ID =
 {
     0x99221FA0,
     0x24AD,
@@ -400,7 +400,7 @@ const HV_GUID SYNTHRDP_CONTROL_INSTANCE_ID =
 };
 
 // {F9E9C0D3-B511-4A48-8046-D38079A8830C}
-const HV_GUID SYNTHRDP_DATA_CLASS_ID =
+HV_CONSTEXPR HV_GUID SYNTHRDP_DATA_CLASS_ID =
 {
     0xF9E9C0D3,
     0xB511,
@@ -409,7 +409,7 @@ const HV_GUID SYNTHRDP_DATA_CLASS_ID =
 };
 
 // {99221FA1-24AD-11E2-BE98-001AA01BBF6E}
-const HV_GUID SYNTHRDP_DATA_INSTANCE_ID_1 =
+HV_CONSTEXPR HV_GUID SYNTHRDP_DATA_INSTANCE_ID_1 =
 {
     0x99221FA1,
     0x24AD,
@@ -418,7 +418,7 @@ const HV_GUID SYNTHRDP_DATA_INSTANCE_ID_1 =
 };
 
 // {99221FA2-24AD-11E2-BE98-001AA01BBF6E}
-const HV_GUID SYNTHRDP_DATA_INSTANCE_ID_2 =
+HV_CONSTEXPR HV_GUID SYNTHRDP_DATA_INSTANCE_ID_2 =
 {
     0x99221FA2,
     0x24AD,
@@ -427,7 +427,7 @@ const HV_GUID SYNTHRDP_DATA_INSTANCE_ID_2 =
 };
 
 // {99221FA3-24AD-11E2-BE98-001AA01BBF6E}
-const HV_GUID SYNTHRDP_DATA_INSTANCE_ID_3 =
+HV_CONSTEXPR HV_GUID SYNTHRDP_DATA_INSTANCE_ID_3 =
 {
     0x99221FA3,
     0x24AD,
@@ -436,7 +436,7 @@ const HV_GUID SYNTHRDP_DATA_INSTANCE_ID_3 =
 };
 
 // {99221FA4-24AD-11E2-BE98-001AA01BBF6E}
-const HV_GUID SYNTHRDP_DATA_INSTANCE_ID_4 =
+HV_CONSTEXPR HV_GUID SYNTHRDP_DATA_INSTANCE_ID_4 =
 {
     0x99221FA4,
     0x24AD,
@@ -445,7 +445,7 @@ const HV_GUID SYNTHRDP_DATA_INSTANCE_ID_4 =
 };
 
 // {99221FA5-24AD-11E2-BE98-001AA01BBF6E}
-const HV_GUID SYNTHRDP_DATA_INSTANCE_ID_5 =
+HV_CONSTEXPR HV_GUID SYNTHRDP_DATA_INSTANCE_ID_5 =
 {
     0x99221FA5,
     0x24AD,
@@ -513,7 +513,7 @@ typedef struct _SYNTHRDP_VERSION_RESPONSE_MESSAGE
 //
 
 // {4D12E519-17A0-4AE4-8EAA-5270FC6ABDB7}
-const HV_GUID VSMB_CLASS_ID =
+HV_CONSTEXPR HV_GUID VSMB_CLASS_ID =
 {
     0x4D12E519,
     0x17A0,
@@ -522,7 +522,7 @@ const HV_GUID VSMB_CLASS_ID =
 };
 
 // {DCC079AE-60BA-4D07-847C-3493609C0870}
-const HV_GUID VSMB_INSTANCE_ID =
+HV_CONSTEXPR HV_GUID VSMB_INSTANCE_ID =
 {
     0xDCC079AE,
     0x60BA,
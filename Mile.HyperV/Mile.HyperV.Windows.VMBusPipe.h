@@ -17,6 +17,8 @@
 
 #include <Windows.h>
 
+#include "Mile.HyperV.VMBusPipe.Types.h"
+
 #ifdef _MSC_VER
 #if _MSC_VER > 1000
 #pragma once
@@ -31,77 +33,6 @@
 extern "C" {
 #endif // __cplusplus
 
-    typedef struct _VMBUS_PIPE_CHANNEL_INFO
-    {
-        // Add 4 for old Windows compatibility.
-        WCHAR DevicePath[MAX_PATH + 4];
-    } VMBUS_PIPE_CHANNEL_INFO, *PVMBUS_PIPE_CHANNEL_INFO;
-
-    typedef VOID(CALLBACK* CHANNEL_OFFER_NOTIFICATION)(
-        _In_opt_ LPVOID HostContext,
-        _In_ LPBYTE UserDefined,
-        _In_ PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
-        _In_ LPCGUID InstanceGuid);
-
-    DECLARE_HANDLE(HVMBUS_PIPE_NOTIFICATION);
-
-    typedef enum _VMBUS_PIPE_CHANNEL_NOTIFICATION_TYPE
-    {
-        ChannelNotificationArrival = 0x1,
-    } VMBUS_PIPE_CHANNEL_NOTIFICATION_TYPE, *PVMBUS_PIPE_CHANNEL_NOTIFICATION_TYPE;
-
-    typedef VOID(CALLBACK* VMBUS_PIPE_CLIENT_CHANNEL_NOTIFICATION_CALLBACK)(
-        _In_opt_ LPVOID ClientContext,
-        _In_ PVMBUS_PIPE_CHANNEL_INFO ChannelInfo,
-        _In_ VMBUS_PIPE_CHANNEL_NOTIFICATION_TYPE NotificationType);
-
-    typedef struct _VMBUS_PIPE_SERVER_OFFER
-    {
-        union
-        {
-            GUID VmGuid;
-            HANDLE VmbusHandle;
-        };
-        DWORD InterruptLatencyInMilliseconds;
-        GUID InterfaceType;
-        GUID InterfaceInstance;
-        DWORD InterfaceRevision;
-        USHORT MmioMegabytes;
-        USHORT Flags;
-        BYTE UserDefined[112];
-    } VMBUS_PIPE_SERVER_OFFER, *PVMBUS_PIPE_SERVER_OFFER;
-
-    typedef struct _VMBUS_PIPE_SERVER_OFFER_EX
-    {
-        DWORD Version;
-        DWORD Size;
-        union
-        {
-            GUID VmGuid;
-            HANDLE VmbusHandle;
-        };
-        DWORD InterruptLatencyInMilliseconds;
-        GUID InterfaceType;
-        GUID InterfaceInstance;
-        DWORD InterfaceRevision;
-        USHORT MmioMegabytes;
-        USHORT Flags;
-        BYTE UserDefined[112];
-        LPCWSTR Name;
-    } VMBUS_PIPE_SERVER_OFFER_EX, *PVMBUS_PIPE_SERVER_OFFER_EX;
-
-    typedef const VMBUS_PIPE_SERVER_OFFER_EX *PCVMBUS_PIPE_SERVER_OFFER_EX;
-
-#define VMBUS_PIPE_CLIENT_CHANNEL_CURRENT_VERSION 1
-
-    typedef struct _VMBUS_PIPE_CLIENT_CHANNEL_SETTINGS
-    {
-        DWORD Version;
-        DWORD Size;
-        DWORD IncomingSize;
-        DWORD OutgoingSize;
-    } VMBUS_PIPE_CLIENT_CHANNEL_SETTINGS, *PVMBUS_PIPE_CLIENT_CHANNEL_SETTINGS;
-
     BOOL WINAPI VmbusPipeClientEnumeratePipes(
         _In_ LPCGUID InterfaceType,
         _In_opt_ LPVOID UserContext,